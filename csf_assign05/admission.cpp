@@ -0,0 +1,200 @@
+#include "admission.h"
+#include "guard.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+AdmissionControl::User::User(const std::string &name, const Limits &limits)
+    : m_name(name), m_priority(limits.priority),
+      m_interval_ns(limits.rate > 0 ? uint64_t(1e9 / limits.rate) : 0),
+      m_burst_ns(m_interval_ns * (limits.burst > 0 ? limits.burst : 1)),
+      m_next_due_ns(0), m_requests(0), m_throttled(0), m_wait_ns(0),
+      m_connections(0), m_released(0) {}
+
+uint64_t AdmissionControl::User::admit(uint64_t now_ns) {
+  m_requests.fetch_add(1, std::memory_order_relaxed);
+  if (m_interval_ns == 0) {
+    return 0;
+  }
+  // A request takes the token due at next_due; it may go ahead once
+  // that is at most a full bucket (m_burst_ns) away
+  uint64_t next_due = m_next_due_ns.load(std::memory_order_relaxed);
+  uint64_t new_due;
+  do {
+    new_due = std::max(next_due, now_ns) + m_interval_ns;
+  } while (!m_next_due_ns.compare_exchange_weak(next_due, new_due,
+                                                std::memory_order_relaxed));
+  if (new_due <= now_ns + m_burst_ns) {
+    return 0;
+  }
+  uint64_t wait_ns = new_due - m_burst_ns - now_ns;
+  m_throttled.fetch_add(1, std::memory_order_relaxed);
+  m_wait_ns.fetch_add(wait_ns, std::memory_order_relaxed);
+  return wait_ns;
+}
+
+std::string AdmissionControl::User::get_stats() const {
+  return m_name + ":" + (is_bulk() ? "bulk" : "interactive") +
+         ":req=" + std::to_string(m_requests.load(std::memory_order_relaxed)) +
+         ":throttled=" +
+         std::to_string(m_throttled.load(std::memory_order_relaxed)) +
+         ":wait_ms=" +
+         std::to_string(m_wait_ns.load(std::memory_order_relaxed) / 1000000);
+}
+
+// Adds other's counters to this user's
+void AdmissionControl::User::add_counts(const User &other) {
+  m_requests.fetch_add(other.m_requests.load(std::memory_order_relaxed),
+                       std::memory_order_relaxed);
+  m_throttled.fetch_add(other.m_throttled.load(std::memory_order_relaxed),
+                        std::memory_order_relaxed);
+  m_wait_ns.fetch_add(other.m_wait_ns.load(std::memory_order_relaxed),
+                      std::memory_order_relaxed);
+}
+
+AdmissionControl::AdmissionControl(size_t max_default_users)
+    : m_max_default_users(max_default_users), m_releases(0) {
+  pthread_mutex_init(&m_users_lock, NULL);
+}
+
+AdmissionControl::~AdmissionControl() {
+  pthread_mutex_destroy(&m_users_lock);
+}
+
+bool AdmissionControl::parse_limits(std::string_view spec, std::string &name,
+                                    Limits &limits) {
+  name.clear();
+  limits = Limits();
+  size_t eq = spec.find('=');
+  if (eq != std::string_view::npos) {
+    name = std::string(spec.substr(0, eq));
+    spec.remove_prefix(eq + 1);
+    if (name.empty()) {
+      return false;
+    }
+  }
+  // Fields separated by ':', the rate first
+  bool have_burst = false;
+  for (int field = 0; !spec.empty() || field == 0; field++) {
+    size_t colon = spec.find(':');
+    std::string item(spec.substr(0, colon));
+    spec.remove_prefix(colon == std::string_view::npos ? spec.size()
+                                                       : colon + 1);
+    char *end;
+    if (field == 0) {
+      limits.rate = strtod(item.c_str(), &end);
+      if (item.empty() || *end != '\0' || limits.rate < 0) {
+        return false;
+      }
+    } else if (item == "bulk") {
+      limits.priority = Priority::BULK;
+    } else if (item == "interactive") {
+      limits.priority = Priority::INTERACTIVE;
+    } else if (field == 1 && !have_burst) {
+      long burst = strtol(item.c_str(), &end, 10);
+      if (item.empty() || *end != '\0' || burst < 1) {
+        return false;
+      }
+      limits.burst = unsigned(burst);
+      have_burst = true;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+AdmissionControl::User *AdmissionControl::get_user(std::string_view name) {
+  Guard g(m_users_lock);
+  User *user;
+  auto limits = m_limits.find(name);
+  if (limits == m_limits.end()) {
+    user = get_default_user(name);
+  } else {
+    auto it = m_users.find(name);
+    if (it == m_users.end()) {
+      user = new User(limits->first, limits->second);
+      m_users.emplace(limits->first, std::unique_ptr<User>(user));
+    } else {
+      user = it->second.get();
+    }
+  }
+  user->m_connections++;
+  return user;
+}
+
+// The bucket of a user with the default limits; called with the lock held
+AdmissionControl::User *
+AdmissionControl::get_default_user(std::string_view name) {
+  if (!m_default_user) {
+    m_default_user.reset(new User("*", m_default_limits));
+  }
+  if (m_default_limits.rate == 0) {
+    return m_default_user.get(); // there is no bucket to keep apart
+  }
+  auto it = m_default_users.find(name);
+  if (it != m_default_users.end()) {
+    return it->second.get();
+  }
+  if (m_default_users.size() >= m_max_default_users) {
+    // Make way by dropping the user idle longest, keeping its counts
+    auto idlest = m_default_users.end();
+    for (auto it = m_default_users.begin(); it != m_default_users.end();
+         ++it) {
+      if (it->second->m_connections == 0 &&
+          (idlest == m_default_users.end() ||
+           it->second->m_released < idlest->second->m_released)) {
+        idlest = it;
+      }
+    }
+    if (idlest == m_default_users.end()) {
+      return m_default_user.get();
+    }
+    m_default_user->add_counts(*idlest->second);
+    m_default_users.erase(idlest);
+  }
+  User *user = new User(std::string(name), m_default_limits);
+  m_default_users.emplace(user->get_name(), std::unique_ptr<User>(user));
+  return user;
+}
+
+void AdmissionControl::release_user(User *user) {
+  Guard g(m_users_lock);
+  user->m_connections--;
+  user->m_released = ++m_releases;
+}
+
+void AdmissionControl::lower_thread_priority() {
+  // On Linux, the nice value belongs to the thread
+  pid_t tid = syscall(SYS_gettid);
+  errno = 0;
+  int nice = getpriority(PRIO_PROCESS, tid);
+  if (errno == 0) {
+    setpriority(PRIO_PROCESS, tid, nice + BULK_NICE);
+  }
+}
+
+std::string AdmissionControl::get_stats() {
+  Guard g(m_users_lock);
+  std::string stats = "users=";
+  for (auto it = m_users.begin(); it != m_users.end(); ++it) {
+    if (it != m_users.begin()) {
+      stats += ',';
+    }
+    stats += it->second->get_stats();
+  }
+  if (m_default_user) {
+    User total("*", m_default_limits);
+    total.add_counts(*m_default_user);
+    for (const auto &entry : m_default_users) {
+      total.add_counts(*entry.second);
+    }
+    stats += (m_users.empty() ? "" : ",") + total.get_stats();
+  } else if (m_users.empty()) {
+    stats += '-';
+  }
+  return stats;
+}
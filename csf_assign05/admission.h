@@ -0,0 +1,139 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <pthread.h>
+#include <string>
+#include <string_view>
+
+// Per-user admission control: each user (as named by LOGIN) has a
+// request rate limit, enforced by a token bucket shared by all of the
+// user's connections, and a priority class, either its own or the
+// default ones. Users with the default limits only get buckets of their
+// own if the default has a rate: at most max_default_users of them, the
+// one idle (without connections) longest making way for a new one, so
+// the state doesn't grow with the number of names clients log in with.
+// Once all of those have connections, further users share the "*"
+// bucket.
+//
+// A request which finds the bucket empty isn't refused: it waits until
+// its token is due, so a bulk import slows down to its rate instead of
+// failing. The bucket is kept as the time at which the next token is due
+// (the "generic cell rate algorithm" form of a token bucket), in one
+// atomic, so admitting a request takes no lock.
+//
+// Interactive users are served ahead of bulk ones: on an event loop,
+// a bulk connection lets everything else that is ready run before each
+// of its requests (see EventLoop::defer()), and a thread serving only a
+// bulk connection runs at a lower scheduling priority. Loop threads are
+// shared, so they are never reniced.
+class AdmissionControl {
+public:
+  enum class Priority { INTERACTIVE, BULK };
+
+  struct Limits {
+    double rate;       // requests per second, 0 for no limit
+    unsigned burst;    // requests admitted at once after a quiet spell
+    Priority priority;
+
+    Limits() : rate(0), burst(DEFAULT_BURST), priority(Priority::INTERACTIVE) {}
+  };
+
+  static const unsigned DEFAULT_BURST = 100;
+  // Added to the nice value of threads serving bulk connections
+  static const int BULK_NICE = 10;
+  static const size_t MAX_DEFAULT_USERS = 4096;
+
+  // A user's bucket and counters, or the shared ones. A connection keeps
+  // a pointer to its user from get_user() until release_user().
+  class User {
+  private:
+    friend class AdmissionControl;
+
+    std::string m_name;
+    Priority m_priority;
+    uint64_t m_interval_ns; // between tokens, 0 for no limit
+    uint64_t m_burst_ns;    // how far ahead of time tokens may be taken
+    std::atomic<uint64_t> m_next_due_ns; // when the bucket is full again
+    std::atomic<uint64_t> m_requests;
+    std::atomic<uint64_t> m_throttled; // requests which had to wait
+    std::atomic<uint64_t> m_wait_ns;   // total time they waited
+    // Under the AdmissionControl's lock: connections with a pointer to
+    // this user, and when the last one went (counting releases)
+    unsigned m_connections;
+    uint64_t m_released;
+
+    void add_counts(const User &other);
+
+    // copy constructor and assignment operator are prohibited
+    User(const User &);
+    User &operator=(const User &);
+
+  public:
+    User(const std::string &name, const Limits &limits);
+
+    const std::string &get_name() const { return m_name; }
+    Priority get_priority() const { return m_priority; }
+    bool is_bulk() const { return m_priority == Priority::BULK; }
+    // Takes a token for a request arriving at now_ns (on the
+    // CLOCK_MONOTONIC), and returns how long the request has to wait for
+    // it: 0 if the bucket had one
+    uint64_t admit(uint64_t now_ns);
+    // "<name>:<class>:req=...:throttled=...:wait_ms=..."
+    std::string get_stats() const;
+  };
+
+private:
+  Limits m_default_limits;
+  std::map<std::string, Limits, std::less<>> m_limits; // by user
+  size_t m_max_default_users;
+  // protects the users, m_releases and m_default_user
+  pthread_mutex_t m_users_lock;
+  std::map<std::string, std::unique_ptr<User>, std::less<>> m_users;
+  // Users with the default limits
+  std::map<std::string, std::unique_ptr<User>, std::less<>> m_default_users;
+  uint64_t m_releases;
+  // "*", shared by the users with the default limits that don't have a
+  // bucket of their own; it also keeps the counts of those dropped
+  std::unique_ptr<User> m_default_user;
+
+  User *get_default_user(std::string_view name);
+
+  // copy constructor and assignment operator are prohibited
+  AdmissionControl(const AdmissionControl &);
+  AdmissionControl &operator=(const AdmissionControl &);
+
+public:
+  AdmissionControl(size_t max_default_users = MAX_DEFAULT_USERS);
+  ~AdmissionControl();
+
+  // Limits for users without limits of their own, and for one user. Must
+  // be set before users log in.
+  void set_default_limits(const Limits &limits) { m_default_limits = limits; }
+  void set_user_limits(const std::string &name, const Limits &limits) {
+    m_limits[name] = limits;
+  }
+  // Parses "[<user>=]<rate>[:<burst>][:bulk|:interactive]" (a missing
+  // user meaning the default limits). Returns false if spec is invalid.
+  static bool parse_limits(std::string_view spec, std::string &name,
+                           Limits &limits);
+
+  // The user's state, for a connection logging in as name; the
+  // connection hands it back with release_user() once it is done
+  User *get_user(std::string_view name);
+  void release_user(User *user);
+
+  // Lowers the calling thread's scheduling priority by BULK_NICE, for
+  // good (raising it again takes privileges); only for threads which
+  // serve nothing else
+  static void lower_thread_priority();
+
+  // "users=<user stats>,...", in order of name, with the users with the
+  // default limits last, counted together as *
+  std::string get_stats();
+};
+
+#endif // ADMISSION_H
@@ -0,0 +1,88 @@
+#include "arena.h"
+#include <cstdint>
+
+Arena::Arena(size_t block_size)
+    : m_head(nullptr), m_current(nullptr), m_ptr(nullptr), m_end(nullptr),
+      m_block_size(block_size) {}
+
+Arena::~Arena() {
+  while (m_head) {
+    Block *next = m_head->next;
+    ::operator delete(m_head);
+    m_head = next;
+  }
+}
+
+Arena::Block *Arena::new_block(size_t size) {
+  Block *block = static_cast<Block *>(::operator new(sizeof(Block) + size));
+  block->next = nullptr;
+  block->size = size;
+  return block;
+}
+
+char *Arena::block_data(Block *block) {
+  return reinterpret_cast<char *>(block) + sizeof(Block);
+}
+
+void Arena::use_block(Block *block) {
+  m_current = block;
+  m_ptr = block_data(block);
+  m_end = m_ptr + block->size;
+}
+
+void *Arena::allocate(size_t n, size_t align) {
+  while (1) {
+    if (m_current) {
+      uintptr_t p = reinterpret_cast<uintptr_t>(m_ptr);
+      uintptr_t aligned = (p + align - 1) & ~uintptr_t(align - 1);
+      if (aligned + n <= reinterpret_cast<uintptr_t>(m_end)) {
+        m_ptr = reinterpret_cast<char *>(aligned + n);
+        return reinterpret_cast<void *>(aligned);
+      }
+      // Move on to a block retained from an earlier request, if any
+      if (m_current->next && m_current->next->size >= n + align) {
+        use_block(m_current->next);
+        continue;
+      }
+    }
+
+    // Splice a new block in after the current one
+    size_t size = n + align > m_block_size ? n + align : m_block_size;
+    Block *block = new_block(size);
+    if (!m_current) {
+      block->next = m_head;
+      m_head = block;
+    } else {
+      block->next = m_current->next;
+      m_current->next = block;
+    }
+    use_block(block);
+  }
+}
+
+void Arena::reset() {
+  Block **link = &m_head;
+  while (*link) {
+    Block *block = *link;
+    if (block->size > m_block_size) {
+      *link = block->next;
+      ::operator delete(block);
+    } else {
+      link = &block->next;
+    }
+  }
+  if (m_head) {
+    use_block(m_head);
+  } else {
+    m_current = nullptr;
+    m_ptr = m_end = nullptr;
+  }
+}
+
+size_t Arena::get_capacity() const {
+  size_t total = 0;
+  for (Block *block = m_head; block; block = block->next) {
+    total += block->size;
+  }
+  return total;
+}
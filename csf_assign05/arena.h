@@ -0,0 +1,91 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <new>
+
+// Bump allocator for short-lived allocations. Memory is handed out
+// sequentially from large blocks and is only reclaimed all at once by
+// reset(), which rewinds to the first block but keeps the blocks for
+// reuse. Once an arena has warmed up, a request that fits in previously
+// used blocks performs no heap allocation at all.
+class Arena {
+private:
+  struct Block {
+    Block *next;
+    size_t size; // usable bytes following the header
+  };
+
+  Block *m_head;     // first block in the chain
+  Block *m_current;  // block currently being allocated from
+  char *m_ptr;       // next free byte in m_current
+  char *m_end;       // end of m_current
+  size_t m_block_size;
+
+  static Block *new_block(size_t size);
+  static char *block_data(Block *block);
+  void use_block(Block *block);
+
+  // copy constructor and assignment operator are prohibited
+  Arena(const Arena &);
+  Arena &operator=(const Arena &);
+
+public:
+  static const size_t DEFAULT_BLOCK_SIZE = 8192;
+
+  explicit Arena(size_t block_size = DEFAULT_BLOCK_SIZE);
+  ~Arena();
+
+  void *allocate(size_t n, size_t align = alignof(std::max_align_t));
+
+  // Release everything allocated since the last reset. Oversized blocks
+  // (from requests larger than the block size) are returned to the heap
+  // so that one huge request doesn't pin memory forever.
+  void reset();
+
+  // Total bytes reserved from the heap
+  size_t get_capacity() const;
+};
+
+// STL allocator which draws from an Arena. A default-constructed
+// ArenaAllocator (no arena) falls back to the ordinary heap, so types
+// using it work normally outside of request handling. Copies of
+// containers never inherit the arena: they must not outlive reset().
+template <typename T> class ArenaAllocator {
+public:
+  typedef T value_type;
+
+  Arena *m_arena;
+
+  ArenaAllocator() noexcept : m_arena(nullptr) {}
+  ArenaAllocator(Arena *arena) noexcept : m_arena(arena) {}
+  template <typename U>
+  ArenaAllocator(const ArenaAllocator<U> &other) noexcept
+      : m_arena(other.m_arena) {}
+
+  T *allocate(size_t n) {
+    if (m_arena) {
+      return static_cast<T *>(m_arena->allocate(n * sizeof(T), alignof(T)));
+    }
+    return static_cast<T *>(::operator new(n * sizeof(T)));
+  }
+
+  void deallocate(T *p, size_t) noexcept {
+    if (!m_arena) {
+      ::operator delete(p);
+    }
+  }
+
+  ArenaAllocator select_on_container_copy_construction() const {
+    return ArenaAllocator();
+  }
+
+  template <typename U> bool operator==(const ArenaAllocator<U> &rhs) const {
+    return m_arena == rhs.m_arena;
+  }
+  template <typename U> bool operator!=(const ArenaAllocator<U> &rhs) const {
+    return m_arena != rhs.m_arena;
+  }
+};
+
+#endif // ARENA_H
@@ -0,0 +1,300 @@
+#include "async_channel.h"
+#include "guard.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+namespace {
+
+// The threads running offloaded coroutines. They never exit, so the pool
+// is never freed.
+struct OffloadPool {
+  pthread_mutex_t lock; // protects the rest
+  pthread_cond_t cond;  // signalled when a coroutine is queued
+  std::deque<std::coroutine_handle<>> queue;
+  unsigned max_threads;
+  unsigned threads;
+  unsigned idle; // threads waiting with nothing queued for them
+
+  OffloadPool()
+      : max_threads(AsyncChannel::DEFAULT_OFFLOAD_THREADS), threads(0),
+        idle(0) {
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&cond, NULL);
+  }
+};
+
+OffloadPool &offload_pool() {
+  static OffloadPool *pool = new OffloadPool;
+  return *pool;
+}
+
+} // namespace
+
+void AsyncChannel::set_offload_threads(unsigned threads) {
+  OffloadPool &pool = offload_pool();
+  Guard g(pool.lock);
+  pool.max_threads = std::max(threads, 1u);
+}
+
+bool AsyncChannel::OffloadAwaiter::await_suspend(
+    std::coroutine_handle<> handle) {
+  // Events for the socket must not reach the loop while another thread
+  // runs the connection, and it may end there
+  m_channel->m_loop->remove(&m_channel->m_watch);
+  if (m_channel->m_wake_watch.fd >= 0) {
+    m_channel->m_loop->remove(&m_channel->m_wake_watch);
+  }
+  m_channel->set_blocking(true);
+  OffloadPool &pool = offload_pool();
+  Guard g(pool.lock);
+  if (pool.idle > 0) {
+    pool.idle--;
+  } else if (pool.threads < pool.max_threads) {
+    pthread_t thr_id;
+    if (pthread_create(&thr_id, NULL, offload_worker, NULL) == 0) {
+      pthread_detach(thr_id);
+      pool.threads++;
+    } else if (pool.threads == 0) {
+      return false; // carry on here, blocking the loop meanwhile
+    }
+  }
+  pool.queue.push_back(handle);
+  pthread_cond_signal(&pool.cond);
+  return true;
+}
+
+void *AsyncChannel::offload_worker(void *arg) {
+  OffloadPool &pool = offload_pool();
+  Guard g(pool.lock);
+  while (true) {
+    while (pool.queue.empty()) {
+      pthread_cond_wait(&pool.cond, &pool.lock);
+    }
+    std::coroutine_handle<> handle = pool.queue.front();
+    pool.queue.pop_front();
+    pthread_mutex_unlock(&pool.lock);
+    handle.resume(); // until it returns to its loop, or ends
+    pthread_mutex_lock(&pool.lock);
+    if (pool.queue.empty()) {
+      pool.idle++;
+    }
+  }
+  return nullptr;
+}
+
+AsyncChannel::AsyncChannel(int fd, EventLoop *loop)
+    : IoChannel(fd), m_loop(loop), m_watch(fd), m_wake_watch(-1),
+      m_blocking(false),
+      m_timeout_ms(0), m_in_start(0), m_in_end(0), m_eof(false),
+      m_drained(false) {
+  // The server limits idle time with SO_RCVTIMEO, which only applies to
+  // blocking reads
+  struct timeval timeout;
+  socklen_t len = sizeof(timeout);
+  if (getsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, &len) == 0) {
+    m_timeout_ms = timeout.tv_sec * 1000 + timeout.tv_usec / 1000;
+  }
+  set_blocking(false);
+  m_loop->add(&m_watch);
+}
+
+AsyncChannel::~AsyncChannel() {
+  if (!m_blocking) {
+    m_loop->remove(&m_watch);
+    if (m_wake_watch.fd >= 0) {
+      m_loop->remove(&m_wake_watch);
+    }
+  }
+}
+
+void AsyncChannel::set_blocking(bool blocking) {
+  int flags = fcntl(m_fd, F_GETFL);
+  fcntl(m_fd, F_SETFL, blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK);
+  m_blocking = blocking;
+}
+
+ssize_t AsyncChannel::read(void *buf, size_t n) {
+  if (m_in_start < m_in_end) {
+    size_t len = std::min(n, m_in_end - m_in_start);
+    memcpy(buf, m_in + m_in_start, len);
+    m_in_start += len;
+    return len;
+  }
+  if (m_blocking) {
+    if (!flush()) {
+      return -1;
+    }
+    count_syscall();
+    return ::read(m_fd, buf, n);
+  }
+  if (m_eof) {
+    return 0;
+  }
+  // wait_line() should have made sure this doesn't happen
+  errno = EWOULDBLOCK;
+  return -1;
+}
+
+bool AsyncChannel::flush() {
+  if (!send_some()) {
+    return false;
+  }
+  if (m_blocking && !m_out.empty()) {
+    m_out.clear(); // SO_SNDTIMEO expired
+    return false;
+  }
+  return true;
+}
+
+// Sends as much buffered output as the socket takes. Returns false if the
+// connection failed.
+bool AsyncChannel::send_some() {
+  size_t sent = 0;
+  while (sent < m_out.size()) {
+    count_syscall();
+    ssize_t n = ::write(m_fd, m_out.data() + sent, m_out.size() - sent);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    if (n <= 0) {
+      m_out.clear();
+      return false;
+    }
+    sent += n;
+  }
+  m_out.erase(0, sent);
+  return true;
+}
+
+// Reads whatever has arrived into m_in. Returns like read().
+ssize_t AsyncChannel::read_more() {
+  if (m_in_start > 0) {
+    memmove(m_in, m_in + m_in_start, m_in_end - m_in_start);
+    m_in_end -= m_in_start;
+    m_in_start = 0;
+  }
+  size_t space = sizeof(m_in) - m_in_end;
+  ssize_t n;
+  do {
+    count_syscall();
+    n = ::read(m_fd, m_in + m_in_end, space);
+  } while (n < 0 && errno == EINTR);
+  if (n > 0) {
+    m_in_end += n;
+  }
+  m_drained = n > 0 && size_t(n) < space;
+  return n;
+}
+
+// True if rio_readlineb() can return without reading from the socket
+bool AsyncChannel::has_line(const rio_t *rio) const {
+  if (m_eof) {
+    return true;
+  }
+  if (rio->rio_cnt > 0 && memchr(rio->rio_bufptr, '\n', rio->rio_cnt)) {
+    return true;
+  }
+  if (memchr(m_in + m_in_start, '\n', m_in_end - m_in_start)) {
+    return true;
+  }
+  // rio_readlineb() stops at MAXLINE - 1 characters
+  return available(rio) >= MAXLINE - 1;
+}
+
+ssize_t AsyncChannel::available(const rio_t *rio) const {
+  return (rio->rio_cnt > 0 ? rio->rio_cnt : 0) + (m_in_end - m_in_start);
+}
+
+Task<ssize_t> AsyncChannel::wait_line(const rio_t *rio, int wake_fd) {
+  if (wake_fd >= 0 && m_wake_watch.fd < 0) {
+    m_wake_watch.fd = wake_fd;
+    m_loop->add(&m_wake_watch);
+  }
+  uint64_t deadline = m_timeout_ms > 0 && wake_fd < 0
+                          ? EventLoop::now_ms() + m_timeout_ms
+                          : 0;
+  while (1) {
+    // Requests are only taken while the client reads its responses
+    bool backlogged = m_out.size() >= MAX_BUFFERED;
+    if (!backlogged) {
+      if (has_line(rio)) {
+        co_return available(rio);
+      }
+      ssize_t n = -1;
+      errno = EAGAIN;
+      if (!m_drained) {
+        n = read_more();
+      }
+      if (n > 0) {
+        continue;
+      }
+      if (n == 0) {
+        m_eof = true;
+        co_return available(rio);
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        co_return -1;
+      }
+    }
+
+    // Nothing more to do until the socket is ready, so send the responses
+    // buffered so far
+    if (!send_some()) {
+      co_return -1;
+    }
+    if (backlogged && m_out.size() < MAX_BUFFERED) {
+      continue;
+    }
+    uint32_t events = backlogged ? 0 : EPOLLIN;
+    if (!m_out.empty()) {
+      events |= EPOLLOUT;
+    }
+    // A backlogged client gets no more output until it catches up
+    EventLoop::WaitAwaiter waiting = m_loop->wait(
+        &m_watch, events, deadline,
+        wake_fd >= 0 && !backlogged ? &m_wake_watch : nullptr);
+    if (!co_await waiting) {
+      errno = EAGAIN; // like a read() hitting SO_RCVTIMEO
+      co_return -1;
+    }
+    if (waiting.woken()) {
+      errno = EINTR;
+      co_return -1;
+    }
+    m_drained = false;
+  }
+}
+
+Task<bool> AsyncChannel::drain() {
+  uint64_t deadline = m_timeout_ms > 0 ? EventLoop::now_ms() + m_timeout_ms : 0;
+  while (1) {
+    if (!send_some()) {
+      co_return false;
+    }
+    if (m_out.empty()) {
+      co_return true;
+    }
+    if (!co_await m_loop->wait(&m_watch, EPOLLOUT, deadline)) {
+      m_out.clear(); // the client isn't reading
+      co_return false;
+    }
+  }
+}
+
+Task<void> AsyncChannel::return_to_loop() {
+  co_await m_loop->schedule();
+  set_blocking(false);
+  m_drained = false;
+  m_loop->add(&m_watch);
+  if (m_wake_watch.fd >= 0) {
+    m_loop->add(&m_wake_watch);
+  }
+}
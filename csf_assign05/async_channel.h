@@ -0,0 +1,87 @@
+#ifndef ASYNC_CHANNEL_H
+#define ASYNC_CHANNEL_H
+
+#include "event_loop.h"
+#include "io_channel.h"
+#include "task.h"
+
+// Channel for a connection run as a coroutine on an EventLoop. The
+// socket is non-blocking: read() and flush() never wait, and the
+// coroutine waits instead with co_await wait_line() and drain(), which
+// suspend it on the loop until the socket is ready.
+//
+// A command which streams data (LOAD, DUMP, REPLICATE) can't be split
+// into suspensions without rewriting it, so the coroutine moves to
+// another thread for it with co_await offload(): the socket becomes
+// blocking and the channel behaves like a SocketChannel until
+// co_await return_to_loop(). Offloaded coroutines run on a pool of
+// threads shared by every loop, started as they are needed up to a
+// fixed number; once all of them are busy, further offloads wait their
+// turn.
+class AsyncChannel : public IoChannel {
+public:
+  static const unsigned DEFAULT_OFFLOAD_THREADS = 16;
+
+private:
+  // Moves the awaiting coroutine to the offload pool
+  class OffloadAwaiter {
+  private:
+    AsyncChannel *m_channel;
+
+  public:
+    OffloadAwaiter(AsyncChannel *channel) : m_channel(channel) {}
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> handle);
+    void await_resume() const {}
+  };
+
+  EventLoop *m_loop;
+  EventLoop::Watch m_watch;
+  EventLoop::Watch m_wake_watch; // wait_line()'s wake_fd, once there is one
+  bool m_blocking;       // offloaded to a thread of its own
+  unsigned m_timeout_ms; // from SO_RCVTIMEO
+  // Input read ahead of the rio buffer, to find out whether a whole line
+  // has arrived
+  char m_in[RIO_BUFSIZE];
+  size_t m_in_start, m_in_end;
+  bool m_eof;
+  // The last read came back short, so the socket had nothing more; the
+  // next data to arrive triggers an event, and reading again until
+  // EAGAIN would only cost a system call
+  bool m_drained;
+
+  bool has_line(const rio_t *rio) const;
+  ssize_t available(const rio_t *rio) const;
+  ssize_t read_more();
+  bool send_some();
+  void set_blocking(bool blocking);
+  static void *offload_worker(void *arg); // runs one thread of the pool
+
+public:
+  // Must be created on the loop's thread
+  AsyncChannel(int fd, EventLoop *loop);
+  virtual ~AsyncChannel();
+
+  virtual ssize_t read(void *buf, size_t n);
+  virtual bool flush();
+
+  // Waits until rio (which this channel fills) can return a whole line
+  // without blocking, sending buffered output in the meantime. Returns
+  // what rio_waitb() would: the bytes available, 0 at the end of the
+  // input, or -1 with errno set (EAGAIN after the idle timeout). With a
+  // wake_fd (always the same one), there is no idle timeout, and the
+  // wait ends with -1 and errno EINTR once wake_fd becomes readable,
+  // unless the client is behind with reading its responses.
+  Task<ssize_t> wait_line(const rio_t *rio, int wake_fd = -1);
+  // Sends all buffered output. Returns false if the connection failed or
+  // the client stopped reading for the idle timeout.
+  Task<bool> drain();
+
+  // The size of the offload pool; must be called before any offload
+  static void set_offload_threads(unsigned threads);
+
+  OffloadAwaiter offload() { return OffloadAwaiter(this); }
+  Task<void> return_to_loop();
+};
+
+#endif // ASYNC_CHANNEL_H
@@ -1,243 +1,552 @@
 #include "client_connection.h"
+#include "async_channel.h"
 #include "csapp.h"
 #include "exceptions.h"
 #include "message.h"
 #include "message_serialization.h"
+#include "record_stream.h"
+#include "replication.h"
 #include "server.h"
-#include <algorithm>
+#include "value_codec.h"
 #include <cassert>
+#include <cerrno>
 #include <iostream>
+#include <sys/socket.h>
+#include <time.h>
+
+namespace {
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000UL + uint64_t(ts.tv_nsec);
+}
+
+} // namespace
 
 // Constructor for ClientConnection: Initializes connection settings and state.
-ClientConnection::ClientConnection(Server *server, int client_fd)
-    : m_server(server), m_client_fd(client_fd), in_transaction(false),
-      stack(new ValueStack()), is_logged_in(false) {
+ClientConnection::ClientConnection(Server *server, int client_fd,
+                                   const std::string &peer)
+    : m_server(server), m_client_fd(client_fd), m_peer(peer), m_busy(false),
+      m_session(&server->get_database()), is_logged_in(false),
+      m_user(nullptr), m_lowered_priority(false),
+      m_io(IoChannel::create(client_fd)),
+      m_last_response(MessageType::NONE), m_request_start(0),
+      m_access_start_ns(0) {
   rio_readinitb(&m_fdbuf, m_client_fd);
+  if (server->get_read_buffer_size() > m_fdbuf.rio_bufsize) {
+    m_read_buf.resize(server->get_read_buffer_size());
+    rio_setbuf(&m_fdbuf, m_read_buf.data(), m_read_buf.size());
+  }
+  m_io->attach(&m_fdbuf);
+  m_outbuf.reserve(Message::MAX_ENCODED_LEN);
 }
 
 // Destructor: Ensures that resources are properly released when a
 // ClientConnection is destroyed.
 ClientConnection::~ClientConnection() {
+  // A client that disconnects mid-transaction must not leave tables locked
+  m_session.rollback();
+  m_session.release_prelock();
+  m_io.reset(); // may still be using the socket (and the subscriber's fd)
+  if (m_subscriber) {
+    m_server->get_pubsub().unsubscribe(m_subscriber.get());
+  }
+  if (m_user) {
+    m_server->get_admission().release_user(m_user);
+  }
   Close(m_client_fd);
-  delete stack;
 }
 
 // Main communication loop handling messages from the client.
+// Everything allocated while handling one request (the parsed message,
+// responses) comes from m_arena, which is reset once the request is done.
 void ClientConnection::chat_with_client() {
   bool ongoing = true;
-  while (ongoing) {
-    Message message;
-    char buf[MAXLINE];
-    if (Rio_readlineb(&m_fdbuf, buf, MAXLINE) < 0) {
-      throw CommException("Failed to read from client");
+  while (ongoing && !m_server->is_draining()) {
+    ongoing = handle_request();
+    m_arena.reset();
+    // A shutdown starting from here on either sees this, or is seen by
+    // the is_draining() check
+    m_busy = false;
+  }
+  flush_output();
+}
+
+void ClientConnection::reject(std::string_view reason) {
+  try {
+    send_response(MessageType::ERROR, reason);
+    flush_output();
+  } catch (CommException &ex) {
+    // The client is going away anyway
+  }
+}
+
+void ClientConnection::interrupt_if_idle() {
+  if (!m_busy) {
+    shutdown(m_client_fd, SHUT_RD);
+  }
+}
+
+void ClientConnection::interrupt() { shutdown(m_client_fd, SHUT_RDWR); }
+
+// Reads, decodes and dispatches one request. Returns false once the
+// conversation is over.
+bool ClientConnection::handle_request() {
+  if (!request_arrived(wait_for_request())) {
+    return false;
+  }
+  Message message(MessageType::NONE, &m_arena);
+  bool ongoing;
+  if (!read_request(message, ongoing)) {
+    return ongoing;
+  }
+  uint64_t wait_ns = admit_request();
+  if (wait_ns > 0) {
+    struct timespec ts = {time_t(wait_ns / 1000000000),
+                          long(wait_ns % 1000000000)};
+    nanosleep(&ts, NULL);
+  }
+  ongoing = dispatch_request(message);
+  // This thread serves nobody else
+  if (m_user && m_user->is_bulk() && !m_lowered_priority) {
+    AdmissionControl::lower_thread_priority();
+    m_lowered_priority = true;
+  }
+  return ongoing;
+}
+
+// Takes a token from the user's bucket for the request which was just
+// read, and returns how long it has to wait before being handled
+uint64_t ClientConnection::admit_request() {
+  if (!m_user) {
+    return 0; // LOGIN
+  }
+  m_timing.throttle_ns = m_user->admit(now_ns());
+  return m_timing.throttle_ns;
+}
+
+// Waits for the next request like rio_waitb(). A subscriber is sent its
+// change events meanwhile, and doesn't time out.
+ssize_t ClientConnection::wait_for_request() {
+  while (m_subscriber) {
+    if (!deliver_events()) {
+      return 0;
     }
-    try {
-      MessageSerialization::decode(buf, message);
-    } catch (InvalidMessage &err) {
-      send_response(MessageType::ERROR, err.what());
+    if (m_fdbuf.rio_cnt > 0) {
       break;
     }
-
-    // Ensure the user is logged in before proceeding with other commands.
-    if (!is_logged_in && message.get_message_type() != MessageType::LOGIN) {
-      send_response(MessageType::ERROR, "Must login first");
+    int ready = m_io->wait_input(m_subscriber->get_fd());
+    if (ready < 0) {
+      return -1;
+    }
+    if (ready > 0) {
       break;
     }
+  }
+  return rio_waitb(&m_fdbuf);
+}
+
+// Queues the change events waiting for this subscriber, if any. Returns
+// false if it fell too far behind and is being disconnected.
+bool ClientConnection::deliver_events() {
+  uint64_t dropped;
+  if (!m_subscriber->take(m_events, dropped)) {
+    m_server->get_pubsub().count_disconnect();
+    reject("Subscriber too slow");
+    return false;
+  }
+  // The dropped events are older than the ones still queued
+  if (dropped > 0) {
+    send_dropped(dropped);
+  }
+  for (const Subscriber::Event &event : m_events) {
+    Message message(MessageType::EVENT, &m_arena);
+    message.push_arg(event.table);
+    message.push_arg(event.key);
+    message.push_arg(event.value);
+    try {
+      MessageSerialization::encode(message, m_outbuf);
+    } catch (InvalidMessage &ex) {
+      send_dropped(1); // the value is too long for a protocol line
+      continue;
+    }
+    write_all(m_outbuf);
+  }
+  m_arena.reset();
+  return true;
+}
 
-    // Handle different types of messages based on their type.
-    switch (message.get_message_type()) {
-    case MessageType::LOGIN:
-      handle_login(message);
-      break;
-    case MessageType::CREATE:
-      handle_create(message);
-      break;
-    case MessageType::SET:
-      handle_set(message);
-      break;
-    case MessageType::GET:
-      handle_get(message);
-      break;
-    case MessageType::PUSH:
-      handle_push(message);
-      break;
-    case MessageType::POP:
-      handle_pop();
-      break;
-    case MessageType::TOP:
-      handle_top();
-      break;
-    case MessageType::ADD:
-      handle_add();
-      break;
-    case MessageType::SUB:
-      handle_sub();
-      break;
-    case MessageType::MUL:
-      handle_mul();
-      break;
-    case MessageType::DIV:
-      handle_div();
-      break;
-    case MessageType::BEGIN:
-      handle_begin();
-      break;
-    case MessageType::COMMIT:
-      handle_commit();
-      break;
-    case MessageType::BYE:
-      ongoing =
-          false; // End the communication loop if "BYE" message is received.
-      send_response(MessageType::OK);
+void ClientConnection::send_dropped(uint64_t count) {
+  Message notice(MessageType::DROPPED, &m_arena);
+  notice.push_arg(std::to_string(count));
+  MessageSerialization::encode(notice, m_outbuf);
+  write_all(m_outbuf);
+}
+
+// Handles requests like chat_with_client(), as a coroutine on an event
+// loop: waiting for a request and sending the responses suspend it
+// instead of blocking a thread, so many connections share the loop's
+// thread. The request handlers are the same.
+Task<void> ClientConnection::chat_async(EventLoop *loop) {
+  AsyncChannel *channel = new AsyncChannel(m_client_fd, loop);
+  m_io.reset(channel);
+  m_io->attach(&m_fdbuf);
+  bool ongoing = true;
+  while (ongoing && !m_server->is_draining()) {
+    if (m_subscriber && !deliver_events()) {
       break;
-    default:
-      send_response(MessageType::ERROR, "Unsupported operation");
+    }
+    ssize_t avail = co_await channel->wait_line(
+        &m_fdbuf, m_subscriber ? m_subscriber->get_fd() : -1);
+    if (avail < 0 && errno == EINTR && m_subscriber) {
+      continue; // events to deliver
+    }
+    if (!request_arrived(avail)) {
       break;
     }
+    {
+      Message message(MessageType::NONE, &m_arena);
+      bool admitted = read_request(message, ongoing);
+      if (admitted) {
+        uint64_t wait_ns = admit_request();
+        if (wait_ns > 0) {
+          co_await loop->sleep_until(EventLoop::now_ms() +
+                                     (wait_ns + 999999) / 1000000);
+        }
+        if (m_user && m_user->is_bulk()) {
+          // Whatever else is ready on this loop goes first
+          co_await loop->defer();
+        }
+      }
+      if (!admitted) {
+        // answered already
+      } else if (is_streaming(message.get_message_type()) ||
+                 !prelock_table(message)) {
+        // These run for as long as the data keeps coming, or wait for a
+        // table another connection has locked
+        co_await channel->offload();
+        ongoing = dispatch_request(message);
+        co_await channel->return_to_loop();
+      } else {
+        ongoing = dispatch_request(message);
+        m_session.release_prelock();
+      }
+    }
+    m_arena.reset();
+    m_busy = false;
   }
+  co_await channel->drain();
 }
 
-// Handles pushing a value onto the client's stack.
-void ClientConnection::handle_push(const Message &message) {
-  stack->push(message.get_value());
-  send_response(MessageType::OK);
+bool ClientConnection::is_streaming(MessageType type) {
+  return type == MessageType::LOAD || type == MessageType::DUMP ||
+         type == MessageType::REPLICATE;
 }
 
-// Handles popping the top value from the stack and handling exceptions if the
-// stack is empty.
-void ClientConnection::handle_pop() {
+// A request outside a transaction waits for its table's lock, which may
+// be held by a transaction of another connection on the same event loop:
+// waiting on the loop's thread would stop that transaction from ever
+// finishing. So on a loop, the table is locked here without waiting,
+// and the session's next lock_table() takes it over. Returns false if
+// the request has to wait on a thread of its own instead.
+bool ClientConnection::prelock_table(const Message &message) {
+  MessageType type = message.get_message_type();
+  if (type == MessageType::STATS) {
+    // Table statistics wait for the mutex directly
+    return message.no_args();
+  }
+  if (m_session.in_transaction()) {
+    return true; // transactions never wait for locks
+  }
+  const char *holder;
+  if (type == MessageType::GET) {
+    holder = "GET";
+  } else if (type == MessageType::SET) {
+    holder = "SET";
+  } else if (type == MessageType::FIND) {
+    holder = "FIND";
+  } else if (type == MessageType::CREATEINDEX) {
+    holder = "CREATEINDEX";
+  } else {
+    return true;
+  }
+  Table *table = m_session.find_table(message.get_table());
+  if (!table) {
+    return true; // the handler reports it
+  }
+  if (type == MessageType::GET && (table->supports_unlocked_reads() ||
+                                   table->is_cached(message.get_key()))) {
+    return true; // read without the lock
+  }
+  return m_session.prelock(table, holder);
+}
+
+// Deals with the result of waiting for the next request (as returned by
+// rio_waitb()). Returns false if there is no request to handle.
+bool ClientConnection::request_arrived(ssize_t avail) {
+  if (avail < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    // No request within the server's idle timeout
+    m_server->count_idle_timeout();
+    reject("Idle timeout");
+    return false;
+  }
+  if (avail < 0) {
+    throw CommException("Failed to read from client");
+  }
+  if (avail == 0) {
+    if (m_server->is_draining()) {
+      reject("Server is shutting down");
+    }
+    return false; // client hung up
+  }
+  return true;
+}
+
+// Reads and decodes a request which has arrived. Returns true if it is to
+// be dispatched; otherwise it has been answered already, and ongoing says
+// whether the conversation goes on.
+bool ClientConnection::read_request(Message &message, bool &ongoing) {
+  ongoing = false;
+  m_busy = true;
+  m_timing.clear();
+  m_request_start = now_ns();
+  // The line is decoded where it was read into (the message copies its
+  // arguments), until the next read
+  const char *line;
+  ssize_t len = rio_readlinev(&m_fdbuf, &line, MAXLINE);
+  if (len < 0) {
+    throw CommException("Failed to read from client");
+  }
+  if (len == 0) {
+    return false; // client hung up
+  }
+  uint64_t read_end = now_ns();
+  m_timing.read_ns = read_end - m_request_start;
+  m_access_start_ns =
+      m_server->get_access_log() ? Logger::wall_clock_ns() : 0;
   try {
-    if (stack->is_empty())
-      throw OperationException("\"Stack empty\"");
-    stack->pop();
+    MessageSerialization::decode(std::string_view(line, len), message);
+    m_timing.parse_ns = now_ns() - read_end;
+  } catch (InvalidMessage &err) {
+    m_server->log(LogLevel::WARN, "protocol",
+                  std::string("Invalid message from client: ") + err.what());
+    send_response(MessageType::ERROR, err.what());
+    return false;
+  }
+
+  // Ensure the user is logged in before proceeding with other commands.
+  if (!is_logged_in && message.get_message_type() != MessageType::LOGIN) {
+    send_response(MessageType::ERROR, "Must login first");
+    return false;
+  }
+
+  // A replica only changes its tables by replicating its primary
+  if (m_server->is_read_only() &&
+      (message.get_message_type() == MessageType::CREATE ||
+       message.get_message_type() == MessageType::SET ||
+       message.get_message_type() == MessageType::LOAD)) {
+    send_response(MessageType::FAILED, "Server is a read-only replica");
+    ongoing = true;
+    return false;
+  }
+  return true;
+}
+
+// Handles a decoded request. Returns false once the conversation is over.
+bool ClientConnection::dispatch_request(const Message &message) {
+  bool ongoing = true;
+  // Handle different types of messages based on their type.
+  switch (message.get_message_type()) {
+  case MessageType::LOGIN:
+    handle_login(message);
+    break;
+  case MessageType::CREATE:
+    handle_create(message);
+    break;
+  case MessageType::SET:
+    handle_set(message);
+    break;
+  case MessageType::GET:
+    handle_get(message);
+    break;
+  case MessageType::PUSH:
+    handle_push(message);
+    break;
+  case MessageType::POP:
+    handle_pop();
+    break;
+  case MessageType::TOP:
+    handle_top();
+    break;
+  case MessageType::ADD:
+  case MessageType::SUB:
+  case MessageType::MUL:
+  case MessageType::DIV:
+    handle_arithmetic(message.get_message_type());
+    break;
+  case MessageType::BEGIN:
+    handle_begin();
+    break;
+  case MessageType::COMMIT:
+    handle_commit();
+    break;
+  case MessageType::STATS:
+    handle_stats(message);
+    break;
+  case MessageType::LOAD:
+    handle_load(message);
+    break;
+  case MessageType::DUMP:
+    handle_dump(message);
+    break;
+  case MessageType::REPLICATE:
+    handle_replicate();
+    break;
+  case MessageType::SLOWLOG:
+    handle_slowlog(message);
+    break;
+  case MessageType::WATCH:
+  case MessageType::SUBSCRIBE:
+    handle_watch(message);
+    break;
+  case MessageType::UNSUBSCRIBE:
+    handle_unsubscribe();
+    break;
+  case MessageType::CREATEINDEX:
+    handle_create_index(message);
+    break;
+  case MessageType::FIND:
+    handle_find(message);
+    break;
+  case MessageType::BYE:
+    ongoing =
+        false; // End the communication loop if "BYE" message is received.
     send_response(MessageType::OK);
-  } catch (const std::exception &e) {
-    send_response(MessageType::FAILED, e.what());
+    break;
+  default:
+    send_response(MessageType::ERROR, "Unsupported operation");
+    break;
+  }
+  if (m_server->get_access_log()) {
+    log_access(message, m_access_start_ns);
   }
+  m_timing.lock_ns += m_session.take_lock_wait_ns();
+  m_timing.total_ns = now_ns() - m_request_start;
+  if (m_server->get_slow_log().is_slow(m_timing.total_ns)) {
+    record_slow_request(message);
+  }
+  return ongoing;
 }
 
-// Handles retrieving and sending the top value of the stack.
-void ClientConnection::handle_top() {
-  try {
-    if (stack->is_empty())
-      throw OperationException("\"Stack empty\"");
-    std::string topValue = stack->get_top();
-    send_response(MessageType::DATA, topValue);
-  } catch (const std::exception &e) {
-    send_response(MessageType::FAILED, e.what());
+// Adds the request which was just handled to the server's slow log
+void ClientConnection::record_slow_request(const Message &message) {
+  SlowLog::Entry entry;
+  entry.time_ns = Logger::wall_clock_ns() - m_timing.total_ns;
+  entry.user = m_username;
+  entry.command = Message::message_type_to_string(message.get_message_type());
+  switch (message.get_message_type()) {
+  case MessageType::SET:
+  case MessageType::GET:
+  case MessageType::WATCH:
+    entry.key = std::string(message.get_key());
+    // fall through
+  case MessageType::CREATE:
+  case MessageType::LOAD:
+  case MessageType::DUMP:
+  case MessageType::SUBSCRIBE:
+  case MessageType::CREATEINDEX:
+  case MessageType::FIND:
+    entry.table = std::string(message.get_table());
+    break;
+  case MessageType::STATS:
+    if (!message.no_args()) {
+      entry.table = std::string(message.get_table());
+    }
+    break;
+  default:
+    break;
   }
+  entry.timing = m_timing;
+  m_server->get_slow_log().record(std::move(entry));
 }
 
-// Utility function to check if a string is numeric.
-bool ClientConnection::isNumeric(const std::string &str) {
-  return std::all_of(str.begin(), str.end(),
-                     [](char c) { return std::isdigit(c) || c == '-'; });
+// Writes a JSON access log record for a request which has been handled
+void ClientConnection::log_access(const Message &message, uint64_t start_ns) {
+  // Arguments are shortened so the record fits in a log record
+  const size_t MAX_ARG_LEN = 100;
+  uint64_t end_ns = Logger::wall_clock_ns();
+  char time_buf[32];
+  size_t time_len = Logger::format_time(time_buf, sizeof(time_buf), start_ns);
+
+  m_access_buf.clear();
+  m_access_buf += "{\"time\":\"";
+  m_access_buf.append(time_buf, time_len);
+  m_access_buf += "\",\"fd\":";
+  m_access_buf += std::to_string(m_client_fd);
+  m_access_buf += ",\"user\":";
+  Logger::append_json_string(m_access_buf, m_username);
+  m_access_buf += ",\"cmd\":\"";
+  m_access_buf += Message::message_type_to_string(message.get_message_type());
+  m_access_buf += "\",\"args\":[";
+  for (unsigned i = 0; i < message.get_num_args() && i < 2; i++) {
+    if (i > 0) {
+      m_access_buf += ',';
+    }
+    Logger::append_json_string(m_access_buf,
+                               message.get_arg(i).substr(0, MAX_ARG_LEN));
+  }
+  m_access_buf += "],\"status\":\"";
+  m_access_buf += Message::message_type_to_string(m_last_response);
+  m_access_buf += "\",\"us\":";
+  m_access_buf += std::to_string((end_ns - start_ns) / 1000);
+  m_access_buf += '}';
+  m_server->get_access_log()->log_record(m_access_buf);
 }
-void ClientConnection::handle_add() {
+
+// Handles pushing a value onto the client's stack.
+void ClientConnection::handle_push(const Message &message) {
   try {
-    if (stack->is_empty())
-      throw OperationException("\"Not enough operands on stack\"");
-    std::string num1_str = stack->get_top();
-    if (!isNumeric(num1_str))
-      throw std::invalid_argument("\"Non-numeric operand\"");
-    stack->pop(); // Pop after validation
-
-    if (stack->is_empty())
-      throw OperationException(
-          "\"Stack underflow on second operand for addition\"");
-    std::string num2_str = stack->get_top();
-    if (!isNumeric(num2_str))
-      throw std::invalid_argument("\"Non-numeric operand\"");
-    stack->pop(); // Pop after validation
-
-    int num1 = std::stoi(num1_str);
-    int num2 = std::stoi(num2_str);
-    int sum = num1 + num2;
-    stack->push(std::to_string(sum));
+    m_session.push(message.get_value());
     send_response(MessageType::OK);
-  } catch (const std::exception &e) {
-    send_response(MessageType::FAILED, e.what());
+  } catch (OperationException &e) {
+    send_response(MessageType::FAILED, e.what()); // over a stack limit
   }
 }
 
-void ClientConnection::handle_sub() {
+// Handles popping the top value from the stack and handling exceptions if the
+// stack is empty.
+void ClientConnection::handle_pop() {
   try {
-    if (stack->is_empty())
-      throw OperationException("\"Not enough operands on stack\"");
-    std::string right_str = stack->get_top();
-    if (!isNumeric(right_str))
-      throw std::invalid_argument("\"Non-numeric operand\"");
-    stack->pop();
-
-    if (stack->is_empty())
-      throw OperationException(
-          "Stack underflow on second operand for subtraction");
-    std::string left_str = stack->get_top();
-    if (!isNumeric(left_str))
-      throw std::invalid_argument("\"Non-numeric operand\"");
-    stack->pop();
-
-    int right = std::stoi(right_str);
-    int left = std::stoi(left_str);
-    int difference = left - right;
-    stack->push(std::to_string(difference));
+    m_session.pop();
     send_response(MessageType::OK);
   } catch (const std::exception &e) {
     send_response(MessageType::FAILED, e.what());
   }
 }
 
-void ClientConnection::handle_mul() {
+// Handles retrieving and sending the top value of the stack.
+void ClientConnection::handle_top() {
   try {
-    if (stack->is_empty())
-      throw OperationException("\"Not enough operands on stack\"");
-    std::string first_str = stack->get_top();
-    if (!isNumeric(first_str))
-      throw std::invalid_argument("\"Non-numeric operand\"");
-    stack->pop();
-
-    if (stack->is_empty())
-      throw OperationException(
-          "Stack underflow on second operand for multiplication");
-    std::string second_str = stack->get_top();
-    if (!isNumeric(second_str))
-      throw std::invalid_argument("Non-numeric operand");
-    stack->pop();
-
-    int first = std::stoi(first_str);
-    int second = std::stoi(second_str);
-    int product = first * second;
-    stack->push(std::to_string(product));
-    send_response(MessageType::OK);
+    send_response(MessageType::DATA, m_session.top());
   } catch (const std::exception &e) {
     send_response(MessageType::FAILED, e.what());
   }
 }
 
-void ClientConnection::handle_div() {
+// ADD, SUB, MUL and DIV: the top two values of the stack are replaced by
+// the result
+void ClientConnection::handle_arithmetic(MessageType type) {
   try {
-    if (stack->is_empty())
-      throw OperationException("\"Not enough operands on stack\"");
-    std::string divisor_str = stack->get_top();
-    if (!isNumeric(divisor_str))
-      throw std::invalid_argument(
-          "\"Non-numeric operand or division by zero\"");
-    if (std::stoi(divisor_str) == 0)
-      throw std::invalid_argument("\"Division by zero\"");
-    stack->pop();
-
-    if (stack->is_empty())
-      throw OperationException(
-          "\"Stack underflow on second operand for division\"");
-    std::string dividend_str = stack->get_top();
-    if (!isNumeric(dividend_str))
-      throw std::invalid_argument("\"Non-numeric operand\"");
-    stack->pop();
-
-    int divisor = std::stoi(divisor_str);
-    int dividend = std::stoi(dividend_str);
-    int quotient = dividend / divisor;
-    stack->push(std::to_string(quotient));
+    if (type == MessageType::ADD) {
+      m_session.add();
+    } else if (type == MessageType::SUB) {
+      m_session.sub();
+    } else if (type == MessageType::MUL) {
+      m_session.mul();
+    } else {
+      m_session.div();
+    }
     send_response(MessageType::OK);
   } catch (const std::exception &e) {
     send_response(MessageType::FAILED, e.what());
@@ -251,171 +560,358 @@ void ClientConnection::handle_login(const Message &message) {
   }
 
   is_logged_in = true;
+  m_username = std::string(message.get_username());
+  m_user = m_server->get_admission().get_user(m_username);
   send_response(MessageType::OK);
 }
 
 // Handles the creation of a new table on the server.
 void ClientConnection::handle_create(const Message &message) {
-  std::string tableName = message.get_table();
-  // Check if the table already exists on the server
-  if (m_server->find_table(tableName)) {
-    // If the table exists, inform the client of the failure
-    send_response(MessageType::FAILED, {"Table already exists"});
-  } else {
-    // If the table does not exist, create it and confirm creation to the client
-    m_server->create_table(tableName);
-    send_response(MessageType::OK, {});
+  std::string_view engine =
+      message.get_num_args() > 1 ? message.get_arg(1) : "memory";
+  try {
+    // Checking for an existing table and creating it happen atomically
+    if (m_session.create_table(std::string(message.get_table()), engine)) {
+      send_response(MessageType::OK);
+    } else {
+      // If the table exists, inform the client of the failure
+      send_response(MessageType::FAILED, "Table already exists");
+    }
+  } catch (OperationException &ex) {
+    send_response(MessageType::FAILED, ex.what());
   }
 }
 
 // Handles setting a value in a specified table, possibly within a transaction
 void ClientConnection::handle_set(const Message &message) {
-  std::string tableName = message.get_table();
-  std::string key = message.get_key();
-
   // Check if there's data on the stack to set
-  if (stack->is_empty()) {
+  ValueStack &stack = m_session.stack();
+  if (stack.is_empty()) {
     send_response(MessageType::FAILED, "Stack is empty, cannot set value");
     return;
   }
+  // The value stays on the stack if the table doesn't exist
+  if (!m_session.find_table(message.get_table())) {
+    send_response(MessageType::ERROR, "Table not found");
+    return;
+  }
 
   // Retrieve value from the stack to be set in the table
-  std::string value = stack->get_top();
-  stack->pop(); // Remove the value from the stack after use
+  std::string value = stack.get_top();
+  stack.pop(); // Remove the value from the stack after use
 
-  Table *table = m_server->find_table(tableName);
-  // Check if the table exists
-  if (!table) {
-    send_response(MessageType::ERROR, "Table not found");
+  try {
+    // A failure in a transaction rolls it back
+    m_session.set(message.get_table(), message.get_key(), value);
+    send_response(MessageType::OK);
+  } catch (const std::exception &e) {
+    send_response(MessageType::FAILED, e.what());
+  }
+}
+
+// Retrieves a value from a table and pushes it onto the stack
+void ClientConnection::handle_get(const Message &message) {
+  std::string value;
+  try {
+    value = m_session.get(message.get_table(), message.get_key());
+  } catch (UnknownTable &e) {
+    send_response(MessageType::ERROR, e.what());
     return;
+  } catch (const std::exception &e) {
+    send_response(MessageType::FAILED, e.what());
+    return;
+  }
+  try {
+    m_session.push(value);
+    send_response(MessageType::OK);
+  } catch (OperationException &e) {
+    send_response(MessageType::FAILED, e.what()); // over a stack limit
   }
+}
 
+// Indexes a table by value, so FIND can look keys up. Building the index
+// holds the table lock for as long as it takes.
+void ClientConnection::handle_create_index(const Message &message) {
   try {
-    // Check transaction status and lock table accordingly
-    if (in_transaction) {
-      if (!locked_tables.count(tableName)) {
-        if (!table->trylock()) {
-          send_response(MessageType::FAILED, "Lock failed");
-          return;
-        }
-        locked_tables.insert(tableName);
-      }
-      // Set value in the table with changes staged for transaction
-      table->set(key, value, true);
+    if (m_session.create_index(message.get_table())) {
+      send_response(MessageType::OK);
     } else {
-      // Directly modify the table data outside of a transaction
-      table->lock();
-      table->set(key, value, false);
-      table->unlock();
+      send_response(MessageType::FAILED, "Table is already indexed");
+    }
+  } catch (UnknownTable &e) {
+    send_response(MessageType::ERROR, e.what());
+  }
+}
+
+// Pushes the keys of an indexed table which hold a value, and then their
+// number, so that the count is on top. In a transaction, the table joins
+// it (like GET) and the transaction's own changes count.
+void ClientConnection::handle_find(const Message &message) {
+  std::vector<std::string> keys;
+  try {
+    if (!m_session.find(message.get_table(), message.get_arg(1), keys)) {
+      send_response(MessageType::FAILED, "Table has no index");
+      return;
     }
+  } catch (UnknownTable &e) {
+    send_response(MessageType::ERROR, e.what());
+    return;
+  } catch (FailedTransaction &e) {
+    send_response(MessageType::FAILED, e.what());
+    return;
+  }
+  keys.push_back(std::to_string(keys.size()));
+  size_t bytes = 0;
+  for (const std::string &key : keys) {
+    bytes += key.size();
+  }
+  // All or nothing
+  ValueStack &stack = m_session.stack();
+  if (!stack.has_room(keys.size(), bytes)) {
+    send_response(MessageType::FAILED, "Stack limit exceeded");
+    return;
+  }
+  for (const std::string &key : keys) {
+    stack.push(key);
+  }
+  send_response(MessageType::OK);
+}
+
+// Begins a new transaction
+void ClientConnection::handle_begin() {
+  try {
+    m_session.begin();
+    send_response(MessageType::OK);
+  } catch (OperationException &e) {
+    send_response(MessageType::FAILED, e.what());
+  }
+}
+
+// Commits all changes made during the current transaction (rolling them
+// back if that fails)
+void ClientConnection::handle_commit() {
+  try {
+    m_session.commit();
     send_response(MessageType::OK);
   } catch (const std::exception &e) {
-    // Handle exceptions by sending error messages and rolling back transactions
-    // if necessary
     send_response(MessageType::FAILED, e.what());
-    if (in_transaction) {
-      rollback_transaction();
+  }
+}
+
+// Bulk-loads a stream of records (see record_stream.h) into a table,
+// creating it if necessary. The records are collected into a WriteSet
+// without holding the table lock, and then committed in one step.
+void ClientConnection::handle_load(const Message &message) {
+  if (m_session.in_transaction()) {
+    send_response(MessageType::FAILED, "LOAD is not allowed in a transaction");
+    return;
+  }
+  Table *table = m_server->find_or_create_table(message.get_table());
+
+  // Tell the client to start streaming
+  send_response(MessageType::OK);
+
+  WriteSet entries;
+  std::string key, value;
+  try {
+    while (RecordStream::read(&m_fdbuf, key, value)) {
+      if (!Message::checkIdentifier(key) || !Message::checkValue(value)) {
+        throw InvalidMessage("Invalid key or value in record stream");
+      }
+      entries.put(key, value);
     }
+  } catch (InvalidMessage &ex) {
+    // The rest of the stream can't be interpreted, so hang up
+    send_response(MessageType::ERROR, ex.what());
+    throw CommException("Invalid record stream");
   }
+
+  m_session.lock_table(table, "LOAD");
+  try {
+    table->commit_changes(entries);
+  } catch (std::exception &ex) {
+    table->unlock();
+    send_response(MessageType::FAILED, ex.what());
+    return;
+  }
+  table->unlock();
+  send_response(MessageType::OK);
 }
 
-// Retrieves a value from a table and sends it to the client
-void ClientConnection::handle_get(const Message &message) {
-  std::string tableName = message.get_table();
-  std::string key = message.get_key();
-  Table *table = m_server->find_table(tableName);
-  // Ensure the table exists
+// Streams a snapshot of a table's contents to the client. The snapshot is
+// taken under the table lock, and then sent without holding it.
+void ClientConnection::handle_dump(const Message &message) {
+  Table *table = m_session.find_table(message.get_table());
   if (!table) {
     send_response(MessageType::ERROR, "Table not found");
     return;
   }
+  if (m_session.has_locked(message.get_table())) {
+    // Locking the table again would self-deadlock
+    send_response(MessageType::FAILED, "Table is locked by this transaction");
+    return;
+  }
 
+  m_session.lock_table(table, "DUMP");
+  std::unique_ptr<StorageEngine::Snapshot> snapshot;
   try {
-    // Lock the table, retrieve the value, and then unlock
-    table->lock();
-    std::string value = table->get(key, in_transaction);
-    stack->push(value);
-    table->unlock();
-    send_response(MessageType::OK, {});
-  } catch (const std::exception &e) {
-    // If an exception occurs, unlock the table and send an error response
+    snapshot = table->snapshot();
+  } catch (std::exception &ex) {
     table->unlock();
-    send_response(MessageType::FAILED, e.what());
+    send_response(MessageType::FAILED, ex.what());
+    return;
   }
+  table->unlock();
+
+  send_response(MessageType::OK);
+
+  const size_t CHUNK_SIZE = 64 * 1024;
+  std::string buf, scratch;
+  buf.reserve(CHUNK_SIZE + 2 * RecordStream::MAX_FIELD_LEN);
+  snapshot->for_each([&](std::string_view key, std::string_view value) {
+    RecordStream::append(buf, key, ValueCodec::decode(value, scratch));
+    if (buf.size() >= CHUNK_SIZE) {
+      write_all(buf);
+      buf.clear();
+    }
+  });
+  RecordStream::append_end(buf);
+  write_all(buf);
 }
 
-// Begins a new transaction by setting the appropriate flags
-void ClientConnection::handle_begin() {
-  if (in_transaction) {
-    // Send an error if a transaction is already active
-    send_response(MessageType::FAILED, "Transaction already started");
-  } else {
-    // Start a new transaction and clear any previously tracked tables
-    in_transaction = true;
-    locked_tables.clear();
+// Turns this connection into a replication feed: a snapshot of every
+// table, followed by the stream of changes committed since (see
+// replication.h). Only returns by throwing CommException, once the
+// replica disconnects.
+void ClientConnection::handle_replicate() {
+  if (m_session.in_transaction()) {
+    send_response(MessageType::FAILED,
+                  "REPLICATE is not allowed in a transaction");
+    return;
+  }
+  send_response(MessageType::OK);
+  // The feed writes to the socket itself
+  flush_output();
+  ReplicationFeed feed(m_server, m_client_fd);
+  feed.run();
+}
+
+// Pushes the slow request log onto the stack, oldest entry first, and
+// then the number of entries, so that the count is on top and the newest
+// entry below it. SLOWLOG reset empties the log instead.
+void ClientConnection::handle_slowlog(const Message &message) {
+  SlowLog &slow_log = m_server->get_slow_log();
+  if (!message.no_args()) {
+    slow_log.reset();
     send_response(MessageType::OK);
+    return;
+  }
+  std::vector<std::string> values;
+  size_t bytes = 0;
+  for (const SlowLog::Entry &entry : slow_log.get_entries()) {
+    values.push_back(entry.to_string());
+    bytes += values.back().size();
+  }
+  values.push_back(std::to_string(values.size()));
+  bytes += values.back().size();
+  // All or nothing
+  ValueStack &stack = m_session.stack();
+  if (!stack.has_room(values.size(), bytes)) {
+    send_response(MessageType::FAILED, "Stack limit exceeded");
+    return;
   }
+  for (const std::string &value : values) {
+    stack.push(value);
+  }
+  send_response(MessageType::OK);
 }
-// Commits all changes made during the current transaction
-void ClientConnection::handle_commit() {
-  if (!in_transaction) {
-    // If no transaction is active, send an error
-    send_response(MessageType::FAILED, "No transaction is active");
+
+// Subscribes this connection to the changes of one key (WATCH) or of
+// every key of a table (SUBSCRIBE). Events are delivered between
+// requests (see pubsub.h).
+void ClientConnection::handle_watch(const Message &message) {
+  if (!m_session.find_table(message.get_table())) {
+    send_response(MessageType::ERROR, "Table not found");
     return;
   }
+  PubSub &pubsub = m_server->get_pubsub();
+  if (!m_subscriber) {
+    m_subscriber.reset(pubsub.create_subscriber());
+  }
+  if (message.get_message_type() == MessageType::WATCH) {
+    pubsub.watch(m_subscriber.get(), message.get_table(), message.get_key());
+  } else {
+    pubsub.subscribe(m_subscriber.get(), message.get_table());
+  }
+  send_response(MessageType::OK);
+}
 
+// Drops all of this connection's subscriptions, along with any events
+// not yet delivered. (The subscriber itself is kept: an I/O channel may
+// still be waiting on its eventfd.)
+void ClientConnection::handle_unsubscribe() {
+  if (m_subscriber) {
+    m_server->get_pubsub().unsubscribe(m_subscriber.get());
+    m_subscriber->clear();
+  }
+  send_response(MessageType::OK);
+}
+
+// Pushes server-wide statistics, or the statistics of a single table,
+// onto the stack
+void ClientConnection::handle_stats(const Message &message) {
   try {
-    // Commit changes for all tables involved in the transaction and unlock them
-    for (const auto &tableName : locked_tables) {
-      Table *table = m_server->find_table(tableName);
-      if (table) {
-        table->commit_changes();
-        table->unlock();
-      }
+    if (message.no_args()) {
+      m_session.push(m_server->get_stats());
+      send_response(MessageType::OK);
+    } else {
+      handle_table_stats(message);
     }
-    // Clear the list of locked tables and mark the transaction as complete
-    locked_tables.clear();
-    in_transaction = false;
-    send_response(MessageType::OK);
-  } catch (const std::exception &e) {
-    // If committing fails, roll back all changes and inform the client
-    rollback_transaction();
-    send_response(MessageType::FAILED, e.what());
+  } catch (OperationException &e) {
+    send_response(MessageType::FAILED, e.what()); // over a stack limit
   }
 }
 
-// Rolls back any changes made during the current transaction
-void ClientConnection::rollback_transaction() {
-  for (const auto &tableName : locked_tables) {
-    Table *table = m_server->find_table(tableName);
-    if (table) {
-      // Discard any staged changes and unlock the table
-      table->rollback_changes();
-      table->unlock();
-    }
+void ClientConnection::handle_table_stats(const Message &message) {
+  Table *table = m_session.find_table(message.get_table());
+  if (!table) {
+    send_response(MessageType::ERROR, "Table not found");
+    return;
+  }
+  if (m_session.has_locked(message.get_table())) {
+    // Reading the statistics would self-deadlock on the table mutex
+    send_response(MessageType::FAILED, "Table is locked by this transaction");
+    return;
   }
-  // Clear the list of locked tables and mark the transaction as not active
-  locked_tables.clear();
-  in_transaction = false;
-  // Inform the client that the transaction has been rolled back successfully
+  m_session.push(table->get_stats());
   send_response(MessageType::OK);
 }
-void ClientConnection::send_response(MessageType type,
-                                     const std::string &additional_info) {
-  Message response(type, {additional_info});
-  std::string encoded;
-  MessageSerialization::encode(response, encoded);
 
-  ssize_t num_bytes_written =
-      rio_writen(m_client_fd, encoded.data(), encoded.size());
+void ClientConnection::send_response(MessageType type,
+                                     std::string_view additional_info) {
+  m_last_response = type;
+  Message response(type, &m_arena);
+  if (!additional_info.empty()) {
+    response.push_arg(additional_info);
+  }
+  MessageSerialization::encode(response, m_outbuf);
+  write_all(m_outbuf);
+}
 
-  if (num_bytes_written < 0) {
-    // Handle the error case where writing fails
+// Queues data for the client. The I/O channel sends it once the next
+// read would block, or once enough has accumulated, so write_ns only
+// covers large responses.
+void ClientConnection::write_all(std::string_view data) {
+  uint64_t start = now_ns();
+  bool ok = m_io->write(data);
+  m_timing.write_ns += now_ns() - start;
+  if (!ok) {
     throw CommException("Failed to write to client");
   }
+}
 
-  if (static_cast<size_t>(num_bytes_written) != encoded.size()) {
-    // Handle the case where not all bytes were written
-    throw CommException("Incomplete write to client");
+void ClientConnection::flush_output() {
+  if (!m_io->flush()) {
+    throw CommException("Failed to write to client");
   }
-}
\ No newline at end of file
+}
@@ -2,30 +2,86 @@
 #ifndef CLIENT_CONNECTION_H
 #define CLIENT_CONNECTION_H
 
+#include "admission.h"
+#include "arena.h"
 #include "csapp.h"
+#include "database.h"
+#include "io_channel.h"
 #include "message.h"
-#include "value_stack.h"
-#include <set>
+#include "pubsub.h"
+#include "slow_log.h"
+#include "task.h"
+#include <atomic>
+#include <memory>
 #include <string>
+#include <vector>
 
 class Server; // Forward declaration to resolve circular dependency
+class EventLoop;
 
 class ClientConnection {
 public:
-  ClientConnection(Server *server, int client_fd);
+  // peer is the client's address, used for per-address connection limits
+  ClientConnection(Server *server, int client_fd,
+                   const std::string &peer = "");
   ~ClientConnection();
 
+  // Handles requests until the client leaves or the server shuts down,
+  // on the calling thread or as a coroutine on an event loop (started
+  // there)
   void chat_with_client();
+  Task<void> chat_async(EventLoop *loop);
   int get_client_fd() const { return m_client_fd; }
+  Server *get_server() const { return m_server; }
+  const std::string &get_peer() const { return m_peer; }
+
+  // Tells a client which won't be served why, ignoring errors
+  void reject(std::string_view reason);
+  // Used by the server while shutting down: a connection waiting for its
+  // next request sees the end of its input, while one handling a request
+  // finishes it first. interrupt() ends the connection regardless.
+  void interrupt_if_idle();
+  void interrupt();
 
 private:
   Server *m_server; // Pointer to server object managing this connection
   int m_client_fd;  // File descriptor for the client socket
   rio_t m_fdbuf;    // Buffered file descriptor info for robust I/O
-  std::set<std::string> locked_tables; // Track tables locked in transaction
-  bool in_transaction; // Flag to check if currently in a transaction
-  ValueStack *stack;   // Pointer to the stack used for operations
+  std::string m_peer;        // client address
+  std::atomic<bool> m_busy;  // handling a request
+  // The client's stack and transaction: requests are carried out through
+  // the session, and the handlers turn its results into responses
+  Session m_session;
   bool is_logged_in;   // Flag to check if client is logged in
+  Arena m_arena;       // Per-request memory, reset after each request
+  std::string m_outbuf; // Reused buffer for encoding responses
+  std::string m_username;
+  // The user's rate limit and priority class, set by LOGIN
+  AdmissionControl::User *m_user;
+  bool m_lowered_priority; // the thread serving a bulk user is niced
+  std::unique_ptr<IoChannel> m_io; // socket I/O, coalescing responses
+  MessageType m_last_response; // type of the last response sent
+  std::string m_access_buf;    // Reused buffer for access log records
+  RequestTiming m_timing;      // phases of the current request
+  uint64_t m_request_start;    // when the current request arrived
+  uint64_t m_access_start_ns;  // the same, on the wall clock (access log)
+  std::vector<char> m_read_buf; // m_fdbuf's buffer, if bigger than its own
+  // Set once the client has sent WATCH or SUBSCRIBE
+  std::unique_ptr<Subscriber> m_subscriber;
+  std::vector<Subscriber::Event> m_events; // reused by deliver_events()
+
+  bool handle_request();
+  ssize_t wait_for_request();
+  bool deliver_events();
+  void send_dropped(uint64_t count);
+  bool request_arrived(ssize_t avail);
+  bool read_request(Message &message, bool &ongoing);
+  bool dispatch_request(const Message &message);
+  uint64_t admit_request();
+  static bool is_streaming(MessageType type);
+  bool prelock_table(const Message &message);
+  void log_access(const Message &message, uint64_t start_ns);
+  void record_slow_request(const Message &message);
 
   // Helper methods for handling different message types
   void handle_login(const Message &message);
@@ -35,16 +91,23 @@ private:
   void handle_push(const Message &message);
   void handle_pop();
   void handle_top();
-  void handle_add();
-  void handle_sub();
-  void handle_mul();
-  void handle_div();
+  void handle_arithmetic(MessageType type);
   void handle_begin();
   void handle_commit();
-  void send_response(MessageType type, const std::string &additional_info = "");
+  void handle_stats(const Message &message);
+  void handle_table_stats(const Message &message);
+  void handle_load(const Message &message);
+  void handle_dump(const Message &message);
+  void handle_replicate();
+  void handle_slowlog(const Message &message);
+  void handle_watch(const Message &message);
+  void handle_create_index(const Message &message);
+  void handle_find(const Message &message);
+  void handle_unsubscribe();
+  void send_response(MessageType type, std::string_view additional_info = "");
+  void write_all(std::string_view data);
+  void flush_output();
   void handle_exceptions(const std::string &error, bool ongoing);
-  bool isNumeric(const std::string &str);
-  void rollback_transaction();
 };
 
 #endif // CLIENT_CONNECTION_H
\ No newline at end of file
@@ -0,0 +1,102 @@
+#include "client_util.h"
+#include "exceptions.h"
+
+// Extracts the value between the first pair of quotes in the input string.
+std::string extractValueBetweenQuotes(const std::string &input) {
+  size_t start = input.find('"');
+  if (start == std::string::npos) {
+    return ""; // No opening quote found
+  }
+
+  size_t end = input.find('"', start + 1);
+  if (end == std::string::npos) {
+    return ""; // No closing quote found
+  }
+
+  return input.substr(start + 1, end - start - 1);
+}
+
+// Send a message to the server
+void send_message(int fd, const std::string &msg) {
+  if (rio_writen(fd, msg.c_str(), msg.size()) !=
+      static_cast<ssize_t>(msg.size())) {
+    throw CommException("Failed to send message");
+  }
+}
+
+// Read response from the server
+std::string read_response(int fd, rio_t &rio) {
+  const char *line;
+  ssize_t len = rio_readlinev(&rio, &line, MAXLINE);
+  if (len <= 0) {
+    throw CommException("Failed to read response from server");
+  }
+  if (line[len - 1] != '\n') {
+    throw InvalidMessage("Server response not properly terminated");
+  }
+  return std::string(line, len - 1);
+}
+
+void expect_ok(int fd, rio_t &rio, const std::string &request,
+               const std::string &fallback_error) {
+  send_message(fd, request);
+  std::string response = read_response(fd, rio);
+  if (response != "OK") {
+    std::string error_message = extractValueBetweenQuotes(response);
+    if (error_message.empty()) {
+      throw OperationException(fallback_error);
+    } else {
+      throw OperationException(error_message);
+    }
+  }
+}
+
+std::vector<std::string> parse_server_list(const std::string &servers,
+                                           const std::string &default_port) {
+  std::vector<std::string> result;
+  size_t start = 0;
+  while (start <= servers.size()) {
+    size_t end = servers.find(',', start);
+    if (end == std::string::npos) {
+      end = servers.size();
+    }
+    std::string server = servers.substr(start, end - start);
+    if (server.empty() || server[0] == ':') {
+      throw InvalidMessage("Invalid server list");
+    }
+    if (server.find(':') == std::string::npos) {
+      server += ":" + default_port;
+    }
+    result.push_back(server);
+    start = end + 1;
+  }
+  return result;
+}
+
+HashRing make_ring(const std::vector<std::string> &servers) {
+  HashRing ring;
+  for (const std::string &server : servers) {
+    ring.add_node(server);
+  }
+  return ring;
+}
+
+int connect_to_server(const std::string &server) {
+  size_t colon = server.rfind(':');
+  std::string host = server.substr(0, colon), port = server.substr(colon + 1);
+  int fd = open_clientfd(host.c_str(), port.c_str());
+  if (fd < 0) {
+    throw CommException("Could not connect to server " + server);
+  }
+  return fd;
+}
+
+int connect_to_shard(const std::string &servers, const std::string &default_port,
+                     const std::string &table, const std::string &key) {
+  std::vector<std::string> list = parse_server_list(servers, default_port);
+  if (list.size() == 1) {
+    return connect_to_server(list[0]);
+  }
+  HashRing ring = make_ring(list);
+  return connect_to_server(ring.get_node(ring.node_for(table, key)));
+}
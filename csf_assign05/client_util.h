@@ -0,0 +1,45 @@
+#ifndef CLIENT_UTIL_H
+#define CLIENT_UTIL_H
+
+#include "csapp.h"
+#include "hash_ring.h"
+#include <string>
+#include <vector>
+
+// Helpers shared by the command line clients
+
+// Extracts the value between the first pair of quotes in the input string.
+std::string extractValueBetweenQuotes(const std::string &input);
+
+// Send a message to the server
+void send_message(int fd, const std::string &msg);
+
+// Read response from the server (without the terminating newline)
+std::string read_response(int fd, rio_t &rio);
+
+// Send a request and check that the response is OK, throwing an
+// OperationException with the server's error text (or with
+// fallback_error if there is none) otherwise.
+void expect_ok(int fd, rio_t &rio, const std::string &request,
+               const std::string &fallback_error);
+
+// Servers are given to the clients as a comma-separated list of
+// host[:port] (any without a port use default_port). With more than one
+// server, tables are sharded across them by (table, key) using a
+// HashRing. Returns the servers as "host:port" names.
+std::vector<std::string> parse_server_list(const std::string &servers,
+                                           const std::string &default_port);
+
+// Builds the hash ring for a server list from parse_server_list()
+HashRing make_ring(const std::vector<std::string> &servers);
+
+// Connects to a server named "host:port", throwing CommException on
+// failure
+int connect_to_server(const std::string &server);
+
+// Connects to the server (from a list as for parse_server_list())
+// responsible for key in table
+int connect_to_shard(const std::string &servers, const std::string &default_port,
+                     const std::string &table, const std::string &key);
+
+#endif // CLIENT_UTIL_H
@@ -0,0 +1,423 @@
+#include "compact_store.h"
+#include "cpu_topology.h"
+#include "epoch.h"
+#include <cstring>
+#include <functional>
+#include <new>
+#include <utility>
+
+namespace {
+
+const size_t MIN_INDEX_CAPACITY = 16;
+
+// Slabs start with a header saying how they were allocated: the length
+// of the mapping for slabs placed on a node, 0 for the heap. It is as
+// big as the heap's alignment so that records stay aligned as before.
+const size_t SLAB_HEADER = 16;
+
+// Records at least this big get a slab of their own
+const size_t LARGE_RECORD = CompactStore::SLAB_SIZE / 4;
+
+size_t varint_len(size_t n) {
+  size_t len = 1;
+  while (n >= 0x80) {
+    n >>= 7;
+    len++;
+  }
+  return len;
+}
+
+char *put_varint(char *p, size_t n) {
+  while (n >= 0x80) {
+    *p++ = char((n & 0x7f) | 0x80);
+    n >>= 7;
+  }
+  *p++ = char(n);
+  return p;
+}
+
+const char *get_varint(const char *p, size_t &n) {
+  n = 0;
+  unsigned shift = 0;
+  unsigned char c;
+  do {
+    c = static_cast<unsigned char>(*p++);
+    n |= size_t(c & 0x7f) << shift;
+    shift += 7;
+  } while (c & 0x80);
+  return p;
+}
+
+// An index array is preceded by its capacity, so that a reader without
+// the lock gets both from one pointer
+const char **alloc_index(size_t capacity) {
+  const char **block = new const char *[capacity + 1]();
+  block[0] = reinterpret_cast<const char *>(capacity);
+  return block + 1;
+}
+
+size_t index_capacity(const char *const *index) {
+  return reinterpret_cast<size_t>(index[-1]);
+}
+
+void free_index(void *index) {
+  delete[] (static_cast<const char **>(index) - 1);
+}
+
+uint32_t record_hash(const char *record) {
+  uint32_t hash;
+  memcpy(&hash, record, sizeof(hash));
+  return hash;
+}
+
+} // namespace
+
+CompactStore::CompactStore(size_t initial_slab_size)
+    : m_slab_ptr(nullptr), m_slab_end(nullptr),
+      m_next_slab_size(initial_slab_size),
+      m_initial_slab_size(initial_slab_size), m_index(nullptr),
+      m_index_capacity(0), m_size(0), m_live_bytes(0), m_slab_bytes(0),
+      m_concurrent_reads(false), m_node(-1) {}
+
+// Nobody can be reading any more
+CompactStore::~CompactStore() {
+  m_concurrent_reads = false;
+  free_slabs();
+  release_index(m_index);
+}
+
+uint32_t CompactStore::hash_key(std::string_view key) {
+  size_t h = std::hash<std::string_view>()(key);
+  return uint32_t(h ^ (h >> 32));
+}
+
+size_t CompactStore::decode_record(const char *record, std::string_view &key,
+                                   std::string_view &value) {
+  size_t key_len, value_len;
+  const char *p = get_varint(record + sizeof(uint32_t), key_len);
+  p = get_varint(p, value_len);
+  key = std::string_view(p, key_len);
+  value = std::string_view(p + key_len, value_len);
+  return (p - record) + key_len + value_len;
+}
+
+// Allocates a slab of at least size bytes, and sets size to its actual
+// size (mappings are whole pages, and the rest of the last one is used)
+char *CompactStore::alloc_slab(size_t &size) {
+  char *block;
+  size_t mapped = 0;
+  if (m_node < 0) {
+    block = new char[SLAB_HEADER + size];
+  } else {
+    size_t page = Topology::page_size();
+    mapped = (SLAB_HEADER + size + page - 1) / page * page;
+    block = static_cast<char *>(Topology::alloc_on_node(mapped, m_node));
+    size = mapped - SLAB_HEADER;
+  }
+  memcpy(block, &mapped, sizeof(mapped));
+  return block + SLAB_HEADER;
+}
+
+void CompactStore::free_slab(void *slab) {
+  char *block = static_cast<char *>(slab) - SLAB_HEADER;
+  size_t mapped;
+  memcpy(&mapped, block, sizeof(mapped));
+  if (mapped == 0) {
+    delete[] block;
+  } else {
+    Topology::free_on_node(block, mapped);
+  }
+}
+
+char *CompactStore::alloc_record(size_t n) {
+  if (n >= LARGE_RECORD) {
+    // Keep the current slab for small records; insert the dedicated slab
+    // before it so that the last slab is still the one being filled
+    char *slab = alloc_slab(n);
+    m_slabs.insert(m_slabs.empty() ? m_slabs.end() : m_slabs.end() - 1, slab);
+    m_slab_bytes += n;
+    return slab;
+  }
+  if (size_t(m_slab_end - m_slab_ptr) < n) {
+    size_t size = m_next_slab_size;
+    while (size < n) {
+      size *= 2;
+    }
+    if (m_next_slab_size < SLAB_SIZE) {
+      m_next_slab_size *= 2;
+    }
+    char *slab = alloc_slab(size);
+    m_slabs.push_back(slab);
+    m_slab_bytes += size;
+    m_slab_ptr = slab;
+    m_slab_end = slab + size;
+  }
+  char *p = m_slab_ptr;
+  m_slab_ptr += n;
+  return p;
+}
+
+const char *CompactStore::write_record(uint32_t hash, std::string_view key,
+                                       std::string_view value) {
+  size_t len = sizeof(hash) + varint_len(key.size()) +
+               varint_len(value.size()) + key.size() + value.size();
+  char *record = alloc_record(len);
+  memcpy(record, &hash, sizeof(hash));
+  char *p = put_varint(record + sizeof(hash), key.size());
+  p = put_varint(p, value.size());
+  memcpy(p, key.data(), key.size());
+  memcpy(p + key.size(), value.data(), value.size());
+  return record;
+}
+
+// Returns the slot holding key, or the empty slot where it belongs
+size_t CompactStore::find_slot(uint32_t hash, std::string_view key) const {
+  size_t mask = m_index_capacity - 1;
+  size_t slot = hash & mask;
+  while (m_index[slot]) {
+    if (record_hash(m_index[slot]) == hash) {
+      std::string_view k, v;
+      decode_record(m_index[slot], k, v);
+      if (k == key) {
+        break;
+      }
+    }
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+bool CompactStore::get(std::string_view key, std::string_view &value) const {
+  if (m_size == 0) {
+    return false;
+  }
+  const char *record = m_index[find_slot(hash_key(key), key)];
+  if (!record) {
+    return false;
+  }
+  std::string_view k;
+  decode_record(record, k, value);
+  return true;
+}
+
+bool CompactStore::get_concurrent(std::string_view key,
+                                  std::string_view &value) const {
+  const char *const *index = __atomic_load_n(&m_index, __ATOMIC_ACQUIRE);
+  if (!index) {
+    return false;
+  }
+  // Slots only ever go from empty to full, so a probe ends at the same
+  // empty slot as it would have under the lock
+  uint32_t hash = hash_key(key);
+  size_t mask = index_capacity(index) - 1;
+  for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+    const char *record = __atomic_load_n(&index[slot], __ATOMIC_ACQUIRE);
+    if (!record) {
+      return false;
+    }
+    if (record_hash(record) == hash) {
+      std::string_view k;
+      decode_record(record, k, value);
+      if (k == key) {
+        return true;
+      }
+    }
+  }
+}
+
+bool CompactStore::contains(std::string_view key) const {
+  std::string_view value;
+  return get(key, value);
+}
+
+void CompactStore::put(std::string_view key, std::string_view value) {
+  reserve_index(m_size + 1);
+  uint32_t hash = hash_key(key);
+  link_record(find_slot(hash, key), write_record(hash, key, value));
+  maybe_compact();
+}
+
+void CompactStore::adopt(CompactStore &other) {
+  if (other.m_size == 0) {
+    other.clear();
+    return;
+  }
+  if (m_size == 0) {
+    // Nothing to merge with (e.g. a bulk load into a new table): just
+    // take over other's slabs and index
+    clear();
+    std::swap(m_slabs, other.m_slabs);
+    std::swap(m_slab_ptr, other.m_slab_ptr);
+    std::swap(m_slab_end, other.m_slab_end);
+    set_index(other.m_index, other.m_index_capacity);
+    other.m_index = nullptr;
+    other.m_index_capacity = 0;
+    std::swap(m_size, other.m_size);
+    std::swap(m_live_bytes, other.m_live_bytes);
+    std::swap(m_slab_bytes, other.m_slab_bytes);
+    m_next_slab_size = SLAB_SIZE;
+    other.clear();
+    return;
+  }
+  reserve_index(m_size + other.m_size);
+
+  // Our partially filled slab stays last so that we keep filling it
+  m_slabs.insert(m_slabs.empty() ? m_slabs.end() : m_slabs.end() - 1,
+                 other.m_slabs.begin(), other.m_slabs.end());
+  m_slab_bytes += other.m_slab_bytes;
+  other.m_slabs.clear();
+
+  for (size_t i = 0; i < other.m_index_capacity; i++) {
+    const char *record = other.m_index[i];
+    if (record) {
+      std::string_view key, value;
+      decode_record(record, key, value);
+      link_record(find_slot(record_hash(record), key), record);
+    }
+  }
+
+  other.clear();
+  maybe_compact();
+}
+
+void CompactStore::copy_to(CompactStore &out) const {
+  out.clear();
+  if (m_size == 0) {
+    return;
+  }
+  out.set_index(alloc_index(m_index_capacity), m_index_capacity);
+  out.m_index_capacity = m_index_capacity;
+  for (size_t i = 0; i < m_index_capacity; i++) {
+    if (m_index[i]) {
+      std::string_view key, value;
+      size_t len = decode_record(m_index[i], key, value);
+      char *record = out.alloc_record(len);
+      memcpy(record, m_index[i], len);
+      out.m_index[i] = record;
+      out.m_live_bytes += len;
+      out.m_size++;
+    }
+  }
+}
+
+// Points slot (as returned by find_slot()) at record, superseding the
+// record it held, if any
+void CompactStore::link_record(size_t slot, const char *record) {
+  std::string_view key, value;
+  if (m_index[slot]) {
+    m_live_bytes -= decode_record(m_index[slot], key, value);
+  } else {
+    m_size++;
+  }
+  m_live_bytes += decode_record(record, key, value);
+  __atomic_store_n(&m_index[slot], record, __ATOMIC_RELEASE);
+}
+
+// Keep the load factor at or below 3/4
+void CompactStore::reserve_index(size_t entries) {
+  while (entries * 4 > m_index_capacity * 3) {
+    grow_index();
+  }
+}
+
+// Superseded records and unused slab space outweigh the live records:
+// rewrite the live records into fresh slabs
+void CompactStore::maybe_compact() {
+  if (m_slab_bytes > 2 * m_live_bytes + 2 * SLAB_SIZE) {
+    compact();
+  }
+}
+
+void CompactStore::grow_index() {
+  size_t capacity =
+      m_index_capacity ? m_index_capacity * 2 : MIN_INDEX_CAPACITY;
+  const char **index = alloc_index(capacity);
+  size_t mask = capacity - 1;
+  for (size_t i = 0; i < m_index_capacity; i++) {
+    if (m_index[i]) {
+      size_t slot = record_hash(m_index[i]) & mask;
+      while (index[slot]) {
+        slot = (slot + 1) & mask;
+      }
+      index[slot] = m_index[i];
+    }
+  }
+  const char **old_index = m_index;
+  set_index(index, capacity);
+  release_index(old_index);
+}
+
+// Copy live records into new slabs and free the old ones. Index slots
+// don't move, only the pointers in them change.
+void CompactStore::compact() {
+  std::vector<char *> old_slabs;
+  old_slabs.swap(m_slabs);
+  m_slab_ptr = m_slab_end = nullptr;
+  m_slab_bytes = 0;
+  m_next_slab_size = SLAB_SIZE;
+
+  for (size_t i = 0; i < m_index_capacity; i++) {
+    if (m_index[i]) {
+      std::string_view key, value;
+      decode_record(m_index[i], key, value);
+      __atomic_store_n(&m_index[i],
+                       write_record(record_hash(m_index[i]), key, value),
+                       __ATOMIC_RELEASE);
+    }
+  }
+
+  for (char *slab : old_slabs) {
+    release_slab(slab);
+  }
+}
+
+void CompactStore::free_slabs() {
+  for (char *slab : m_slabs) {
+    release_slab(slab);
+  }
+  m_slabs.clear();
+  m_slab_ptr = m_slab_end = nullptr;
+  m_slab_bytes = 0;
+  m_live_bytes = 0;
+}
+
+void CompactStore::clear() {
+  free_slabs();
+  m_next_slab_size = m_initial_slab_size;
+  const char **old_index = m_index;
+  set_index(nullptr, 0);
+  release_index(old_index);
+  m_size = 0;
+}
+
+// Publishes a new index array, filled in beforehand
+void CompactStore::set_index(const char **index, size_t capacity) {
+  __atomic_store_n(&m_index, index, __ATOMIC_RELEASE);
+  m_index_capacity = capacity;
+}
+
+// Frees memory which concurrent readers may still be using once they
+// are done with it
+void CompactStore::release_index(const char **index) {
+  if (!index) {
+    return;
+  }
+  if (m_concurrent_reads) {
+    Epoch::retire(index, free_index);
+  } else {
+    free_index(index);
+  }
+}
+
+void CompactStore::release_slab(char *slab) {
+  if (m_concurrent_reads) {
+    Epoch::retire(slab, free_slab);
+  } else {
+    free_slab(slab);
+  }
+}
+
+size_t CompactStore::memory_usage() const {
+  return m_slab_bytes + m_index_capacity * sizeof(const char *) +
+         m_slabs.capacity() * sizeof(char *);
+}
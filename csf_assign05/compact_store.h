@@ -0,0 +1,135 @@
+#ifndef COMPACT_STORE_H
+#define COMPACT_STORE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+// Memory-efficient key/value map used for table data.
+//
+// Each entry is a single variable-length record packed into large slabs:
+//
+//   [4 byte hash][varint key length][varint value length][key][value]
+//
+// so a small entry costs 6 bytes of header plus an 8 byte index slot,
+// instead of a map node with two separately allocated strings. The index
+// is an open-addressing hash table of record pointers.
+//
+// Records are never modified once written: overwriting a key appends a
+// new record and repoints the index slot. Space used by superseded
+// records is reclaimed by compacting into fresh slabs once it exceeds
+// the live data.
+//
+// Because records don't move while their slab is alive, one store can
+// adopt another's slabs wholesale (see adopt()); this is how a
+// transaction's private writes are committed without copying them.
+//
+// A store can also be read by threads which don't hold its owner's lock
+// (see get_concurrent()), once set_concurrent_reads() says so. Writers
+// then publish index slots and index arrays atomically, and hand the
+// slabs and index arrays they replace to Epoch::retire() instead of
+// freeing them.
+//
+// Slabs are allocated on a given NUMA node after set_node(). Each slab
+// remembers how it was allocated, so adopted slabs are freed correctly
+// whichever store allocated them.
+class CompactStore {
+public:
+  static const size_t SLAB_SIZE = 64 * 1024;
+
+  // Stores which usually hold few entries (such as a transaction's
+  // writes) can start with small slabs; slab sizes double up to
+  // SLAB_SIZE as the store grows.
+  static const size_t SMALL_SLAB_SIZE = 256;
+
+private:
+  std::vector<char *> m_slabs; // all slabs, the last is being filled
+  char *m_slab_ptr;            // next free byte in the current slab
+  char *m_slab_end;            // end of the current slab
+  size_t m_next_slab_size;     // size of the next regular slab
+  size_t m_initial_slab_size;
+
+  const char **m_index;        // record pointers, nullptr for empty slots
+  size_t m_index_capacity;     // power of two
+  size_t m_size;               // number of live entries
+
+  size_t m_live_bytes;         // bytes of records referenced by the index
+  size_t m_slab_bytes;         // bytes reserved for slabs
+  bool m_concurrent_reads;     // see set_concurrent_reads()
+  int m_node;                  // node for new slabs, -1 for anywhere
+
+  char *alloc_slab(size_t &size);
+  static void free_slab(void *slab);
+  char *alloc_record(size_t n);
+  const char *write_record(uint32_t hash, std::string_view key,
+                           std::string_view value);
+  size_t find_slot(uint32_t hash, std::string_view key) const;
+  void reserve_index(size_t entries);
+  void grow_index();
+  void link_record(size_t slot, const char *record);
+  void maybe_compact();
+  void compact();
+  void free_slabs();
+  void set_index(const char **index, size_t capacity);
+  void release_index(const char **index);
+  void release_slab(char *slab);
+
+  // copy constructor and assignment operator are prohibited
+  CompactStore(const CompactStore &);
+  CompactStore &operator=(const CompactStore &);
+
+public:
+  explicit CompactStore(size_t initial_slab_size = SLAB_SIZE);
+  ~CompactStore();
+
+  // On success, value refers to storage owned by the store, which stays
+  // valid until the next modification
+  bool get(std::string_view key, std::string_view &value) const;
+  bool contains(std::string_view key) const;
+  // Like get(), but safe while another thread modifies the store. The
+  // caller must hold an Epoch::ReadGuard for as long as it uses value.
+  bool get_concurrent(std::string_view key, std::string_view &value) const;
+  // Whether get_concurrent() may be used; set before the store is shared
+  void set_concurrent_reads(bool enabled) { m_concurrent_reads = enabled; }
+  // Allocates slabs from now on from the memory of NUMA node (see
+  // Topology), or anywhere if node is -1. Existing slabs move to the node
+  // as the store is compacted.
+  void set_node(int node) { m_node = node; }
+  int get_node() const { return m_node; }
+  void put(std::string_view key, std::string_view value);
+  void clear();
+
+  // Moves every entry of other into this store (other's values win),
+  // leaving other empty. Other's slabs are taken over as they are, so
+  // the cost is proportional to the number of entries moved, and no key
+  // or value bytes are copied.
+  void adopt(CompactStore &other);
+
+  // Replaces the contents of out with a copy of this store's live
+  // entries. Records are copied as they are, without rehashing.
+  void copy_to(CompactStore &out) const;
+
+  size_t size() const { return m_size; }
+
+  // Heap bytes used by slabs and the index
+  size_t memory_usage() const;
+
+  // Calls fn(key, value) for every live entry, in no particular order
+  template <typename Fn> void for_each(Fn fn) const {
+    for (size_t i = 0; i < m_index_capacity; i++) {
+      if (m_index[i]) {
+        std::string_view key, value;
+        decode_record(m_index[i], key, value);
+        fn(key, value);
+      }
+    }
+  }
+
+  static uint32_t hash_key(std::string_view key);
+  // Returns the total length of the record
+  static size_t decode_record(const char *record, std::string_view &key,
+                              std::string_view &value);
+};
+
+#endif // COMPACT_STORE_H
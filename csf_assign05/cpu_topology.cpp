@@ -0,0 +1,211 @@
+#include "cpu_topology.h"
+#include <algorithm>
+#include <dirent.h>
+#include <fstream>
+#include <linux/mempolicy.h>
+#include <new>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+
+struct Node {
+  int kernel_id; // as in /sys/devices/system/node/node<id>
+  std::vector<int> cpus;
+};
+
+struct Machine {
+  std::vector<Node> nodes;
+  std::vector<unsigned> cpu_nodes; // node of each CPU, by CPU number
+};
+
+// Parses a kernel CPU list such as "0-3,8,10-11"
+std::vector<int> parse_cpu_list(const std::string &list) {
+  std::vector<int> cpus;
+  size_t pos = 0;
+  while (pos < list.size()) {
+    size_t end = list.find(',', pos);
+    if (end == std::string::npos) {
+      end = list.size();
+    }
+    std::string range = list.substr(pos, end - pos);
+    size_t dash = range.find('-');
+    try {
+      int first = std::stoi(range);
+      int last = dash == std::string::npos ? first
+                                           : std::stoi(range.substr(dash + 1));
+      for (int cpu = first; cpu <= last; cpu++) {
+        cpus.push_back(cpu);
+      }
+    } catch (std::exception &ex) {
+      // skip what doesn't parse (such as a trailing newline)
+    }
+    pos = end + 1;
+  }
+  return cpus;
+}
+
+// The CPUs this process may run on, which nodes are restricted to
+std::vector<int> allowed_cpus() {
+  std::vector<int> cpus;
+  cpu_set_t set;
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &set)) {
+        cpus.push_back(cpu);
+      }
+    }
+  }
+  if (cpus.empty()) {
+    cpus.push_back(0);
+  }
+  return cpus;
+}
+
+Machine *read_machine() {
+  Machine *machine = new Machine();
+  std::vector<int> allowed = allowed_cpus();
+  const char *dir_name = "/sys/devices/system/node";
+  if (DIR *dir = opendir(dir_name)) {
+    while (struct dirent *ent = readdir(dir)) {
+      std::string name = ent->d_name;
+      if (name.compare(0, 4, "node") != 0 || name.size() == 4 ||
+          !std::all_of(name.begin() + 4, name.end(), ::isdigit)) {
+        continue;
+      }
+      std::ifstream in(std::string(dir_name) + "/" + name + "/cpulist");
+      std::string list;
+      std::getline(in, list);
+      Node node;
+      node.kernel_id = std::stoi(name.substr(4));
+      for (int cpu : parse_cpu_list(list)) {
+        if (std::find(allowed.begin(), allowed.end(), cpu) != allowed.end()) {
+          node.cpus.push_back(cpu);
+        }
+      }
+      if (!node.cpus.empty()) {
+        machine->nodes.push_back(node);
+      }
+    }
+    closedir(dir);
+  }
+  std::sort(machine->nodes.begin(), machine->nodes.end(),
+            [](const Node &a, const Node &b) {
+              return a.kernel_id < b.kernel_id;
+            });
+  if (machine->nodes.empty()) {
+    machine->nodes.push_back(Node{0, allowed});
+  }
+  for (unsigned i = 0; i < machine->nodes.size(); i++) {
+    for (int cpu : machine->nodes[i].cpus) {
+      if (size_t(cpu) >= machine->cpu_nodes.size()) {
+        machine->cpu_nodes.resize(cpu + 1, 0);
+      }
+      machine->cpu_nodes[cpu] = i;
+    }
+  }
+  return machine;
+}
+
+pthread_once_t g_once = PTHREAD_ONCE_INIT;
+Machine *g_machine;
+
+void init_machine() { g_machine = read_machine(); }
+
+const Machine &machine() {
+  pthread_once(&g_once, init_machine);
+  return *g_machine;
+}
+
+cpu_set_t make_cpu_set(const std::vector<int> &cpus) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus) {
+    CPU_SET(cpu, &set);
+  }
+  return set;
+}
+
+} // namespace
+
+unsigned Topology::num_nodes() { return machine().nodes.size(); }
+
+const std::vector<int> &Topology::node_cpus(unsigned node) {
+  return machine().nodes.at(node).cpus;
+}
+
+std::vector<int> Topology::all_cpus() {
+  std::vector<int> cpus;
+  for (const Node &node : machine().nodes) {
+    cpus.insert(cpus.end(), node.cpus.begin(), node.cpus.end());
+  }
+  return cpus;
+}
+
+unsigned Topology::node_of_cpu(int cpu) {
+  const std::vector<unsigned> &cpu_nodes = machine().cpu_nodes;
+  return cpu >= 0 && size_t(cpu) < cpu_nodes.size() ? cpu_nodes[cpu] : 0;
+}
+
+unsigned Topology::current_node() { return node_of_cpu(sched_getcpu()); }
+
+bool Topology::pin_thread(pthread_t thread, const std::vector<int> &cpus) {
+  cpu_set_t set = make_cpu_set(cpus);
+  return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+}
+
+bool Topology::pin_attr(pthread_attr_t *attr, const std::vector<int> &cpus) {
+  cpu_set_t set = make_cpu_set(cpus);
+  return pthread_attr_setaffinity_np(attr, sizeof(set), &set) == 0;
+}
+
+void *Topology::alloc_on_node(size_t size, unsigned node) {
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    throw std::bad_alloc();
+  }
+  // Before the pages are touched, so they are allocated there. Failing
+  // (without NUMA support, say) just leaves the default placement.
+  int kernel_id = machine().nodes.at(node).kernel_id;
+  const int BITS = sizeof(unsigned long) * 8;
+  unsigned long mask[16] = {};
+  if (kernel_id < 16 * BITS) {
+    mask[kernel_id / BITS] |= 1UL << (kernel_id % BITS);
+    syscall(SYS_mbind, p, size, MPOL_PREFERRED, mask, 16 * BITS, 0);
+  }
+  return p;
+}
+
+void Topology::free_on_node(void *p, size_t size) { munmap(p, size); }
+
+size_t Topology::page_size() {
+  static const size_t size = sysconf(_SC_PAGESIZE);
+  return size;
+}
+
+std::string Topology::get_stats() {
+  std::string stats = "numa_nodes=" + std::to_string(num_nodes()) +
+                      ";node_cpus=";
+  for (unsigned i = 0; i < num_nodes(); i++) {
+    if (i > 0) {
+      stats += '/';
+    }
+    // Consecutive CPUs as ranges, as the kernel lists them
+    const std::vector<int> &cpus = node_cpus(i);
+    for (size_t j = 0; j < cpus.size(); j++) {
+      size_t k = j;
+      while (k + 1 < cpus.size() && cpus[k + 1] == cpus[k] + 1) {
+        k++;
+      }
+      stats += (j > 0 ? "," : "") + std::to_string(cpus[j]);
+      if (k > j) {
+        stats += "-" + std::to_string(cpus[k]);
+      }
+      j = k;
+    }
+  }
+  return stats;
+}
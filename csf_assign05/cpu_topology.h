@@ -0,0 +1,45 @@
+#ifndef CPU_TOPOLOGY_H
+#define CPU_TOPOLOGY_H
+
+#include <cstddef>
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+// The machine's NUMA nodes and their CPUs, for placing threads and
+// memory. Read once from /sys/devices/system/node; without NUMA support
+// there is a single node holding every CPU the process may run on.
+// Memory placement uses the mbind() system call directly, so there is no
+// dependency on libnuma.
+namespace Topology {
+
+// Nodes are numbered from 0 in this order, which skips nodes without
+// CPUs (so it may differ from the kernel's numbering)
+unsigned num_nodes();
+const std::vector<int> &node_cpus(unsigned node);
+// Every CPU, node by node
+std::vector<int> all_cpus();
+unsigned node_of_cpu(int cpu);
+// The node the calling thread is running on at the moment
+unsigned current_node();
+
+// Restricts thread to cpus. Returns false if the kernel refuses.
+bool pin_thread(pthread_t thread, const std::vector<int> &cpus);
+// Restricts threads created with attr to cpus from the start (so their
+// stacks and thread-local data are allocated there)
+bool pin_attr(pthread_attr_t *attr, const std::vector<int> &cpus);
+
+// Maps size bytes (a multiple of the page size) whose pages the kernel
+// prefers to take from node; throws std::bad_alloc if mapping fails.
+// Placement is a preference: if the node runs out, pages come from
+// elsewhere.
+void *alloc_on_node(size_t size, unsigned node);
+void free_on_node(void *p, size_t size);
+size_t page_size();
+
+// "numa_nodes=<n>;node_cpus=<cpus of node 0>/<cpus of node 1>/..."
+std::string get_stats();
+
+} // namespace Topology
+
+#endif // CPU_TOPOLOGY_H
@@ -715,20 +715,37 @@ ssize_t rio_writen(int fd, const void *usrbuf, size_t n) {
 }
 /* $end rio_writen */
 
+/*
+ * rio_fillat - Read up to n bytes into buf (part of the internal buffer)
+ *              with read(), or with the fill function set by rio_setfill
+ */
+static ssize_t rio_fillat(rio_t *rp, char *buf, size_t n) {
+  if (rp->rio_fill)
+    return rp->rio_fill(rp->rio_fill_ctx, buf, n);
+  return read(rp->rio_fd, buf, n);
+}
+
+/*
+ * rio_refill - Fill the whole internal buffer
+ */
+static ssize_t rio_refill(rio_t *rp) {
+  return rio_fillat(rp, rp->rio_buf, rp->rio_bufsize);
+}
+
 /*
  * rio_read - This is a wrapper for the Unix read() function that
  *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
  *    buffer, where n is the number of bytes requested by the user and
  *    rio_cnt is the number of unread bytes in the internal buffer. On
  *    entry, rio_read() refills the internal buffer via a call to
- *    read() if the internal buffer is empty.
+ *    read() (or rio_fill) if the internal buffer is empty.
  */
 /* $begin rio_read */
 static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n) {
   int cnt;
 
   while (rp->rio_cnt <= 0) { /* Refill if buf is empty */
-    rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf));
+    rp->rio_cnt = rio_refill(rp);
     if (rp->rio_cnt < 0) {
       if (errno != EINTR) /* Interrupted by sig handler return */
         return -1;
@@ -756,10 +773,58 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n) {
 void rio_readinitb(rio_t *rp, int fd) {
   rp->rio_fd = fd;
   rp->rio_cnt = 0;
+  rp->rio_buf = rp->rio_inline;
+  rp->rio_bufsize = sizeof(rp->rio_inline);
   rp->rio_bufptr = rp->rio_buf;
+  rp->rio_fill = NULL;
+  rp->rio_fill_ctx = NULL;
 }
 /* $end rio_readinitb */
 
+/*
+ * rio_setbuf - Make the buffer use buf, of size bytes, which the caller
+ *              keeps for as long as it uses rp. Unread data moves along.
+ *              Returns -1 if it doesn't fit.
+ */
+int rio_setbuf(rio_t *rp, char *buf, size_t size) {
+  size_t cnt = rp->rio_cnt > 0 ? rp->rio_cnt : 0;
+  if (cnt > size)
+    return -1;
+  memmove(buf, rp->rio_bufptr, cnt);
+  rp->rio_buf = buf;
+  rp->rio_bufsize = size;
+  rp->rio_bufptr = buf;
+  return 0;
+}
+
+/*
+ * rio_setfill - Make the buffer refill itself by calling fill(ctx, buf, n),
+ *               which behaves like read(fd, buf, n)
+ */
+void rio_setfill(rio_t *rp, rio_fill_t fill, void *ctx) {
+  rp->rio_fill = fill;
+  rp->rio_fill_ctx = ctx;
+}
+
+/*
+ * rio_waitb - Block until the read buffer holds unread data, without
+ *             consuming any. Returns the number of bytes buffered,
+ *             0 on EOF and -1 on error.
+ */
+ssize_t rio_waitb(rio_t *rp) {
+  while (rp->rio_cnt <= 0) {
+    rp->rio_cnt = rio_refill(rp);
+    if (rp->rio_cnt < 0) {
+      if (errno != EINTR)
+        return -1;
+    } else if (rp->rio_cnt == 0)
+      return 0; /* EOF */
+    else
+      rp->rio_bufptr = rp->rio_buf;
+  }
+  return rp->rio_cnt;
+}
+
 /*
  * rio_readnb - Robustly read n bytes (buffered)
  */
@@ -782,32 +847,85 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n) {
 /* $end rio_readnb */
 
 /*
- * rio_readlineb - Robustly read a text line (buffered)
+ * rio_readlineb - Robustly read a text line (buffered), copying it to
+ *                 usrbuf a buffered run at a time
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) {
-  int n, rc;
-  char c, *bufp = usrbuf;
-
-  for (n = 1; n < (int)maxlen; n++) {
-    if ((rc = rio_read(rp, &c, 1)) == 1) {
-      *bufp++ = c;
-      if (c == '\n') {
-        n++;
-        break;
-      }
+  size_t n = 0, cnt;
+  ssize_t rc;
+  char *bufp = usrbuf, *nl = NULL;
+
+  while (n + 1 < maxlen && !nl) {
+    if ((rc = rio_waitb(rp)) < 0)
+      return -1; /* Error */
+    else if (rc == 0)
+      break; /* EOF */
+    cnt = rp->rio_cnt;
+    if (cnt > maxlen - 1 - n)
+      cnt = maxlen - 1 - n;
+    nl = memchr(rp->rio_bufptr, '\n', cnt);
+    if (nl)
+      cnt = nl - rp->rio_bufptr + 1;
+    memcpy(bufp + n, rp->rio_bufptr, cnt);
+    rp->rio_bufptr += cnt;
+    rp->rio_cnt -= cnt;
+    n += cnt;
+  }
+  bufp[n] = 0;
+  return n;
+}
+/* $end rio_readlineb */
+
+/*
+ * rio_readlinev - Read a text line (buffered) without copying it: *line
+ *                 points at it in the internal buffer, until the next
+ *                 read from rp. Like rio_readlineb, returns the line
+ *                 with its newline, or maxlen - 1 characters of a longer
+ *                 one (or as many as the buffer holds), 0 on EOF and -1
+ *                 on error; the line isn't null-terminated.
+ */
+ssize_t rio_readlinev(rio_t *rp, const char **line, size_t maxlen) {
+  size_t limit = maxlen - 1, scanned = 0, cnt, len;
+  ssize_t rc;
+  char *nl;
+
+  if (limit > rp->rio_bufsize)
+    limit = rp->rio_bufsize;
+  while (1) {
+    cnt = rp->rio_cnt > 0 ? rp->rio_cnt : 0;
+    len = cnt < limit ? cnt : limit;
+    nl = memchr(rp->rio_bufptr + scanned, '\n', len - scanned);
+    if (nl) {
+      len = nl - rp->rio_bufptr + 1;
+      break;
+    }
+    if (cnt >= limit)
+      break; /* Too long: return the first limit characters */
+    scanned = cnt;
+
+    /* Move the partial line to the front and read more after it */
+    if (rp->rio_bufptr != rp->rio_buf) {
+      memmove(rp->rio_buf, rp->rio_bufptr, cnt);
+      rp->rio_bufptr = rp->rio_buf;
+    }
+    rc = rio_fillat(rp, rp->rio_buf + cnt, rp->rio_bufsize - cnt);
+    if (rc < 0) {
+      if (errno != EINTR) /* Interrupted by sig handler return */
+        return -1;
     } else if (rc == 0) {
-      if (n == 1)
+      if (cnt == 0)
         return 0; /* EOF, no data read */
-      else
-        break; /* EOF, some data was read */
+      len = cnt;  /* EOF, some data was read */
+      break;
     } else
-      return -1; /* Error */
+      rp->rio_cnt = cnt + rc;
   }
-  *bufp = 0;
-  return n - 1;
+  *line = rp->rio_bufptr;
+  rp->rio_bufptr += len;
+  rp->rio_cnt -= len;
+  return len;
 }
-/* $end rio_readlineb */
 
 /**********************************
  * Wrappers for robust I/O routines
@@ -905,7 +1023,7 @@ int open_clientfd(const char *hostname, const char *port) {
  *       -1 with errno set for other errors.
  */
 /* $begin open_listenfd */
-int open_listenfd(const char *port) {
+static int open_listenfd_opt(const char *port, int reuseport) {
   struct addrinfo hints, *listp, *p;
   int listenfd, rc, optval = 1;
 
@@ -930,6 +1048,15 @@ int open_listenfd(const char *port) {
     setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, // line:netp:csapp:setsockopt
                (const void *)&optval, sizeof(int));
 
+    /* Let several sockets bind the same port; the kernel spreads
+       incoming connections between them */
+    if (reuseport &&
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, (const void *)&optval,
+                   sizeof(int)) < 0) {
+      close(listenfd);
+      continue;
+    }
+
     /* Bind the descriptor to the address */
     if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
       break;                   /* Success */
@@ -951,6 +1078,17 @@ int open_listenfd(const char *port) {
   }
   return listenfd;
 }
+
+int open_listenfd(const char *port) { return open_listenfd_opt(port, 0); }
+
+/*
+ * open_listenfd_reuseport - Like open_listenfd, but with SO_REUSEPORT
+ *     set, so that several listening sockets (e.g. one per thread) can
+ *     be opened on the same port.
+ */
+int open_listenfd_reuseport(const char *port) {
+  return open_listenfd_opt(port, 1);
+}
 /* $end open_listenfd */
 
 /****************************************************
@@ -38,6 +38,11 @@
 //   std::string::c_str()
 //
 // - use const void * rather than void * in rio_writen
+//
+// Later changes: rio_setfill, rio_waitb, rio_setbuf (caller-provided
+// buffers of any size), rio_readlinev (lines returned in place), and
+// rio_readlineb scanning for the newline with memchr instead of reading
+// a byte at a time.
 
 #ifdef __cplusplus
 extern "C" {
@@ -57,11 +62,16 @@ typedef struct sockaddr SA;
 /* Persistent state for the robust I/O (Rio) package */
 /* $begin rio_t */
 #define RIO_BUFSIZE 8192
+typedef ssize_t (*rio_fill_t)(void *ctx, void *buf, size_t n);
 typedef struct {
-  int rio_fd;                /* Descriptor for this internal buf */
-  int rio_cnt;               /* Unread bytes in internal buf */
-  char *rio_bufptr;          /* Next unread byte in internal buf */
-  char rio_buf[RIO_BUFSIZE]; /* Internal buffer */
+  int rio_fd;                   /* Descriptor for this internal buf */
+  int rio_cnt;                  /* Unread bytes in internal buf */
+  char *rio_bufptr;             /* Next unread byte in internal buf */
+  rio_fill_t rio_fill;          /* Refills the buf instead of read(), or NULL */
+  void *rio_fill_ctx;           /* First argument to rio_fill */
+  char *rio_buf;                /* Internal buf: rio_inline, or rio_setbuf's */
+  size_t rio_bufsize;           /* Size of rio_buf */
+  char rio_inline[RIO_BUFSIZE]; /* Default internal buffer */
 } rio_t;
 /* $end rio_t */
 
@@ -190,8 +200,12 @@ void V(sem_t *sem);
 ssize_t rio_readn(int fd, void *usrbuf, size_t n);
 ssize_t rio_writen(int fd, const void *usrbuf, size_t n);
 void rio_readinitb(rio_t *rp, int fd);
+void rio_setfill(rio_t *rp, rio_fill_t fill, void *ctx);
 ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t rio_waitb(rio_t *rp);
+int rio_setbuf(rio_t *rp, char *buf, size_t size);
+ssize_t rio_readlinev(rio_t *rp, const char **line, size_t maxlen);
 
 /* Wrappers for Rio package */
 ssize_t Rio_readn(int fd, void *usrbuf, size_t n);
@@ -203,6 +217,7 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
 /* Reentrant protocol-independent client/server helpers */
 int open_clientfd(const char *hostname, const char *port);
 int open_listenfd(const char *port);
+int open_listenfd_reuseport(const char *port);
 
 /* Wrappers for reentrant protocol-independent client/server helpers */
 int Open_clientfd(const char *hostname, const char *port);
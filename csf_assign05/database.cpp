@@ -0,0 +1,411 @@
+#include "database.h"
+#include "cpu_topology.h"
+#include "exceptions.h"
+#include "guard.h"
+#include "log_engine.h"
+#include "message.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <sys/stat.h>
+
+Database::Database() : m_log(nullptr), m_numa_homes(false) {
+  pthread_mutex_init(&m_tables_lock, NULL);
+}
+
+Database::~Database() {
+  // Table closing handeled in table deconstructor.
+  pthread_mutex_destroy(&m_tables_lock);
+}
+
+void Database::add_listener(TableListener *listener) {
+  Guard g(m_tables_lock);
+  m_listeners.push_back(listener);
+  for (const std::shared_ptr<Table> &table : m_tables) {
+    table->add_listener(listener);
+  }
+}
+
+void Database::set_data_dir(const std::string &dir) {
+  if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+    throw std::runtime_error("Could not create data directory " + dir + ": " +
+                             strerror(errno));
+  }
+  DIR *d = opendir(dir.c_str());
+  if (!d) {
+    throw std::runtime_error("Could not open data directory " + dir + ": " +
+                             strerror(errno));
+  }
+  std::vector<std::string> names;
+  while (struct dirent *ent = readdir(d)) {
+    if (ent->d_type == DT_DIR && Message::checkIdentifier(ent->d_name)) {
+      names.push_back(ent->d_name);
+    }
+  }
+  closedir(d);
+
+  m_data_dir = dir;
+  for (const std::string &name : names) {
+    LogEngine *engine = new LogEngine(dir + "/" + name);
+    Guard g(m_tables_lock);
+    add_table_locked(name, engine);
+    if (m_log) {
+      m_log->log(LogLevel::INFO, "storage",
+                 "Opened log table " + name + " (" +
+                     std::to_string(engine->size()) + " keys)");
+    }
+  }
+}
+
+bool Database::create_table(const std::string &name, std::string_view engine) {
+  Guard g(m_tables_lock);
+  if (find_table_locked(name)) {
+    return false;
+  }
+  if (engine == "log") {
+    if (m_data_dir.empty()) {
+      throw OperationException("Server has no data directory");
+    }
+    std::unique_ptr<LogEngine> log_engine;
+    try {
+      log_engine.reset(new LogEngine(m_data_dir + "/" + name));
+    } catch (std::runtime_error &ex) {
+      if (m_log) {
+        m_log->log(LogLevel::ERROR, "server", ex.what());
+      }
+      throw OperationException("Could not create log table");
+    }
+    add_table_locked(name, log_engine.release());
+  } else {
+    add_table_locked(name);
+  }
+  return true;
+}
+
+Table *Database::find_table(std::string_view name) {
+  Guard g(m_tables_lock);
+  return find_table_locked(name);
+}
+
+Table *Database::find_or_create_table(std::string_view name) {
+  Guard g(m_tables_lock);
+  Table *table = find_table_locked(name);
+  if (!table) {
+    table = add_table_locked(std::string(name));
+  }
+  return table;
+}
+
+std::vector<std::shared_ptr<Table>> Database::get_tables() {
+  Guard g(m_tables_lock);
+  return m_tables;
+}
+
+size_t Database::get_num_tables() {
+  Guard g(m_tables_lock);
+  return m_tables.size();
+}
+
+// Caller must hold m_tables_lock
+Table *Database::find_table_locked(std::string_view name) {
+  for (const std::shared_ptr<Table> &table : m_tables) {
+    if (table->get_name() == name) {
+      return table.get();
+    }
+  }
+  return nullptr;
+}
+
+// Caller must hold m_tables_lock
+Table *Database::add_table_locked(const std::string &name,
+                                  StorageEngine *engine) {
+  m_tables.push_back(std::make_shared<Table>(name, engine));
+  Table *table = m_tables.back().get();
+  if (m_numa_homes) {
+    table->set_home_node(Topology::current_node());
+  }
+  for (TableListener *listener : m_listeners) {
+    table->add_listener(listener);
+    listener->table_created(table);
+  }
+  return table;
+}
+
+Session::Session(Database *db)
+    : m_db(db), m_stack(db->get_stack_pool().acquire()),
+      m_in_transaction(false), m_prelocked(nullptr), m_lock_wait_ns(0) {}
+
+Session::~Session() {
+  rollback();
+  release_prelock();
+  m_db->get_stack_pool().release(m_stack);
+}
+
+bool Session::create_table(const std::string &name, std::string_view engine) {
+  return m_db->create_table(name, engine);
+}
+
+Table *Session::find_table(std::string_view name) {
+  auto it = m_table_cache.find(name);
+  if (it != m_table_cache.end()) {
+    return it->second;
+  }
+  Table *table = m_db->find_table(name);
+  if (table) {
+    m_table_cache.emplace(std::string(name), table);
+  }
+  return table;
+}
+
+void Session::set(std::string_view name, std::string_view key,
+                  std::string_view value) {
+  Table *table = find_table(name);
+  if (!table) {
+    throw UnknownTable("Table not found");
+  }
+  if (m_in_transaction) {
+    // Buffer the change in this transaction's private write set
+    WriteSet *writes = join_transaction(table, "SET(txn)");
+    try {
+      table->set(key, value, *writes);
+    } catch (std::exception &ex) {
+      rollback();
+      throw;
+    }
+    return;
+  }
+  // Directly modify the table data outside of a transaction
+  lock_table(table, "SET");
+  try {
+    table->set(key, value);
+  } catch (std::exception &ex) {
+    table->unlock();
+    throw;
+  }
+  table->unlock();
+}
+
+std::string Session::get(std::string_view name, std::string_view key) {
+  Table *table = find_table(name);
+  if (!table) {
+    throw UnknownTable("Table not found");
+  }
+  if (m_in_transaction) {
+    // Tables read in a transaction stay locked until it ends, and reads
+    // see the transaction's own writes
+    WriteSet *writes = join_transaction(table, "GET(txn)");
+    return table->get(key, writes);
+  }
+  // Hot keys are read from this thread's cache, and tables in memory
+  // without their lock
+  std::string value;
+  if (table->get_cached(key, value)) {
+    return value;
+  }
+  if (table->supports_unlocked_reads()) {
+    if (!table->get_unlocked(key, value)) {
+      throw std::out_of_range("Key not found: " + std::string(key));
+    }
+    return value;
+  }
+  lock_table(table, "GET");
+  try {
+    value = table->get(key);
+  } catch (std::exception &ex) {
+    table->unlock();
+    throw;
+  }
+  table->unlock();
+  return value;
+}
+
+// Building the index holds the table lock for as long as it takes
+bool Session::create_index(std::string_view name) {
+  Table *table = find_table(name);
+  if (!table) {
+    throw UnknownTable("Table not found");
+  }
+  if (has_locked(name)) {
+    return table->create_index(); // locked by this transaction
+  }
+  lock_table(table, "CREATEINDEX");
+  bool created = table->create_index();
+  table->unlock();
+  return created;
+}
+
+// In a transaction, the table joins it (like get()) and the
+// transaction's own changes count
+bool Session::find(std::string_view name, std::string_view value,
+                   std::vector<std::string> &keys) {
+  Table *table = find_table(name);
+  if (!table) {
+    throw UnknownTable("Table not found");
+  }
+  if (m_in_transaction) {
+    WriteSet *writes = join_transaction(table, "FIND(txn)");
+    return table->find(value, keys, writes);
+  }
+  lock_table(table, "FIND");
+  bool indexed = table->find(value, keys);
+  table->unlock();
+  return indexed;
+}
+
+// Locks table for the current transaction (if it isn't already) and
+// returns the transaction's write set for it. If the table is locked by
+// someone else, rolls the transaction back and throws FailedTransaction.
+// Never blocks, so transactions can't deadlock.
+WriteSet *Session::join_transaction(Table *table, const char *holder) {
+  auto it = m_locked_tables.find(table->get_name());
+  if (it != m_locked_tables.end()) {
+    return &it->second.writes;
+  }
+  if (!table->trylock(holder)) {
+    rollback();
+    throw FailedTransaction("Lock failed, transaction rolled back");
+  }
+  return &m_locked_tables.try_emplace(table->get_name(), table)
+              .first->second.writes;
+}
+
+void Session::begin() {
+  if (m_in_transaction) {
+    throw OperationException("Transaction already started");
+  }
+  m_in_transaction = true;
+  m_locked_tables.clear();
+}
+
+// Moves each table's buffered writes into the table and unlocks it. A
+// table leaves the transaction once it is committed, so if committing
+// another fails, only the tables not committed yet are rolled back.
+void Session::commit() {
+  if (!m_in_transaction) {
+    throw OperationException("No transaction is active");
+  }
+  std::string committed;
+  try {
+    while (!m_locked_tables.empty()) {
+      auto it = m_locked_tables.begin();
+      it->second.table->commit_changes(it->second.writes);
+      it->second.table->unlock();
+      committed += (committed.empty() ? "" : ",") + it->first;
+      m_locked_tables.erase(it);
+    }
+  } catch (std::exception &ex) {
+    rollback();
+    if (!committed.empty()) {
+      throw OperationException("Commit failed after committing " +
+                               committed + ": " + ex.what());
+    }
+    throw;
+  }
+  m_in_transaction = false;
+}
+
+// Discards the current transaction's changes, if there is one
+void Session::rollback() {
+  for (auto &entry : m_locked_tables) {
+    TxnTable &txn = entry.second;
+    txn.table->rollback_changes(txn.writes);
+    txn.table->unlock();
+  }
+  m_locked_tables.clear();
+  m_in_transaction = false;
+}
+
+void Session::push(std::string_view value) { m_stack->push(value); }
+
+void Session::pop() {
+  if (m_stack->is_empty())
+    throw OperationException("\"Stack empty\"");
+  m_stack->pop();
+}
+
+const std::string &Session::top() {
+  if (m_stack->is_empty())
+    throw OperationException("\"Stack empty\"");
+  return m_stack->get_top();
+}
+
+bool Session::is_numeric(const std::string &str) {
+  return std::all_of(str.begin(), str.end(),
+                     [](char c) { return std::isdigit(c) || c == '-'; });
+}
+
+// Pops the two operands of an arithmetic operation. Each is checked
+// before it is popped, so a bad right operand leaves the stack as it was.
+void Session::pop_operands(int &left, int &right) {
+  if (m_stack->is_empty())
+    throw OperationException("\"Not enough operands on stack\"");
+  if (!is_numeric(m_stack->get_top()))
+    throw std::invalid_argument("\"Non-numeric operand\"");
+  right = std::stoi(m_stack->get_top());
+  m_stack->pop();
+
+  if (m_stack->is_empty())
+    throw OperationException("\"Stack underflow on second operand\"");
+  if (!is_numeric(m_stack->get_top()))
+    throw std::invalid_argument("\"Non-numeric operand\"");
+  left = std::stoi(m_stack->get_top());
+  m_stack->pop();
+}
+
+void Session::add() {
+  int left, right;
+  pop_operands(left, right);
+  m_stack->push(std::to_string(left + right));
+}
+
+void Session::sub() {
+  int left, right;
+  pop_operands(left, right);
+  m_stack->push(std::to_string(left - right));
+}
+
+void Session::mul() {
+  int left, right;
+  pop_operands(left, right);
+  m_stack->push(std::to_string(left * right));
+}
+
+void Session::div() {
+  // Checked first, so the operands stay on the stack
+  if (!m_stack->is_empty() && is_numeric(m_stack->get_top()) &&
+      std::stoi(m_stack->get_top()) == 0)
+    throw std::invalid_argument("\"Division by zero\"");
+  int left, right;
+  pop_operands(left, right);
+  m_stack->push(std::to_string(left / right));
+}
+
+void Session::lock_table(Table *table, const char *holder) {
+  if (table == m_prelocked) {
+    m_prelocked = nullptr; // locked already, without waiting
+    return;
+  }
+  m_lock_wait_ns += table->lock(holder);
+}
+
+bool Session::prelock(Table *table, const char *holder) {
+  if (!table->trylock(holder)) {
+    return false;
+  }
+  m_prelocked = table;
+  return true;
+}
+
+void Session::release_prelock() {
+  if (m_prelocked) {
+    m_prelocked->unlock();
+    m_prelocked = nullptr;
+  }
+}
+
+uint64_t Session::take_lock_wait_ns() {
+  uint64_t ns = m_lock_wait_ns;
+  m_lock_wait_ns = 0;
+  return ns;
+}
@@ -0,0 +1,206 @@
+#ifndef DATABASE_H
+#define DATABASE_H
+
+#include "logger.h"
+#include "table.h"
+#include "value_stack.h"
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <pthread.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// The storage and transaction engine, for use in process: the tables,
+// and (through Session) transactions and operand stacks with the same
+// semantics as the network protocol, without sockets or message
+// encoding. The server is a layer over it, with a Session per
+// connection.
+//
+//   Database db;
+//   Session session(&db);
+//   session.create_table("accounts");
+//   session.begin();
+//   session.set("accounts", "alice", "100");
+//   session.commit();
+//   std::string value = session.get("accounts", "alice");
+class Database {
+private:
+  std::vector<std::shared_ptr<Table>> m_tables;
+  pthread_mutex_t m_tables_lock; // protects m_tables
+  std::vector<TableListener *> m_listeners; // added to every table
+  std::string m_data_dir; // where log tables live (empty if nowhere)
+  ValueStackPool m_stack_pool;
+  Logger *m_log; // optional
+  bool m_numa_homes; // see set_numa_homes()
+
+  Table *find_table_locked(std::string_view name);
+  Table *add_table_locked(const std::string &name,
+                          StorageEngine *engine = nullptr);
+
+  // copy constructor and assignment operator are prohibited
+  Database(const Database &);
+  Database &operator=(const Database &);
+
+public:
+  Database();
+  ~Database();
+
+  // Set up before the database is shared between threads: a listener is
+  // added to every table, including those created later, and errors
+  // storing log tables are reported to log
+  void add_listener(TableListener *listener);
+  void set_log(Logger *log) { m_log = log; }
+  // Keeps each table created from now on in the memory of the NUMA node
+  // of the thread creating it (see Table::set_home_node()); with threads
+  // pinned to nodes, that is the node of the connection which created it
+  void set_numa_homes(bool enabled) { m_numa_homes = enabled; }
+
+  // Keeps log tables in subdirectories of dir, and opens the ones already
+  // there, recovering their contents. Throws std::runtime_error if a
+  // table can't be opened.
+  void set_data_dir(const std::string &dir);
+
+  // Returns false if a table with the name already exists. The engine is
+  // "memory" or "log"; throws OperationException if a log table can't be
+  // created.
+  bool create_table(const std::string &name,
+                    std::string_view engine = "memory");
+  // Tables are never dropped, so the pointers stay valid for as long as
+  // the database
+  Table *find_table(std::string_view name);
+  Table *find_or_create_table(std::string_view name);
+  std::vector<std::shared_ptr<Table>> get_tables();
+  size_t get_num_tables();
+
+  // Compacts each log table (see StorageEngine::compact()) a batch of
+  // batch_bytes at a time, under its lock, until there is nothing left to
+  // reclaim or stopping() returns true. Errors are logged.
+  template <typename Stop> void compact_tables(size_t batch_bytes, Stop stopping);
+
+  ValueStackPool &get_stack_pool() { return m_stack_pool; }
+};
+
+// One client of a Database: its operand stack and its transaction. Like
+// a connection, a session is used by one thread at a time.
+//
+// Outside a transaction, every operation locks its table for as long as
+// it takes. Inside one, tables are locked with trylock as they are first
+// used and stay locked until commit() or rollback(), and writes are
+// buffered until commit(); if a table is locked by another session, the
+// transaction is rolled back and FailedTransaction is thrown, so
+// transactions never deadlock. Operations throw UnknownTable for a table
+// which doesn't exist, and OperationException (or, for the values of
+// missing keys and bad operands, another std::exception) when they fail.
+class Session {
+private:
+  // A table locked by the current transaction, with the transaction's
+  // pending writes to it
+  struct TxnTable {
+    Table *table;
+    WriteSet writes;
+
+    TxnTable(Table *t) : table(t) {}
+  };
+
+  Database *m_db;
+  ValueStack *m_stack;
+  std::map<std::string, TxnTable, std::less<>> m_locked_tables;
+  bool m_in_transaction;
+  // Tables looked up so far, so repeated use doesn't take the database's
+  // lock
+  std::map<std::string, Table *, std::less<>> m_table_cache;
+  Table *m_prelocked;   // locked by prelock(), for the next operation
+  uint64_t m_lock_wait_ns; // waiting for table locks, since the last take
+
+  WriteSet *join_transaction(Table *table, const char *holder);
+  static bool is_numeric(const std::string &str);
+  void pop_operands(int &left, int &right);
+
+  // copy constructor and assignment operator are prohibited
+  Session(const Session &);
+  Session &operator=(const Session &);
+
+public:
+  Session(Database *db);
+  // Rolls back a transaction in progress
+  ~Session();
+
+  Database *get_database() const { return m_db; }
+
+  bool create_table(const std::string &name,
+                    std::string_view engine = "memory");
+  // Returns nullptr if there is no such table
+  Table *find_table(std::string_view name);
+  // Whether the current transaction has name locked
+  bool has_locked(std::string_view name) const {
+    return m_locked_tables.count(name) != 0;
+  }
+
+  // Key/value access. get() throws std::out_of_range for a missing key.
+  void set(std::string_view table, std::string_view key,
+           std::string_view value);
+  std::string get(std::string_view table, std::string_view key);
+  // Returns false if the table is already indexed
+  bool create_index(std::string_view table);
+  // Appends the keys holding value to keys; returns false if the table
+  // has no index
+  bool find(std::string_view table, std::string_view value,
+            std::vector<std::string> &keys);
+
+  // Transactions: begin() and commit() throw OperationException if a
+  // transaction is, or isn't, in progress. If a table's changes can't be
+  // stored, commit() rolls back the tables not committed yet and throws;
+  // tables committed before it stay committed, and an OperationException
+  // then names them.
+  void begin();
+  void commit();
+  void rollback();
+  bool in_transaction() const { return m_in_transaction; }
+
+  // The operand stack. Values pushed beyond the stack's limits throw
+  // OperationException; so do pop() and top() on an empty stack.
+  ValueStack &stack() { return *m_stack; }
+  void push(std::string_view value);
+  void pop();
+  const std::string &top();
+  // Arithmetic on the top two values (the top one is the right operand),
+  // replacing them with the result
+  void add();
+  void sub();
+  void mul();
+  void div();
+
+  // Locks a table outside of a transaction, counting the wait
+  void lock_table(Table *table, const char *holder);
+  // Locks a table without waiting, for the next operation on it (which
+  // then doesn't lock it again). Returns false if it is locked already.
+  bool prelock(Table *table, const char *holder);
+  // Unlocks the table from prelock() if no operation used it
+  void release_prelock();
+  // Time spent waiting for table locks since the last call
+  uint64_t take_lock_wait_ns();
+};
+
+template <typename Stop>
+void Database::compact_tables(size_t batch_bytes, Stop stopping) {
+  for (const std::shared_ptr<Table> &table : get_tables()) {
+    bool more = true;
+    while (more && !stopping()) {
+      table->lock("COMPACT");
+      try {
+        more = table->compact(batch_bytes);
+      } catch (std::exception &ex) {
+        if (m_log) {
+          m_log->log(LogLevel::ERROR, "storage",
+                     "Compacting " + table->get_name() + ": " + ex.what());
+        }
+        more = false;
+      }
+      table->unlock();
+    }
+  }
+}
+
+#endif // DATABASE_H
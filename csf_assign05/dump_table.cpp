@@ -0,0 +1,44 @@
+#include "client_util.h"
+#include "exceptions.h"
+#include "record_stream.h"
+#include <iostream>
+#include <vector>
+
+// Writes the contents of a table to standard output as "key value" lines
+int main(int argc, char **argv) {
+  if (argc != 5) {
+    std::cerr << "Usage: ./dump_table <hostname> <port> <username> <table>\n";
+    return 1;
+  }
+
+  std::string hostname = argv[1], port = argv[2], username = argv[3],
+              table = argv[4];
+
+  try {
+    // A sharded table is the union of its parts on every server
+    for (const std::string &server : parse_server_list(hostname, port)) {
+      int clientfd = connect_to_server(server);
+
+      // Dumps can be big: read them a large buffer at a time
+      rio_t rio;
+      rio_readinitb(&rio, clientfd);
+      std::vector<char> rio_buf(64 * 1024);
+      rio_setbuf(&rio, rio_buf.data(), rio_buf.size());
+
+      expect_ok(clientfd, rio, "LOGIN " + username + "\n", "Failed to login");
+      expect_ok(clientfd, rio, "DUMP " + table + "\n", "Failed to dump table");
+
+      std::string key, value;
+      while (RecordStream::read(&rio, key, value)) {
+        std::cout << key << ' ' << value << '\n';
+      }
+
+      send_message(clientfd, "BYE\n");
+      close(clientfd);
+    }
+    return 0;
+  } catch (const std::exception &e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 2;
+  }
+}
@@ -0,0 +1,148 @@
+#include "epoch.h"
+#include "guard.h"
+#include <algorithm>
+#include <deque>
+#include <pthread.h>
+#include <vector>
+
+namespace {
+
+// A thread's announcement: the epoch it saw when it entered its
+// outermost guard, or 0 while it is outside any guard
+struct ThreadState {
+  std::atomic<uint64_t> epoch;
+  unsigned depth; // nested guards
+};
+
+struct Retired {
+  void *p;
+  void (*free_fn)(void *);
+  uint64_t epoch; // when it was retired
+};
+
+std::atomic<uint64_t> g_epoch(1);
+
+// Protects everything below. The containers are never destroyed, as
+// threads may still exit after static destructors have run.
+pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+std::vector<ThreadState *> &g_threads = *new std::vector<ThreadState *>();
+std::deque<Retired> &g_retired = *new std::deque<Retired>(); // oldest first
+uint64_t g_num_retired = 0;
+uint64_t g_num_freed = 0;
+
+// g_retired.size(), for readers to check without the lock
+std::atomic<size_t> g_pending(0);
+
+// Registers a thread the first time it enters a guard, and unregisters
+// it when it exits
+struct ThreadSlot {
+  ThreadState *state;
+
+  ThreadSlot() : state(new ThreadState()) {
+    state->epoch.store(0, std::memory_order_relaxed);
+    state->depth = 0;
+    Guard g(g_lock);
+    g_threads.push_back(state);
+  }
+
+  ~ThreadSlot() {
+    {
+      Guard g(g_lock);
+      g_threads.erase(std::find(g_threads.begin(), g_threads.end(), state));
+    }
+    delete state;
+  }
+};
+
+thread_local ThreadSlot t_slot;
+
+// Advances the epoch if every thread inside a guard has seen the current
+// one. Caller must hold g_lock (the only place the epoch changes).
+bool try_advance() {
+  uint64_t epoch = g_epoch.load(std::memory_order_relaxed);
+  // Sequentially consistent with the announcements in ReadGuard(): a
+  // reader either announced its epoch before this, or will see
+  // everything unlinked before this
+  for (ThreadState *state : g_threads) {
+    uint64_t seen = state->epoch.load(std::memory_order_seq_cst);
+    if (seen != 0 && seen != epoch) {
+      return false;
+    }
+  }
+  g_epoch.store(epoch + 1, std::memory_order_seq_cst);
+  return true;
+}
+
+// Frees what was retired two or more epochs ago. Caller must hold g_lock.
+void free_old() {
+  uint64_t epoch = g_epoch.load(std::memory_order_relaxed);
+  while (!g_retired.empty() && g_retired.front().epoch + 2 <= epoch) {
+    g_retired.front().free_fn(g_retired.front().p);
+    g_retired.pop_front();
+    g_num_freed++;
+  }
+  g_pending.store(g_retired.size(), std::memory_order_relaxed);
+}
+
+// With no readers about, two advances free everything at once
+size_t reclaim_locked() {
+  for (int i = 0; i < 2 && !g_retired.empty() && try_advance(); i++) {
+    free_old();
+  }
+  return g_retired.size();
+}
+
+} // namespace
+
+Epoch::ReadGuard::ReadGuard() {
+  ThreadState *state = t_slot.state;
+  if (state->depth++ == 0) {
+    // If the epoch advanced before the announcement was seen, it may not
+    // have waited for this thread: announce again
+    uint64_t epoch = g_epoch.load(std::memory_order_seq_cst);
+    while (1) {
+      state->epoch.store(epoch, std::memory_order_seq_cst);
+      uint64_t now = g_epoch.load(std::memory_order_seq_cst);
+      if (now == epoch) {
+        break;
+      }
+      epoch = now;
+    }
+  }
+}
+
+Epoch::ReadGuard::~ReadGuard() {
+  ThreadState *state = t_slot.state;
+  if (--state->depth == 0) {
+    state->epoch.store(0, std::memory_order_release);
+    // Memory retired while readers held it up is freed by the readers
+    // as they leave, unless someone is at it already
+    if (g_pending.load(std::memory_order_relaxed) != 0 &&
+        pthread_mutex_trylock(&g_lock) == 0) {
+      reclaim_locked();
+      pthread_mutex_unlock(&g_lock);
+    }
+  }
+}
+
+void Epoch::retire(void *p, void (*free_fn)(void *)) {
+  Guard g(g_lock);
+  g_retired.push_back(
+      Retired{p, free_fn, g_epoch.load(std::memory_order_relaxed)});
+  g_num_retired++;
+  g_pending.store(g_retired.size(), std::memory_order_relaxed);
+  reclaim_locked();
+}
+
+size_t Epoch::reclaim() {
+  Guard g(g_lock);
+  return reclaim_locked();
+}
+
+std::string Epoch::get_stats() {
+  Guard g(g_lock);
+  return "epoch=" + std::to_string(g_epoch.load(std::memory_order_relaxed)) +
+         ";epoch_retired=" + std::to_string(g_num_retired) +
+         ";epoch_freed=" + std::to_string(g_num_freed) +
+         ";epoch_pending=" + std::to_string(g_retired.size());
+}
@@ -0,0 +1,50 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Epoch-based memory reclamation, so that readers can use shared data
+// structures without locks while writers replace parts of them.
+//
+// A reader holds an Epoch::ReadGuard while it uses shared memory. A
+// writer which unlinks memory that readers may still be using hands it
+// to retire() instead of freeing it. The global epoch advances once every
+// thread inside a guard has seen the current epoch, and memory retired
+// in epoch e is freed once the epoch reaches e + 2: by then every guard
+// that could have seen it has ended.
+//
+// Entering and leaving a guard touch only the calling thread's own
+// state, unless retired memory is waiting: then leaving a guard tries to
+// free it. retire() and reclamation take a mutex, and are meant for
+// infrequent frees (whole slabs and index arrays, not single values).
+namespace Epoch {
+
+class ReadGuard {
+private:
+  // copy constructor and assignment operator are prohibited
+  ReadGuard(const ReadGuard &);
+  ReadGuard &operator=(const ReadGuard &);
+
+public:
+  ReadGuard();
+  ~ReadGuard();
+};
+
+// Frees p with free_fn(p) once no guard can be using it
+void retire(void *p, void (*free_fn)(void *));
+template <typename T> void retire_array(T *p) {
+  retire(p, [](void *q) { delete[] static_cast<T *>(q); });
+}
+
+// Advances the epoch if possible and frees what can be freed. Returns
+// the number of retired blocks still waiting.
+size_t reclaim();
+
+// "epoch=...;epoch_retired=...;epoch_freed=...;epoch_pending=..."
+std::string get_stats();
+
+} // namespace Epoch
+
+#endif // EPOCH_H
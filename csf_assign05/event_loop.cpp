@@ -0,0 +1,282 @@
+#include "event_loop.h"
+#include "cpu_topology.h"
+#include "exceptions.h"
+#include "guard.h"
+#include "io_channel.h"
+#include <algorithm>
+#include <cerrno>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace {
+
+const int MAX_EVENTS = 64;
+
+// A coroutine nobody awaits: it runs until its first suspension when
+// called, and frees itself when it finishes
+struct Detached {
+  struct promise_type {
+    Detached get_return_object() { return Detached(); }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+Detached run_detached(EventLoop *loop, Task<void> task) {
+  co_await loop->schedule();
+  co_await task;
+}
+
+} // namespace
+
+bool EventLoop::WaitAwaiter::await_ready() noexcept {
+  uint32_t ready =
+      m_watch->ready & (m_events | EPOLLERR | EPOLLHUP | EPOLLRDHUP);
+  if (ready) {
+    m_watch->ready &= ~ready;
+  } else if (m_wake && (m_wake->ready & EPOLLIN)) {
+    m_wake->ready &= ~EPOLLIN;
+    m_woken = true;
+  }
+  m_was_ready = ready || m_woken;
+  return m_was_ready;
+}
+
+void EventLoop::WaitAwaiter::await_suspend(std::coroutine_handle<> handle) {
+  m_watch->waiter = handle;
+  m_watch->events = m_events;
+  m_watch->timed_out = false;
+  m_watch->has_timer = m_deadline_ms > 0;
+  if (m_watch->has_timer) {
+    m_watch->timer = m_loop->m_timers.emplace(m_deadline_ms, m_watch);
+  }
+  if (m_wake) {
+    m_wake->waiter = handle;
+    m_wake->events = EPOLLIN;
+    m_wake->timed_out = false;
+  }
+}
+
+void EventLoop::SleepAwaiter::await_suspend(std::coroutine_handle<> handle) {
+  m_watch.waiter = handle;
+  m_watch.has_timer = true;
+  m_watch.timer = m_loop->m_timers.emplace(m_deadline_ms, &m_watch);
+}
+
+bool EventLoop::WaitAwaiter::await_resume() {
+  if (m_was_ready) {
+    return true;
+  }
+  if (m_wake) {
+    // Only the watch which fired has let go of the coroutine
+    if (m_wake->waiter) {
+      m_wake->waiter = nullptr;
+    } else {
+      m_woken = true;
+      m_watch->waiter = nullptr;
+      if (m_watch->has_timer) {
+        m_loop->m_timers.erase(m_watch->timer);
+        m_watch->has_timer = false;
+      }
+    }
+  }
+  return !m_watch->timed_out;
+}
+
+EventLoop::EventLoop()
+    : m_started(false), m_stopping(false), m_in_batch(false) {
+  m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  m_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (m_epoll_fd < 0 || m_wake_fd < 0) {
+    throw CommException("Could not create event loop");
+  }
+  struct epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.ptr = nullptr; // the wakeup eventfd
+  epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_wake_fd, &event);
+  pthread_mutex_init(&m_posted_lock, NULL);
+}
+
+EventLoop::~EventLoop() {
+  stop();
+  close(m_wake_fd);
+  close(m_epoll_fd);
+  pthread_mutex_destroy(&m_posted_lock);
+}
+
+void EventLoop::start(const std::vector<int> &cpus) {
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  if (!cpus.empty()) {
+    Topology::pin_attr(&attr, cpus);
+  }
+  int err = pthread_create(&m_thread, &attr, loop_worker, this);
+  pthread_attr_destroy(&attr);
+  if (err != 0) {
+    throw CommException("Could not create event loop thread");
+  }
+  m_started = true;
+}
+
+void EventLoop::stop() {
+  if (m_started) {
+    m_stopping = true;
+    uint64_t one = 1;
+    ssize_t ignored = write(m_wake_fd, &one, sizeof(one));
+    (void)ignored;
+    pthread_join(m_thread, NULL);
+    m_started = false;
+  }
+}
+
+void EventLoop::post(std::coroutine_handle<> handle) {
+  bool was_empty;
+  {
+    Guard g(m_posted_lock);
+    was_empty = m_posted.empty();
+    m_posted.push_back(handle);
+  }
+  if (was_empty) {
+    // (If it wasn't empty, a wakeup is already on its way)
+    uint64_t one = 1;
+    ssize_t ignored = write(m_wake_fd, &one, sizeof(one));
+    (void)ignored;
+  }
+}
+
+void EventLoop::spawn(Task<void> task) { run_detached(this, std::move(task)); }
+
+void EventLoop::add(Watch *watch) {
+  struct epoll_event event = {};
+  event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  event.data.ptr = watch;
+  watch->ready = 0; // adding reports the socket's state afresh
+  if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, watch->fd, &event) != 0) {
+    throw CommException("Could not register socket with event loop");
+  }
+}
+
+void EventLoop::remove(Watch *watch) {
+  if (watch->has_timer) {
+    m_timers.erase(watch->timer);
+    watch->has_timer = false;
+  }
+  epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, watch->fd, NULL);
+  if (m_in_batch) {
+    m_removed.push_back(watch);
+  }
+}
+
+void *EventLoop::loop_worker(void *arg) {
+  static_cast<EventLoop *>(arg)->run();
+  return nullptr;
+}
+
+void EventLoop::run() {
+  struct epoll_event events[MAX_EVENTS];
+  while (!m_stopping) {
+    IoChannel::count_syscall();
+    int n = epoll_wait(m_epoll_fd, events, MAX_EVENTS, next_timeout_ms());
+    m_in_batch = true;
+    for (int i = 0; i < n; i++) {
+      Watch *watch = static_cast<Watch *>(events[i].data.ptr);
+      if (!watch) {
+        uint64_t count;
+        ssize_t ignored = read(m_wake_fd, &count, sizeof(count));
+        (void)ignored;
+      } else if (!m_removed.empty() &&
+                 std::find(m_removed.begin(), m_removed.end(), watch) !=
+                     m_removed.end()) {
+        // Removed (and perhaps freed) earlier in the batch
+      } else if (watch->waiter &&
+                 (events[i].events &
+                  (watch->events | EPOLLERR | EPOLLHUP | EPOLLRDHUP))) {
+        wake(watch);
+      } else {
+        // The edge won't come again
+        watch->ready |= events[i].events;
+      }
+    }
+    m_in_batch = false;
+    m_removed.clear();
+    run_posted();
+    run_timers();
+    run_deferred();
+  }
+}
+
+void EventLoop::run_posted() {
+  std::vector<std::coroutine_handle<>> posted;
+  {
+    Guard g(m_posted_lock);
+    posted.swap(m_posted);
+  }
+  for (std::coroutine_handle<> handle : posted) {
+    handle.resume();
+  }
+}
+
+// Resumes the coroutines deferred before this pass; those deferring again
+// wait for the next one
+void EventLoop::run_deferred() {
+  if (m_deferred.empty()) {
+    return;
+  }
+  std::vector<std::coroutine_handle<>> deferred;
+  deferred.swap(m_deferred);
+  for (std::coroutine_handle<> handle : deferred) {
+    handle.resume();
+  }
+}
+
+void EventLoop::run_timers() {
+  if (m_timers.empty()) {
+    return;
+  }
+  uint64_t now = now_ms();
+  while (!m_timers.empty() && m_timers.begin()->first <= now) {
+    Watch *watch = m_timers.begin()->second;
+    watch->timed_out = true;
+    wake(watch);
+  }
+}
+
+// Resumes the coroutine waiting for a socket
+void EventLoop::wake(Watch *watch) {
+  if (watch->has_timer) {
+    m_timers.erase(watch->timer);
+    watch->has_timer = false;
+  }
+  std::coroutine_handle<> waiter = watch->waiter;
+  watch->waiter = nullptr;
+  // This may free the watch
+  waiter.resume();
+}
+
+int EventLoop::next_timeout_ms() {
+  if (!m_deferred.empty()) {
+    return 0;
+  }
+  {
+    Guard g(m_posted_lock);
+    if (!m_posted.empty()) {
+      return 0;
+    }
+  }
+  if (m_timers.empty()) {
+    return -1;
+  }
+  uint64_t now = now_ms();
+  uint64_t deadline = m_timers.begin()->first;
+  return deadline <= now ? 0 : int(deadline - now);
+}
+
+uint64_t EventLoop::now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return uint64_t(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
@@ -0,0 +1,172 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include "task.h"
+#include <atomic>
+#include <coroutine>
+#include <cstdint>
+#include <map>
+#include <pthread.h>
+#include <vector>
+
+// A thread running coroutines which wait for sockets with epoll. Sockets
+// are registered edge-triggered, once: a coroutine only waits after a
+// read() or write() has returned EAGAIN, and is resumed on the next edge
+// (or when its deadline passes). An edge which comes while nobody waits
+// for it (the coroutine is asleep, say) is kept, and ends the next wait
+// for it at once. Everything but post() and spawn() must be called on
+// the loop's own thread.
+class EventLoop {
+public:
+  // A registered socket, and the coroutine waiting for it (if any)
+  struct Watch {
+    int fd;
+    std::coroutine_handle<> waiter;
+    uint32_t events;  // what the waiter waits for
+    uint32_t ready;   // edges which came with nobody waiting for them
+    bool timed_out;
+    bool has_timer;
+    std::multimap<uint64_t, Watch *>::iterator timer;
+
+    Watch(int f)
+        : fd(f), events(0), ready(0), timed_out(false), has_timer(false) {}
+  };
+
+  class WaitAwaiter {
+  private:
+    EventLoop *m_loop;
+    Watch *m_watch;
+    uint32_t m_events;
+    uint64_t m_deadline_ms;
+    Watch *m_wake; // also waited for, if set
+    bool m_woken;
+    bool m_was_ready; // an edge was kept, so the coroutine didn't suspend
+
+  public:
+    WaitAwaiter(EventLoop *loop, Watch *watch, uint32_t events,
+                uint64_t deadline_ms, Watch *wake)
+        : m_loop(loop), m_watch(watch), m_events(events),
+          m_deadline_ms(deadline_ms), m_wake(wake), m_woken(false),
+          m_was_ready(false) {}
+    bool await_ready() noexcept;
+    void await_suspend(std::coroutine_handle<> handle);
+    // false if the deadline passed
+    bool await_resume();
+    // The wake watch ended the wait
+    bool woken() const { return m_woken; }
+  };
+
+  class ScheduleAwaiter {
+  private:
+    EventLoop *m_loop;
+
+  public:
+    ScheduleAwaiter(EventLoop *loop) : m_loop(loop) {}
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle) {
+      m_loop->post(handle);
+    }
+    void await_resume() const {}
+  };
+
+  // Suspends a coroutine until a deadline, with a timer only
+  class SleepAwaiter {
+  private:
+    EventLoop *m_loop;
+    Watch m_watch;
+    uint64_t m_deadline_ms;
+
+  public:
+    SleepAwaiter(EventLoop *loop, uint64_t deadline_ms)
+        : m_loop(loop), m_watch(-1), m_deadline_ms(deadline_ms) {}
+    bool await_ready() const noexcept { return m_deadline_ms <= now_ms(); }
+    void await_suspend(std::coroutine_handle<> handle);
+    void await_resume() const {}
+  };
+
+  class DeferAwaiter {
+  private:
+    EventLoop *m_loop;
+
+  public:
+    DeferAwaiter(EventLoop *loop) : m_loop(loop) {}
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle) {
+      m_loop->m_deferred.push_back(handle);
+    }
+    void await_resume() const {}
+  };
+
+private:
+  int m_epoll_fd;
+  int m_wake_fd; // eventfd: wakes the loop for posted coroutines
+  pthread_t m_thread;
+  bool m_started;
+  std::atomic<bool> m_stopping;
+  pthread_mutex_t m_posted_lock;
+  std::vector<std::coroutine_handle<>> m_posted;
+  std::multimap<uint64_t, Watch *> m_timers; // by deadline
+  // Low priority coroutines, resumed after everything else that was ready
+  std::vector<std::coroutine_handle<>> m_deferred;
+  // Watches removed while a batch of events is being handled: a coroutine
+  // resumed for one event may free watches which later events refer to
+  bool m_in_batch;
+  std::vector<Watch *> m_removed;
+
+  static void *loop_worker(void *arg);
+  void run();
+  void run_posted();
+  void run_timers();
+  void run_deferred();
+  void wake(Watch *watch);
+  int next_timeout_ms();
+
+  // copy constructor and assignment operator are prohibited
+  EventLoop(const EventLoop &);
+  EventLoop &operator=(const EventLoop &);
+
+public:
+  EventLoop();
+  // Stops the loop. Coroutines still suspended on it are leaked.
+  ~EventLoop();
+
+  // The loop's thread runs on the given CPUs, or wherever the scheduler
+  // puts it
+  void start(const std::vector<int> &cpus = std::vector<int>());
+  void stop();
+
+  // Resumes a coroutine on the loop's thread; callable from any thread
+  void post(std::coroutine_handle<> handle);
+  // Runs task on the loop's thread, destroying it once it finishes. The
+  // task must not throw.
+  void spawn(Task<void> task);
+  // co_await schedule() continues a coroutine on the loop's thread
+  ScheduleAwaiter schedule() { return ScheduleAwaiter(this); }
+  // co_await sleep_until(deadline_ms) resumes the coroutine once
+  // deadline_ms (on the CLOCK_MONOTONIC) has passed
+  SleepAwaiter sleep_until(uint64_t deadline_ms) {
+    return SleepAwaiter(this, deadline_ms);
+  }
+  // co_await defer() lets every other coroutine which is ready, or whose
+  // socket is, run first; deferred coroutines then resume in turn, once
+  // per pass of the loop. Must be called on the loop's thread.
+  DeferAwaiter defer() { return DeferAwaiter(this); }
+
+  void add(Watch *watch);
+  // Stops watching; the watch may be freed as soon as this returns
+  void remove(Watch *watch);
+  // co_await wait(...) suspends until the socket reports one of events
+  // (EPOLLIN, EPOLLOUT; errors and hangups always count), or until
+  // deadline_ms (on the CLOCK_MONOTONIC, 0 for none), and returns false
+  // in the latter case. If wake is given, its becoming readable (an
+  // eventfd, say) also resumes the coroutine, and the awaiter's woken()
+  // then says so.
+  WaitAwaiter wait(Watch *watch, uint32_t events, uint64_t deadline_ms,
+                   Watch *wake = nullptr) {
+    return WaitAwaiter(this, watch, events, deadline_ms, wake);
+  }
+
+  static uint64_t now_ms();
+};
+
+#endif // EVENT_LOOP_H
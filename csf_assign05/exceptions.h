@@ -44,4 +44,12 @@ public:
   ~FailedTransaction() {}
 };
 
+// Exception indicating that a request named a table which doesn't exist
+class UnknownTable : public std::runtime_error {
+public:
+  UnknownTable(const std::string &msg) : std::runtime_error(msg) {}
+
+  ~UnknownTable() {}
+};
+
 #endif // EXCEPTIONS_H
@@ -0,0 +1,73 @@
+#include "client_util.h"
+#include "exceptions.h"
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+namespace {
+
+// Pops the value on top of the server's stack
+std::string pop_value(int clientfd, rio_t &rio) {
+  send_message(clientfd, "TOP\n");
+  std::string response = read_response(clientfd, rio);
+  if (response.substr(0, 4) != "DATA") {
+    throw OperationException("Failed to retrieve data");
+  }
+  expect_ok(clientfd, rio, "POP\n", "Failed to pop value");
+  return response.substr(5);
+}
+
+} // namespace
+
+// Prints the slow request log of one server, newest entry first, or
+// empties it
+void print_slowlog(const std::string &server, const std::string &username,
+                   bool reset) {
+  int clientfd = connect_to_server(server);
+
+  rio_t rio;
+  rio_readinitb(&rio, clientfd);
+
+  expect_ok(clientfd, rio, "LOGIN " + username + "\n", "Failed to login");
+
+  if (reset) {
+    expect_ok(clientfd, rio, "SLOWLOG reset\n", "Failed to reset slow log");
+  } else {
+    // The entries are pushed oldest first, and then their number
+    expect_ok(clientfd, rio, "SLOWLOG\n", "Failed to get slow log");
+    int count = std::stoi(pop_value(clientfd, rio));
+    for (int i = 0; i < count; i++) {
+      std::string entry = pop_value(clientfd, rio);
+      std::replace(entry.begin(), entry.end(), ';', ' ');
+      std::cout << entry << "\n";
+    }
+  }
+
+  send_message(clientfd, "BYE\n");
+  close(clientfd);
+}
+
+int main(int argc, char **argv) {
+  if ((argc != 4 && argc != 5) ||
+      (argc == 5 && std::string(argv[4]) != "reset")) {
+    std::cerr << "Usage: ./get_slowlog <hostname> <port> <username> [reset]\n";
+    return 1;
+  }
+
+  std::string hostname = argv[1], port = argv[2], username = argv[3];
+  bool reset = (argc == 5);
+
+  try {
+    std::vector<std::string> servers = parse_server_list(hostname, port);
+    for (const std::string &server : servers) {
+      if (servers.size() > 1) {
+        std::cout << "[" << server << "]\n";
+      }
+      print_slowlog(server, username, reset);
+    }
+    return 0;
+  } catch (const std::exception &e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 2;
+  }
+}
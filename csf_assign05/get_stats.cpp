@@ -0,0 +1,63 @@
+#include "client_util.h"
+#include "exceptions.h"
+#include <iostream>
+#include <vector>
+
+// Prints the statistics of one server, one "name=value" pair per line
+void print_stats(const std::string &server, const std::string &username,
+                 const std::string &table) {
+  int clientfd = connect_to_server(server);
+
+  rio_t rio;
+  rio_readinitb(&rio, clientfd);
+
+  expect_ok(clientfd, rio, "LOGIN " + username + "\n", "Failed to login");
+
+  // Server or table statistics are pushed onto the stack
+  expect_ok(clientfd, rio, table.empty() ? "STATS\n" : "STATS " + table + "\n",
+            "Failed to get statistics");
+
+  send_message(clientfd, "TOP\n");
+  std::string response = read_response(clientfd, rio);
+  if (response.substr(0, 4) != "DATA") {
+    throw OperationException("Failed to retrieve data");
+  }
+
+  std::string stats = response.substr(5);
+  size_t start = 0;
+  while (start <= stats.size()) {
+    size_t end = stats.find(';', start);
+    if (end == std::string::npos) {
+      end = stats.size();
+    }
+    std::cout << stats.substr(start, end - start) << "\n";
+    start = end + 1;
+  }
+
+  send_message(clientfd, "BYE\n");
+  close(clientfd);
+}
+
+int main(int argc, char **argv) {
+  if (argc != 4 && argc != 5) {
+    std::cerr << "Usage: ./get_stats <hostname> <port> <username> [<table>]\n";
+    return 1;
+  }
+
+  std::string hostname = argv[1], port = argv[2], username = argv[3];
+  std::string table = (argc == 5) ? argv[4] : "";
+
+  try {
+    std::vector<std::string> servers = parse_server_list(hostname, port);
+    for (const std::string &server : servers) {
+      if (servers.size() > 1) {
+        std::cout << "[" << server << "]\n";
+      }
+      print_stats(server, username, table);
+    }
+    return 0;
+  } catch (const std::exception &e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 2;
+  }
+}
@@ -1,44 +1,8 @@
-#include "csapp.h"
+#include "client_util.h"
 #include "exceptions.h"
 #include <cstring>
 #include <iostream>
 
-// Extracts the value between the first pair of quotes in the input string.
-std::string extractValueBetweenQuotes(const std::string &input) {
-  size_t start = input.find('"');
-  if (start == std::string::npos) {
-    return ""; // No opening quote found
-  }
-
-  size_t end = input.find('"', start + 1);
-  if (end == std::string::npos) {
-    return ""; // No closing quote found
-  }
-
-  return input.substr(start + 1, end - start - 1);
-}
-
-// Send a message to the server
-void send_message(int fd, const std::string &msg) {
-  if (rio_writen(fd, msg.c_str(), msg.size()) !=
-      static_cast<ssize_t>(msg.size())) {
-    throw CommException("Failed to send message");
-  }
-}
-
-// Read response from the server
-std::string read_response(int fd, rio_t &rio) {
-  char buf[MAXLINE];
-  if (rio_readlineb(&rio, buf, MAXLINE) < 0) {
-    throw CommException("Failed to read response from server");
-  }
-  std::string response(buf);
-  if (response.empty() || response.back() != '\n') {
-    throw InvalidMessage("Server response not properly terminated");
-  }
-  return response.substr(0, response.size() - 1);
-}
-
 int main(int argc, char **argv) {
   // Check command line arguments
   if (argc != 6) {
@@ -51,13 +15,11 @@ int main(int argc, char **argv) {
   std::string hostname = argv[1], port = argv[2], username = argv[3],
               table = argv[4], key = argv[5];
 
-  int clientfd;
+  int clientfd = -1;
   try {
-    // Connect to the server
-    clientfd = open_clientfd(hostname.c_str(), port.c_str());
-    if (clientfd < 0) {
-      throw CommException("Could not connect to server");
-    }
+    // Connect to the server holding the key (hostname may list several
+    // sharded servers, see parse_server_list())
+    clientfd = connect_to_shard(hostname, port, table, key);
 
     // Initialize rio for reading
     rio_t rio;
@@ -0,0 +1,59 @@
+#include "hash_ring.h"
+#include <algorithm>
+#include <stdexcept>
+
+namespace {
+
+const uint64_t FNV_OFFSET = 14695981039346656037ULL;
+const uint64_t FNV_PRIME = 1099511628211ULL;
+
+uint64_t fnv1a(uint64_t h, std::string_view data) {
+  for (unsigned char c : data) {
+    h = (h ^ c) * FNV_PRIME;
+  }
+  return h;
+}
+
+// FNV-1a alone leaves similar strings (such as "key1", "key2") close
+// together; this finalizer spreads them over the whole ring
+uint64_t mix(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+} // namespace
+
+HashRing::HashRing(int vnodes) : m_vnodes(vnodes) {}
+
+size_t HashRing::add_node(const std::string &name) {
+  uint32_t index = m_nodes.size();
+  m_nodes.push_back(name);
+  for (int i = 0; i < m_vnodes; i++) {
+    m_points.emplace_back(hash(name, std::to_string(i)), index);
+  }
+  std::sort(m_points.begin(), m_points.end());
+  return index;
+}
+
+size_t HashRing::node_for(std::string_view table, std::string_view key) const {
+  if (m_points.empty()) {
+    throw std::logic_error("Hash ring has no nodes");
+  }
+  auto it = std::lower_bound(m_points.begin(), m_points.end(),
+                             std::make_pair(hash(table, key), uint32_t(0)));
+  if (it == m_points.end()) {
+    it = m_points.begin(); // wrap around
+  }
+  return it->second;
+}
+
+uint64_t HashRing::hash(std::string_view table, std::string_view key) {
+  // The separator keeps ("ab", "c") and ("a", "bc") apart
+  uint64_t h = fnv1a(FNV_OFFSET, table);
+  h = (h ^ 0xff) * FNV_PRIME;
+  return mix(fnv1a(h, key));
+}
@@ -0,0 +1,46 @@
+#ifndef HASH_RING_H
+#define HASH_RING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Consistent hash ring which maps (table, key) pairs to one of a set of
+// nodes (servers, named "host:port").
+//
+// Each node owns VNODES points on the ring, placed by hashing its name,
+// and a key belongs to the node owning the first point at or after the
+// key's hash. With many points per node the keys spread evenly, and
+// adding or removing a node only moves the keys on its own points. The
+// hash is fixed (not std::hash), so every client and proxy given the
+// same node list agrees on where each key lives.
+class HashRing {
+public:
+  static const int DEFAULT_VNODES = 160;
+
+private:
+  int m_vnodes;
+  std::vector<std::string> m_nodes;
+  // (point, node index), sorted by point
+  std::vector<std::pair<uint64_t, uint32_t>> m_points;
+
+public:
+  HashRing(int vnodes = DEFAULT_VNODES);
+
+  // Adds a node and returns its index
+  size_t add_node(const std::string &name);
+
+  size_t num_nodes() const { return m_nodes.size(); }
+  const std::string &get_node(size_t index) const { return m_nodes.at(index); }
+
+  // Index of the node responsible for key in table. There must be at
+  // least one node.
+  size_t node_for(std::string_view table, std::string_view key) const;
+
+  static uint64_t hash(std::string_view table, std::string_view key);
+};
+
+#endif // HASH_RING_H
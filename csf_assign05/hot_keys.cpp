@@ -0,0 +1,214 @@
+#include "hot_keys.h"
+#include "guard.h"
+#include <algorithm>
+
+namespace {
+
+// This thread's xorshift state for choosing samples, seeded on first use
+thread_local uint64_t t_random = 0;
+
+struct CacheEntry {
+  uint64_t table_id; // 0 for an empty entry (table ids start at 1)
+  uint64_t version;
+  size_t hash;
+  std::string key;
+  std::string value;
+};
+
+thread_local CacheEntry t_cache[ReadCache::ENTRIES];
+
+std::atomic<bool> g_cache_enabled(true);
+
+CacheEntry &cache_entry(uint64_t table_id, size_t hash) {
+  return t_cache[(hash ^ (table_id * 0x9e3779b97f4a7c15ULL)) %
+                 ReadCache::ENTRIES];
+}
+
+} // namespace
+
+HotKeyTracker::HotKeyTracker()
+    : m_samples(0), m_sampled_hits(0), m_hot_count(MIN_HOT_COUNT) {
+  for (unsigned row = 0; row < DEPTH; row++) {
+    for (unsigned i = 0; i < WIDTH; i++) {
+      m_counts[row][i].store(0, std::memory_order_relaxed);
+    }
+  }
+  pthread_mutex_init(&m_top_lock, NULL);
+}
+
+HotKeyTracker::~HotKeyTracker() { pthread_mutex_destroy(&m_top_lock); }
+
+// Sampling at random, rather than every SAMPLE_EVERY-th read, means a
+// cyclic access pattern can't make the samples land on the same keys
+bool HotKeyTracker::sample() {
+  uint64_t x = t_random;
+  if (x == 0) {
+    // Threads start from different states, never zero
+    x = (reinterpret_cast<uintptr_t>(&t_random) | 1) * 0x9e3779b97f4a7c15ULL;
+  }
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  t_random = x;
+  return x % SAMPLE_EVERY == 0;
+}
+
+// Each row uses different bits of the hash, remixed
+unsigned HotKeyTracker::slot(size_t hash, unsigned row) {
+  uint64_t h = (hash + row) * 0xff51afd7ed558ccdULL;
+  return (h ^ (h >> 32)) % WIDTH;
+}
+
+uint32_t HotKeyTracker::estimate(size_t hash) const {
+  uint32_t count = UINT32_MAX;
+  for (unsigned row = 0; row < DEPTH; row++) {
+    count = std::min(count,
+                     m_counts[row][slot(hash, row)].load(
+                         std::memory_order_relaxed));
+  }
+  return count;
+}
+
+void HotKeyTracker::record(std::string_view key, size_t hash, bool cached) {
+  uint32_t count = UINT32_MAX;
+  for (unsigned row = 0; row < DEPTH; row++) {
+    count = std::min(count, m_counts[row][slot(hash, row)].fetch_add(
+                                1, std::memory_order_relaxed) + 1);
+  }
+  if (cached) {
+    m_sampled_hits.fetch_add(1, std::memory_order_relaxed);
+  }
+  if (count >= m_hot_count.load(std::memory_order_relaxed)) {
+    update_top(key, count);
+  }
+  if (m_samples.fetch_add(1, std::memory_order_relaxed) % DECAY_SAMPLES ==
+      DECAY_SAMPLES - 1) {
+    decay();
+  }
+}
+
+bool HotKeyTracker::is_hot(size_t hash) const {
+  return estimate(hash) >= m_hot_count.load(std::memory_order_relaxed);
+}
+
+// Puts key on the top list with its new count, if it belongs there
+void HotKeyTracker::update_top(std::string_view key, uint32_t count) {
+  Guard g(m_top_lock);
+  auto it = std::find_if(m_top.begin(), m_top.end(),
+                         [&](const TopKey &top) { return top.key == key; });
+  if (it != m_top.end()) {
+    it->count = std::max(it->count, count);
+  } else if (m_top.size() < TOP_K) {
+    m_top.push_back(TopKey{std::string(key), count});
+  } else {
+    auto coldest = std::min_element(
+        m_top.begin(), m_top.end(),
+        [](const TopKey &a, const TopKey &b) { return a.count < b.count; });
+    if (coldest->count >= count) {
+      return;
+    }
+    coldest->key = key;
+    coldest->count = count;
+  }
+  // Once the list is full, keys have to beat its coldest key
+  uint32_t hot = MIN_HOT_COUNT;
+  if (m_top.size() == TOP_K) {
+    uint32_t coldest = UINT32_MAX;
+    for (const TopKey &top : m_top) {
+      coldest = std::min(coldest, top.count);
+    }
+    hot = std::max(hot, coldest);
+  }
+  m_hot_count.store(hot, std::memory_order_relaxed);
+}
+
+// Halves every count. Samples taken meanwhile may be lost or halved too,
+// which doesn't matter for estimates.
+void HotKeyTracker::decay() {
+  for (unsigned row = 0; row < DEPTH; row++) {
+    for (unsigned i = 0; i < WIDTH; i++) {
+      m_counts[row][i].store(
+          m_counts[row][i].load(std::memory_order_relaxed) / 2,
+          std::memory_order_relaxed);
+    }
+  }
+  Guard g(m_top_lock);
+  uint32_t hot = UINT32_MAX;
+  for (TopKey &top : m_top) {
+    top.count /= 2;
+    hot = std::min(hot, top.count);
+  }
+  m_top.erase(std::remove_if(m_top.begin(), m_top.end(),
+                             [](const TopKey &top) {
+                               return top.count < MIN_HOT_COUNT;
+                             }),
+              m_top.end());
+  m_hot_count.store(m_top.size() == TOP_K ? std::max(hot, MIN_HOT_COUNT)
+                                          : MIN_HOT_COUNT,
+                    std::memory_order_relaxed);
+}
+
+std::string HotKeyTracker::get_stats(size_t max_len) {
+  std::vector<TopKey> top;
+  {
+    Guard g(m_top_lock);
+    top = m_top;
+  }
+  std::sort(top.begin(), top.end(), [](const TopKey &a, const TopKey &b) {
+    return a.count > b.count;
+  });
+  uint64_t samples = m_samples.load(std::memory_order_relaxed);
+  uint64_t hits = m_sampled_hits.load(std::memory_order_relaxed);
+  std::string rest = ";reads_sampled=" + std::to_string(samples) +
+                     ";cache_hit_pct=" +
+                     std::to_string(samples ? hits * 100 / samples : 0);
+  std::string stats = "hot_keys=";
+  size_t listed = 0;
+  for (const TopKey &entry : top) {
+    std::string item = (listed > 0 ? "," : "") + entry.key + ":" +
+                       std::to_string(uint64_t(entry.count) * SAMPLE_EVERY);
+    if (stats.size() + item.size() + rest.size() > max_len) {
+      break; // the rest are colder
+    }
+    stats += item;
+    listed++;
+  }
+  if (listed == 0) {
+    stats += '-';
+  }
+  return stats + rest;
+}
+
+void ReadCache::set_enabled(bool enabled) {
+  g_cache_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+bool ReadCache::is_enabled() {
+  return g_cache_enabled.load(std::memory_order_relaxed);
+}
+
+bool ReadCache::lookup(uint64_t table_id, size_t hash, std::string_view key,
+                       uint64_t version, std::string &value) {
+  if (!contains(table_id, hash, key, version)) {
+    return false;
+  }
+  value = cache_entry(table_id, hash).value;
+  return true;
+}
+
+bool ReadCache::contains(uint64_t table_id, size_t hash, std::string_view key,
+                         uint64_t version) {
+  const CacheEntry &entry = cache_entry(table_id, hash);
+  return entry.table_id == table_id && entry.hash == hash &&
+         entry.version == version && entry.key == key;
+}
+
+void ReadCache::store(uint64_t table_id, size_t hash, std::string_view key,
+                      uint64_t version, std::string_view value) {
+  CacheEntry &entry = cache_entry(table_id, hash);
+  entry.table_id = table_id;
+  entry.version = version;
+  entry.hash = hash;
+  entry.key = key;
+  entry.value = value;
+}
@@ -0,0 +1,94 @@
+#ifndef HOT_KEYS_H
+#define HOT_KEYS_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <pthread.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Finds the most read keys of a table. A random sample of the reads (one
+// in SAMPLE_EVERY on average) is added to a count-min sketch: DEPTH
+// rows of WIDTH counters, each key incrementing one counter per row, so
+// that the smallest of its counters bounds its count from above. The
+// TOP_K keys with the highest counts are kept in a list, and a key is hot
+// if its count reaches the smallest count on that list. Every
+// DECAY_SAMPLES samples, all counts are halved, so keys cool off once
+// they stop being read.
+//
+// Counters are relaxed atomics, updated without any lock; only changes
+// to the top list take its mutex. Counts are approximate either way.
+class HotKeyTracker {
+public:
+  static const unsigned DEPTH = 4;
+  static const unsigned WIDTH = 1024;
+  static const unsigned TOP_K = 32;
+  static const unsigned SAMPLE_EVERY = 16;
+  static const uint64_t DECAY_SAMPLES = 1 << 16;
+  // A key isn't hot until it has been sampled this often, so evenly
+  // spread reads don't make every key hot
+  static constexpr uint32_t MIN_HOT_COUNT = 8;
+
+private:
+  struct TopKey {
+    std::string key;
+    uint32_t count;
+  };
+
+  std::atomic<uint32_t> m_counts[DEPTH][WIDTH];
+  std::atomic<uint64_t> m_samples;
+  std::atomic<uint64_t> m_sampled_hits; // samples read from a cache
+  std::atomic<uint32_t> m_hot_count;    // count at which a key is hot
+
+  pthread_mutex_t m_top_lock; // protects m_top
+  std::vector<TopKey> m_top;
+
+  static unsigned slot(size_t hash, unsigned row);
+  uint32_t estimate(size_t hash) const;
+  void update_top(std::string_view key, uint32_t count);
+  void decay();
+
+  // copy constructor and assignment operator are prohibited
+  HotKeyTracker(const HotKeyTracker &);
+  HotKeyTracker &operator=(const HotKeyTracker &);
+
+public:
+  HotKeyTracker();
+  ~HotKeyTracker();
+
+  // Whether the calling thread's next read is to be sampled
+  static bool sample();
+  // Counts a sampled read of key, whose hash is std::hash of it; cached
+  // says whether it was served from a read cache
+  void record(std::string_view key, size_t hash, bool cached);
+  bool is_hot(size_t hash) const;
+
+  // "hot_keys=<key>:<reads>,...;reads_sampled=...;cache_hit_pct=...",
+  // with reads scaled up from the samples, hottest first. Keys which
+  // would make it longer than max_len are left out.
+  std::string get_stats(size_t max_len);
+};
+
+// Each thread's cache of hot values, so that reading a hot key needn't
+// lock its table. Entries are tagged with the table's id and a version
+// of the key, which the table changes whenever the key is written, so a
+// lookup with a newer version misses. The cache is direct mapped, and
+// only hot keys are stored, so it stays small.
+namespace ReadCache {
+const unsigned ENTRIES = 256;
+
+// On by default
+void set_enabled(bool enabled);
+bool is_enabled();
+
+bool lookup(uint64_t table_id, size_t hash, std::string_view key,
+            uint64_t version, std::string &value);
+bool contains(uint64_t table_id, size_t hash, std::string_view key,
+              uint64_t version);
+void store(uint64_t table_id, size_t hash, std::string_view key,
+           uint64_t version, std::string_view value);
+} // namespace ReadCache
+
+#endif // HOT_KEYS_H
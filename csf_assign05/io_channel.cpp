@@ -0,0 +1,108 @@
+#include "io_channel.h"
+#include "io_uring_channel.h"
+#include <cerrno>
+#include <poll.h>
+#include <unistd.h>
+
+namespace {
+
+ssize_t fill_from_channel(void *ctx, void *buf, size_t n) {
+  return static_cast<IoChannel *>(ctx)->read(buf, n);
+}
+
+} // namespace
+
+std::atomic<uint64_t> IoChannel::s_syscalls(0);
+
+IoChannel::IoChannel(int fd) : m_fd(fd) { m_out.reserve(MAX_BUFFERED); }
+
+IoChannel::~IoChannel() {}
+
+bool IoChannel::write(std::string_view data) {
+  if (m_out.size() + data.size() > MAX_BUFFERED && !flush()) {
+    return false;
+  }
+  m_out.append(data.data(), data.size());
+  if (m_out.size() >= MAX_BUFFERED) {
+    return flush();
+  }
+  return true;
+}
+
+int IoChannel::wait_input(int wake_fd) {
+  if (!flush()) {
+    return -1;
+  }
+  struct pollfd fds[2] = {{m_fd, POLLIN, 0}, {wake_fd, POLLIN, 0}};
+  while (1) {
+    count_syscall();
+    int n = poll(fds, 2, -1);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return -1;
+    }
+    // Hangups and errors count as input: the next read reports them
+    return fds[0].revents != 0 ? 1 : 0;
+  }
+}
+
+void IoChannel::attach(rio_t *rio) { rio_setfill(rio, fill_from_channel, this); }
+
+IoChannel *IoChannel::create(int fd) {
+#ifdef USE_IO_URING
+  return new UringChannel(fd);
+#else
+  return new SocketChannel(fd);
+#endif
+}
+
+const char *IoChannel::backend_name() {
+#ifdef USE_IO_URING
+  return "io_uring";
+#else
+  return "threads";
+#endif
+}
+
+SocketChannel::SocketChannel(int fd) : IoChannel(fd) {}
+
+ssize_t SocketChannel::read(void *buf, size_t n) {
+  if (!flush()) {
+    return -1;
+  }
+  count_syscall();
+  return ::read(m_fd, buf, n);
+}
+
+bool SocketChannel::flush() {
+  size_t written = 0;
+  while (written < m_out.size()) {
+    count_syscall();
+    ssize_t n = ::write(m_fd, m_out.data() + written, m_out.size() - written);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      m_out.clear();
+      return false;
+    }
+    written += n;
+  }
+  m_out.clear();
+  return true;
+}
+
+int Acceptor::accept(struct sockaddr_storage *addr, socklen_t *addrlen) {
+  return ::accept(m_listen_fd, reinterpret_cast<struct sockaddr *>(addr),
+                  addrlen);
+}
+
+Acceptor *Acceptor::create(int listen_fd) {
+#ifdef USE_IO_URING
+  return new UringAcceptor(listen_fd);
+#else
+  return new Acceptor(listen_fd);
+#endif
+}
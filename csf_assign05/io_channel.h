@@ -0,0 +1,97 @@
+#ifndef IO_CHANNEL_H
+#define IO_CHANNEL_H
+
+#include "csapp.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+
+// Network I/O for one client connection. ClientConnection reads through
+// a rio_t whose buffer the channel refills (see attach()), and writes
+// with write(). The backend is chosen at compile time: blocking read()
+// and write() calls, or io_uring (make IO_BACKEND=uring; see
+// io_uring_channel.h).
+//
+// Output is coalesced: write() only buffers, up to MAX_BUFFERED bytes,
+// and the buffer is sent before the channel blocks waiting for input
+// (or by flush()). A client pipelining requests gets all the responses
+// to what it has sent so far in one send.
+class IoChannel {
+protected:
+  int m_fd;
+  std::string m_out; // buffered output
+
+  // copy constructor and assignment operator are prohibited
+  IoChannel(const IoChannel &);
+  IoChannel &operator=(const IoChannel &);
+
+  static std::atomic<uint64_t> s_syscalls;
+
+public:
+  static const size_t MAX_BUFFERED = 64 * 1024;
+
+  IoChannel(int fd);
+  virtual ~IoChannel();
+
+  // Like read(2) on a blocking socket, except that buffered output is
+  // sent first. Times out like the socket's SO_RCVTIMEO, returning -1
+  // with errno set to EAGAIN.
+  virtual ssize_t read(void *buf, size_t n) = 0;
+
+  // Waits until there is input to read (returning 1) or wake_fd becomes
+  // readable (returning 0), sending buffered output first; -1 with errno
+  // set if the connection failed. Doesn't time out. wake_fd must be the
+  // same on every call.
+  virtual int wait_input(int wake_fd);
+
+  // Queues data for sending. Returns false if the connection failed.
+  bool write(std::string_view data);
+  // Sends everything queued. Returns false if the connection failed.
+  virtual bool flush() = 0;
+
+  // Makes rio's buffer refill itself with read()
+  void attach(rio_t *rio);
+
+  // Creates a channel using the compiled-in backend
+  static IoChannel *create(int fd);
+  static const char *backend_name();
+  // I/O system calls made by all channels (and event loops) so far
+  static void count_syscall() {
+    s_syscalls.fetch_add(1, std::memory_order_relaxed);
+  }
+  static uint64_t get_syscalls() { return s_syscalls.load(); }
+};
+
+// Blocking read() and write() calls, one connection per thread
+class SocketChannel : public IoChannel {
+public:
+  SocketChannel(int fd);
+
+  virtual ssize_t read(void *buf, size_t n);
+  virtual bool flush();
+};
+
+// Accepts connections on a listening socket, for one acceptor thread
+class Acceptor {
+protected:
+  int m_listen_fd;
+
+  // copy constructor and assignment operator are prohibited
+  Acceptor(const Acceptor &);
+  Acceptor &operator=(const Acceptor &);
+
+public:
+  Acceptor(int listen_fd) : m_listen_fd(listen_fd) {}
+  virtual ~Acceptor() {}
+
+  // Like accept(2)
+  virtual int accept(struct sockaddr_storage *addr, socklen_t *addrlen);
+
+  // Creates an acceptor using the compiled-in backend
+  static Acceptor *create(int listen_fd);
+};
+
+#endif // IO_CHANNEL_H
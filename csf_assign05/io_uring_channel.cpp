@@ -0,0 +1,495 @@
+#include "io_uring_channel.h"
+
+#ifdef USE_IO_URING
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace {
+
+// user_data of the channel's SQEs
+const uint64_t SEND_TAG = 1;
+const uint64_t RECV_TAG = 2;
+const uint64_t WAKE_TAG = 3;
+
+// All provided buffers of a channel belong to this group
+const unsigned short BUF_GROUP = 0;
+
+uint64_t now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return uint64_t(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Absolute deadline for a timeout in milliseconds, 0 if there is none
+uint64_t deadline_after(unsigned timeout_ms) {
+  return timeout_ms > 0 ? now_ms() + timeout_ms : 0;
+}
+
+} // namespace
+
+UringRing::UringRing()
+    : m_fd(-1), m_sq_ptr(MAP_FAILED), m_sq_len(0), m_cq_ptr(MAP_FAILED),
+      m_cq_len(0), m_sqes(static_cast<struct io_uring_sqe *>(MAP_FAILED)),
+      m_sqes_len(0), m_sq_entries(0), m_to_submit(0) {}
+
+UringRing::~UringRing() {
+  if (m_sqes != MAP_FAILED) {
+    munmap(m_sqes, m_sqes_len);
+  }
+  if (m_cq_ptr != MAP_FAILED && m_cq_ptr != m_sq_ptr) {
+    munmap(m_cq_ptr, m_cq_len);
+  }
+  if (m_sq_ptr != MAP_FAILED) {
+    munmap(m_sq_ptr, m_sq_len);
+  }
+  if (m_fd >= 0) {
+    close(m_fd);
+  }
+}
+
+bool UringRing::init(unsigned entries) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  // Completions are only processed when this thread waits for them
+  params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+  m_fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (m_fd < 0 && errno == EINVAL) {
+    memset(&params, 0, sizeof(params)); // kernel older than 6.1
+    m_fd = syscall(__NR_io_uring_setup, entries, &params);
+  }
+  if (m_fd < 0) {
+    return false;
+  }
+
+  m_sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  m_cq_len =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    m_sq_len = m_cq_len = std::max(m_sq_len, m_cq_len);
+  }
+  m_sq_ptr = mmap(NULL, m_sq_len, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+  if (m_sq_ptr == MAP_FAILED) {
+    return false;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    m_cq_ptr = m_sq_ptr;
+  } else {
+    m_cq_ptr = mmap(NULL, m_cq_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+    if (m_cq_ptr == MAP_FAILED) {
+      return false;
+    }
+  }
+  m_sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+  m_sqes = static_cast<struct io_uring_sqe *>(
+      mmap(NULL, m_sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+           m_fd, IORING_OFF_SQES));
+  if (m_sqes == MAP_FAILED) {
+    return false;
+  }
+
+  char *sq = static_cast<char *>(m_sq_ptr);
+  char *cq = static_cast<char *>(m_cq_ptr);
+  m_sq_entries = params.sq_entries;
+  m_sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+  m_sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+  m_sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+  m_sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+  m_cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+  m_cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+  m_cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+  m_cqes = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+  return true;
+}
+
+struct io_uring_sqe *UringRing::get_sqe() {
+  unsigned head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+  unsigned tail = *m_sq_tail;
+  if (tail - head >= m_sq_entries) {
+    return nullptr;
+  }
+  unsigned index = tail & *m_sq_mask;
+  struct io_uring_sqe *sqe = &m_sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  m_sq_array[index] = index;
+  // The kernel only looks at the tail when we enter, so the SQE can be
+  // filled in after this
+  __atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+  m_to_submit++;
+  return sqe;
+}
+
+int UringRing::enter(unsigned min_complete, unsigned timeout_ms) {
+  unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  void *argp = NULL;
+  size_t argsz = 0;
+  if (timeout_ms > 0) {
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = reinterpret_cast<uint64_t>(&ts);
+    flags |= IORING_ENTER_EXT_ARG;
+    argp = &arg;
+    argsz = sizeof(arg);
+  }
+  int ret = syscall(__NR_io_uring_enter, m_fd, m_to_submit, min_complete,
+                    flags, argp, argsz);
+  if (ret > 0) {
+    m_to_submit -= std::min(unsigned(ret), m_to_submit);
+  }
+  return ret;
+}
+
+bool UringRing::pop_cqe(struct io_uring_cqe &cqe) {
+  unsigned head = *m_cq_head;
+  if (head == __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE)) {
+    return false;
+  }
+  cqe = m_cqes[head & *m_cq_mask];
+  __atomic_store_n(m_cq_head, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+int UringRing::register_op(unsigned opcode, void *arg, unsigned nr_args) {
+  return syscall(__NR_io_uring_register, m_fd, opcode, arg, nr_args);
+}
+
+UringChannel::UringChannel(int fd)
+    : IoChannel(fd), m_ready(false), m_error(0), m_eof(false),
+      m_timeout_ms(0), m_bufs(static_cast<char *>(MAP_FAILED)),
+      m_buf_ring(static_cast<struct io_uring_buf_ring *>(MAP_FAILED)),
+      m_buf_tail(0), m_recv_armed(false), m_send_in_flight(false),
+      m_wake_armed(false), m_woken(false), m_recv_head(0), m_recv_count(0) {
+  // The server limits idle time with SO_RCVTIMEO, which io_uring
+  // doesn't see
+  struct timeval timeout;
+  socklen_t len = sizeof(timeout);
+  if (getsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, &len) == 0) {
+    m_timeout_ms = timeout.tv_sec * 1000 + timeout.tv_usec / 1000;
+  }
+}
+
+UringChannel::~UringChannel() {
+  if (m_recv_armed || m_send_in_flight) {
+    // The kernel may still use our buffers until these complete
+    shutdown(m_fd, SHUT_RDWR);
+    while ((m_recv_armed || m_send_in_flight) && wait(1, 0)) {
+    }
+  }
+  // m_ring is destroyed after this, unregistering the buffer ring
+  if (m_bufs != MAP_FAILED) {
+    munmap(m_bufs, NUM_BUFS * BUF_SIZE);
+  }
+  if (m_buf_ring != MAP_FAILED) {
+    munmap(m_buf_ring, NUM_BUFS * sizeof(struct io_uring_buf));
+  }
+}
+
+bool UringChannel::setup() {
+  if (m_ready) {
+    return true;
+  }
+  if (m_error != 0) {
+    return false;
+  }
+  m_bufs = static_cast<char *>(mmap(NULL, NUM_BUFS * BUF_SIZE,
+                                    PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  m_buf_ring = static_cast<struct io_uring_buf_ring *>(
+      mmap(NULL, NUM_BUFS * sizeof(struct io_uring_buf),
+           PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  if (m_bufs == MAP_FAILED || m_buf_ring == MAP_FAILED || !m_ring.init(8)) {
+    m_error = errno;
+    return false;
+  }
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = reinterpret_cast<uint64_t>(m_buf_ring);
+  reg.ring_entries = NUM_BUFS;
+  reg.bgid = BUF_GROUP;
+  if (m_ring.register_op(IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+    m_error = errno;
+    return false;
+  }
+  for (unsigned short bid = 0; bid < NUM_BUFS; bid++) {
+    recycle(bid);
+  }
+  m_ready = true;
+  return true;
+}
+
+// Hands a provided buffer (back) to the kernel
+void UringChannel::recycle(unsigned short bid) {
+  // Not m_buf_ring->bufs: compiled as C++, the header's flexible array
+  // member doesn't start at offset 0
+  struct io_uring_buf *buf = reinterpret_cast<struct io_uring_buf *>(
+      m_buf_ring) + (m_buf_tail & (NUM_BUFS - 1));
+  buf->addr = reinterpret_cast<uint64_t>(m_bufs + bid * BUF_SIZE);
+  buf->len = BUF_SIZE;
+  buf->bid = bid;
+  m_buf_tail++;
+  __atomic_store_n(&m_buf_ring->tail, m_buf_tail, __ATOMIC_RELEASE);
+}
+
+// Queues a send of the buffered output. The buffer must not change until
+// the send completes.
+void UringChannel::queue_send() {
+  struct io_uring_sqe *sqe = m_ring.get_sqe();
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = m_fd;
+  sqe->addr = reinterpret_cast<uint64_t>(m_out.data());
+  sqe->len = m_out.size();
+  // Without MSG_WAITALL a send can complete partially
+  sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+  sqe->user_data = SEND_TAG;
+  m_send_in_flight = true;
+}
+
+void UringChannel::arm_recv() {
+  struct io_uring_sqe *sqe = m_ring.get_sqe();
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = m_fd;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = BUF_GROUP;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->user_data = RECV_TAG;
+  m_recv_armed = true;
+}
+
+// Submits what is queued and processes completions, waiting for at least
+// min_complete of them, or until deadline_ms (0 for none). Returns false
+// with errno set to ETIME once the deadline has passed, or if the ring
+// fails.
+bool UringChannel::wait(unsigned min_complete, uint64_t deadline_ms) {
+  unsigned timeout_ms = 0;
+  if (deadline_ms > 0) {
+    uint64_t now = now_ms();
+    if (now >= deadline_ms) {
+      errno = ETIME;
+      return false;
+    }
+    timeout_ms = deadline_ms - now;
+  }
+  count_syscall();
+  // (enter() reports a timeout as ETIME only if it had nothing to submit,
+  // so callers rely on the deadline check above instead)
+  int ret = m_ring.enter(min_complete, timeout_ms);
+  int saved_errno = errno;
+  struct io_uring_cqe cqe;
+  while (m_ring.pop_cqe(cqe)) {
+    handle_cqe(cqe);
+  }
+  if (ret < 0 && saved_errno != EINTR && saved_errno != ETIME) {
+    errno = saved_errno;
+    return false;
+  }
+  return true;
+}
+
+// Waits for the send in flight, if any. A client which doesn't read its
+// responses by deadline_ms loses its connection, as the blocking backend's
+// SO_SNDTIMEO would do.
+void UringChannel::finish_send(uint64_t deadline_ms) {
+  while (m_send_in_flight) {
+    if (!wait(1, deadline_ms)) {
+      if (errno != ETIME) {
+        m_error = errno;
+        return;
+      }
+      shutdown(m_fd, SHUT_RDWR); // makes the send fail promptly
+      deadline_ms = 0;
+    }
+  }
+}
+
+void UringChannel::handle_cqe(const struct io_uring_cqe &cqe) {
+  if (cqe.user_data == SEND_TAG) {
+    m_send_in_flight = false;
+    if (cqe.res < 0 || size_t(cqe.res) != m_out.size()) {
+      m_error = cqe.res < 0 ? -cqe.res : EPIPE;
+    }
+    m_out.clear();
+    return;
+  }
+  if (cqe.user_data == WAKE_TAG) {
+    m_wake_armed = false;
+    m_woken = true;
+    return;
+  }
+  if (!(cqe.flags & IORING_CQE_F_MORE)) {
+    m_recv_armed = false;
+  }
+  if (cqe.res > 0 && (cqe.flags & IORING_CQE_F_BUFFER)) {
+    unsigned short bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+    m_received[(m_recv_head + m_recv_count++) % NUM_BUFS] =
+        Received{bid, 0, unsigned(cqe.res)};
+  } else if (cqe.res == 0) {
+    m_eof = true;
+  } else if (cqe.res != -ENOBUFS || m_recv_count == 0) {
+    // (Running out of buffers just means the recv must be rearmed once
+    // some have been read)
+    m_error = -cqe.res;
+  }
+}
+
+ssize_t UringChannel::read(void *buf, size_t n) {
+  if (!setup()) {
+    errno = m_error;
+    return -1;
+  }
+  uint64_t deadline = deadline_after(m_timeout_ms);
+  while (m_recv_count == 0 && !m_eof && m_error == 0) {
+    if (!m_out.empty() && !m_send_in_flight) {
+      queue_send();
+    }
+    if (!m_recv_armed) {
+      arm_recv();
+    }
+    // Wait for the send as well as for input, so m_out can be reused
+    // once this returns
+    if (!wait(m_send_in_flight ? 2 : 1, deadline)) {
+      if (errno != ETIME) {
+        m_error = errno;
+        break;
+      }
+      finish_send(deadline);
+      if (m_recv_count == 0) {
+        errno = EAGAIN; // like a read() hitting SO_RCVTIMEO
+        return -1;
+      }
+    }
+  }
+  finish_send(deadline);
+  if (m_recv_count == 0) {
+    if (m_error != 0) {
+      errno = m_error;
+      return -1;
+    }
+    return 0; // EOF
+  }
+
+  Received &chunk = m_received[m_recv_head];
+  size_t len = std::min(n, size_t(chunk.len - chunk.offset));
+  memcpy(buf, m_bufs + chunk.bid * BUF_SIZE + chunk.offset, len);
+  chunk.offset += len;
+  if (chunk.offset == chunk.len) {
+    recycle(chunk.bid);
+    m_recv_head = (m_recv_head + 1) % NUM_BUFS;
+    m_recv_count--;
+  }
+  return len;
+}
+
+// Waits for input, or for a poll of wake_fd, in the same io_uring_enter.
+// The poll stays pending while input is handled, so it is only queued
+// again once it has completed.
+int UringChannel::wait_input(int wake_fd) {
+  if (!setup()) {
+    errno = m_error;
+    return -1;
+  }
+  while (m_recv_count == 0 && !m_eof && m_error == 0 && !m_woken) {
+    if (!m_out.empty() && !m_send_in_flight) {
+      queue_send();
+    }
+    if (!m_recv_armed) {
+      arm_recv();
+    }
+    if (!m_wake_armed) {
+      struct io_uring_sqe *sqe = m_ring.get_sqe();
+      sqe->opcode = IORING_OP_POLL_ADD;
+      sqe->fd = wake_fd;
+      sqe->poll32_events = POLLIN;
+      sqe->user_data = WAKE_TAG;
+      m_wake_armed = true;
+    }
+    if (!wait(1, 0)) {
+      m_error = errno;
+    }
+  }
+  // The caller may write more output once this returns
+  finish_send(deadline_after(m_timeout_ms));
+  if (m_recv_count > 0 || m_eof || m_error != 0) {
+    return 1; // read() reports errors
+  }
+  m_woken = false;
+  return 0;
+}
+
+bool UringChannel::flush() {
+  if (m_out.empty()) {
+    return m_error == 0;
+  }
+  if (!setup() || m_error != 0) {
+    m_out.clear();
+    return false;
+  }
+  queue_send();
+  finish_send(deadline_after(m_timeout_ms));
+  return m_error == 0;
+}
+
+UringAcceptor::UringAcceptor(int listen_fd)
+    : Acceptor(listen_fd), m_ready(false), m_armed(false), m_error(0) {}
+
+UringAcceptor::~UringAcceptor() {
+  for (int fd : m_accepted) {
+    close(fd);
+  }
+}
+
+int UringAcceptor::accept(struct sockaddr_storage *addr, socklen_t *addrlen) {
+  if (!m_ready) {
+    if (!m_ring.init(64)) {
+      return -1;
+    }
+    m_ready = true;
+  }
+  while (m_accepted.empty() && m_error == 0) {
+    if (!m_armed) {
+      struct io_uring_sqe *sqe = m_ring.get_sqe();
+      sqe->opcode = IORING_OP_ACCEPT;
+      sqe->fd = m_listen_fd;
+      sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+      m_armed = true;
+    }
+    if (m_ring.enter(1) < 0 && errno != EINTR) {
+      return -1;
+    }
+    struct io_uring_cqe cqe;
+    while (m_ring.pop_cqe(cqe)) {
+      if (!(cqe.flags & IORING_CQE_F_MORE)) {
+        m_armed = false;
+      }
+      if (cqe.res >= 0) {
+        m_accepted.push_back(cqe.res);
+      } else {
+        m_error = -cqe.res;
+      }
+    }
+  }
+  if (m_accepted.empty()) {
+    errno = m_error;
+    m_error = 0;
+    return -1;
+  }
+  int fd = m_accepted.front();
+  m_accepted.pop_front();
+  // Multishot accepts don't report the peer's address
+  getpeername(fd, reinterpret_cast<struct sockaddr *>(addr), addrlen);
+  return fd;
+}
+
+#endif // USE_IO_URING
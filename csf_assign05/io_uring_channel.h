@@ -0,0 +1,126 @@
+#ifndef IO_URING_CHANNEL_H
+#define IO_URING_CHANNEL_H
+
+#ifdef USE_IO_URING
+
+#include "io_channel.h"
+#include <deque>
+#include <linux/io_uring.h>
+
+// A minimal io_uring, driven through the raw system calls so that
+// liburing isn't needed. A ring belongs to the thread which first
+// submits to it.
+class UringRing {
+private:
+  int m_fd;
+  void *m_sq_ptr;
+  size_t m_sq_len;
+  void *m_cq_ptr; // same as m_sq_ptr with IORING_FEAT_SINGLE_MMAP
+  size_t m_cq_len;
+  struct io_uring_sqe *m_sqes;
+  size_t m_sqes_len;
+  unsigned m_sq_entries;
+  unsigned *m_sq_head, *m_sq_tail, *m_sq_mask, *m_sq_array;
+  unsigned *m_cq_head, *m_cq_tail, *m_cq_mask;
+  struct io_uring_cqe *m_cqes;
+  unsigned m_to_submit; // SQEs queued since the last enter()
+
+  // copy constructor and assignment operator are prohibited
+  UringRing(const UringRing &);
+  UringRing &operator=(const UringRing &);
+
+public:
+  UringRing();
+  ~UringRing();
+
+  // Returns false, with errno set, if the ring can't be created
+  bool init(unsigned entries);
+
+  // A zeroed SQE to fill in, or nullptr if the submission queue is full
+  struct io_uring_sqe *get_sqe();
+  // Submits the queued SQEs and waits until at least min_complete CQEs
+  // are available, or timeout_ms have passed (0 for no timeout). Returns
+  // -1 with errno set on failure (ETIME for a timeout).
+  int enter(unsigned min_complete, unsigned timeout_ms = 0);
+  // Takes the next CQE, if there is one
+  bool pop_cqe(struct io_uring_cqe &cqe);
+  int register_op(unsigned opcode, void *arg, unsigned nr_args);
+};
+
+// Channel which does its socket I/O through a per-connection io_uring:
+//  - A multishot recv stays armed on the socket, receiving into a ring
+//    of provided buffers registered with the kernel, so data that
+//    arrives while a request is being handled is already in user
+//    memory when the next read() comes.
+//  - Buffered output is sent by a send queued with the wait for more
+//    input, so a request/response round trip costs one io_uring_enter
+//    instead of a read() and a write().
+// The ring is created by the first read() or flush(), on the
+// connection's own thread.
+class UringChannel : public IoChannel {
+public:
+  static const unsigned NUM_BUFS = 8; // must be a power of 2
+  static const unsigned BUF_SIZE = 4096;
+
+private:
+  // A received chunk, in provided buffer bid, not yet read
+  struct Received {
+    unsigned short bid;
+    unsigned offset;
+    unsigned len;
+  };
+
+  UringRing m_ring;
+  bool m_ready;
+  int m_error; // errno of a failed setup, send or recv
+  bool m_eof;
+  unsigned m_timeout_ms; // from SO_RCVTIMEO
+  char *m_bufs;          // NUM_BUFS provided buffers
+  struct io_uring_buf_ring *m_buf_ring;
+  unsigned short m_buf_tail;
+  bool m_recv_armed;
+  bool m_send_in_flight;
+  bool m_wake_armed; // a poll of wait_input()'s wake_fd is pending
+  bool m_woken;      // and it has completed
+  // Each chunk holds a buffer, so there are at most NUM_BUFS
+  Received m_received[NUM_BUFS];
+  unsigned m_recv_head;
+  unsigned m_recv_count;
+
+  bool setup();
+  void queue_send();
+  void arm_recv();
+  bool wait(unsigned min_complete, uint64_t deadline_ms);
+  void finish_send(uint64_t deadline_ms);
+  void handle_cqe(const struct io_uring_cqe &cqe);
+  void recycle(unsigned short bid);
+
+public:
+  UringChannel(int fd);
+  virtual ~UringChannel();
+
+  virtual ssize_t read(void *buf, size_t n);
+  virtual bool flush();
+  virtual int wait_input(int wake_fd);
+};
+
+// Acceptor which keeps a multishot accept armed on the listening socket,
+// so a burst of connections is picked up with one io_uring_enter
+class UringAcceptor : public Acceptor {
+private:
+  UringRing m_ring;
+  bool m_ready;
+  bool m_armed;
+  int m_error;
+  std::deque<int> m_accepted;
+
+public:
+  UringAcceptor(int listen_fd);
+  virtual ~UringAcceptor();
+
+  virtual int accept(struct sockaddr_storage *addr, socklen_t *addrlen);
+};
+
+#endif // USE_IO_URING
+
+#endif // IO_URING_CHANNEL_H
@@ -0,0 +1,869 @@
+// Benchmarks for the key/value server.
+//
+// Usage: ./kvbench <mode> [options]
+//
+// Modes:
+//   alloc [requests]   Drive a ClientConnection in-process over a socketpair
+//                      and count heap allocations per request once warmed up
+//   embedded [requests]
+//                      The same requests through the in-process API, with
+//                      no connection, and read-modify-write transactions
+//   hot [threads] [seconds]
+//                      Zipfian GETs through the in-process API, with the
+//                      hot key read cache off and on
+//   lockfree [max threads] [seconds] [writer]
+//                      Uniform GETs of a table under its lock versus
+//                      without it, at 1, 2, 4... threads, optionally
+//                      while a thread overwrites keys
+//   numa [threads] [seconds]
+//                      Threads reading and writing tables of their own,
+//                      created by one thread and left unplaced, versus
+//                      created by each thread pinned to a NUMA node and
+//                      kept in that node's memory
+//   mem [entries]      Heap bytes per entry of std::map versus CompactStore
+//   load <hostname> <port> [keys]
+//                      LOAD keys into a running server, then DUMP them back
+//   accept <hostname> <port> [seconds] [clients]
+//                      Connection rate: each client repeatedly connects,
+//                      sends LOGIN and BYE, and disconnects
+//   io <hostname> <port> [seconds] [clients] [pipeline]
+//                      Request throughput over persistent connections, and
+//                      the server's I/O system calls per request
+
+#include "client_connection.h"
+#include "client_util.h"
+#include "compact_store.h"
+#include "cpu_topology.h"
+#include "csapp.h"
+#include "database.h"
+#include "epoch.h"
+#include "exceptions.h"
+#include "hot_keys.h"
+#include "record_stream.h"
+#include "server.h"
+#include "table.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <malloc.h>
+#include <memory>
+#include <map>
+#include <new>
+#include <pthread.h>
+#include <string>
+#include <sys/socket.h>
+#include <time.h>
+#include <vector>
+
+// Every operator new in the process goes through here so that benchmarks
+// can count heap allocations and the heap bytes (including allocator
+// rounding) in use
+static std::atomic<unsigned long> g_allocations(0);
+static std::atomic<long> g_heap_bytes(0);
+
+void *operator new(size_t n) {
+  g_allocations.fetch_add(1, std::memory_order_relaxed);
+  void *p = malloc(n ? n : 1);
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  g_heap_bytes.fetch_add(malloc_usable_size(p), std::memory_order_relaxed);
+  return p;
+}
+
+void *operator new[](size_t n) { return operator new(n); }
+
+void operator delete(void *p) noexcept {
+  if (p) {
+    g_heap_bytes.fetch_sub(malloc_usable_size(p), std::memory_order_relaxed);
+    free(p);
+  }
+}
+void operator delete(void *p, size_t) noexcept { operator delete(p); }
+void operator delete[](void *p) noexcept { operator delete(p); }
+void operator delete[](void *p, size_t) noexcept { operator delete(p); }
+
+namespace {
+
+double now_sec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void *connection_worker(void *arg) {
+  ClientConnection *conn = static_cast<ClientConnection *>(arg);
+  try {
+    conn->chat_with_client();
+  } catch (std::exception &ex) {
+    std::cerr << "Connection failed: " << ex.what() << "\n";
+  }
+  return nullptr;
+}
+
+// Send a pre-encoded batch of requests and wait for one response line per
+// request. Doesn't allocate.
+void round_trip(int fd, const char *requests, size_t len, int num_responses) {
+  if (rio_writen(fd, requests, len) != static_cast<ssize_t>(len)) {
+    std::cerr << "write failed\n";
+    exit(1);
+  }
+  char buf[4096];
+  while (num_responses > 0) {
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n <= 0) {
+      std::cerr << "read failed\n";
+      exit(1);
+    }
+    for (ssize_t i = 0; i < n; i++) {
+      if (buf[i] == '\n') {
+        num_responses--;
+      }
+    }
+  }
+}
+
+int bench_alloc(int argc, char **argv) {
+  long requests = argc > 0 ? atol(argv[0]) : 200000;
+
+  Server server;
+  server.create_table("bench");
+  {
+    Table *table = server.find_table("bench");
+    table->lock();
+    table->set("counter", "12345");
+    table->unlock();
+  }
+
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+    std::cerr << "socketpair failed\n";
+    return 1;
+  }
+  ClientConnection *conn = new ClientConnection(&server, fds[1]);
+  pthread_t thr;
+  pthread_create(&thr, NULL, connection_worker, conn);
+
+  int fd = fds[0];
+  const char login[] = "LOGIN bench\n";
+  round_trip(fd, login, sizeof(login) - 1, 1);
+
+  // One GET (pushing onto the stack), TOP to fetch it, POP to discard it,
+  // plus an overwriting SET: a read-modify-write without the arithmetic
+  const char batch[] =
+      "GET bench counter\nTOP\nPOP\nPUSH 54321\nSET bench counter\n";
+  const int batch_requests = 5;
+
+  // Warm up the arena, buffers and the stack
+  for (int i = 0; i < 1000; i++) {
+    round_trip(fd, batch, sizeof(batch) - 1, batch_requests);
+  }
+
+  long batches = requests / batch_requests;
+  unsigned long start_allocs = g_allocations.load();
+  double start = now_sec();
+  for (long i = 0; i < batches; i++) {
+    round_trip(fd, batch, sizeof(batch) - 1, batch_requests);
+  }
+  double elapsed = now_sec() - start;
+  unsigned long allocs = g_allocations.load() - start_allocs;
+
+  const char bye[] = "BYE\n";
+  round_trip(fd, bye, sizeof(bye) - 1, 1);
+  pthread_join(thr, NULL);
+  delete conn;
+  close(fd);
+
+  long total = batches * batch_requests;
+  std::cout << "requests:            " << total << "\n"
+            << "requests/sec:        " << long(total / elapsed) << "\n"
+            << "heap allocations:    " << allocs << "\n"
+            << "allocations/request: " << double(allocs) / total << "\n";
+  return 0;
+}
+
+// The same read-modify-write as alloc, and a transaction doing one,
+// through the embedded API (database.h) instead of a connection
+int bench_embedded(int argc, char **argv) {
+  long requests = argc > 0 ? atol(argv[0]) : 2000000;
+
+  Database db;
+  Session session(&db);
+  session.create_table("bench");
+  session.set("bench", "counter", "12345");
+
+  const int batch_requests = 5;
+  long batches = requests / batch_requests;
+  unsigned long start_allocs = g_allocations.load();
+  double start = now_sec();
+  for (long i = 0; i < batches; i++) {
+    session.push(session.get("bench", "counter"));
+    session.top();
+    session.pop();
+    session.push("54321");
+    session.set("bench", "counter", session.top());
+    session.pop();
+  }
+  double elapsed = now_sec() - start;
+  unsigned long allocs = g_allocations.load() - start_allocs;
+
+  long txns = batches;
+  double txn_start = now_sec();
+  for (long i = 0; i < txns; i++) {
+    session.begin();
+    std::string value = session.get("bench", "counter");
+    session.set("bench", "counter", value);
+    session.commit();
+  }
+  double txn_elapsed = now_sec() - txn_start;
+
+  long total = batches * batch_requests;
+  std::cout << "requests:            " << total << "\n"
+            << "ns/request:          " << elapsed * 1e9 / total << "\n"
+            << "allocations/request: " << double(allocs) / total << "\n"
+            << "transactions:        " << txns << "\n"
+            << "ns/transaction:      " << txn_elapsed * 1e9 / txns << "\n";
+  return 0;
+}
+
+struct HotReader {
+  Database *db;
+  const std::vector<std::string> *keys;
+  const std::vector<unsigned> *picks; // indexes into keys, Zipf distributed
+  unsigned start;
+  double seconds;
+  long reads;
+};
+
+void *hot_reader_worker(void *arg) {
+  HotReader *reader = static_cast<HotReader *>(arg);
+  Session session(reader->db);
+  const std::vector<unsigned> &picks = *reader->picks;
+  size_t next = reader->start;
+  double deadline = now_sec() + reader->seconds;
+  long reads = 0;
+  while (now_sec() < deadline) {
+    for (int i = 0; i < 1000; i++) {
+      session.get("bench", (*reader->keys)[picks[next]]);
+      next = (next + 1) % picks.size();
+    }
+    reads += 1000;
+  }
+  reader->reads = reads;
+  return nullptr;
+}
+
+// Zipfian GETs from several threads, each with a Session, with the hot
+// key read cache off and then on
+int bench_hot(int argc, char **argv) {
+  int threads = argc > 0 ? atoi(argv[0]) : 4;
+  double seconds = argc > 1 ? atof(argv[1]) : 2;
+  const unsigned num_keys = 10000;
+  const double skew = 0.99;
+
+  Database db;
+  Session loader(&db);
+  loader.create_table("bench");
+  std::vector<std::string> keys;
+  for (unsigned i = 0; i < num_keys; i++) {
+    keys.push_back("key" + std::to_string(i));
+    loader.set("bench", keys.back(), "value" + std::to_string(i));
+  }
+
+  // Key i is read in proportion to 1 / (i + 1)^skew
+  std::vector<double> cdf(num_keys);
+  double total = 0;
+  for (unsigned i = 0; i < num_keys; i++) {
+    total += 1 / pow(i + 1, skew);
+    cdf[i] = total;
+  }
+  std::vector<unsigned> picks(1 << 20);
+  unsigned seed = 42;
+  for (unsigned &pick : picks) {
+    double r = rand_r(&seed) / (RAND_MAX + 1.0) * total;
+    pick = std::lower_bound(cdf.begin(), cdf.end(), r) - cdf.begin();
+  }
+
+  for (int cached = 0; cached < 2; cached++) {
+    ReadCache::set_enabled(cached);
+    std::vector<HotReader> readers(threads);
+    std::vector<pthread_t> thrs(threads);
+    for (int i = 0; i < threads; i++) {
+      readers[i] = HotReader{&db, &keys, &picks,
+                             unsigned(i * picks.size() / threads), seconds, 0};
+      pthread_create(&thrs[i], NULL, hot_reader_worker, &readers[i]);
+    }
+    long reads = 0;
+    for (int i = 0; i < threads; i++) {
+      pthread_join(thrs[i], NULL);
+      reads += readers[i].reads;
+    }
+    std::cout << "read cache " << (cached ? "on: " : "off:") << "  "
+              << long(reads / seconds) << " GETs/sec\n";
+  }
+  std::cout << db.find_table("bench")->get_stats() << "\n";
+  return 0;
+}
+
+struct TableReader {
+  Table *table;
+  const std::vector<std::string> *keys;
+  bool locked; // through Table::lock(), or get_unlocked()
+  unsigned start;
+  std::atomic<bool> *stop;
+  long reads;
+};
+
+void *table_reader_worker(void *arg) {
+  TableReader *reader = static_cast<TableReader *>(arg);
+  const std::vector<std::string> &keys = *reader->keys;
+  size_t next = reader->start;
+  std::string value;
+  long reads = 0;
+  while (!reader->stop->load(std::memory_order_relaxed)) {
+    for (int i = 0; i < 1000; i++) {
+      const std::string &key = keys[next];
+      if (reader->locked) {
+        reader->table->lock("GET");
+        value = reader->table->get(key);
+        reader->table->unlock();
+      } else {
+        reader->table->get_unlocked(key, value);
+      }
+      next = (next + 7919) % keys.size();
+    }
+    reads += 1000;
+  }
+  reader->reads = reads;
+  return nullptr;
+}
+
+struct TableWriter {
+  Table *table;
+  const std::vector<std::string> *keys;
+  std::atomic<bool> *stop;
+};
+
+void *table_writer_worker(void *arg) {
+  TableWriter *writer = static_cast<TableWriter *>(arg);
+  const std::vector<std::string> &keys = *writer->keys;
+  size_t next = 0;
+  while (!writer->stop->load(std::memory_order_relaxed)) {
+    writer->table->lock("SET");
+    writer->table->set(keys[next], "changed" + std::to_string(next));
+    writer->table->unlock();
+    next = (next + 1) % keys.size();
+  }
+  return nullptr;
+}
+
+// GETs/sec from threads reading through one path for seconds
+long run_table_readers(Table *table, const std::vector<std::string> &keys,
+                       bool locked, int threads, double seconds,
+                       bool writer) {
+  std::atomic<bool> stop(false);
+  std::vector<TableReader> readers(threads);
+  std::vector<pthread_t> thrs(threads);
+  for (int i = 0; i < threads; i++) {
+    readers[i].table = table;
+    readers[i].keys = &keys;
+    readers[i].locked = locked;
+    readers[i].start = unsigned(i * keys.size() / threads);
+    readers[i].stop = &stop;
+    readers[i].reads = 0;
+    pthread_create(&thrs[i], NULL, table_reader_worker, &readers[i]);
+  }
+  TableWriter writer_args{table, &keys, &stop};
+  pthread_t writer_thr;
+  if (writer) {
+    pthread_create(&writer_thr, NULL, table_writer_worker, &writer_args);
+  }
+  struct timespec ts;
+  ts.tv_sec = time_t(seconds);
+  ts.tv_nsec = long((seconds - ts.tv_sec) * 1e9);
+  nanosleep(&ts, NULL);
+  stop.store(true);
+  long reads = 0;
+  for (int i = 0; i < threads; i++) {
+    pthread_join(thrs[i], NULL);
+    reads += readers[i].reads;
+  }
+  if (writer) {
+    pthread_join(writer_thr, NULL);
+  }
+  return long(reads / seconds);
+}
+
+// GETs of a memory table through the table mutex (the path GETs took
+// before lock-free reads) and through Table::get_unlocked(), with the
+// read cache off so that every read goes to the table
+int bench_lockfree(int argc, char **argv) {
+  int max_threads = argc > 0 ? atoi(argv[0]) : 64;
+  double seconds = argc > 1 ? atof(argv[1]) : 1;
+  bool writer = argc > 2 && std::string(argv[2]) == "writer";
+  const unsigned num_keys = 100000;
+
+  Table table("bench");
+  std::vector<std::string> keys;
+  table.lock();
+  for (unsigned i = 0; i < num_keys; i++) {
+    keys.push_back("key" + std::to_string(i));
+    table.set(keys.back(), "value" + std::to_string(i));
+  }
+  table.unlock();
+  ReadCache::set_enabled(false);
+
+  std::cout << "threads     locked GETs/sec  lock-free GETs/sec   speedup"
+            << (writer ? "  (with a writer)" : "") << "\n";
+  for (int threads = 1; threads <= max_threads; threads *= 2) {
+    long locked = run_table_readers(&table, keys, true, threads, seconds,
+                                    writer);
+    long unlocked = run_table_readers(&table, keys, false, threads, seconds,
+                                      writer);
+    char line[128];
+    snprintf(line, sizeof(line), "%7d  %18ld  %18ld  %8.2fx", threads, locked,
+             unlocked, locked ? double(unlocked) / locked : 0.0);
+    std::cout << line << "\n";
+  }
+  std::cout << Epoch::get_stats() << "\n";
+  return 0;
+}
+
+struct ShardWorker {
+  unsigned index;
+  bool placed;  // pin to a node, and create the table there
+  Table *table; // created by the main thread unless placed
+  std::atomic<bool> *stop;
+  pthread_barrier_t *ready; // every table is filled
+  long ops;
+};
+
+const unsigned SHARD_KEYS = 200000;
+
+void fill_shard(Table *table) {
+  table->lock();
+  for (unsigned i = 0; i < SHARD_KEYS; i++) {
+    table->set("key" + std::to_string(i), "value" + std::to_string(i));
+  }
+  table->unlock();
+}
+
+void *shard_worker(void *arg) {
+  ShardWorker *worker = static_cast<ShardWorker *>(arg);
+  std::unique_ptr<Table> own_table;
+  if (worker->placed) {
+    unsigned node = worker->index % Topology::num_nodes();
+    const std::vector<int> &cpus = Topology::node_cpus(node);
+    Topology::pin_thread(pthread_self(),
+                         {cpus[worker->index / Topology::num_nodes() %
+                               cpus.size()]});
+    own_table.reset(new Table("shard" + std::to_string(worker->index)));
+    own_table->set_home_node(node);
+    fill_shard(own_table.get());
+    worker->table = own_table.get();
+  }
+  pthread_barrier_wait(worker->ready);
+
+  // Nine GETs to a SET, over keys spread across the table
+  std::string value;
+  size_t next = worker->index * 7919;
+  long ops = 0;
+  while (!worker->stop->load(std::memory_order_relaxed)) {
+    for (int i = 0; i < 1000; i++) {
+      std::string key = "key" + std::to_string(next % SHARD_KEYS);
+      worker->table->lock(i % 10 == 0 ? "SET" : "GET");
+      if (i % 10 == 0) {
+        worker->table->set(key, "changed" + std::to_string(i));
+      } else {
+        value = worker->table->get(key);
+      }
+      worker->table->unlock();
+      next += 104729;
+    }
+    ops += 1000;
+  }
+  worker->ops = ops;
+  return nullptr;
+}
+
+// Operations/sec of threads each working on a table of its own
+long run_shards(int threads, double seconds, bool placed) {
+  std::vector<std::unique_ptr<Table>> tables;
+  if (!placed) {
+    // All the memory is allocated by this thread, wherever it runs
+    for (int i = 0; i < threads; i++) {
+      tables.emplace_back(new Table("shard" + std::to_string(i)));
+      fill_shard(tables.back().get());
+    }
+  }
+  std::atomic<bool> stop(false);
+  pthread_barrier_t ready;
+  pthread_barrier_init(&ready, NULL, threads + 1);
+  std::vector<ShardWorker> workers(threads);
+  std::vector<pthread_t> thrs(threads);
+  for (int i = 0; i < threads; i++) {
+    workers[i] = ShardWorker{unsigned(i), placed,
+                             placed ? nullptr : tables[i].get(), &stop,
+                             &ready, 0};
+    pthread_create(&thrs[i], NULL, shard_worker, &workers[i]);
+  }
+  pthread_barrier_wait(&ready);
+  struct timespec ts;
+  ts.tv_sec = time_t(seconds);
+  ts.tv_nsec = long((seconds - ts.tv_sec) * 1e9);
+  nanosleep(&ts, NULL);
+  stop.store(true);
+  long ops = 0;
+  for (int i = 0; i < threads; i++) {
+    pthread_join(thrs[i], NULL);
+    ops += workers[i].ops;
+  }
+  pthread_barrier_destroy(&ready);
+  return long(ops / seconds);
+}
+
+int bench_numa(int argc, char **argv) {
+  int threads = argc > 0 ? atoi(argv[0]) : int(Topology::all_cpus().size());
+  double seconds = argc > 1 ? atof(argv[1]) : 2;
+  ReadCache::set_enabled(false);
+
+  std::cout << Topology::get_stats() << "\n";
+  long unplaced = run_shards(threads, seconds, false);
+  long placed = run_shards(threads, seconds, true);
+  char line[128];
+  snprintf(line, sizeof(line),
+           "%d threads: unplaced %ld ops/sec, placed %ld ops/sec (%.2fx)",
+           threads, unplaced, placed,
+           unplaced ? double(placed) / unplaced : 0.0);
+  std::cout << line << "\n";
+  return 0;
+}
+
+// Fills std::map (the previous table representation) and CompactStore with
+// the same small keys/values and reports the heap cost of each
+int bench_mem(int argc, char **argv) {
+  long entries = argc > 0 ? atol(argv[0]) : 1000000;
+
+  char key[32], value[32];
+  size_t payload = 0;
+  for (long i = 0; i < entries; i++) {
+    payload += snprintf(key, sizeof(key), "user%09ld", i * 7919);
+    payload += snprintf(value, sizeof(value), "%ld", i);
+  }
+
+  long before = g_heap_bytes.load();
+  double start = now_sec();
+  {
+    std::map<std::string, std::string> map;
+    for (long i = 0; i < entries; i++) {
+      snprintf(key, sizeof(key), "user%09ld", i * 7919);
+      snprintf(value, sizeof(value), "%ld", i);
+      map[key] = value;
+    }
+    long bytes = g_heap_bytes.load() - before;
+    std::cout << "std::map:     " << double(bytes) / entries
+              << " bytes/entry, " << (now_sec() - start) << " s to insert\n";
+  }
+
+  before = g_heap_bytes.load();
+  start = now_sec();
+  {
+    CompactStore store;
+    for (long i = 0; i < entries; i++) {
+      snprintf(key, sizeof(key), "user%09ld", i * 7919);
+      snprintf(value, sizeof(value), "%ld", i);
+      store.put(key, value);
+    }
+    long bytes = g_heap_bytes.load() - before;
+    std::cout << "CompactStore: " << double(bytes) / entries
+              << " bytes/entry, " << (now_sec() - start) << " s to insert\n";
+  }
+
+  std::cout << "payload:      " << double(payload) / entries
+            << " bytes/entry (" << entries << " entries)\n";
+  return 0;
+}
+
+// Bulk load throughput over a real (loopback) connection
+int bench_load(int argc, char **argv) {
+  if (argc < 2) {
+    std::cerr << "Usage: ./kvbench load <hostname> <port> [keys]\n";
+    return 1;
+  }
+  long keys = argc > 2 ? atol(argv[2]) : 1000000;
+
+  int fd = open_clientfd(argv[0], argv[1]);
+  if (fd < 0) {
+    std::cerr << "Could not connect to server\n";
+    return 1;
+  }
+  rio_t rio;
+  rio_readinitb(&rio, fd);
+
+  try {
+    expect_ok(fd, rio, "LOGIN bench\n", "Failed to login");
+
+    double start = now_sec();
+    expect_ok(fd, rio, "LOAD bulk\n", "Failed to start load");
+    const size_t CHUNK_SIZE = 256 * 1024;
+    std::string buf;
+    char key[32], value[32];
+    for (long i = 0; i < keys; i++) {
+      int key_len = snprintf(key, sizeof(key), "key%ld", i);
+      int value_len = snprintf(value, sizeof(value), "%ld", i * 31);
+      RecordStream::append(buf, std::string_view(key, key_len),
+                           std::string_view(value, value_len));
+      if (buf.size() >= CHUNK_SIZE) {
+        send_message(fd, buf);
+        buf.clear();
+      }
+    }
+    RecordStream::append_end(buf);
+    send_message(fd, buf);
+    if (read_response(fd, rio) != "OK") {
+      std::cerr << "LOAD failed\n";
+      return 1;
+    }
+    double load_elapsed = now_sec() - start;
+
+    start = now_sec();
+    expect_ok(fd, rio, "DUMP bulk\n", "Failed to dump");
+    std::string k, v;
+    long dumped = 0;
+    while (RecordStream::read(&rio, k, v)) {
+      dumped++;
+    }
+    double dump_elapsed = now_sec() - start;
+
+    std::cout << "LOAD: " << keys << " keys in " << load_elapsed << " s ("
+              << long(keys / load_elapsed) << " keys/sec)\n"
+              << "DUMP: " << dumped << " keys in " << dump_elapsed << " s ("
+              << long(dumped / dump_elapsed) << " keys/sec)\n";
+
+    send_message(fd, "BYE\n");
+  } catch (std::exception &ex) {
+    std::cerr << "Error: " << ex.what() << "\n";
+    return 1;
+  }
+  close(fd);
+  return 0;
+}
+
+struct AcceptParams {
+  const char *hostname;
+  const char *port;
+  double end_time;
+  long connections;
+  long failures;
+};
+
+void *accept_worker(void *arg) {
+  AcceptParams *params = static_cast<AcceptParams *>(arg);
+  const char request[] = "LOGIN bench\nBYE\n";
+  while (now_sec() < params->end_time) {
+    int fd = open_clientfd(params->hostname, params->port);
+    if (fd < 0) {
+      params->failures++;
+      continue;
+    }
+    if (rio_writen(fd, request, sizeof(request) - 1) !=
+        static_cast<ssize_t>(sizeof(request) - 1)) {
+      params->failures++;
+      close(fd);
+      continue;
+    }
+    // Wait for both responses, then for the server to hang up
+    char buf[64];
+    while (read(fd, buf, sizeof(buf)) > 0) {
+    }
+    close(fd);
+    params->connections++;
+  }
+  return nullptr;
+}
+
+// Connection setup rate, as seen by clients which reconnect for every
+// operation
+int bench_accept(int argc, char **argv) {
+  if (argc < 2) {
+    std::cerr
+        << "Usage: ./kvbench accept <hostname> <port> [seconds] [clients]\n";
+    return 1;
+  }
+  double seconds = argc > 2 ? atof(argv[2]) : 5;
+  int clients = argc > 3 ? atoi(argv[3]) : 8;
+
+  double start = now_sec();
+  std::vector<AcceptParams> params(
+      clients, AcceptParams{argv[0], argv[1], start + seconds, 0, 0});
+  std::vector<pthread_t> threads(clients);
+  for (int i = 0; i < clients; i++) {
+    pthread_create(&threads[i], NULL, accept_worker, &params[i]);
+  }
+  long connections = 0, failures = 0;
+  for (int i = 0; i < clients; i++) {
+    pthread_join(threads[i], NULL);
+    connections += params[i].connections;
+    failures += params[i].failures;
+  }
+  double elapsed = now_sec() - start;
+
+  std::cout << connections << " connections in " << elapsed << " s ("
+            << long(connections / elapsed) << " connections/sec, " << clients
+            << " clients, " << failures << " failures)\n";
+  return 0;
+}
+
+// Reads one field of a running server's STATS
+std::string server_stat(const char *hostname, const char *port,
+                        const std::string &name) {
+  int fd = open_clientfd(hostname, port);
+  if (fd < 0) {
+    throw CommException("Could not connect to server");
+  }
+  rio_t rio;
+  rio_readinitb(&rio, fd);
+  expect_ok(fd, rio, "LOGIN bench\n", "Failed to login");
+  expect_ok(fd, rio, "STATS\n", "Failed to get statistics");
+  send_message(fd, "TOP\n");
+  std::string stats = ";" + read_response(fd, rio).substr(5) + ";";
+  send_message(fd, "BYE\n");
+  close(fd);
+  size_t start = stats.find(";" + name + "=");
+  if (start == std::string::npos) {
+    return "";
+  }
+  start += name.size() + 2;
+  return stats.substr(start, stats.find(';', start) - start);
+}
+
+struct IoParams {
+  const char *hostname;
+  const char *port;
+  double end_time;
+  int pipeline;
+  long requests;
+};
+
+void *io_worker(void *arg) {
+  IoParams *params = static_cast<IoParams *>(arg);
+  int fd = open_clientfd(params->hostname, params->port);
+  if (fd < 0) {
+    std::cerr << "Could not connect to server\n";
+    exit(1);
+  }
+  const char login[] = "LOGIN bench\n";
+  round_trip(fd, login, sizeof(login) - 1, 1);
+  // Stack operations only, so the clients don't contend for a table lock
+  std::string batch;
+  for (int i = 0; i < params->pipeline; i++) {
+    batch += "PUSH 7\nTOP\nPOP\n";
+  }
+  while (now_sec() < params->end_time) {
+    round_trip(fd, batch.data(), batch.size(), 3 * params->pipeline);
+    params->requests += 3 * params->pipeline;
+  }
+  const char bye[] = "BYE\n";
+  round_trip(fd, bye, sizeof(bye) - 1, 1);
+  close(fd);
+  return nullptr;
+}
+
+// Throughput of small requests on persistent connections. pipeline is the
+// number of PUSH/TOP/POP triples each client sends before waiting for the
+// responses.
+int bench_io(int argc, char **argv) {
+  if (argc < 2) {
+    std::cerr << "Usage: ./kvbench io <hostname> <port> [seconds] [clients] "
+                 "[pipeline]\n";
+    return 1;
+  }
+  double seconds = argc > 2 ? atof(argv[2]) : 5;
+  int clients = argc > 3 ? atoi(argv[3]) : 8;
+  int pipeline = argc > 4 ? atoi(argv[4]) : 1;
+
+  std::string backend;
+  long start_syscalls, end_syscalls;
+  long requests = 0;
+  double elapsed;
+  try {
+    backend = server_stat(argv[0], argv[1], "io_backend");
+    start_syscalls = atol(server_stat(argv[0], argv[1], "io_syscalls").c_str());
+
+    double start = now_sec();
+    std::vector<IoParams> params(
+        clients, IoParams{argv[0], argv[1], start + seconds, pipeline, 0});
+    std::vector<pthread_t> threads(clients);
+    for (int i = 0; i < clients; i++) {
+      pthread_create(&threads[i], NULL, io_worker, &params[i]);
+    }
+    for (int i = 0; i < clients; i++) {
+      pthread_join(threads[i], NULL);
+      requests += params[i].requests;
+    }
+    elapsed = now_sec() - start;
+
+    end_syscalls = atol(server_stat(argv[0], argv[1], "io_syscalls").c_str());
+  } catch (std::exception &ex) {
+    std::cerr << "Error: " << ex.what() << "\n";
+    return 1;
+  }
+
+  // (The syscall count includes the few requests made for the statistics)
+  std::cout << "backend:          " << backend << "\n"
+            << "requests:         " << requests << "\n"
+            << "requests/sec:     " << long(requests / elapsed) << "\n"
+            << "syscalls/request: "
+            << double(end_syscalls - start_syscalls) / requests << "\n";
+  return 0;
+}
+
+void usage() {
+  std::cerr << "Usage: ./kvbench <mode> [options]\n"
+               "Modes:\n"
+               "  alloc [requests]\n"
+               "  embedded [requests]\n"
+               "  hot [threads] [seconds]\n"
+               "  lockfree [max threads] [seconds] [writer]\n"
+               "  numa [threads] [seconds]\n"
+               "  mem [entries]\n"
+               "  load <hostname> <port> [keys]\n"
+               "  accept <hostname> <port> [seconds] [clients]\n"
+               "  io <hostname> <port> [seconds] [clients] [pipeline]\n";
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    usage();
+    return 1;
+  }
+
+  std::string mode = argv[1];
+  if (mode == "alloc") {
+    return bench_alloc(argc - 2, argv + 2);
+  } else if (mode == "embedded") {
+    return bench_embedded(argc - 2, argv + 2);
+  } else if (mode == "hot") {
+    return bench_hot(argc - 2, argv + 2);
+  } else if (mode == "lockfree") {
+    return bench_lockfree(argc - 2, argv + 2);
+  } else if (mode == "numa") {
+    return bench_numa(argc - 2, argv + 2);
+  } else if (mode == "mem") {
+    return bench_mem(argc - 2, argv + 2);
+  } else if (mode == "load") {
+    return bench_load(argc - 2, argv + 2);
+  } else if (mode == "accept") {
+    return bench_accept(argc - 2, argv + 2);
+  } else if (mode == "io") {
+    return bench_io(argc - 2, argv + 2);
+  }
+
+  usage();
+  return 1;
+}
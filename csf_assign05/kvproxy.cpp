@@ -0,0 +1,423 @@
+// Sharding proxy: accepts connections from unmodified clients and routes
+// their requests to a set of servers, sharding tables by (table, key)
+// with the same HashRing as the command line clients.
+//
+// Each client session has its own connections to the servers: one to
+// the first server, which holds the client's stack (so PUSH/POP/TOP and
+// the arithmetic commands behave exactly as on a server), and one per
+// shard for table operations, opened when first needed. GET moves the
+// value from the shard's stack to the client's stack, SET the other way.
+//
+// CREATE goes to every shard. BEGIN is passed on to each shard a
+// transaction touches, and COMMIT commits them one by one, so a
+// transaction spanning shards is isolated but not atomic across them.
+// When a shard rolls a transaction back (its trylock failed), the proxy
+// rolls back the others by closing their connections. If a shard's
+// commit fails after others have committed, the rest are rolled back and
+// the client gets FAILED "Partial commit ...", naming the shards which
+// committed.
+//
+// Usage: ./kvproxy <port> <host:port>[,<host:port>...]
+
+#include "client_util.h"
+#include "csapp.h"
+#include "exceptions.h"
+#include "hash_ring.h"
+#include "message.h"
+#include "message_serialization.h"
+#include <csignal>
+#include <iostream>
+#include <memory>
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+namespace {
+
+// A server rolls a transaction back when a table lock can't be acquired,
+// and says so in its FAILED response
+const char ROLLED_BACK[] = "transaction rolled back";
+
+// A connection to one server on behalf of one client
+class Backend {
+private:
+  std::string m_server;
+  int m_fd;
+  rio_t m_rio;
+  bool m_in_transaction; // BEGIN has been sent
+
+  // copy constructor and assignment operator are prohibited
+  Backend(const Backend &);
+  Backend &operator=(const Backend &);
+
+public:
+  Backend(const std::string &server)
+      : m_server(server), m_fd(-1), m_in_transaction(false) {}
+  ~Backend() { disconnect(); }
+
+  const std::string &get_server() const { return m_server; }
+  bool is_connected() const { return m_fd >= 0; }
+  bool in_transaction() const { return m_in_transaction; }
+  void set_in_transaction(bool in_transaction) {
+    m_in_transaction = in_transaction;
+  }
+
+  void connect(const std::string &username) {
+    m_fd = connect_to_server(m_server);
+    rio_readinitb(&m_rio, m_fd);
+    expect_ok(m_fd, m_rio, "LOGIN " + username + "\n",
+              "Failed to login to " + m_server);
+  }
+
+  void begin() {
+    expect_ok(m_fd, m_rio, "BEGIN\n",
+              "Failed to begin transaction on " + m_server);
+    m_in_transaction = true;
+  }
+
+  // Closing the connection makes the server roll back an open transaction
+  void disconnect() {
+    if (m_fd >= 0) {
+      close(m_fd);
+      m_fd = -1;
+    }
+    m_in_transaction = false;
+  }
+
+  // Sends a request line and returns the response (without newline)
+  std::string request(const std::string &line) {
+    send_message(m_fd, line);
+    return read_response(m_fd, m_rio);
+  }
+};
+
+class ProxySession {
+private:
+  int m_client_fd;
+  rio_t m_fdbuf;
+  const HashRing &m_ring;
+  std::vector<std::unique_ptr<Backend>> m_shards;
+  std::unique_ptr<Backend> m_stack; // holds the client's stack
+  std::string m_username;
+  bool m_in_transaction;
+  std::string m_outbuf;
+
+  // copy constructor and assignment operator are prohibited
+  ProxySession(const ProxySession &);
+  ProxySession &operator=(const ProxySession &);
+
+  Backend &get_shard(size_t index, bool join_transaction);
+  void abort_transaction();
+  void check_rollback(Backend &shard, const std::string &response);
+
+  bool handle_request(const Message &message, const std::string &line);
+  void handle_create(const std::string &line);
+  void handle_get(const Message &message, const std::string &line);
+  void handle_set(const Message &message, const std::string &line);
+  void handle_commit();
+  void send_response(MessageType type, std::string_view additional_info = "");
+  void relay(const std::string &response);
+
+public:
+  ProxySession(int client_fd, const HashRing &ring);
+  ~ProxySession();
+
+  void chat_with_client();
+};
+
+ProxySession::ProxySession(int client_fd, const HashRing &ring)
+    : m_client_fd(client_fd), m_ring(ring), m_in_transaction(false) {
+  rio_readinitb(&m_fdbuf, m_client_fd);
+  for (size_t i = 0; i < ring.num_nodes(); i++) {
+    m_shards.emplace_back(new Backend(ring.get_node(i)));
+  }
+}
+
+ProxySession::~ProxySession() { close(m_client_fd); }
+
+void ProxySession::chat_with_client() {
+  while (1) {
+    const char *buf;
+    ssize_t len = rio_readlinev(&m_fdbuf, &buf, MAXLINE);
+    if (len <= 0) {
+      return; // client hung up
+    }
+    std::string line(buf, len); // forwarded to the servers as it is
+    Message message;
+    try {
+      MessageSerialization::decode(line, message);
+    } catch (InvalidMessage &err) {
+      send_response(MessageType::ERROR, err.what());
+      return;
+    }
+    try {
+      if (!handle_request(message, line)) {
+        return;
+      }
+    } catch (OperationException &ex) {
+      // A server refused the login
+      send_response(MessageType::ERROR, ex.what());
+      return;
+    }
+  }
+}
+
+// Handles one request; returns false once the conversation is over
+bool ProxySession::handle_request(const Message &message,
+                                  const std::string &line) {
+  MessageType type = message.get_message_type();
+  if (!m_stack && type != MessageType::LOGIN) {
+    send_response(MessageType::ERROR, "Must login first");
+    return false;
+  }
+
+  switch (type) {
+  case MessageType::LOGIN:
+    if (m_stack) {
+      send_response(MessageType::ERROR, "Already logged in");
+      break;
+    }
+    m_username = std::string(message.get_username());
+    m_stack.reset(new Backend(m_ring.get_node(0)));
+    m_stack->connect(m_username);
+    send_response(MessageType::OK);
+    break;
+  case MessageType::PUSH:
+  case MessageType::POP:
+  case MessageType::TOP:
+  case MessageType::ADD:
+  case MessageType::SUB:
+  case MessageType::MUL:
+  case MessageType::DIV:
+    relay(m_stack->request(line));
+    break;
+  case MessageType::CREATE:
+    handle_create(line);
+    break;
+  case MessageType::GET:
+    handle_get(message, line);
+    break;
+  case MessageType::SET:
+    handle_set(message, line);
+    break;
+  case MessageType::BEGIN:
+    if (m_in_transaction) {
+      send_response(MessageType::FAILED, "Transaction already started");
+    } else {
+      // Shards join when the transaction first touches them
+      m_in_transaction = true;
+      send_response(MessageType::OK);
+    }
+    break;
+  case MessageType::COMMIT:
+    handle_commit();
+    break;
+  case MessageType::BYE:
+    send_response(MessageType::OK);
+    return false;
+  default:
+    // STATS, SLOWLOG, LOAD, DUMP, REPLICATE, the subscription commands
+    // and secondary indexes concern a single server; the clients talk to
+    // the shards directly for those
+    send_response(MessageType::ERROR, "Unsupported operation");
+    break;
+  }
+  return true;
+}
+
+// Returns the connection to a shard, connecting to it (and starting the
+// current transaction on it) if necessary
+Backend &ProxySession::get_shard(size_t index, bool join_transaction) {
+  Backend &shard = *m_shards[index];
+  if (!shard.is_connected()) {
+    shard.connect(m_username);
+  }
+  if (join_transaction && m_in_transaction && !shard.in_transaction()) {
+    shard.begin();
+  }
+  return shard;
+}
+
+void ProxySession::abort_transaction() {
+  for (std::unique_ptr<Backend> &shard : m_shards) {
+    if (shard->in_transaction()) {
+      shard->disconnect();
+    }
+  }
+  m_in_transaction = false;
+}
+
+// After a failed request in a transaction: if the shard rolled its part
+// of the transaction back, roll back the other shards too
+void ProxySession::check_rollback(Backend &shard, const std::string &response) {
+  if (m_in_transaction && response.find(ROLLED_BACK) != std::string::npos) {
+    shard.set_in_transaction(false);
+    abort_transaction();
+  }
+}
+
+void ProxySession::handle_create(const std::string &line) {
+  std::string result = "OK";
+  for (size_t i = 0; i < m_shards.size(); i++) {
+    std::string response = get_shard(i, false).request(line);
+    if (response != "OK" && result == "OK") {
+      result = response;
+    }
+  }
+  relay(result);
+}
+
+void ProxySession::handle_get(const Message &message, const std::string &line) {
+  Backend &shard =
+      get_shard(m_ring.node_for(message.get_table(), message.get_key()), true);
+  std::string response = shard.request(line);
+  if (response != "OK") {
+    check_rollback(shard, response);
+    relay(response);
+    return;
+  }
+  // Move the value from the shard's stack to the client's
+  std::string data = shard.request("TOP\n");
+  shard.request("POP\n");
+  if (data.compare(0, 5, "DATA ") != 0) {
+    send_response(MessageType::FAILED, "Failed to retrieve value");
+    return;
+  }
+  relay(m_stack->request("PUSH " + data.substr(5) + "\n"));
+}
+
+void ProxySession::handle_set(const Message &message, const std::string &line) {
+  std::string data = m_stack->request("TOP\n");
+  if (data.compare(0, 5, "DATA ") != 0) {
+    send_response(MessageType::FAILED, "Stack is empty, cannot set value");
+    return;
+  }
+  Backend &shard =
+      get_shard(m_ring.node_for(message.get_table(), message.get_key()), true);
+  std::string response = shard.request("PUSH " + data.substr(5) + "\n");
+  if (response != "OK") {
+    relay(response);
+    return;
+  }
+  response = shard.request(line);
+  if (response.compare(0, 5, "ERROR") == 0) {
+    // The shard didn't use the value (no such table), and neither does
+    // a server
+    shard.request("POP\n");
+  } else {
+    m_stack->request("POP\n");
+    if (response != "OK") {
+      check_rollback(shard, response);
+    }
+  }
+  relay(response);
+}
+
+void ProxySession::handle_commit() {
+  if (!m_in_transaction) {
+    send_response(MessageType::FAILED, "No transaction is active");
+    return;
+  }
+  std::string committed;
+  for (std::unique_ptr<Backend> &shard : m_shards) {
+    if (!shard->in_transaction()) {
+      continue;
+    }
+    std::string response = shard->request("COMMIT\n");
+    shard->set_in_transaction(false);
+    if (response == "OK") {
+      committed += (committed.empty() ? "" : ",") + shard->get_server();
+      continue;
+    }
+    // The shards not committed yet are rolled back
+    abort_transaction();
+    if (committed.empty()) {
+      relay(response);
+      return;
+    }
+    // The shard's reason, without the response type and quotes
+    size_t start = response.find('"'), end = response.rfind('"');
+    std::string reason = start < end
+                             ? response.substr(start + 1, end - start - 1)
+                             : response;
+    send_response(MessageType::FAILED, "Partial commit, committed on " +
+                                           committed + ", failed on " +
+                                           shard->get_server() + ": " +
+                                           reason);
+    return;
+  }
+  m_in_transaction = false;
+  send_response(MessageType::OK);
+}
+
+void ProxySession::send_response(MessageType type,
+                                 std::string_view additional_info) {
+  Message response(type);
+  if (!additional_info.empty()) {
+    response.push_arg(additional_info);
+  }
+  MessageSerialization::encode(response, m_outbuf);
+  send_message(m_client_fd, m_outbuf);
+}
+
+// Passes a server's response on to the client
+void ProxySession::relay(const std::string &response) {
+  send_message(m_client_fd, response + "\n");
+}
+
+void *session_worker(void *arg) {
+  pthread_detach(pthread_self());
+  std::unique_ptr<ProxySession> session(static_cast<ProxySession *>(arg));
+  try {
+    session->chat_with_client();
+  } catch (CommException &ex) {
+    // The client or a server went away; closing the session's
+    // connections rolls back any open transaction
+  }
+  return nullptr;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    std::cerr << "Usage: ./kvproxy <port> <host:port>[,<host:port>...]\n";
+    return 1;
+  }
+
+  HashRing ring;
+  try {
+    for (const std::string &server : parse_server_list(argv[2], "")) {
+      if (server.back() == ':') {
+        throw InvalidMessage("Missing port for server " + server);
+      }
+      ring.add_node(server);
+    }
+  } catch (InvalidMessage &ex) {
+    std::cerr << "Error: " << ex.what() << "\n";
+    return 1;
+  }
+
+  // A client disconnecting mid-response must not kill the proxy
+  signal(SIGPIPE, SIG_IGN);
+
+  int listen_fd = open_listenfd(argv[1]);
+  if (listen_fd < 0) {
+    std::cerr << "Error: Could not listen on port " << argv[1] << "\n";
+    return 1;
+  }
+
+  while (1) {
+    int client_fd = accept(listen_fd, NULL, NULL);
+    if (client_fd < 0) {
+      continue;
+    }
+    ProxySession *session = new ProxySession(client_fd, ring);
+    pthread_t thr_id;
+    if (pthread_create(&thr_id, NULL, session_worker, session) != 0) {
+      std::cerr << "Error: Could not create session thread\n";
+      delete session;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,611 @@
+// Stress test for concurrent clients and transactions.
+//
+// Usage: ./kvstress [-c clients] [-n operations per client] [-k keys]
+//                   [-b accounts] [-s seed] [-S host:port]
+//
+// Runs many clients at once against a Server (in-process over socketpairs,
+// or a running server with -S), each issuing a random mix of:
+//
+//   - autocommit GETs and SETs of the register table's keys
+//   - transactions reading and writing several register keys
+//   - transactions transferring 1 between two bank accounts
+//   - transactions auditing every bank account
+//   - transactions incrementing a counter
+//
+// with the table locks contended as much as possible. Every register
+// write stores a value unique to it, and each operation is recorded with
+// the times it was sent and answered. The history is then checked:
+//
+//   - every register read returns a value some write stored, never one
+//     from a rolled back transaction or from a write that started after
+//     the read finished, and never one that a later write had overwritten
+//     before the read started (so autocommit operations are linearizable,
+//     and transactions, taking effect between BEGIN and COMMIT, are too)
+//   - every completed audit sees the accounts' original total, and so
+//     does a final one (so transactions are atomic and isolated)
+//   - the counter ends up incremented by exactly the number of committed
+//     increments (so no update is lost)
+//   - no request gets an ERROR, and no connection fails
+//
+// Exits with status 1 if any check fails. Build with make tsan to run it
+// under ThreadSanitizer.
+
+#include "client_connection.h"
+#include "client_util.h"
+#include "csapp.h"
+#include "exceptions.h"
+#include "server.h"
+#include <algorithm>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <pthread.h>
+#include <random>
+#include <string>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+const char *REGISTER_TABLE = "stress_reg";
+const char *BANK_TABLE = "stress_bank";
+const char *COUNTER_TABLE = "stress_ctr";
+const int INITIAL_BALANCE = 100;
+const size_t MAX_VIOLATIONS_SHOWN = 10;
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000UL + uint64_t(ts.tv_nsec);
+}
+
+struct Options {
+  int clients = 8;
+  long operations = 2000;
+  int keys = 4;
+  int accounts = 4;
+  unsigned seed = 1;
+  std::string server; // empty to run a Server in-process
+};
+
+// A register read or write. Transactional operations take effect at
+// some point between being sent and their transaction ending.
+struct RegisterOp {
+  bool write;
+  int key;
+  std::string value;
+  uint64_t invoke, complete;
+  int txn; // index into the client's transactions, or -1 for autocommit
+};
+
+struct TxnRecord {
+  uint64_t end; // when COMMIT was answered, or the rollback reported
+  bool committed;
+};
+
+// What one client did
+struct History {
+  std::vector<RegisterOp> ops;
+  std::vector<TxnRecord> txns;
+  long increments = 0;   // committed counter increments
+  long audits = 0;       // completed audits
+  long aborted = 0;      // transactions rolled back
+  std::vector<std::string> violations;
+};
+
+void *connection_worker(void *arg) {
+  ClientConnection *conn = static_cast<ClientConnection *>(arg);
+  try {
+    conn->chat_with_client();
+  } catch (std::exception &ex) {
+    std::cerr << "Connection failed: " << ex.what() << "\n";
+  }
+  return nullptr;
+}
+
+// A connection to the server under test
+class Connection {
+private:
+  int m_fd;
+  rio_t m_rio;
+  ClientConnection *m_conn; // the server's end, when in-process
+  pthread_t m_thread;
+
+public:
+  Connection(Server *server, const std::string &address) : m_conn(nullptr) {
+    if (server) {
+      int fds[2];
+      if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        throw CommException("socketpair failed");
+      }
+      m_fd = fds[0];
+      m_conn = new ClientConnection(server, fds[1]);
+      pthread_create(&m_thread, NULL, connection_worker, m_conn);
+    } else {
+      m_fd = connect_to_server(address);
+    }
+    rio_readinitb(&m_rio, m_fd);
+  }
+
+  ~Connection() {
+    shutdown(m_fd, SHUT_WR);
+    if (m_conn) {
+      pthread_join(m_thread, NULL);
+      delete m_conn;
+    }
+    close(m_fd);
+  }
+
+  std::string request(const std::string &line) {
+    send_message(m_fd, line + "\n");
+    return read_response(m_fd, m_rio);
+  }
+
+  // Sends a request which must succeed, returning its response
+  std::string expect(const std::string &line, const char *expected = "OK") {
+    std::string response = request(line);
+    if (response.compare(0, strlen(expected), expected) != 0) {
+      throw OperationException(line + ": " + response);
+    }
+    return response;
+  }
+
+  // Fetches the top of the stack and pops it
+  std::string take_top() {
+    std::string value = expect("TOP", "DATA ").substr(5);
+    expect("POP");
+    return value;
+  }
+
+  // Empties the stack after a transaction was rolled back midway
+  void clear_stack() {
+    while (request("POP") == "OK") {
+    }
+  }
+};
+
+struct ClientParams {
+  Server *server;
+  const Options *options;
+  int id;
+  History history;
+};
+
+bool is_failed(const std::string &response) {
+  return response.compare(0, 6, "FAILED") == 0;
+}
+
+class Client {
+private:
+  ClientParams &m_params;
+  const Options &m_opts;
+  History &m_history;
+  Connection m_conn;
+  std::mt19937 m_rng;
+  long m_next_value;
+  int m_txn; // current transaction, or -1
+
+  int random(int n) {
+    return std::uniform_int_distribution<int>(0, n - 1)(m_rng);
+  }
+
+  std::string key_name(const char *prefix, int i) {
+    return prefix + std::to_string(i);
+  }
+
+  // Sends a transactional request; returns false (having recorded the
+  // rollback) if the transaction was rolled back
+  bool txn_request(const std::string &line) {
+    std::string response = m_conn.request(line);
+    if (is_failed(response)) {
+      end_txn(false);
+      m_conn.clear_stack();
+      return false;
+    }
+    if (response != "OK") {
+      throw OperationException(line + ": " + response);
+    }
+    return true;
+  }
+
+  void begin_txn() {
+    m_conn.expect("BEGIN");
+    m_txn = m_history.txns.size();
+    m_history.txns.push_back(TxnRecord{0, false});
+  }
+
+  void end_txn(bool committed) {
+    m_history.txns[m_txn].end = now_ns();
+    m_history.txns[m_txn].committed = committed;
+    if (!committed) {
+      m_history.aborted++;
+    }
+    m_txn = -1;
+  }
+
+  void commit() {
+    std::string response = m_conn.request("COMMIT");
+    if (response != "OK") {
+      throw OperationException("COMMIT: " + response);
+    }
+    end_txn(true);
+  }
+
+  // Register operations, autocommit or in the current transaction
+  bool read_register(int key) {
+    RegisterOp op{false, key, "", now_ns(), 0, m_txn};
+    std::string response = m_conn.request(
+        "GET " + std::string(REGISTER_TABLE) + " " + key_name("r", key));
+    if (is_failed(response) && m_txn >= 0) {
+      end_txn(false);
+      m_conn.clear_stack();
+      return false;
+    } else if (response != "OK") {
+      throw OperationException("GET: " + response);
+    }
+    op.value = m_conn.take_top();
+    op.complete = now_ns();
+    m_history.ops.push_back(op);
+    return true;
+  }
+
+  bool write_register(int key) {
+    std::string value = "c" + std::to_string(m_params.id) + "v" +
+                        std::to_string(m_next_value++);
+    RegisterOp op{true, key, value, now_ns(), 0, m_txn};
+    m_conn.expect("PUSH " + value);
+    std::string response = m_conn.request(
+        "SET " + std::string(REGISTER_TABLE) + " " + key_name("r", key));
+    op.complete = now_ns();
+    if (is_failed(response) && m_txn >= 0) {
+      // The write is recorded, so reading it would be caught
+      m_history.ops.push_back(op);
+      end_txn(false);
+      m_conn.clear_stack();
+      return false;
+    } else if (response != "OK") {
+      throw OperationException("SET: " + response);
+    }
+    m_history.ops.push_back(op);
+    return true;
+  }
+
+  void register_txn() {
+    begin_txn();
+    int n = 1 + random(3);
+    for (int i = 0; i < n; i++) {
+      bool ok = random(2) ? read_register(random(m_opts.keys))
+                          : write_register(random(m_opts.keys));
+      if (!ok) {
+        return;
+      }
+    }
+    commit();
+  }
+
+  void transfer() {
+    int from = random(m_opts.accounts), to = random(m_opts.accounts);
+    std::string bank = std::string(BANK_TABLE) + " ";
+    begin_txn();
+    if (!txn_request("GET " + bank + key_name("a", from))) {
+      return;
+    }
+    std::string balance = m_conn.expect("TOP", "DATA ").substr(5);
+    if (balance == "0") {
+      m_conn.expect("POP");
+      commit();
+      return;
+    }
+    if (!txn_request("PUSH 1") || !txn_request("SUB") ||
+        !txn_request("SET " + bank + key_name("a", from)) ||
+        !txn_request("GET " + bank + key_name("a", to)) ||
+        !txn_request("PUSH 1") || !txn_request("ADD") ||
+        !txn_request("SET " + bank + key_name("a", to))) {
+      return;
+    }
+    commit();
+  }
+
+  void audit() {
+    begin_txn();
+    long total = 0;
+    for (int i = 0; i < m_opts.accounts; i++) {
+      if (!txn_request("GET " + std::string(BANK_TABLE) + " " +
+                       key_name("a", i))) {
+        return;
+      }
+      total += atol(m_conn.take_top().c_str());
+    }
+    commit();
+    m_history.audits++;
+    if (total != long(m_opts.accounts) * INITIAL_BALANCE) {
+      m_history.violations.push_back("audit saw a total of " +
+                                     std::to_string(total));
+    }
+  }
+
+  void increment() {
+    std::string counter = std::string(COUNTER_TABLE) + " n";
+    begin_txn();
+    if (!txn_request("GET " + counter) || !txn_request("PUSH 1") ||
+        !txn_request("ADD") || !txn_request("SET " + counter)) {
+      return;
+    }
+    commit();
+    m_history.increments++;
+  }
+
+public:
+  Client(ClientParams &params)
+      : m_params(params), m_opts(*params.options), m_history(params.history),
+        m_conn(params.server, m_opts.server),
+        m_rng(m_opts.seed * 1000003 + params.id), m_next_value(0), m_txn(-1) {
+    m_conn.expect("LOGIN stress" + std::to_string(params.id));
+  }
+
+  void run() {
+    for (long i = 0; i < m_opts.operations; i++) {
+      int dice = random(100);
+      if (dice < 35) {
+        read_register(random(m_opts.keys));
+      } else if (dice < 65) {
+        write_register(random(m_opts.keys));
+      } else if (dice < 80) {
+        register_txn();
+      } else if (dice < 90) {
+        transfer();
+      } else if (dice < 95) {
+        audit();
+      } else {
+        increment();
+      }
+    }
+    m_conn.expect("BYE");
+  }
+};
+
+void *client_worker(void *arg) {
+  ClientParams *params = static_cast<ClientParams *>(arg);
+  try {
+    Client client(*params);
+    client.run();
+  } catch (std::exception &ex) {
+    params->history.violations.push_back(std::string("client failed: ") +
+                                         ex.what());
+  }
+  return nullptr;
+}
+
+// Effective interval of a register operation
+void op_interval(const History &h, const RegisterOp &op, uint64_t &invoke,
+                 uint64_t &complete) {
+  invoke = op.invoke;
+  complete = op.txn >= 0 ? h.txns[op.txn].end : op.complete;
+}
+
+// Checks every register read against the writes to its key
+void check_registers(const Options &opts, std::vector<ClientParams> &clients,
+                     std::vector<std::string> &violations) {
+  struct Write {
+    uint64_t invoke, complete;
+    bool committed;
+    int client, txn;
+  };
+  for (int key = 0; key < opts.keys; key++) {
+    // The initial value was written before any client started
+    std::map<std::string, Write> writes;
+    writes["init"] = Write{0, 0, true, -1, -1};
+    for (const ClientParams &c : clients) {
+      const History &h = c.history;
+      for (const RegisterOp &op : h.ops) {
+        if (op.write && op.key == key) {
+          Write w{0, 0, op.txn < 0 || h.txns[op.txn].committed, c.id, op.txn};
+          op_interval(h, op, w.invoke, w.complete);
+          writes[op.value] = w;
+        }
+      }
+    }
+
+    // Committed writes by completion time, with the latest invocation of
+    // any of them up to each one
+    std::vector<std::pair<uint64_t, uint64_t>> done; // (complete, max invoke)
+    for (const auto &entry : writes) {
+      if (entry.second.committed) {
+        done.emplace_back(entry.second.complete, entry.second.invoke);
+      }
+    }
+    std::sort(done.begin(), done.end());
+    for (size_t i = 1; i < done.size(); i++) {
+      done[i].second = std::max(done[i].second, done[i - 1].second);
+    }
+
+    for (const ClientParams &c : clients) {
+      const History &h = c.history;
+      for (const RegisterOp &op : h.ops) {
+        if (op.write || op.key != key) {
+          continue;
+        }
+        std::string what = "client " + std::to_string(c.id) + " read " +
+                           op.value + " from r" + std::to_string(key);
+        auto it = writes.find(op.value);
+        if (it == writes.end()) {
+          violations.push_back(what + ", which was never written");
+          continue;
+        }
+        const Write &w = it->second;
+        bool own_txn = w.client == c.id && w.txn == op.txn && op.txn >= 0;
+        if (!w.committed && !own_txn) {
+          violations.push_back(what + ", written by a rolled back transaction");
+        }
+        uint64_t invoke, complete;
+        op_interval(h, op, invoke, complete);
+        if (w.invoke > complete) {
+          violations.push_back(what + " before it was written");
+        }
+        // A write which started after w finished and finished before
+        // the read started must have overwritten w
+        auto before = std::lower_bound(
+            done.begin(), done.end(), std::make_pair(invoke, uint64_t(0)));
+        if (before != done.begin() && (before - 1)->second > w.complete) {
+          violations.push_back(what + ", which had been overwritten");
+        }
+      }
+    }
+  }
+}
+
+int run(const Options &opts) {
+  std::unique_ptr<Server> server;
+  if (opts.server.empty()) {
+    server.reset(new Server());
+    server->configure_logging(LogLevel::WARN, false);
+  }
+
+  // Set up the tables
+  long total_increments = 0;
+  std::string counter_start;
+  {
+    Connection conn(server.get(), opts.server);
+    conn.expect("LOGIN stress");
+    for (const char *table : {REGISTER_TABLE, BANK_TABLE, COUNTER_TABLE}) {
+      conn.request(std::string("CREATE ") + table); // may exist already
+    }
+    for (int i = 0; i < opts.keys; i++) {
+      conn.expect("PUSH init");
+      conn.expect("SET " + std::string(REGISTER_TABLE) + " r" +
+                  std::to_string(i));
+    }
+    for (int i = 0; i < opts.accounts; i++) {
+      conn.expect("PUSH " + std::to_string(INITIAL_BALANCE));
+      conn.expect("SET " + std::string(BANK_TABLE) + " a" + std::to_string(i));
+    }
+    conn.expect("PUSH 0");
+    conn.expect("SET " + std::string(COUNTER_TABLE) + " n");
+    conn.expect("BYE");
+  }
+
+  uint64_t start = now_ns();
+  std::vector<ClientParams> clients(opts.clients);
+  std::vector<pthread_t> threads(opts.clients);
+  for (int i = 0; i < opts.clients; i++) {
+    clients[i].server = server.get();
+    clients[i].options = &opts;
+    clients[i].id = i;
+    pthread_create(&threads[i], NULL, client_worker, &clients[i]);
+  }
+  for (int i = 0; i < opts.clients; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  double elapsed = (now_ns() - start) / 1e9;
+
+  std::vector<std::string> violations;
+  long ops = 0, txns = 0, aborted = 0, audits = 0;
+  for (ClientParams &c : clients) {
+    violations.insert(violations.end(), c.history.violations.begin(),
+                      c.history.violations.end());
+    ops += c.history.ops.size();
+    txns += c.history.txns.size();
+    aborted += c.history.aborted;
+    audits += c.history.audits;
+    total_increments += c.history.increments;
+  }
+  check_registers(opts, clients, violations);
+
+  // The final state
+  try {
+    Connection conn(server.get(), opts.server);
+    conn.expect("LOGIN stress");
+    long total = 0;
+    for (int i = 0; i < opts.accounts; i++) {
+      conn.expect("GET " + std::string(BANK_TABLE) + " a" + std::to_string(i));
+      total += atol(conn.take_top().c_str());
+    }
+    if (total != long(opts.accounts) * INITIAL_BALANCE) {
+      violations.push_back("the accounts ended with a total of " +
+                           std::to_string(total));
+    }
+    conn.expect("GET " + std::string(COUNTER_TABLE) + " n");
+    long counter = atol(conn.take_top().c_str());
+    if (counter != total_increments) {
+      violations.push_back("the counter is " + std::to_string(counter) +
+                           " after " + std::to_string(total_increments) +
+                           " committed increments");
+    }
+    conn.expect("BYE");
+  } catch (std::exception &ex) {
+    violations.push_back(std::string("final check failed: ") + ex.what());
+  }
+
+  std::cout << "clients:              " << opts.clients << "\n"
+            << "register operations:  " << ops << "\n"
+            << "transactions:         " << txns << " (" << aborted
+            << " rolled back)\n"
+            << "audits:               " << audits << "\n"
+            << "counter increments:   " << total_increments << "\n"
+            << "seconds:              " << elapsed << "\n";
+  if (violations.empty()) {
+    std::cout << "history OK\n";
+    return 0;
+  }
+  std::cout << violations.size() << " violations:\n";
+  for (size_t i = 0; i < violations.size() && i < MAX_VIOLATIONS_SHOWN; i++) {
+    std::cout << "  " << violations[i] << "\n";
+  }
+  return 1;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  const char *usage = "Usage: ./kvstress [-c clients] [-n operations per "
+                      "client] [-k keys]\n"
+                      "                  [-b accounts] [-s seed] [-S "
+                      "host:port]\n";
+  Options opts;
+  int opt;
+  while ((opt = getopt(argc, argv, "c:n:k:b:s:S:")) != -1) {
+    switch (opt) {
+    case 'c':
+      opts.clients = atoi(optarg);
+      break;
+    case 'n':
+      opts.operations = atol(optarg);
+      break;
+    case 'k':
+      opts.keys = atoi(optarg);
+      break;
+    case 'b':
+      opts.accounts = atoi(optarg);
+      break;
+    case 's':
+      opts.seed = strtoul(optarg, NULL, 10);
+      break;
+    case 'S':
+      opts.server = optarg; // a running server instead of an in-process one
+      break;
+    default:
+      std::cerr << usage;
+      return 1;
+    }
+  }
+  if (optind != argc || opts.clients < 1 || opts.operations < 0 ||
+      opts.keys < 1 || opts.accounts < 1) {
+    std::cerr << usage;
+    return 1;
+  }
+
+  // A client disconnecting mid-response must not kill the process
+  signal(SIGPIPE, SIG_IGN);
+  try {
+    return run(opts);
+  } catch (std::exception &ex) {
+    std::cerr << "Error: " << ex.what() << "\n";
+    return 1;
+  }
+}
@@ -0,0 +1,78 @@
+#include "client_util.h"
+#include "exceptions.h"
+#include "record_stream.h"
+#include <iostream>
+#include <vector>
+
+// Reads "key value" lines from standard input and bulk-loads them into a
+// table (which is created if it doesn't exist), on one server or
+// sharded across several
+int main(int argc, char **argv) {
+  if (argc != 5) {
+    std::cerr << "Usage: ./load_table <hostname> <port> <username> <table> "
+                 "< pairs.txt\n";
+    return 1;
+  }
+
+  std::string hostname = argv[1], port = argv[2], username = argv[3],
+              table = argv[4];
+
+  try {
+    // With several (sharded) servers, each pair goes to the server
+    // responsible for its key, and every server gets a LOAD
+    std::vector<std::string> servers = parse_server_list(hostname, port);
+    HashRing ring = make_ring(servers);
+    struct Shard {
+      int fd;
+      rio_t rio;
+      std::string buf;
+    };
+    // Sized once: rio_t must not move after rio_readinitb()
+    std::vector<Shard> shards(servers.size());
+    for (size_t i = 0; i < servers.size(); i++) {
+      shards[i].fd = connect_to_server(servers[i]);
+      rio_readinitb(&shards[i].rio, shards[i].fd);
+      expect_ok(shards[i].fd, shards[i].rio, "LOGIN " + username + "\n",
+                "Failed to login");
+      expect_ok(shards[i].fd, shards[i].rio, "LOAD " + table + "\n",
+                "Failed to start load");
+    }
+
+    const size_t CHUNK_SIZE = 64 * 1024;
+    std::string key, value;
+    long count = 0;
+    while (std::cin >> key >> value) {
+      Shard &shard = shards[shards.size() == 1 ? 0 : ring.node_for(table, key)];
+      RecordStream::append(shard.buf, key, value);
+      count++;
+      if (shard.buf.size() >= CHUNK_SIZE) {
+        send_message(shard.fd, shard.buf);
+        shard.buf.clear();
+      }
+    }
+    for (Shard &shard : shards) {
+      RecordStream::append_end(shard.buf);
+      send_message(shard.fd, shard.buf);
+    }
+
+    // Each server confirms once everything has been committed
+    for (Shard &shard : shards) {
+      std::string response = read_response(shard.fd, shard.rio);
+      if (response != "OK") {
+        std::string error_message = extractValueBetweenQuotes(response);
+        throw OperationException(error_message.empty() ? "Failed to load"
+                                                       : error_message);
+      }
+    }
+    std::cout << "Loaded " << count << " pairs.\n";
+
+    for (Shard &shard : shards) {
+      send_message(shard.fd, "BYE\n");
+      close(shard.fd);
+    }
+    return 0;
+  } catch (const std::exception &e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 2;
+  }
+}
@@ -0,0 +1,571 @@
+#include "log_engine.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+const unsigned char RECORD_MAGIC = 0xb7;
+const unsigned char BATCH_MAGIC = 0xb8;  // part of a batch, see adopt()
+const unsigned char COMMIT_MAGIC = 0xb9; // commits a batch
+const size_t CHECKSUM_OFFSET = 1;
+const size_t LENGTHS_OFFSET = 5;
+const size_t MAX_HEADER = LENGTHS_OFFSET + 2 * 10;
+
+// FNV-1a; only has to catch torn writes
+uint32_t checksum(const char *p, size_t n) {
+  uint32_t h = 2166136261U;
+  for (size_t i = 0; i < n; i++) {
+    h = (h ^ (unsigned char)p[i]) * 16777619U;
+  }
+  return h;
+}
+
+size_t put_varint(char *p, uint64_t v) {
+  size_t n = 0;
+  while (v >= 0x80) {
+    p[n++] = char(v | 0x80);
+    v >>= 7;
+  }
+  p[n++] = char(v);
+  return n;
+}
+
+// Returns the number of bytes read, or 0 if the varint runs past end
+size_t get_varint(const char *p, const char *end, uint64_t &v) {
+  v = 0;
+  for (size_t n = 0; n < 10 && p + n < end; n++) {
+    unsigned char b = p[n];
+    v |= uint64_t(b & 0x7f) << (7 * n);
+    if (!(b & 0x80)) {
+      return n + 1;
+    }
+  }
+  return 0;
+}
+
+// Splits a record into its key and value, without checking its
+// checksum. Returns its total length, or 0 if it runs past end.
+size_t decode_record(const char *p, const char *end, std::string_view &key,
+                     std::string_view &value) {
+  const char *q = p + LENGTHS_OFFSET;
+  uint64_t key_len, value_len;
+  size_t n = get_varint(q, end, key_len);
+  if (n == 0) {
+    return 0;
+  }
+  size_t m = get_varint(q + n, end, value_len);
+  if (m == 0) {
+    return 0;
+  }
+  const char *data = q + n + m;
+  if (key_len > size_t(end - data) ||
+      value_len > size_t(end - data) - key_len) {
+    return 0;
+  }
+  key = std::string_view(data, key_len);
+  value = std::string_view(data + key_len, value_len);
+  return (data - p) + key_len + value_len;
+}
+
+// Unmaps a segment when the last reference goes
+std::shared_ptr<char> share_mapping(char *base, size_t mapped) {
+  return std::shared_ptr<char>(base,
+                               [mapped](char *p) { munmap(p, mapped); });
+}
+
+// The live records of a LogEngine, as (segment, offset) pairs, and
+// their segments' mappings
+class LogSnapshot : public StorageEngine::Snapshot {
+public:
+  struct Mapping {
+    std::shared_ptr<char> base;
+    size_t end; // of the records when the snapshot was taken
+  };
+  std::map<uint32_t, Mapping> segments;
+  std::vector<std::pair<uint32_t, uint32_t>> records;
+
+  void for_each(const StorageEngine::EntryFn &fn) override {
+    // In log order, so the segments are read sequentially
+    std::sort(records.begin(), records.end());
+    auto seg = segments.end();
+    for (const auto &record : records) {
+      if (seg == segments.end() || seg->first != record.first) {
+        seg = segments.find(record.first);
+      }
+      const char *base = seg->second.base.get();
+      std::string_view key, value;
+      decode_record(base + record.second, base + seg->second.end, key,
+                    value);
+      fn(key, value);
+    }
+  }
+};
+
+std::runtime_error io_error(const std::string &what, const std::string &path) {
+  return std::runtime_error(what + " " + path + ": " + strerror(errno));
+}
+
+} // namespace
+
+LogEngine::LogEngine(const std::string &dir, size_t segment_size)
+    : m_dir(dir), m_segment_size(segment_size), m_active(0), m_key_bytes(0),
+      m_compacting(0), m_compact_pos(0), m_compactions(0),
+      m_compacted_bytes(0), m_recovered(0), m_torn_bytes(0) {
+  if (segment_size < 2 * MAX_HEADER || segment_size > UINT32_MAX) {
+    throw std::invalid_argument("Invalid log segment size");
+  }
+  if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+    throw io_error("Could not create", dir);
+  }
+  try {
+    recover();
+  } catch (...) {
+    for (auto &entry : m_segments) {
+      if (entry.second.fd >= 0) {
+        close(entry.second.fd);
+      }
+    }
+    throw;
+  }
+}
+
+LogEngine::~LogEngine() {
+  sync_active();
+  for (auto &entry : m_segments) {
+    if (entry.second.fd >= 0) {
+      close(entry.second.fd);
+    }
+  }
+}
+
+std::string LogEngine::segment_path(uint32_t id) const {
+  char name[16];
+  snprintf(name, sizeof(name), "%08u.log", id);
+  return m_dir + "/" + name;
+}
+
+// Rebuilds the index from the segments, oldest first, and picks the
+// segment to append to
+void LogEngine::recover() {
+  DIR *d = opendir(m_dir.c_str());
+  if (!d) {
+    throw io_error("Could not open", m_dir);
+  }
+  std::vector<uint32_t> ids;
+  while (struct dirent *ent = readdir(d)) {
+    unsigned id;
+    char suffix[8];
+    if (sscanf(ent->d_name, "%8u.%7s", &id, suffix) == 2 &&
+        strcmp(suffix, "log") == 0 && id > 0 &&
+        strlen(ent->d_name) == 12) {
+      ids.push_back(id);
+    }
+  }
+  closedir(d);
+  std::sort(ids.begin(), ids.end());
+  // Batch records waiting for their commit record; any left at the end
+  // are from a batch which never committed
+  std::vector<Location> pending;
+  for (uint32_t id : ids) {
+    load_segment(id, pending);
+  }
+
+  // The last segment is appended to, unless it was full
+  if (!m_segments.empty()) {
+    auto last = m_segments.rbegin();
+    if (last->second.mapped == m_segment_size &&
+        last->second.end + MAX_HEADER < m_segment_size) {
+      last->second.fd = open(segment_path(last->first).c_str(), O_RDWR);
+      if (last->second.fd < 0) {
+        throw io_error("Could not open", segment_path(last->first));
+      }
+      m_active = last->first;
+      return;
+    }
+  }
+  start_segment();
+}
+
+// Maps a segment and indexes its records, and the pending batch records
+// which its commit records commit
+void LogEngine::load_segment(uint32_t id, std::vector<Location> &pending) {
+  std::string path = segment_path(id);
+  int fd = open(path.c_str(), O_RDWR);
+  if (fd < 0) {
+    throw io_error("Could not open", path);
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw io_error("Could not stat", path);
+  }
+  if (st.st_size == 0) {
+    close(fd);
+    return;
+  }
+  void *base =
+      mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    throw io_error("Could not map", path);
+  }
+  Segment &seg = m_segments[id];
+  seg.fd = -1;
+  seg.base = static_cast<char *>(base);
+  seg.mapping = share_mapping(seg.base, st.st_size);
+  seg.mapped = st.st_size;
+  seg.end = 0;
+  seg.live_bytes = 0;
+  seg.batch_start = 0;
+
+  size_t pos = 0;
+  std::string_view key, value;
+  while (size_t len =
+             parse_record(seg.base + pos, seg.mapped - pos, key, value)) {
+    Location loc{id, uint32_t(pos)};
+    unsigned char magic = seg.base[pos];
+    pos += len;
+    seg.end = pos;
+    if (magic == BATCH_MAGIC) {
+      pending.push_back(loc);
+      continue;
+    }
+    if (magic == COMMIT_MAGIC) {
+      // Records before the batch's start are from one which failed
+      Location start;
+      if (value.size() != sizeof(start)) {
+        continue;
+      }
+      memcpy(&start, value.data(), sizeof(start));
+      for (const Location &record : pending) {
+        if (record.segment > start.segment ||
+            (record.segment == start.segment &&
+             record.offset >= start.offset)) {
+          const Segment &record_seg = m_segments.at(record.segment);
+          std::string_view record_key, record_value;
+          decode_record(record_seg.base + record.offset,
+                        record_seg.base + record_seg.end, record_key,
+                        record_value);
+          index_record(record_key, record);
+          m_recovered++;
+        }
+      }
+      pending.clear();
+      if (start.segment != id) {
+        seg.batch_start = start.segment;
+      }
+      continue;
+    }
+    index_record(key, loc);
+    m_recovered++;
+  }
+  // An unfilled segment is zeroed after its records; anything else there
+  // is the remains of a torn write
+  size_t check = std::min(seg.mapped - pos, MAX_HEADER);
+  for (size_t i = 0; i < check; i++) {
+    if (seg.base[pos + i] != 0) {
+      m_torn_bytes += seg.mapped - pos;
+      break;
+    }
+  }
+}
+
+void LogEngine::start_segment() {
+  uint32_t id = m_segments.empty() ? 1 : m_segments.rbegin()->first + 1;
+  std::string path = segment_path(id);
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    throw io_error("Could not create", path);
+  }
+  // Allocated rather than just sized, so running out of disk is an error
+  // here and not a SIGBUS when a record is copied into the mapping
+  if (int err = posix_fallocate(fd, 0, m_segment_size)) {
+    close(fd);
+    unlink(path.c_str());
+    errno = err;
+    throw io_error("Could not allocate", path);
+  }
+  void *base =
+      mmap(NULL, m_segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) {
+    close(fd);
+    throw io_error("Could not map", path);
+  }
+  Segment &seg = m_segments[id];
+  seg.fd = fd;
+  seg.base = static_cast<char *>(base);
+  seg.mapping = share_mapping(seg.base, m_segment_size);
+  seg.mapped = m_segment_size;
+  seg.end = 0;
+  seg.live_bytes = 0;
+  seg.batch_start = 0;
+  m_active = id;
+}
+
+// Makes a full segment durable and trims it to its records. Its mapping
+// is kept; nothing past the records is read again.
+void LogEngine::seal_segment(uint32_t id) {
+  Segment &seg = m_segments.at(id);
+  if (seg.end > 0) {
+    msync(seg.base, seg.end, MS_SYNC);
+  }
+  if (ftruncate(seg.fd, seg.end) != 0) {
+    throw io_error("Could not trim", segment_path(id));
+  }
+  close(seg.fd);
+  seg.fd = -1;
+}
+
+void LogEngine::sync_active() {
+  auto it = m_segments.find(m_active);
+  if (it != m_segments.end() && it->second.end > 0) {
+    msync(it->second.base, it->second.end, MS_SYNC);
+  }
+}
+
+void LogEngine::remove_segment(uint32_t id) {
+  Segment &seg = m_segments.at(id);
+  if (seg.fd >= 0) {
+    close(seg.fd);
+  }
+  unlink(segment_path(id).c_str());
+  m_segments.erase(id);
+}
+
+// Writes a record, which the caller indexes
+LogEngine::Location LogEngine::append(std::string_view key,
+                                      std::string_view value,
+                                      unsigned char magic) {
+  char lengths[20];
+  size_t lengths_len = put_varint(lengths, key.size());
+  lengths_len += put_varint(lengths + lengths_len, value.size());
+  size_t len = LENGTHS_OFFSET + lengths_len + key.size() + value.size();
+  if (len > m_segment_size) {
+    throw std::length_error("Record too long for a log segment");
+  }
+  if (m_segments.at(m_active).end + len > m_segment_size) {
+    // If the new segment can't be made, the full one stays active and
+    // mapped at its full size
+    uint32_t full = m_active;
+    start_segment();
+    seal_segment(full);
+  }
+
+  Segment &seg = m_segments.at(m_active);
+  char *p = seg.base + seg.end;
+  p[0] = char(magic);
+  char *q = p + LENGTHS_OFFSET;
+  memcpy(q, lengths, lengths_len);
+  memcpy(q + lengths_len, key.data(), key.size());
+  memcpy(q + lengths_len + key.size(), value.data(), value.size());
+  uint32_t sum = checksum(q, len - LENGTHS_OFFSET);
+  memcpy(p + CHECKSUM_OFFSET, &sum, sizeof(sum));
+
+  Location loc{m_active, uint32_t(seg.end)};
+  seg.end += len;
+  return loc;
+}
+
+// Points key's index entry at the record at loc
+void LogEngine::index_record(std::string_view key, const Location &loc) {
+  auto it = m_index.find(key);
+  if (it != m_index.end()) {
+    drop_record(it->second);
+    it->second = loc;
+  } else {
+    m_index.emplace(std::string(key), loc);
+    m_key_bytes += key.size();
+  }
+  Segment &seg = m_segments.at(loc.segment);
+  std::string_view stored_key, value;
+  seg.live_bytes += decode_record(seg.base + loc.offset, seg.base + seg.end,
+                                  stored_key, value);
+}
+
+// Marks a record stale
+void LogEngine::drop_record(const Location &loc) {
+  Segment &seg = m_segments.at(loc.segment);
+  std::string_view key, value;
+  seg.live_bytes -=
+      decode_record(seg.base + loc.offset, seg.base + seg.end, key, value);
+}
+
+size_t LogEngine::parse_record(const char *p, size_t avail,
+                               std::string_view &key,
+                               std::string_view &value) {
+  unsigned char magic = p[0];
+  if (avail < LENGTHS_OFFSET + 2 ||
+      (magic != RECORD_MAGIC && magic != BATCH_MAGIC &&
+       magic != COMMIT_MAGIC)) {
+    return 0;
+  }
+  size_t len = decode_record(p, p + avail, key, value);
+  uint32_t sum;
+  memcpy(&sum, p + CHECKSUM_OFFSET, sizeof(sum));
+  if (len == 0 ||
+      sum != checksum(p + LENGTHS_OFFSET, len - LENGTHS_OFFSET)) {
+    return 0;
+  }
+  return len;
+}
+
+bool LogEngine::get(std::string_view key, std::string_view &value) {
+  auto it = m_index.find(key);
+  if (it == m_index.end()) {
+    return false;
+  }
+  const Segment &seg = m_segments.at(it->second.segment);
+  std::string_view stored_key;
+  decode_record(seg.base + it->second.offset, seg.base + seg.end, stored_key,
+                value);
+  return true;
+}
+
+bool LogEngine::contains(std::string_view key) {
+  return m_index.find(key) != m_index.end();
+}
+
+void LogEngine::put(std::string_view key, std::string_view value) {
+  index_record(key, append(key, value, RECORD_MAGIC));
+}
+
+// The writes are all stored, and then committed by one record, before
+// any of them is indexed: if writing fails, none of them takes effect,
+// now or when the log is read again
+void LogEngine::adopt(CompactStore &writes) {
+  if (writes.size() == 0) {
+    return;
+  }
+  std::vector<std::pair<std::string_view, Location>> records;
+  records.reserve(writes.size());
+  writes.for_each([&](std::string_view key, std::string_view value) {
+    records.emplace_back(key, append(key, value, BATCH_MAGIC));
+  });
+  Location start = records.front().second;
+  Location commit = append(
+      "", std::string_view(reinterpret_cast<const char *>(&start),
+                           sizeof(start)),
+      COMMIT_MAGIC);
+  if (commit.segment != start.segment) {
+    m_segments.at(commit.segment).batch_start = start.segment;
+  }
+  for (const auto &record : records) {
+    index_record(record.first, record.second);
+  }
+  writes.clear();
+}
+
+void LogEngine::for_each(const EntryFn &fn) {
+  for (const auto &entry : m_index) {
+    std::string_view value;
+    get(entry.first, value);
+    fn(entry.first, value);
+  }
+}
+
+void LogEngine::copy_to(CompactStore &out) {
+  out.clear();
+  for_each([&out](std::string_view key, std::string_view value) {
+    out.put(key, value);
+  });
+}
+
+std::unique_ptr<StorageEngine::Snapshot> LogEngine::snapshot() {
+  std::unique_ptr<LogSnapshot> snapshot(new LogSnapshot());
+  for (const auto &entry : m_segments) {
+    snapshot->segments[entry.first] = {entry.second.mapping, entry.second.end};
+  }
+  snapshot->records.reserve(m_index.size());
+  for (const auto &entry : m_index) {
+    snapshot->records.emplace_back(entry.second.segment, entry.second.offset);
+  }
+  return snapshot;
+}
+
+size_t LogEngine::memory_usage() const {
+  // Hash nodes hold a key string and a location; long keys are allocated
+  // separately
+  size_t node =
+      sizeof(void *) + sizeof(std::string) + sizeof(Location) + sizeof(size_t);
+  return m_index.bucket_count() * sizeof(void *) + m_index.size() * node +
+         m_key_bytes;
+}
+
+bool LogEngine::compact(size_t budget) {
+  if (!m_compacting) {
+    // Pick the full segment with the largest fraction of stale records
+    double best_live = 0.5;
+    for (const auto &entry : m_segments) {
+      const Segment &seg = entry.second;
+      if (entry.first != m_active && can_compact(entry.first) &&
+          double(seg.live_bytes) <= best_live * seg.end) {
+        best_live = seg.end > 0 ? double(seg.live_bytes) / seg.end : 0;
+        m_compacting = entry.first;
+      }
+    }
+    if (!m_compacting) {
+      return false;
+    }
+    m_compact_pos = 0;
+  }
+
+  // Segments don't move as others are added, so seg stays valid
+  Segment &seg = m_segments.at(m_compacting);
+  size_t done = 0;
+  while (m_compact_pos < seg.end && done < budget) {
+    std::string_view key, value;
+    size_t len = decode_record(seg.base + m_compact_pos, seg.base + seg.end,
+                               key, value);
+    auto it = m_index.find(key);
+    if (it != m_index.end() && it->second.segment == m_compacting &&
+        it->second.offset == m_compact_pos) {
+      it->second = append(key, value, RECORD_MAGIC);
+      m_segments.at(it->second.segment).live_bytes += len;
+      seg.live_bytes -= len;
+      m_compacted_bytes += len;
+    }
+    m_compact_pos += len;
+    done += len;
+  }
+  if (m_compact_pos >= seg.end) {
+    // The copies must be on disk before the originals go
+    sync_active();
+    remove_segment(m_compacting);
+    m_compacting = 0;
+    m_compactions++;
+  }
+  return true;
+}
+
+// A segment holding the commit record of a batch which started in an
+// earlier segment stays until no segment from there on is left
+bool LogEngine::can_compact(uint32_t id) const {
+  const Segment &seg = m_segments.at(id);
+  return seg.batch_start == 0 ||
+         m_segments.lower_bound(seg.batch_start)->first >= id;
+}
+
+std::string LogEngine::get_stats() const {
+  size_t disk_bytes = 0, live_bytes = 0;
+  for (const auto &entry : m_segments) {
+    disk_bytes +=
+        entry.first == m_active ? entry.second.mapped : entry.second.end;
+    live_bytes += entry.second.live_bytes;
+  }
+  return ";segments=" + std::to_string(m_segments.size()) +
+         ";disk_bytes=" + std::to_string(disk_bytes) +
+         ";live_bytes=" + std::to_string(live_bytes) +
+         ";compactions=" + std::to_string(m_compactions) +
+         ";compacted_bytes=" + std::to_string(m_compacted_bytes) +
+         ";recovered_records=" + std::to_string(m_recovered) +
+         ";torn_bytes=" + std::to_string(m_torn_bytes);
+}
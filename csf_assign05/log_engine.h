@@ -0,0 +1,143 @@
+#ifndef LOG_ENGINE_H
+#define LOG_ENGINE_H
+
+#include "storage_engine.h"
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Disk-backed storage engine in the style of Bitcask: values live in
+// append-only log segments, and only the keys are kept in memory, in a
+// hash index of record locations.
+//
+// A table's segments are files 00000001.log, 00000002.log, ... in its
+// own directory. Each is memory mapped, so writes are copies into the
+// mapping and reads return views of it; records are
+//
+//   [0xb7][4 byte checksum][varint key length][varint value length][key][value]
+//
+// with the checksum covering everything after it. A transaction's writes
+// (adopt()) are written as batch records, marked 0xb8, followed by a
+// commit record, 0xb9, which holds the location of the batch's first
+// record; they only take effect, in memory or when the log is read
+// again, once the commit record is written. Segments are allocated
+// at their full size when created, so a full disk fails the write that
+// needs a new segment, and are trimmed to their contents once full.
+//
+// Writing a key appends a record and repoints its index entry, leaving
+// the old record stale. compact() copies the live records out of the
+// segment with the most stale data, a budget at a time, and deletes it
+// once they have all moved.
+//
+// Since records never change once written, a snapshot is just the
+// locations of the live records; it keeps their segments mapped, even
+// once compacted away, until it is destroyed.
+//
+// Opening a directory rebuilds the index by scanning the segments in
+// order, so later records win, and batches without a commit record are
+// skipped. A record torn by a crash fails its checksum, which ends its
+// segment. Records are in the page cache as soon as they are written, so
+// they survive the server crashing; they are synced to disk when a
+// segment fills up, before a compacted segment is deleted, and when the
+// engine is closed.
+class LogEngine : public StorageEngine {
+public:
+  static const size_t DEFAULT_SEGMENT_SIZE = 64 * 1024 * 1024;
+
+private:
+  struct Segment {
+    int fd;             // open while the segment is being appended to
+    char *base;         // mapping
+    std::shared_ptr<char> mapping; // unmaps base, once snapshots are done
+    size_t mapped;      // length of the mapping
+    size_t end;         // bytes of records
+    size_t live_bytes;  // bytes of records the index refers to
+    // The segment a batch committed in this one started in, if earlier
+    // (else 0): while segments from there on remain, they may hold
+    // records which need the commit record, so this one isn't compacted
+    uint32_t batch_start;
+  };
+  struct Location {
+    uint32_t segment;
+    uint32_t offset;
+  };
+  struct KeyHash {
+    typedef void is_transparent;
+    size_t operator()(std::string_view key) const {
+      return std::hash<std::string_view>()(key);
+    }
+  };
+
+  std::string m_dir;
+  size_t m_segment_size;
+  std::map<uint32_t, Segment> m_segments;
+  uint32_t m_active; // the segment being appended to
+  std::unordered_map<std::string, Location, KeyHash, std::equal_to<>> m_index;
+  size_t m_key_bytes; // heap bytes of the index's keys
+
+  // Compaction in progress, if m_compacting is nonzero
+  uint32_t m_compacting;
+  size_t m_compact_pos;
+
+  uint64_t m_compactions;     // segments compacted away
+  uint64_t m_compacted_bytes; // live records copied by compaction
+  uint64_t m_recovered;       // records read when the engine was opened
+  uint64_t m_torn_bytes;      // bytes after the last valid record of each
+                              // segment when it was opened
+
+  std::string segment_path(uint32_t id) const;
+  void recover();
+  void load_segment(uint32_t id, std::vector<Location> &pending);
+  void start_segment();
+  void seal_segment(uint32_t id);
+  void sync_active();
+  void remove_segment(uint32_t id);
+  Location append(std::string_view key, std::string_view value,
+                  unsigned char magic);
+  void index_record(std::string_view key, const Location &loc);
+  void drop_record(const Location &loc);
+  bool can_compact(uint32_t id) const;
+
+  // copy constructor and assignment operator are prohibited
+  LogEngine(const LogEngine &);
+  LogEngine &operator=(const LogEngine &);
+
+public:
+  // Opens the engine stored in dir, creating the directory if needed.
+  // Throws std::runtime_error if it can't be read or written.
+  LogEngine(const std::string &dir,
+            size_t segment_size = DEFAULT_SEGMENT_SIZE);
+  ~LogEngine();
+
+  const char *name() const override { return "log"; }
+
+  bool get(std::string_view key, std::string_view &value) override;
+  bool contains(std::string_view key) override;
+  void put(std::string_view key, std::string_view value) override;
+  void adopt(CompactStore &writes) override;
+  void for_each(const EntryFn &fn) override;
+  void copy_to(CompactStore &out) override;
+  std::unique_ptr<Snapshot> snapshot() override;
+
+  size_t size() const override { return m_index.size(); }
+  size_t memory_usage() const override;
+
+  // Works on a segment which is at least half stale
+  bool compact(size_t budget) override;
+
+  // segments, disk_bytes, live_bytes, compactions, ...
+  std::string get_stats() const override;
+
+  // Parses the record (of any kind) at p, of at most avail bytes,
+  // checking its checksum. Returns its total length, or 0 if it isn't
+  // valid.
+  static size_t parse_record(const char *p, size_t avail, std::string_view &key,
+                             std::string_view &value);
+};
+
+#endif // LOG_ENGINE_H
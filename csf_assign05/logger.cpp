@@ -0,0 +1,331 @@
+#include "logger.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <time.h>
+#include <unistd.h>
+
+namespace {
+
+// The flusher writes at most this much per write() call
+const size_t FLUSH_SIZE = 64 * 1024;
+// How long the flusher sleeps when there is nothing to write
+const long FLUSH_INTERVAL_NS = 2000000;
+
+// Appends to a fixed-size buffer, silently truncating at its end
+struct BoundedWriter {
+  char *buf;
+  size_t len;
+  size_t cap;
+
+  void put(char c) {
+    if (len < cap) {
+      buf[len++] = c;
+    }
+  }
+  void put(std::string_view s) {
+    size_t n = std::min(s.size(), cap - len);
+    memcpy(buf + len, s.data(), n);
+    len += n;
+  }
+  void put_json(std::string_view s) {
+    for (char c : s) {
+      if (c == '"' || c == '\\') {
+        if (len + 2 > cap) {
+          return;
+        }
+        put('\\');
+        put(c);
+      } else if (static_cast<unsigned char>(c) < 0x20) {
+        if (len + 6 > cap) {
+          return;
+        }
+        char esc[8];
+        snprintf(esc, sizeof(esc), "\\u%04x", c);
+        put(std::string_view(esc, 6));
+      } else {
+        put(c);
+      }
+    }
+  }
+};
+
+} // namespace
+
+Logger::Logger(int fd, bool json, size_t capacity, unsigned rate_limit)
+    : m_fd(fd), m_json(json), m_level(int(LogLevel::INFO)),
+      m_rate_limit(rate_limit), m_mask(capacity - 1), m_head(0), m_tail(0),
+      m_started(false), m_stopping(false), m_dropped(0), m_suppressed(0) {
+  if (capacity == 0 || (capacity & (capacity - 1)) != 0) {
+    throw std::invalid_argument("Logger capacity must be a power of 2");
+  }
+  m_slots = new Slot[capacity];
+  for (size_t i = 0; i < capacity; i++) {
+    m_slots[i].seq.store(i, std::memory_order_relaxed);
+  }
+  for (RateBucket &bucket : m_buckets) {
+    bucket.msg_class.store(nullptr);
+    bucket.second.store(0);
+    bucket.count.store(0);
+    bucket.suppressed.store(0);
+  }
+}
+
+Logger::~Logger() {
+  if (m_started.load()) {
+    m_stopping.store(true);
+    pthread_join(m_flusher, NULL);
+  }
+  delete[] m_slots;
+}
+
+void Logger::set_level(LogLevel level) {
+  m_level.store(int(level), std::memory_order_relaxed);
+}
+
+void Logger::log(LogLevel level, const char *msg_class,
+                 std::string_view message) {
+  if (!is_enabled(level)) {
+    return;
+  }
+  while (!message.empty() && message.back() == '\n') {
+    message.remove_suffix(1);
+  }
+  uint64_t now_ns = wall_clock_ns();
+  if (rate_limited(msg_class, now_ns / 1000000000)) {
+    return;
+  }
+  Slot *slot = reserve();
+  if (!slot) {
+    m_dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  size_t len;
+  format(slot->text, len, level, msg_class, message, now_ns);
+  slot->len = len;
+  publish(slot);
+}
+
+void Logger::log_record(std::string_view record) {
+  Slot *slot = reserve();
+  if (!slot) {
+    m_dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  size_t len = std::min(record.size(), MAX_RECORD_LEN - 1);
+  memcpy(slot->text, record.data(), len);
+  slot->text[len++] = '\n';
+  slot->len = len;
+  publish(slot);
+}
+
+// Claims the next slot of the ring, or returns nullptr if it is full.
+// The record must be published with publish().
+Logger::Slot *Logger::reserve() {
+  ensure_started();
+  uint64_t pos = m_head.load(std::memory_order_relaxed);
+  while (1) {
+    Slot *slot = &m_slots[pos & m_mask];
+    int64_t diff =
+        int64_t(slot->seq.load(std::memory_order_acquire)) - int64_t(pos);
+    if (diff == 0) {
+      // The slot is free for this position; try to claim it
+      if (m_head.compare_exchange_weak(pos, pos + 1,
+                                       std::memory_order_relaxed)) {
+        slot->pos = pos;
+        return slot;
+      }
+    } else if (diff < 0) {
+      return nullptr; // the flusher hasn't consumed this slot yet
+    } else {
+      pos = m_head.load(std::memory_order_relaxed); // lost a race
+    }
+  }
+}
+
+void Logger::publish(Slot *slot) {
+  slot->seq.store(slot->pos + 1, std::memory_order_release);
+}
+
+// Counts a message against its class's limit for the current second.
+// Returns true if the message should be suppressed.
+bool Logger::rate_limited(const char *msg_class, uint64_t now_sec) {
+  if (m_rate_limit == 0) {
+    return false;
+  }
+  RateBucket &bucket =
+      m_buckets[std::hash<std::string_view>()(msg_class) % NUM_BUCKETS];
+  uint64_t second = bucket.second.load(std::memory_order_relaxed);
+  if (second != now_sec &&
+      bucket.second.compare_exchange_strong(second, now_sec)) {
+    // First message of a new second: report what the last one dropped
+    bucket.count.store(0);
+    uint32_t suppressed = bucket.suppressed.exchange(0);
+    const char *suppressed_class = bucket.msg_class.exchange(msg_class);
+    if (suppressed > 0) {
+      char text[128];
+      snprintf(text, sizeof(text), "%u \"%s\" messages suppressed",
+               suppressed, suppressed_class ? suppressed_class : msg_class);
+      Slot *slot = reserve();
+      if (slot) {
+        size_t len;
+        format(slot->text, len, LogLevel::WARN, "logger", text,
+               now_sec * 1000000000);
+        slot->len = len;
+        publish(slot);
+      }
+    }
+  }
+  if (bucket.count.fetch_add(1, std::memory_order_relaxed) >= m_rate_limit) {
+    bucket.suppressed.fetch_add(1, std::memory_order_relaxed);
+    m_suppressed.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+  return false;
+}
+
+void Logger::format(char *buf, size_t &len, LogLevel level,
+                    const char *msg_class, std::string_view message,
+                    uint64_t now_ns) {
+  char time_buf[32];
+  size_t time_len = format_time(time_buf, sizeof(time_buf), now_ns);
+  std::string_view time(time_buf, time_len);
+
+  // Leave room for the closing characters
+  BoundedWriter out{buf, 0, MAX_RECORD_LEN - 3};
+  if (m_json) {
+    out.put("{\"time\":\"");
+    out.put(time);
+    out.put("\",\"level\":\"");
+    out.put(level_name(level));
+    out.put("\",\"class\":\"");
+    out.put_json(msg_class);
+    out.put("\",\"msg\":\"");
+    out.put_json(message);
+    out.cap += 3;
+    out.put("\"}\n");
+  } else {
+    out.put(time);
+    out.put(' ');
+    out.put(level_name(level));
+    out.put(" [");
+    out.put(msg_class);
+    out.put("] ");
+    out.put(message);
+    out.cap += 3;
+    out.put('\n');
+  }
+  len = out.len;
+}
+
+void Logger::ensure_started() {
+  if (m_started.load(std::memory_order_acquire)) {
+    return;
+  }
+  bool expected = false;
+  if (m_started.compare_exchange_strong(expected, true)) {
+    if (pthread_create(&m_flusher, NULL, flusher_worker, this) != 0) {
+      m_started.store(false);
+    }
+  }
+}
+
+void *Logger::flusher_worker(void *arg) {
+  Logger *logger = static_cast<Logger *>(arg);
+  std::string buf;
+  buf.reserve(FLUSH_SIZE + MAX_RECORD_LEN);
+  while (1) {
+    bool stopping = logger->m_stopping.load();
+    buf.clear();
+    logger->drain(buf);
+    if (!buf.empty()) {
+      // Errors are ignored: there is nowhere to report them
+      size_t written = 0;
+      while (written < buf.size()) {
+        ssize_t n = write(logger->m_fd, buf.data() + written,
+                          buf.size() - written);
+        if (n <= 0) {
+          break;
+        }
+        written += n;
+      }
+    } else if (stopping) {
+      break; // everything logged before the stop request is written
+    } else {
+      struct timespec delay = {0, FLUSH_INTERVAL_NS};
+      nanosleep(&delay, NULL);
+    }
+  }
+  return nullptr;
+}
+
+// Moves published records into buf, up to FLUSH_SIZE bytes. Returns the
+// number of records moved.
+size_t Logger::drain(std::string &buf) {
+  size_t count = 0;
+  while (buf.size() < FLUSH_SIZE) {
+    Slot &slot = m_slots[m_tail & m_mask];
+    if (slot.seq.load(std::memory_order_acquire) != m_tail + 1) {
+      break; // not yet published
+    }
+    buf.append(slot.text, slot.len);
+    // Hand the slot back to producers for its next lap of the ring
+    slot.seq.store(m_tail + m_mask + 1, std::memory_order_release);
+    m_tail++;
+    count++;
+  }
+  return count;
+}
+
+uint64_t Logger::wall_clock_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// e.g. 2024-05-01T12:00:00.123Z
+size_t Logger::format_time(char *buf, size_t size, uint64_t time_ns) {
+  time_t secs = time_ns / 1000000000;
+  struct tm tm;
+  gmtime_r(&secs, &tm);
+  size_t len = strftime(buf, size, "%Y-%m-%dT%H:%M:%S", &tm);
+  len += snprintf(buf + len, size - len, ".%03uZ",
+                  unsigned(time_ns / 1000000 % 1000));
+  return len;
+}
+
+bool Logger::parse_level(std::string_view name, LogLevel &level) {
+  for (LogLevel l : {LogLevel::DEBUG, LogLevel::INFO, LogLevel::WARN,
+                     LogLevel::ERROR}) {
+    if (name == level_name(l)) {
+      level = l;
+      return true;
+    }
+  }
+  return false;
+}
+
+const char *Logger::level_name(LogLevel level) {
+  switch (level) {
+  case LogLevel::DEBUG:
+    return "debug";
+  case LogLevel::INFO:
+    return "info";
+  case LogLevel::WARN:
+    return "warn";
+  case LogLevel::ERROR:
+  default:
+    return "error";
+  }
+}
+
+void Logger::append_json_string(std::string &out, std::string_view s) {
+  char buf[MAX_RECORD_LEN];
+  BoundedWriter writer{buf, 0, sizeof(buf)};
+  writer.put_json(s);
+  out += '"';
+  out.append(buf, writer.len);
+  out += '"';
+}
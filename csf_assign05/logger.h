@@ -0,0 +1,111 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <pthread.h>
+#include <string>
+#include <string_view>
+
+enum class LogLevel { DEBUG, INFO, WARN, ERROR };
+
+// Asynchronous logger. Callers format a record into a slot of a bounded
+// lock-free ring (multiple producers, one consumer) and return; a
+// flusher thread, started by the first record, writes whatever has
+// accumulated with a single write() call. Nothing on the logging path
+// takes a lock or blocks: when the ring is full, records are dropped and
+// counted.
+//
+// Messages belong to a class (such as "protocol" or "accept"), and each
+// class may log at most rate_limit messages per second; the excess is
+// suppressed and reported once the second is over.
+class Logger {
+public:
+  // Longest record (including the newline); longer ones are truncated
+  static const size_t MAX_RECORD_LEN = 512;
+
+private:
+  struct Slot {
+    std::atomic<uint64_t> seq; // ring position this slot is ready for
+    uint64_t pos;              // position claimed by the producer
+    uint32_t len;
+    char text[MAX_RECORD_LEN];
+  };
+
+  // Per-class rate limit state; classes share buckets by hash
+  struct RateBucket {
+    std::atomic<const char *> msg_class;
+    std::atomic<uint64_t> second;     // current one-second window
+    std::atomic<uint32_t> count;      // messages in the window
+    std::atomic<uint32_t> suppressed; // messages dropped in the window
+  };
+  static const size_t NUM_BUCKETS = 64;
+
+  int m_fd;
+  bool m_json;
+  std::atomic<int> m_level;
+  unsigned m_rate_limit;
+
+  Slot *m_slots;
+  size_t m_mask;                // capacity - 1
+  std::atomic<uint64_t> m_head; // next position to produce
+  uint64_t m_tail;              // next position to consume (flusher only)
+  RateBucket m_buckets[NUM_BUCKETS];
+
+  std::atomic<bool> m_started;
+  std::atomic<bool> m_stopping;
+  pthread_t m_flusher;
+
+  std::atomic<uint64_t> m_dropped;    // ring was full
+  std::atomic<uint64_t> m_suppressed; // over a class's rate limit
+
+  Slot *reserve();
+  void publish(Slot *slot);
+  bool rate_limited(const char *msg_class, uint64_t now_sec);
+  void format(char *buf, size_t &len, LogLevel level, const char *msg_class,
+              std::string_view message, uint64_t now_ns);
+  void ensure_started();
+  static void *flusher_worker(void *arg);
+  size_t drain(std::string &buf);
+
+  // copy constructor and assignment operator are prohibited
+  Logger(const Logger &);
+  Logger &operator=(const Logger &);
+
+public:
+  // Writes to fd, as text lines or (with json) as JSON lines. capacity
+  // (the number of records buffered) must be a power of 2; rate_limit 0
+  // disables rate limiting.
+  Logger(int fd, bool json = false, size_t capacity = 4096,
+         unsigned rate_limit = 100);
+  // Writes out everything logged so far
+  ~Logger();
+
+  void set_level(LogLevel level);
+  bool is_enabled(LogLevel level) const {
+    return int(level) >= m_level.load(std::memory_order_relaxed);
+  }
+
+  // msg_class must be a string literal (or otherwise live forever)
+  void log(LogLevel level, const char *msg_class, std::string_view message);
+
+  // Queues a preformatted line (without its newline). Not rate limited;
+  // used for access logs.
+  void log_record(std::string_view record);
+
+  uint64_t get_dropped() const { return m_dropped.load(); }
+  uint64_t get_suppressed() const { return m_suppressed.load(); }
+
+  static uint64_t wall_clock_ns();
+  // Formats a wall clock time as ISO 8601 UTC with milliseconds
+  static size_t format_time(char *buf, size_t size, uint64_t time_ns);
+
+  static bool parse_level(std::string_view name, LogLevel &level);
+  static const char *level_name(LogLevel level);
+
+  // Appends s to out as a quoted JSON string
+  static void append_json_string(std::string &out, std::string_view s);
+};
+
+#endif // LOGGER_H
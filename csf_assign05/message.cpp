@@ -10,7 +10,15 @@ Message::Message() : m_message_type(MessageType::NONE) {}
 
 Message::Message(MessageType message_type,
                  std::initializer_list<std::string> args)
-    : m_message_type(message_type), m_args(args) {}
+    : m_message_type(message_type) {
+  m_args.reserve(args.size());
+  for (const std::string &arg : args) {
+    push_arg(arg);
+  }
+}
+
+Message::Message(MessageType message_type, Arena *arena)
+    : m_message_type(message_type), m_args(ArenaAllocator<ArgString>(arena)) {}
 
 Message::Message(const Message &other)
     : m_message_type(other.m_message_type), m_args(other.m_args) {}
@@ -31,44 +39,47 @@ void Message::set_message_type(MessageType message_type) {
   m_message_type = message_type;
 }
 
-std::string Message::get_username() const {
+std::string_view Message::get_username() const {
   if (m_args.size() > 0) {
     return m_args[0];
   }
-  return "";
+  return std::string_view();
 }
 
-std::string Message::get_table() const {
+std::string_view Message::get_table() const {
   if (m_args.size() > 0) {
     return m_args[0];
   }
-  return "";
+  return std::string_view();
 }
 
-std::string Message::get_key() const {
+std::string_view Message::get_key() const {
   if (m_args.size() > 1) {
     return m_args[1];
   }
-  return "";
+  return std::string_view();
 }
 
-std::string Message::get_value() const {
+std::string_view Message::get_value() const {
   if (m_args.size() > 0) {
     return m_args[0];
   }
-  return "";
+  return std::string_view();
 }
 
-std::string Message::get_quoted_text() const {
+std::string_view Message::get_quoted_text() const {
   if (m_args.size() > 0) {
     return m_args[0];
   }
-  return "";
+  return std::string_view();
 }
 
-void Message::push_arg(const std::string &arg) { m_args.push_back(arg); }
+void Message::push_arg(std::string_view arg) {
+  // Arguments share the message's allocator (and so its arena, if any)
+  m_args.emplace_back(arg.data(), arg.size(), m_args.get_allocator());
+}
 
-bool Message::is_quoted_text(const std::string &arg) {
+bool Message::is_quoted_text(std::string_view arg) {
   return !arg.empty() && arg.front() == '"' && arg.back() == '"';
 }
 
@@ -105,6 +116,26 @@ std::string Message::message_type_to_string(MessageType type) {
     return "COMMIT";
   case MessageType::BYE:
     return "BYE";
+  case MessageType::STATS:
+    return "STATS";
+  case MessageType::LOAD:
+    return "LOAD";
+  case MessageType::DUMP:
+    return "DUMP";
+  case MessageType::REPLICATE:
+    return "REPLICATE";
+  case MessageType::SLOWLOG:
+    return "SLOWLOG";
+  case MessageType::WATCH:
+    return "WATCH";
+  case MessageType::SUBSCRIBE:
+    return "SUBSCRIBE";
+  case MessageType::UNSUBSCRIBE:
+    return "UNSUBSCRIBE";
+  case MessageType::CREATEINDEX:
+    return "CREATEINDEX";
+  case MessageType::FIND:
+    return "FIND";
   case MessageType::OK:
     return "OK";
   case MessageType::FAILED:
@@ -113,6 +144,10 @@ std::string Message::message_type_to_string(MessageType type) {
     return "ERROR";
   case MessageType::DATA:
     return "DATA";
+  case MessageType::EVENT:
+    return "EVENT";
+  case MessageType::DROPPED:
+    return "DROPPED";
 
   default:
     return "";
@@ -120,7 +155,7 @@ std::string Message::message_type_to_string(MessageType type) {
 }
 
 // For Decoding
-MessageType Message::string_to_message_type(const std::string &typeStr) {
+MessageType Message::string_to_message_type(std::string_view typeStr) {
   if (typeStr == "NONE") {
     return MessageType::NONE;
   } else if (typeStr == "LOGIN") {
@@ -151,6 +186,26 @@ MessageType Message::string_to_message_type(const std::string &typeStr) {
     return MessageType::COMMIT;
   } else if (typeStr == "BYE") {
     return MessageType::BYE;
+  } else if (typeStr == "STATS") {
+    return MessageType::STATS;
+  } else if (typeStr == "LOAD") {
+    return MessageType::LOAD;
+  } else if (typeStr == "DUMP") {
+    return MessageType::DUMP;
+  } else if (typeStr == "REPLICATE") {
+    return MessageType::REPLICATE;
+  } else if (typeStr == "SLOWLOG") {
+    return MessageType::SLOWLOG;
+  } else if (typeStr == "WATCH") {
+    return MessageType::WATCH;
+  } else if (typeStr == "SUBSCRIBE") {
+    return MessageType::SUBSCRIBE;
+  } else if (typeStr == "UNSUBSCRIBE") {
+    return MessageType::UNSUBSCRIBE;
+  } else if (typeStr == "CREATEINDEX") {
+    return MessageType::CREATEINDEX;
+  } else if (typeStr == "FIND") {
+    return MessageType::FIND;
   } else if (typeStr == "OK") {
     return MessageType::OK;
   } else if (typeStr == "FAILED") {
@@ -159,6 +214,10 @@ MessageType Message::string_to_message_type(const std::string &typeStr) {
     return MessageType::ERROR;
   } else if (typeStr == "DATA") {
     return MessageType::DATA;
+  } else if (typeStr == "EVENT") {
+    return MessageType::EVENT;
+  } else if (typeStr == "DROPPED") {
+    return MessageType::DROPPED;
   } else {
     return MessageType::NONE; // Default case if no matches
   }
@@ -166,7 +225,10 @@ MessageType Message::string_to_message_type(const std::string &typeStr) {
 
 bool Message::no_args() const { return get_num_args() == 0; }
 
-bool Message::checkIdentifier(const std::string &arg) const {
+bool Message::checkIdentifier(std::string_view arg) {
+  if (arg.empty()) {
+    return false;
+  }
   char first_char = arg[0];
   if (!std::isalpha(first_char)) {
     return false;
@@ -181,7 +243,7 @@ bool Message::checkIdentifier(const std::string &arg) const {
   return true;
 }
 
-bool Message::checkValue(const std::string &arg) const {
+bool Message::checkValue(std::string_view arg) {
   int char_length = arg.size();
   for (int i = 0; i < char_length; i++) {
     if (std::isspace(arg[i])) {
@@ -197,19 +259,45 @@ bool Message::is_valid() const {
   case MessageType::NONE:
     return no_args();
 
-  case MessageType::LOGIN:
   case MessageType::CREATE:
+    // An optional second argument picks the table's storage engine
+    return (m_args.size() == 1 ||
+            (m_args.size() == 2 &&
+             (m_args.at(1) == "memory" || m_args.at(1) == "log"))) &&
+           checkIdentifier(m_args.at(0));
+
+  case MessageType::LOGIN:
+  case MessageType::LOAD:
+  case MessageType::DUMP:
+  case MessageType::SUBSCRIBE:
+  case MessageType::CREATEINDEX:
     return m_args.size() == 1 && checkIdentifier(m_args.at(0));
 
+  case MessageType::FIND:
+    return m_args.size() == 2 && checkIdentifier(m_args.at(0)) &&
+           checkValue(m_args.at(1));
+
   case MessageType::SET:
   case MessageType::GET:
+  case MessageType::WATCH:
     return m_args.size() == 2 && checkIdentifier(m_args.at(0)) &&
            checkIdentifier(m_args.at(1));
 
+  case MessageType::STATS: // optional table name
+    return no_args() || (m_args.size() == 1 && checkIdentifier(m_args.at(0)));
+
+  case MessageType::SLOWLOG: // optional "reset"
+    return no_args() || (m_args.size() == 1 && m_args.at(0) == "reset");
+
   case MessageType::PUSH:
   case MessageType::DATA:
+  case MessageType::DROPPED:
     return m_args.size() == 1 && checkValue(m_args.at(0));
 
+  case MessageType::EVENT:
+    return m_args.size() == 3 && checkIdentifier(m_args.at(0)) &&
+           checkIdentifier(m_args.at(1)) && checkValue(m_args.at(2));
+
   case MessageType::POP:
   case MessageType::TOP:
   case MessageType::ADD:
@@ -219,6 +307,8 @@ bool Message::is_valid() const {
   case MessageType::BEGIN:
   case MessageType::COMMIT:
   case MessageType::BYE:
+  case MessageType::REPLICATE:
+  case MessageType::UNSUBSCRIBE:
   case MessageType::OK:
     return no_args();
 
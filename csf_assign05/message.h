@@ -1,7 +1,9 @@
 #ifndef MESSAGE_H
 #define MESSAGE_H
 
+#include "arena.h"
 #include <string>
+#include <string_view>
 #include <vector>
 
 enum class MessageType {
@@ -23,18 +25,38 @@ enum class MessageType {
   BEGIN,
   COMMIT,
   BYE,
+  STATS,
+  LOAD,
+  DUMP,
+  REPLICATE,
+  SLOWLOG,
+  WATCH,
+  SUBSCRIBE,
+  UNSUBSCRIBE,
+  CREATEINDEX,
+  FIND,
 
   // Responses
   OK,
   FAILED,
   ERROR,
   DATA,
+  // Sent unrequested to subscribers (see pubsub.h)
+  EVENT,
+  DROPPED,
 };
 
 class Message {
+public:
+  // Argument storage. Messages constructed with an Arena keep their
+  // arguments in it; all others use the heap.
+  typedef std::basic_string<char, std::char_traits<char>, ArenaAllocator<char>>
+      ArgString;
+  typedef std::vector<ArgString, ArenaAllocator<ArgString>> ArgList;
+
 private:
   MessageType m_message_type;
-  std::vector<std::string> m_args;
+  ArgList m_args;
 
 public:
   // Maximum encoded message length (including terminator newline character)
@@ -43,38 +65,42 @@ public:
   Message();
   Message(MessageType message_type, std::initializer_list<std::string> args =
                                         std::initializer_list<std::string>());
+  // Message whose arguments are allocated from arena; it must not be used
+  // after the arena is reset
+  Message(MessageType message_type, Arena *arena);
   Message(const Message &other);
   ~Message();
 
-  const std::vector<std::string> &get_args() const { return m_args; }
+  const ArgList &get_args() const { return m_args; }
   void clear_args() { m_args.clear(); }
   Message &operator=(const Message &rhs);
 
   MessageType get_message_type() const;
   void set_message_type(MessageType message_type);
 
-  std::string get_username() const;
-  std::string get_table() const;
-  std::string get_key() const;
-  std::string get_value() const;
-  std::string get_quoted_text() const;
+  // The returned views are valid until the message is modified or destroyed
+  std::string_view get_username() const;
+  std::string_view get_table() const;
+  std::string_view get_key() const;
+  std::string_view get_value() const;
+  std::string_view get_quoted_text() const;
 
-  void push_arg(const std::string &arg);
+  void push_arg(std::string_view arg);
 
-  static bool is_quoted_text(const std::string &arg);
+  static bool is_quoted_text(std::string_view arg);
 
   static std::string message_type_to_string(MessageType type);
-  static MessageType string_to_message_type(const std::string &typeStr);
+  static MessageType string_to_message_type(std::string_view typeStr);
 
   bool no_args() const;
-  bool checkIdentifier(const std::string &arg) const;
-  bool checkValue(const std::string &arg) const;
-  bool checkQuotedText(const std::string &arg) const;
+  static bool checkIdentifier(std::string_view arg);
+  static bool checkValue(std::string_view arg);
+  static bool checkQuotedText(std::string_view arg);
 
   bool is_valid() const;
 
   unsigned get_num_args() const { return m_args.size(); }
-  std::string get_arg(unsigned i) const { return m_args.at(i); }
+  std::string_view get_arg(unsigned i) const { return m_args.at(i); }
 };
 
 #endif // MESSAGE_H
@@ -1,75 +1,102 @@
 #include "message_serialization.h"
 #include "exceptions.h"
 #include <cassert>
-#include <iostream>
-#include <map>
-#include <sstream>
-#include <utility>
+#include <cctype>
+
+namespace {
+
+bool is_space(char c) { return std::isspace(static_cast<unsigned char>(c)); }
+
+// FAILED and ERROR carry quoted_text, which is transmitted with quotes
+bool has_quoted_text(MessageType type) {
+  return type == MessageType::FAILED || type == MessageType::ERROR;
+}
+
+} // namespace
 
 void MessageSerialization::encode(const Message &msg,
                                   std::string &encoded_msg) {
-  // Start by clearing the encoded_msg
+  // Start by clearing the encoded_msg (keeping its capacity)
   encoded_msg.clear();
 
   // Encode the command
-  std::stringstream ss;
-  ss << msg.message_type_to_string(msg.get_message_type());
-  if (msg.is_quoted_text(msg.get_quoted_text())) {
-    ss << " ";
-    ss << msg.get_quoted_text();
-  } else if (msg.get_num_args() != 0) {
-    ss << " ";
-    ss << msg.get_arg(0);
-  }
+  encoded_msg += Message::message_type_to_string(msg.get_message_type());
 
-  // additional args
-  if (msg.get_message_type() == MessageType::SET ||
-      msg.get_message_type() == MessageType::GET) {
-    ss << " " << msg.get_arg(1);
+  // Encode the arguments
+  for (unsigned i = 0; i < msg.get_num_args(); i++) {
+    std::string_view arg = msg.get_arg(i);
+    encoded_msg += ' ';
+    if (i == 0 && has_quoted_text(msg.get_message_type()) &&
+        !Message::is_quoted_text(arg)) {
+      encoded_msg += '"';
+      encoded_msg += arg;
+      encoded_msg += '"';
+    } else {
+      encoded_msg += arg;
+    }
   }
-  // Newline char
-  ss << "\n";
 
-  encoded_msg = ss.str();
+  // Newline char
+  encoded_msg += '\n';
 
   if (encoded_msg.length() > Message::MAX_ENCODED_LEN) {
     throw InvalidMessage("Encoded message is too long");
   }
 }
 
-void MessageSerialization::decode(const std::string &encoded_msg,
-                                  Message &msg) {
-  if (encoded_msg.back() != '\n') {
+void MessageSerialization::decode(std::string_view encoded_msg, Message &msg) {
+  if (encoded_msg.empty() || encoded_msg.back() != '\n') {
     throw InvalidMessage("Encoded message must end with a newline.");
   }
 
-  std::istringstream iss(
-      encoded_msg.substr(0, encoded_msg.size() - 1)); // Strip the newline
-  std::string typeStr;
-  iss >> typeStr;
+  // Tokenize in place (without the newline): no temporary strings are
+  // created, arguments are copied straight into the message
+  const char *p = encoded_msg.data();
+  const char *end = p + encoded_msg.size() - 1;
 
-  MessageType type = Message::string_to_message_type(typeStr);
+  while (p < end && is_space(*p)) {
+    p++;
+  }
+  const char *type_start = p;
+  while (p < end && !is_space(*p)) {
+    p++;
+  }
+
+  MessageType type = Message::string_to_message_type(
+      std::string_view(type_start, p - type_start));
   msg.set_message_type(type);
   msg.clear_args();
 
-  std::string arg;
-  char nextChar;
-  while (iss >> std::ws && iss.peek() != EOF) {
-    nextChar = iss.peek();
-    if (nextChar == '"') {
-      iss.get();                   // Skip the initial quote
-      std::getline(iss, arg, '"'); // Read until the next quote
-      if (iss.peek() == ' ' || iss.peek() == EOF) {
-        iss.get(); // Skip the space after the quote
+  while (1) {
+    while (p < end && is_space(*p)) {
+      p++;
+    }
+    if (p == end) {
+      break;
+    }
+
+    const char *arg_start;
+    if (*p == '"') {
+      // Quoted text runs to the next quote (or the end of the line), and
+      // is stored without the surrounding quotes
+      arg_start = ++p;
+      while (p < end && *p != '"') {
+        p++;
+      }
+      msg.push_arg(std::string_view(arg_start, p - arg_start));
+      if (p < end) {
+        p++; // Skip the closing quote
       }
-      msg.push_arg(arg); // Store without the surrounding quotes
     } else {
-      iss >> arg;
-      msg.push_arg(arg);
+      arg_start = p;
+      while (p < end && !is_space(*p)) {
+        p++;
+      }
+      msg.push_arg(std::string_view(arg_start, p - arg_start));
     }
   }
 
   if (!msg.is_valid()) {
     throw InvalidMessage("\"Decoded message is not valid.\"");
   }
-}
\ No newline at end of file
+}
@@ -2,10 +2,14 @@
 #define MESSAGE_SERIALIZATION_H
 
 #include "message.h"
+#include <string_view>
 
 namespace MessageSerialization {
+// encoded_msg is cleared and reused, so passing the same string for every
+// message avoids reallocating it
 void encode(const Message &msg, std::string &encoded_msg);
-void decode(const std::string &encoded_msg, Message &msg);
+// Arguments are appended to msg using its allocator
+void decode(std::string_view encoded_msg, Message &msg);
 }; // namespace MessageSerialization
 
 #endif // MESSAGE_SERIALIZATION_H
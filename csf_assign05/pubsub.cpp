@@ -0,0 +1,205 @@
+#include "pubsub.h"
+#include "exceptions.h"
+#include "guard.h"
+#include <algorithm>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+Subscriber::Subscriber(size_t max_queued, bool disconnect)
+    : m_signalled(false), m_ring(std::max(max_queued, size_t(1))), m_head(0),
+      m_count(0), m_dropped(0), m_disconnect(disconnect), m_overflowed(false) {
+  m_event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (m_event_fd < 0) {
+    throw CommException("Could not create subscriber eventfd");
+  }
+  pthread_mutex_init(&m_lock, NULL);
+}
+
+Subscriber::~Subscriber() {
+  close(m_event_fd);
+  pthread_mutex_destroy(&m_lock);
+}
+
+bool Subscriber::push(std::string_view table, std::string_view key,
+                      std::string_view value) {
+  bool kept = true;
+  {
+    Guard g(m_lock);
+    if (m_overflowed) {
+      return false; // about to be disconnected
+    }
+    if (m_count == m_ring.size()) {
+      kept = false;
+      if (m_disconnect) {
+        m_overflowed = true;
+      } else {
+        // Drop the oldest event: the newest values matter most
+        m_head = (m_head + 1) % m_ring.size();
+        m_count--;
+        m_dropped++;
+      }
+    }
+    if (!m_overflowed) {
+      Event &event = m_ring[(m_head + m_count++) % m_ring.size()];
+      event.table.assign(table);
+      event.key.assign(key);
+      event.value.assign(value);
+    }
+    if (m_signalled) {
+      return kept;
+    }
+    m_signalled = true;
+  }
+  uint64_t one = 1;
+  ssize_t ignored = write(m_event_fd, &one, sizeof(one));
+  (void)ignored;
+  return kept;
+}
+
+bool Subscriber::take(std::vector<Event> &events, uint64_t &dropped) {
+  Guard g(m_lock);
+  if (m_signalled) {
+    uint64_t count;
+    ssize_t ignored = read(m_event_fd, &count, sizeof(count));
+    (void)ignored;
+    m_signalled = false;
+  }
+  if (m_overflowed) {
+    return false;
+  }
+  if (events.size() < m_count) {
+    events.resize(m_count);
+  }
+  for (size_t i = 0; i < m_count; i++) {
+    // Swapping hands the ring the caller's old buffers to reuse
+    std::swap(events[i], m_ring[(m_head + i) % m_ring.size()]);
+  }
+  events.resize(m_count);
+  m_head = 0;
+  m_count = 0;
+  dropped = m_dropped;
+  m_dropped = 0;
+  return true;
+}
+
+void Subscriber::clear() {
+  Guard g(m_lock);
+  m_head = 0;
+  m_count = 0;
+  m_dropped = 0;
+}
+
+PubSub::PubSub()
+    : m_num_subscriptions(0), m_max_queued(DEFAULT_MAX_QUEUED),
+      m_disconnect(false), m_published(0), m_dropped(0), m_disconnected(0) {
+  pthread_mutex_init(&m_lock, NULL);
+}
+
+PubSub::~PubSub() { pthread_mutex_destroy(&m_lock); }
+
+void PubSub::set_limits(size_t max_queued, bool disconnect) {
+  m_max_queued = max_queued;
+  m_disconnect = disconnect;
+}
+
+Subscriber *PubSub::create_subscriber() {
+  return new Subscriber(m_max_queued, m_disconnect);
+}
+
+// Returns false if sub was already there
+bool PubSub::add(std::vector<Subscriber *> &subscribers, Subscriber *sub) {
+  if (std::find(subscribers.begin(), subscribers.end(), sub) !=
+      subscribers.end()) {
+    return false;
+  }
+  subscribers.push_back(sub);
+  return true;
+}
+
+void PubSub::watch(Subscriber *sub, std::string_view table,
+                   std::string_view key) {
+  Guard g(m_lock);
+  TableSubscribers &subs = m_tables[std::string(table)];
+  auto it = subs.keys.find(key);
+  if (it == subs.keys.end()) {
+    it = subs.keys.emplace(std::string(key), std::vector<Subscriber *>())
+             .first;
+  }
+  if (add(it->second, sub)) {
+    m_num_subscriptions++;
+  }
+}
+
+void PubSub::subscribe(Subscriber *sub, std::string_view table) {
+  Guard g(m_lock);
+  if (add(m_tables[std::string(table)].all, sub)) {
+    m_num_subscriptions++;
+  }
+}
+
+void PubSub::unsubscribe(Subscriber *sub) {
+  Guard g(m_lock);
+  size_t removed = 0;
+  auto remove = [&](std::vector<Subscriber *> &subscribers) {
+    auto it = std::find(subscribers.begin(), subscribers.end(), sub);
+    if (it != subscribers.end()) {
+      subscribers.erase(it);
+      removed++;
+    }
+  };
+  for (auto table = m_tables.begin(); table != m_tables.end();) {
+    TableSubscribers &subs = table->second;
+    remove(subs.all);
+    for (auto key = subs.keys.begin(); key != subs.keys.end();) {
+      remove(key->second);
+      key = key->second.empty() ? subs.keys.erase(key) : std::next(key);
+    }
+    bool unused = subs.all.empty() && subs.keys.empty();
+    table = unused ? m_tables.erase(table) : std::next(table);
+  }
+  m_num_subscriptions -= removed;
+}
+
+// Called with the table locked, so each subscriber sees a table's changes
+// in commit order
+void PubSub::key_changed(Table *table, std::string_view key,
+                         std::string_view value) {
+  if (m_num_subscriptions.load(std::memory_order_relaxed) == 0) {
+    return;
+  }
+  Guard g(m_lock);
+  auto subs = m_tables.find(table->get_name());
+  if (subs == m_tables.end()) {
+    return;
+  }
+  const std::vector<Subscriber *> &all = subs->second.all;
+  publish(all, nullptr, table->get_name(), key, value);
+  auto key_subs = subs->second.keys.find(key);
+  if (key_subs != subs->second.keys.end()) {
+    publish(key_subs->second, &all, table->get_name(), key, value);
+  }
+}
+
+// Queues an event for each of subscribers, except those in skip (which
+// have had it already)
+void PubSub::publish(const std::vector<Subscriber *> &subscribers,
+                     const std::vector<Subscriber *> *skip,
+                     std::string_view table, std::string_view key,
+                     std::string_view value) {
+  for (Subscriber *sub : subscribers) {
+    if (skip && std::find(skip->begin(), skip->end(), sub) != skip->end()) {
+      continue;
+    }
+    if (!sub->push(table, key, value)) {
+      m_dropped++;
+    }
+    m_published++;
+  }
+}
+
+std::string PubSub::get_stats() {
+  return "subscriptions=" + std::to_string(m_num_subscriptions.load()) +
+         ";events_published=" + std::to_string(m_published.load()) +
+         ";events_dropped=" + std::to_string(m_dropped.load()) +
+         ";subscribers_disconnected=" + std::to_string(m_disconnected.load());
+}
@@ -0,0 +1,123 @@
+#ifndef PUBSUB_H
+#define PUBSUB_H
+
+#include "table.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <pthread.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Change notifications. A connection which sends WATCH <table> <key> or
+// SUBSCRIBE <table> gets a Subscriber, and every change committed to a
+// watched key (by SET, COMMIT, LOAD or replication) is queued on it as
+//
+//   EVENT <table> <key> <value>
+//
+// to be sent while the connection waits for its next request. Events
+// never split a response, but may come between any two responses.
+//
+// Each subscriber's queue is bounded. When a subscriber falls behind by
+// more than the queue length, the oldest events are dropped and the
+// subscriber is sent DROPPED <count> before the rest, or, with the
+// disconnect policy, it is disconnected.
+class Subscriber {
+public:
+  struct Event {
+    std::string table;
+    std::string key;
+    std::string value;
+  };
+
+private:
+  pthread_mutex_t m_lock; // protects everything below but m_event_fd
+  int m_event_fd;         // eventfd, readable while events are queued
+  bool m_signalled;       // m_event_fd has been written to
+  // Ring of queued events; slots keep their buffers, so queueing only
+  // allocates for values longer than any seen before
+  std::vector<Event> m_ring;
+  size_t m_head, m_count;
+  uint64_t m_dropped; // since the last take()
+  bool m_disconnect;  // overflow policy
+  bool m_overflowed;  // the queue overflowed under the disconnect policy
+
+  // copy constructor and assignment operator are prohibited
+  Subscriber(const Subscriber &);
+  Subscriber &operator=(const Subscriber &);
+
+public:
+  Subscriber(size_t max_queued, bool disconnect);
+  ~Subscriber();
+
+  // Becomes readable when events are queued; take() resets it
+  int get_fd() const { return m_event_fd; }
+
+  // Queues an event. Returns false if an event had to be dropped.
+  bool push(std::string_view table, std::string_view key,
+            std::string_view value);
+  // Moves the queued events to events (reusing its elements) and returns
+  // how many were dropped since the last call. Returns false instead if
+  // the subscriber overflowed under the disconnect policy.
+  bool take(std::vector<Event> &events, uint64_t &dropped);
+  // Discards the queued events
+  void clear();
+};
+
+// Routes committed changes to subscribers. Registered as a listener on
+// every table; with no subscriptions, a change costs one atomic load.
+class PubSub : public TableListener {
+private:
+  // Subscribers to one table: to all of its keys, or to single keys
+  struct TableSubscribers {
+    std::vector<Subscriber *> all;
+    std::map<std::string, std::vector<Subscriber *>, std::less<>> keys;
+  };
+
+  pthread_mutex_t m_lock; // protects m_tables
+  std::map<std::string, TableSubscribers, std::less<>> m_tables;
+  std::atomic<size_t> m_num_subscriptions;
+  size_t m_max_queued;
+  bool m_disconnect;
+  std::atomic<uint64_t> m_published;    // events queued
+  std::atomic<uint64_t> m_dropped;      // events dropped by full queues
+  std::atomic<uint64_t> m_disconnected; // slow subscribers disconnected
+
+  static bool add(std::vector<Subscriber *> &subscribers, Subscriber *sub);
+  void publish(const std::vector<Subscriber *> &subscribers,
+               const std::vector<Subscriber *> *skip, std::string_view table,
+               std::string_view key, std::string_view value);
+
+  // copy constructor and assignment operator are prohibited
+  PubSub(const PubSub &);
+  PubSub &operator=(const PubSub &);
+
+public:
+  static const size_t DEFAULT_MAX_QUEUED = 1024;
+
+  PubSub();
+  ~PubSub();
+
+  // Applies to subscribers created from then on
+  void set_limits(size_t max_queued, bool disconnect);
+  Subscriber *create_subscriber();
+
+  // Subscribing twice to the same thing has no further effect, and a
+  // subscriber to a table which also watches a key in it gets each
+  // change once
+  void watch(Subscriber *sub, std::string_view table, std::string_view key);
+  void subscribe(Subscriber *sub, std::string_view table);
+  // Removes all of a subscriber's subscriptions; it gets no events once
+  // this returns
+  void unsubscribe(Subscriber *sub);
+
+  void key_changed(Table *table, std::string_view key,
+                   std::string_view value) override;
+
+  void count_disconnect() { m_disconnected++; }
+  std::string get_stats();
+};
+
+#endif // PUBSUB_H
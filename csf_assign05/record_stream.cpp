@@ -0,0 +1,45 @@
+#include "record_stream.h"
+#include "exceptions.h"
+#include <arpa/inet.h>
+#include <cstring>
+
+namespace {
+
+void append_header(std::string &buf, uint32_t key_len, uint32_t value_len) {
+  uint32_t header[2] = {htonl(key_len), htonl(value_len)};
+  buf.append(reinterpret_cast<const char *>(header), sizeof(header));
+}
+
+void read_exactly(rio_t *rio, void *buf, size_t n) {
+  if (n > 0 && rio_readnb(rio, buf, n) != static_cast<ssize_t>(n)) {
+    throw CommException("Record stream ended unexpectedly");
+  }
+}
+
+} // namespace
+
+void RecordStream::append(std::string &buf, std::string_view key,
+                          std::string_view value) {
+  append_header(buf, key.size(), value.size());
+  buf.append(key);
+  buf.append(value);
+}
+
+void RecordStream::append_end(std::string &buf) { append_header(buf, 0, 0); }
+
+bool RecordStream::read(rio_t *rio, std::string &key, std::string &value) {
+  uint32_t header[2];
+  read_exactly(rio, header, sizeof(header));
+  uint32_t key_len = ntohl(header[0]), value_len = ntohl(header[1]);
+  if (key_len == 0) {
+    return false;
+  }
+  if (key_len > MAX_FIELD_LEN || value_len > MAX_FIELD_LEN) {
+    throw InvalidMessage("Record too long");
+  }
+  key.resize(key_len);
+  value.resize(value_len);
+  read_exactly(rio, &key[0], key_len);
+  read_exactly(rio, &value[0], value_len);
+  return true;
+}
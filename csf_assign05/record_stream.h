@@ -0,0 +1,31 @@
+#ifndef RECORD_STREAM_H
+#define RECORD_STREAM_H
+
+#include "csapp.h"
+#include "message.h"
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Binary framing for bulk transfers of key/value pairs (LOAD and DUMP).
+// After the command's OK response, records are sent back to back as
+//
+//   [4 byte key length][4 byte value length][key][value]
+//
+// with lengths in network byte order. A record with an empty key ends
+// the stream.
+namespace RecordStream {
+// Longest key or value accepted in a stream (anything longer couldn't be
+// sent in a regular message anyway)
+const uint32_t MAX_FIELD_LEN = Message::MAX_ENCODED_LEN;
+
+void append(std::string &buf, std::string_view key, std::string_view value);
+void append_end(std::string &buf);
+
+// Reads the next record into key and value (reusing their storage).
+// Returns false at the end of the stream; throws CommException if the
+// connection fails and InvalidMessage for malformed records.
+bool read(rio_t *rio, std::string &key, std::string &value);
+}; // namespace RecordStream
+
+#endif // RECORD_STREAM_H
@@ -0,0 +1,590 @@
+#include "replication.h"
+#include "csapp.h"
+#include "exceptions.h"
+#include "guard.h"
+#include "server.h"
+#include "value_codec.h"
+#include <cerrno>
+#include <charconv>
+#include <sys/socket.h>
+#include <time.h>
+#include <vector>
+
+namespace {
+
+// Changes are sent in batches of at most this many entries
+const size_t BATCH_SIZE = 1024;
+// Snapshot records are committed on the replica in batches of this size
+const size_t SNAPSHOT_BATCH_SIZE = 4096;
+// Buffered stream data is written once it reaches this size
+const size_t FLUSH_SIZE = 64 * 1024;
+// and read by the replica through a buffer of this size
+const size_t STREAM_BUFFER_SIZE = 64 * 1024;
+// Delay before reconnecting to the primary
+const unsigned RECONNECT_DELAY_SECS = 1;
+
+// Splits line at single spaces into at most n fields; the last field
+// takes the rest of the line (so it may be empty, or contain spaces).
+// Returns the number of fields.
+size_t split_fields(std::string_view line, std::string_view *fields,
+                    size_t n) {
+  size_t count = 0;
+  while (count + 1 < n) {
+    size_t pos = line.find(' ');
+    if (pos == std::string_view::npos) {
+      break;
+    }
+    fields[count++] = line.substr(0, pos);
+    line.remove_prefix(pos + 1);
+  }
+  fields[count++] = line;
+  return count;
+}
+
+uint64_t parse_u64(std::string_view field) {
+  uint64_t result;
+  auto res = std::from_chars(field.data(), field.data() + field.size(), result);
+  if (res.ec != std::errc() || res.ptr != field.data() + field.size()) {
+    throw InvalidMessage("Invalid number in replication stream");
+  }
+  return result;
+}
+
+void append_u64(std::string &buf, uint64_t value) {
+  char digits[24];
+  auto res = std::to_chars(digits, digits + sizeof(digits), value);
+  buf.append(digits, res.ptr);
+}
+
+} // namespace
+
+uint64_t Replication::wall_clock_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+////////////////////////////////////////////////////////////////////////
+// ReplicationLog
+////////////////////////////////////////////////////////////////////////
+
+ReplicationLog::ReplicationLog(size_t max_entries)
+    : m_active(false), m_last_seq(0), m_next_id(0),
+      m_max_entries(max_entries) {
+  pthread_mutex_init(&m_lock, NULL);
+  pthread_cond_init(&m_cond, NULL);
+}
+
+ReplicationLog::~ReplicationLog() {
+  pthread_cond_destroy(&m_cond);
+  pthread_mutex_destroy(&m_lock);
+}
+
+void ReplicationLog::key_changed(Table *table, std::string_view key,
+                                 std::string_view value) {
+  // Without replicas this is the only cost of replication. A change
+  // missed while a replica attaches is covered by its snapshot, which
+  // is taken under the table lock.
+  if (!m_active.load(std::memory_order_relaxed)) {
+    return;
+  }
+  ReplicationEntry entry{'S', 0, 0, table->get_name(), std::string(key),
+                         std::string(value), 0};
+  Guard g(m_lock);
+  auto commit = m_commits.find(table);
+  if (commit != m_commits.end()) {
+    commit->second.push_back(std::move(entry));
+  } else {
+    append(std::move(entry));
+  }
+}
+
+void ReplicationLog::table_created(Table *table) {
+  if (!m_active.load(std::memory_order_relaxed)) {
+    return;
+  }
+  Guard g(m_lock);
+  append(ReplicationEntry{'C', 0, 0, table->get_name(), "", "", 0});
+}
+
+// The table stays locked until commit_finished(), so its commit's
+// changes can be collected by table
+void ReplicationLog::commit_started(Table *table, size_t num_keys) {
+  if (!m_active.load(std::memory_order_relaxed)) {
+    return;
+  }
+  Guard g(m_lock);
+  std::vector<ReplicationEntry> &changes = m_commits[table];
+  changes.clear();
+  changes.reserve(num_keys);
+}
+
+// Logs the commit as a B entry followed by its changes, with no other
+// entry between them
+void ReplicationLog::commit_finished(Table *table) {
+  Guard g(m_lock);
+  auto commit = m_commits.find(table);
+  if (commit == m_commits.end()) {
+    return;
+  }
+  std::vector<ReplicationEntry> changes = std::move(commit->second);
+  m_commits.erase(commit);
+  if (changes.empty()) {
+    return;
+  }
+  uint64_t time_ns = Replication::wall_clock_ns();
+  append(ReplicationEntry{'B', 0, time_ns, table->get_name(), "", "",
+                          changes.size()});
+  for (ReplicationEntry &entry : changes) {
+    entry.time_ns = time_ns;
+    append(std::move(entry));
+  }
+}
+
+// Logs entry with the next seq, and the current time unless it has one.
+// Caller must hold m_lock.
+void ReplicationLog::append(ReplicationEntry &&entry) {
+  if (m_sent.empty()) {
+    return; // the last replica detached
+  }
+  entry.seq = ++m_last_seq;
+  if (entry.time_ns == 0) {
+    entry.time_ns = Replication::wall_clock_ns();
+  }
+  m_entries.push_back(std::move(entry));
+  if (m_entries.size() > m_max_entries) {
+    // The slowest replica will notice the gap and be dropped
+    m_entries.pop_front();
+  }
+  pthread_cond_broadcast(&m_cond);
+}
+
+// Discards entries every replica has been sent. Caller must hold m_lock.
+void ReplicationLog::trim() {
+  if (m_sent.empty()) {
+    m_entries.clear();
+    return;
+  }
+  uint64_t min_sent = m_last_seq;
+  for (const auto &entry : m_sent) {
+    min_sent = std::min(min_sent, entry.second);
+  }
+  while (!m_entries.empty() && m_entries.front().seq <= min_sent) {
+    m_entries.pop_front();
+  }
+}
+
+int ReplicationLog::attach(uint64_t &position) {
+  Guard g(m_lock);
+  int id = m_next_id++;
+  position = m_last_seq;
+  m_sent[id] = position;
+  m_active.store(true, std::memory_order_relaxed);
+  return id;
+}
+
+void ReplicationLog::detach(int id) {
+  Guard g(m_lock);
+  m_sent.erase(id);
+  if (m_sent.empty()) {
+    m_active.store(false, std::memory_order_relaxed);
+  }
+  trim();
+}
+
+bool ReplicationLog::wait_for_entries(int id, uint64_t position,
+                                      std::vector<ReplicationEntry> &out,
+                                      size_t max_count, int timeout_ms) {
+  Guard g(m_lock);
+  m_sent[id] = position;
+  trim();
+
+  if (m_last_seq <= position) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += long(timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    while (m_last_seq <= position) {
+      if (pthread_cond_timedwait(&m_cond, &m_lock, &deadline) == ETIMEDOUT) {
+        break;
+      }
+    }
+  }
+
+  // m_entries holds a contiguous range of seqs ending at m_last_seq
+  uint64_t first_seq = m_last_seq - m_entries.size() + 1;
+  if (position + 1 < first_seq) {
+    return false;
+  }
+  for (size_t i = position + 1 - first_seq;
+       i < m_entries.size() && out.size() < max_count; i++) {
+    out.push_back(m_entries[i]);
+  }
+  return true;
+}
+
+uint64_t ReplicationLog::get_last_seq() {
+  Guard g(m_lock);
+  return m_last_seq;
+}
+
+int ReplicationLog::get_num_replicas() {
+  Guard g(m_lock);
+  return m_sent.size();
+}
+
+////////////////////////////////////////////////////////////////////////
+// ReplicationFeed
+////////////////////////////////////////////////////////////////////////
+
+ReplicationFeed::ReplicationFeed(Server *server, int fd)
+    : m_server(server), m_fd(fd), m_log(server->get_replication_log()),
+      m_batch_left(0) {
+  // Attach before taking the snapshot, so no change can fall between
+  // the snapshot and the log
+  m_id = m_log.attach(m_position);
+  m_buf.reserve(FLUSH_SIZE + 2 * Message::MAX_ENCODED_LEN);
+}
+
+ReplicationFeed::~ReplicationFeed() { m_log.detach(m_id); }
+
+void ReplicationFeed::run() {
+  send_snapshot();
+
+  std::vector<ReplicationEntry> entries;
+  uint64_t last_heartbeat = 0;
+  while (1) {
+    if (m_server->is_draining()) {
+      throw CommException("Server is shutting down");
+    }
+    entries.clear();
+    if (!m_log.wait_for_entries(m_id, m_position, entries, BATCH_SIZE,
+                                Replication::HEARTBEAT_MS)) {
+      throw CommException("Replica fell too far behind");
+    }
+    send_entries(entries);
+
+    // Heartbeats go out when idle, and periodically under load so the
+    // replica can tell how far behind it is, but not in the middle of a
+    // commit's lines
+    uint64_t now = Replication::wall_clock_ns();
+    if (m_batch_left == 0 &&
+        (entries.empty() ||
+         now - last_heartbeat >= Replication::HEARTBEAT_MS * 1000000ULL)) {
+      send_heartbeat();
+      last_heartbeat = now;
+    }
+    flush();
+  }
+}
+
+void ReplicationFeed::send_snapshot() {
+  for (const std::shared_ptr<Table> &table : m_server->get_tables()) {
+    table->lock("REPLICATE");
+    // Changes to the table are logged with its lock held, so everything
+    // up to this seq is in the snapshot, and nothing after it is
+    m_snapshot_seqs[table->get_name()] = m_log.get_last_seq();
+    std::unique_ptr<StorageEngine::Snapshot> snapshot = table->snapshot();
+    table->unlock();
+
+    m_buf += "T ";
+    m_buf += table->get_name();
+    m_buf += '\n';
+    std::string scratch;
+    snapshot->for_each([&](std::string_view key, std::string_view value) {
+      m_buf += "P ";
+      m_buf += key;
+      m_buf += ' ';
+      m_buf += ValueCodec::decode(value, scratch);
+      m_buf += '\n';
+      if (m_buf.size() >= FLUSH_SIZE) {
+        flush();
+      }
+    });
+  }
+  m_buf += "E\n";
+  flush();
+}
+
+void ReplicationFeed::send_entries(
+    const std::vector<ReplicationEntry> &entries) {
+  for (const ReplicationEntry &entry : entries) {
+    m_position = entry.seq;
+    if (entry.type != 'C') {
+      auto it = m_snapshot_seqs.find(entry.table);
+      if (it != m_snapshot_seqs.end() && entry.seq <= it->second) {
+        continue; // already in the snapshot
+      }
+    }
+    m_buf += entry.type;
+    m_buf += ' ';
+    append_u64(m_buf, entry.seq);
+    m_buf += ' ';
+    append_u64(m_buf, entry.time_ns);
+    m_buf += ' ';
+    m_buf += entry.table;
+    if (entry.type == 'S') {
+      m_buf += ' ';
+      m_buf += entry.key;
+      m_buf += ' ';
+      m_buf += entry.value;
+      if (m_batch_left > 0) {
+        m_batch_left--;
+      }
+    } else if (entry.type == 'B') {
+      m_buf += ' ';
+      append_u64(m_buf, entry.count);
+      m_batch_left = entry.count;
+    }
+    m_buf += '\n';
+    if (m_buf.size() >= FLUSH_SIZE) {
+      flush();
+    }
+  }
+}
+
+void ReplicationFeed::send_heartbeat() {
+  m_buf += "H ";
+  append_u64(m_buf, m_position);
+  m_buf += ' ';
+  append_u64(m_buf, m_log.get_last_seq());
+  m_buf += ' ';
+  append_u64(m_buf, Replication::wall_clock_ns());
+  m_buf += '\n';
+}
+
+void ReplicationFeed::flush() {
+  if (m_buf.empty()) {
+    return;
+  }
+  if (rio_writen(m_fd, m_buf.data(), m_buf.size()) !=
+      static_cast<ssize_t>(m_buf.size())) {
+    throw CommException("Failed to write to replica");
+  }
+  m_buf.clear();
+}
+
+////////////////////////////////////////////////////////////////////////
+// ReplicaClient
+////////////////////////////////////////////////////////////////////////
+
+ReplicaClient::ReplicaClient(Server *server, const std::string &host,
+                             const std::string &port)
+    : m_server(server), m_host(host), m_port(port), m_connected(false),
+      m_caught_up(false), m_applied_seq(0), m_primary_seq(0),
+      m_applied_time_ns(0), m_syncs(0), m_fd(-1), m_stopping(false),
+      m_started(false) {
+  pthread_mutex_init(&m_lock, NULL);
+}
+
+ReplicaClient::~ReplicaClient() {
+  {
+    Guard g(m_lock);
+    m_stopping = true;
+    if (m_fd >= 0) {
+      shutdown(m_fd, SHUT_RDWR); // wakes up the worker
+    }
+  }
+  if (m_started) {
+    pthread_join(m_thread, NULL);
+  }
+  pthread_mutex_destroy(&m_lock);
+}
+
+void ReplicaClient::start() {
+  if (pthread_create(&m_thread, NULL, worker, this) != 0) {
+    m_server->log_error("Could not create replication thread");
+    return;
+  }
+  m_started = true;
+}
+
+bool ReplicaClient::is_stopping() {
+  Guard g(m_lock);
+  return m_stopping;
+}
+
+void *ReplicaClient::worker(void *arg) {
+  ReplicaClient *replica = static_cast<ReplicaClient *>(arg);
+  while (!replica->is_stopping()) {
+    int fd = open_clientfd(replica->m_host.c_str(), replica->m_port.c_str());
+    if (fd >= 0) {
+      {
+        Guard g(replica->m_lock);
+        replica->m_fd = fd;
+      }
+      try {
+        if (!replica->is_stopping()) {
+          replica->replicate(fd);
+        }
+      } catch (std::exception &ex) {
+        if (!replica->is_stopping()) {
+          replica->m_server->log(LogLevel::WARN, "replication", ex.what());
+        }
+      }
+      {
+        Guard g(replica->m_lock);
+        replica->m_fd = -1;
+        close(fd);
+      }
+      replica->m_connected = false;
+      replica->m_caught_up = false;
+    }
+    // Wait before reconnecting, in steps so stopping isn't delayed
+    for (unsigned i = 0; i < RECONNECT_DELAY_SECS * 10; i++) {
+      if (replica->is_stopping()) {
+        break;
+      }
+      usleep(100000);
+    }
+  }
+  return nullptr;
+}
+
+// Runs one replication session, until the connection fails
+void ReplicaClient::replicate(int fd) {
+  rio_t rio;
+  rio_readinitb(&rio, fd);
+  std::vector<char> rio_buf(STREAM_BUFFER_SIZE);
+  rio_setbuf(&rio, rio_buf.data(), rio_buf.size());
+  const char request[] = "LOGIN replica\nREPLICATE\n";
+  if (rio_writen(fd, request, sizeof(request) - 1) !=
+      static_cast<ssize_t>(sizeof(request) - 1)) {
+    throw CommException("Failed to write to primary");
+  }
+
+  const char *buf;
+  for (int i = 0; i < 2; i++) {
+    ssize_t len = rio_readlinev(&rio, &buf, MAXLINE);
+    if (len <= 0) {
+      throw CommException("Lost connection to primary");
+    }
+    if (std::string_view(buf, len) != "OK\n") {
+      throw OperationException("Primary refused replication: " +
+                               std::string(buf, len - 1));
+    }
+  }
+
+  // The snapshot reflects the primary's data as of (at least) now
+  m_applied_time_ns = Replication::wall_clock_ns();
+  m_connected = true;
+  m_syncs++;
+
+  Table *pending_table = nullptr;
+  WriteSet pending_writes;
+  size_t batch_left = 0;
+  while (1) {
+    ssize_t len = rio_readlinev(&rio, &buf, MAXLINE);
+    if (len <= 0) {
+      throw CommException("Lost connection to primary");
+    }
+    if (buf[len - 1] != '\n') {
+      throw InvalidMessage("Replication stream line too long");
+    }
+    apply_line(std::string_view(buf, len - 1), pending_table, pending_writes,
+               batch_left);
+  }
+}
+
+// Applies one line of the stream. Snapshot records are collected in
+// pending_writes and committed to pending_table in batches, and so are
+// the batch_left S records still to come of a B line's commit.
+void ReplicaClient::apply_line(std::string_view line, Table *&pending_table,
+                               WriteSet &pending_writes, size_t &batch_left) {
+  std::string_view fields[6];
+  size_t num_fields = split_fields(line, fields, 6);
+  if (fields[0].size() != 1) {
+    throw InvalidMessage("Invalid replication stream record");
+  }
+  char type = fields[0][0];
+
+  if (batch_left > 0) {
+    if (type != 'S' || num_fields != 6 ||
+        fields[3] != pending_table->get_name()) {
+      throw InvalidMessage("Incomplete commit in replication stream");
+    }
+    pending_writes.put(fields[4], fields[5]);
+    if (--batch_left == 0) {
+      pending_table->lock("REPLICA");
+      pending_table->commit_changes(pending_writes);
+      pending_table->unlock();
+      pending_table = nullptr;
+      m_applied_seq = parse_u64(fields[1]);
+      m_applied_time_ns = parse_u64(fields[2]);
+    }
+    return;
+  }
+
+  if (type == 'P' || type == 'T' || type == 'E') {
+    // Commit the current batch when it is full, or the table changes
+    bool end_batch =
+        type != 'P' || pending_writes.size() >= SNAPSHOT_BATCH_SIZE;
+    if (end_batch && pending_table && !pending_writes.empty()) {
+      pending_table->lock("REPLICA");
+      pending_table->commit_changes(pending_writes);
+      pending_table->unlock();
+    }
+    if (type == 'T' && num_fields == 2) {
+      pending_table = m_server->find_or_create_table(fields[1]);
+    } else if (type == 'P' && num_fields == 3 && pending_table) {
+      pending_writes.put(fields[1], fields[2]);
+    } else if (type == 'E' && num_fields == 1) {
+      pending_table = nullptr;
+    } else {
+      throw InvalidMessage("Invalid replication snapshot record");
+    }
+    return;
+  }
+
+  if (type == 'S' && num_fields == 6) {
+    Table *table = m_server->find_or_create_table(fields[3]);
+    table->lock("REPLICA");
+    table->set(fields[4], fields[5]);
+    table->unlock();
+  } else if (type == 'C' && num_fields == 4) {
+    m_server->find_or_create_table(fields[3]);
+  } else if (type == 'B' && num_fields == 5) {
+    // Applied once its last S line has arrived
+    batch_left = parse_u64(fields[4]);
+    if (batch_left == 0) {
+      throw InvalidMessage("Empty commit in replication stream");
+    }
+    pending_table = m_server->find_or_create_table(fields[3]);
+    return;
+  } else if (type == 'H' && num_fields == 4) {
+    uint64_t sent = parse_u64(fields[1]), last = parse_u64(fields[2]);
+    m_applied_seq = sent;
+    m_primary_seq = last;
+    m_caught_up = sent >= last;
+    if (sent >= last) {
+      m_applied_time_ns = parse_u64(fields[3]);
+    }
+    return;
+  } else {
+    throw InvalidMessage("Invalid replication stream record");
+  }
+  m_applied_seq = parse_u64(fields[1]);
+  m_applied_time_ns = parse_u64(fields[2]);
+}
+
+std::string ReplicaClient::get_stats() {
+  uint64_t applied = m_applied_seq, primary = m_primary_seq;
+  uint64_t lag_ms = 0;
+  if (!m_caught_up) {
+    uint64_t now = Replication::wall_clock_ns();
+    uint64_t applied_time = m_applied_time_ns;
+    lag_ms = now > applied_time ? (now - applied_time) / 1000000 : 0;
+  }
+  return "role=replica;primary=" + m_host + ":" + m_port +
+         ";repl_connected=" + (m_connected ? "yes" : "no") +
+         ";repl_syncs=" + std::to_string(m_syncs.load()) +
+         ";repl_applied_seq=" + std::to_string(applied) +
+         ";repl_primary_seq=" + std::to_string(primary) +
+         ";repl_lag_entries=" +
+         std::to_string(primary > applied ? primary - applied : 0) +
+         ";repl_lag_ms=" + std::to_string(lag_ms);
+}
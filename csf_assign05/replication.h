@@ -0,0 +1,182 @@
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include "table.h"
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <pthread.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class Server;
+
+// Asynchronous primary/replica replication.
+//
+// A replica connects to its primary like a regular client and sends
+// REPLICATE. After the OK response, the connection carries a stream of
+// newline-terminated lines, with fields separated by single spaces:
+//
+//   T <table>                        snapshot of a table follows
+//   P <key> <value>                  snapshot record, of the last table
+//   E                                end of the snapshot
+//   C <seq> <time> <table>           table created
+//   S <seq> <time> <table> <key> <value>   key set
+//   B <seq> <time> <table> <count>   the next <count> S lines are one
+//                                    commit
+//   H <sent seq> <last seq> <time>   heartbeat
+//
+// Sequence numbers order all changes committed on the primary; <time> is
+// the primary's wall clock time (nanoseconds since the epoch) at commit.
+// A replica applies a B line's S lines together, as one commit, and a
+// lone S line (an autocommit SET) by itself.
+// A heartbeat says that every change up to <sent seq> has been sent,
+// and that the primary has committed changes up to <last seq>.
+namespace Replication {
+// Heartbeats are sent at least this often
+const int HEARTBEAT_MS = 100;
+
+uint64_t wall_clock_ns();
+}; // namespace Replication
+
+// One committed change
+struct ReplicationEntry {
+  char type; // 'C', 'S' or 'B', as in the stream
+  uint64_t seq;
+  uint64_t time_ns;
+  std::string table;
+  std::string key;
+  std::string value;
+  size_t count; // for 'B', the S entries which follow
+};
+
+// Primary side: records committed changes, in commit order, while at
+// least one replica is attached. Entries are discarded once every
+// attached replica has been sent them; a replica which falls more than
+// max_entries behind is dropped (it resynchronizes when it reconnects).
+class ReplicationLog : public TableListener {
+private:
+  pthread_mutex_t m_lock; // protects everything below but m_active
+  pthread_cond_t m_cond;  // signalled when entries are added
+  std::atomic<bool> m_active; // true while replicas are attached
+  std::deque<ReplicationEntry> m_entries;
+  uint64_t m_last_seq;             // seq of the last entry logged
+  std::map<int, uint64_t> m_sent;  // replica id -> last seq sent to it
+  int m_next_id;
+  size_t m_max_entries;
+  // The changes of commits in progress, logged once they are complete
+  std::map<Table *, std::vector<ReplicationEntry>> m_commits;
+
+  void append(ReplicationEntry &&entry);
+  void trim();
+
+  // copy constructor and assignment operator are prohibited
+  ReplicationLog(const ReplicationLog &);
+  ReplicationLog &operator=(const ReplicationLog &);
+
+public:
+  ReplicationLog(size_t max_entries = 1000000);
+  ~ReplicationLog();
+
+  void key_changed(Table *table, std::string_view key,
+                   std::string_view value) override;
+  void table_created(Table *table) override;
+  void commit_started(Table *table, size_t num_keys) override;
+  void commit_finished(Table *table) override;
+
+  // Attaches a replica and starts logging. Returns the replica's id;
+  // position is set to the last seq logged so far.
+  int attach(uint64_t &position);
+  void detach(int id);
+
+  // Waits up to timeout_ms for entries after position, and copies up to
+  // max_count of them into out. Returns false if the entries after
+  // position have already been discarded.
+  bool wait_for_entries(int id, uint64_t position,
+                        std::vector<ReplicationEntry> &out, size_t max_count,
+                        int timeout_ms);
+
+  uint64_t get_last_seq();
+  int get_num_replicas();
+};
+
+// Primary side: sends the snapshot and change stream to one replica
+// over a client connection which sent REPLICATE. run() only returns by
+// throwing CommException, when the replica goes away or the server shuts
+// down.
+class ReplicationFeed {
+private:
+  Server *m_server;
+  int m_fd;
+  ReplicationLog &m_log;
+  int m_id;
+  uint64_t m_position; // last seq sent
+  size_t m_batch_left; // S lines still to send of the last B line's commit
+  std::string m_buf;
+  // seq at which each table was snapshotted; earlier changes to the
+  // table are already in the snapshot
+  std::map<std::string, uint64_t, std::less<>> m_snapshot_seqs;
+
+  void send_snapshot();
+  void send_entries(const std::vector<ReplicationEntry> &entries);
+  void send_heartbeat();
+  void flush();
+
+  // copy constructor and assignment operator are prohibited
+  ReplicationFeed(const ReplicationFeed &);
+  ReplicationFeed &operator=(const ReplicationFeed &);
+
+public:
+  ReplicationFeed(Server *server, int fd);
+  ~ReplicationFeed();
+
+  void run();
+};
+
+// Replica side: a thread which keeps a connection to the primary,
+// applying the stream to the local tables and reconnecting (with a full
+// resynchronization) whenever the connection is lost.
+class ReplicaClient {
+private:
+  Server *m_server;
+  std::string m_host;
+  std::string m_port;
+
+  std::atomic<bool> m_connected;
+  std::atomic<bool> m_caught_up;       // as of the last heartbeat
+  std::atomic<uint64_t> m_applied_seq; // last primary seq applied
+  std::atomic<uint64_t> m_primary_seq; // primary's last seq, as of the last heartbeat
+  std::atomic<uint64_t> m_applied_time_ns; // commit time of the last change applied
+  std::atomic<uint64_t> m_syncs;       // full resynchronizations
+
+  pthread_mutex_t m_lock; // protects m_fd and m_stopping
+  int m_fd;               // connection to the primary, or -1
+  bool m_stopping;
+  bool m_started;
+  pthread_t m_thread;
+
+  static void *worker(void *arg);
+  bool is_stopping();
+  void replicate(int fd);
+  void apply_line(std::string_view line, Table *&pending_table,
+                  WriteSet &pending_writes, size_t &batch_left);
+
+  // copy constructor and assignment operator are prohibited
+  ReplicaClient(const ReplicaClient &);
+  ReplicaClient &operator=(const ReplicaClient &);
+
+public:
+  ReplicaClient(Server *server, const std::string &host,
+                const std::string &port);
+  // Stops the thread
+  ~ReplicaClient();
+
+  void start();
+
+  // Replication state formatted for STATS
+  std::string get_stats();
+};
+
+#endif // REPLICATION_H
@@ -1,80 +1,555 @@
 #include "server.h"
+#include "cpu_topology.h"
 #include "csapp.h"
+#include "epoch.h"
 #include "exceptions.h"
 #include "guard.h"
+#include "io_channel.h"
+#include "value_codec.h"
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
 #include <iostream>
 #include <memory>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
 
-Server::Server() {
-  server_socket_fd = socket(AF_INET, SOCK_STREAM, 0); // server socket
-  if (server_socket_fd < 0) {
-    log_error("Error creating server socket\n");
+namespace {
+
+// The numeric host of a peer address, e.g. "127.0.0.1"
+std::string format_address(const struct sockaddr_storage &addr,
+                            socklen_t addrlen) {
+  char host[NI_MAXHOST];
+  if (getnameinfo(reinterpret_cast<const struct sockaddr *>(&addr), addrlen,
+                  host, sizeof(host), NULL, 0, NI_NUMERICHOST) != 0) {
+    return "unknown";
   }
+  return host;
+}
+
+} // namespace
+
+Server::Server()
+    : m_accepted(0), m_next_loop(0), m_pin_threads(false), m_numa(false),
+      m_next_node(0), m_num_clients(0), m_max_clients(DEFAULT_MAX_CLIENTS),
+      m_max_clients_per_addr(0), m_idle_timeout_secs(DEFAULT_IDLE_TIMEOUT_SECS),
+      m_read_buffer_size(RIO_BUFSIZE),
+      m_rejected(0), m_idle_timeouts(0), m_draining(false),
+      m_force_close(false), m_log(new Logger(STDERR_FILENO)),
+      m_compactor_started(false), m_compactor_stopping(false) {
+  pthread_mutex_init(&m_compactor_lock, NULL);
+  pthread_cond_init(&m_compactor_cond, NULL);
+  pthread_mutex_init(&m_clients_lock, NULL);
+  pthread_cond_init(&m_clients_cond, NULL);
+  m_db.add_listener(&m_replication_log);
+  m_db.add_listener(&m_pubsub);
+  m_db.set_log(m_log.get());
+  m_db.get_stack_pool().set_limits(DEFAULT_MAX_STACK_DEPTH,
+                                   DEFAULT_MAX_STACK_BYTES);
 }
 
 Server::~Server() {
-  if (server_socket_fd >= 0) {
-    close(server_socket_fd); // Close server socket
+  if (m_compactor_started) {
+    // Tables must outlive the compactor
+    {
+      Guard g(m_compactor_lock);
+      m_compactor_stopping = true;
+      pthread_cond_signal(&m_compactor_cond);
+    }
+    pthread_join(m_compactor, NULL);
+  }
+  m_node_loops.clear();
+  m_loops.clear(); // stops their threads
+  for (int fd : m_listen_fds) {
+    close(fd); // Close server sockets
   }
 
-  // Table closing handeled in table deconstructor.
+  pthread_mutex_destroy(&m_compactor_lock);
+  pthread_cond_destroy(&m_compactor_cond);
+  pthread_mutex_destroy(&m_clients_lock);
+  pthread_cond_destroy(&m_clients_cond);
 }
 
-void Server::listen(const std::string &port) {
-  server_socket_fd = open_listenfd(
-      port.c_str()); // Open server socket and establish client connection
-  if (server_socket_fd < 0) {
-    log_error("Error opening server socket\n");
+void Server::listen(const std::string &port, int num_acceptors) {
+  if (num_acceptors <= 1) {
+    // Open server socket and establish client connection
+    int fd = open_listenfd(port.c_str());
+    if (fd < 0) {
+      throw CommException("Error opening server socket");
+    }
+    m_listen_fds.push_back(fd);
+    return;
+  }
+  for (int i = 0; i < num_acceptors; i++) {
+    int fd = open_listenfd_reuseport(port.c_str());
+    if (fd < 0) {
+      throw CommException("Error opening server socket");
+    }
+    m_listen_fds.push_back(fd);
   }
 }
 
-/**/
+// Accepts connections on every listening socket, one thread per socket,
+// until shutdown() is called; then waits for the connections to finish
 void Server::server_loop() {
+  {
+    // Skipped if shutdown() came first, when there were no sockets to
+    // wake up
+    Guard g(m_clients_lock);
+    for (size_t i = 0; i < m_listen_fds.size() && !m_draining; i++) {
+      // With an acceptor for each node, connections stay on the node
+      // which accepted them; otherwise they are spread over the nodes
+      AcceptorParams *params = new AcceptorParams{this, m_listen_fds[i], -1};
+      pthread_attr_t attr;
+      pthread_attr_init(&attr);
+      unsigned num_nodes = Topology::num_nodes();
+      if (m_numa && m_listen_fds.size() >= num_nodes) {
+        params->node = i % num_nodes;
+        Topology::pin_attr(&attr, Topology::node_cpus(params->node));
+      }
+      pthread_t thr_id;
+      int err = pthread_create(&thr_id, &attr, acceptor_worker, params);
+      pthread_attr_destroy(&attr);
+      if (err != 0) {
+        delete params;
+        throw CommException("Could not create acceptor thread");
+      }
+      m_acceptors.push_back(thr_id);
+    }
+    while (!m_draining) {
+      pthread_cond_wait(&m_clients_cond, &m_clients_lock);
+    }
+  }
+  for (pthread_t thr_id : m_acceptors) {
+    pthread_join(thr_id, NULL);
+  }
+  // Every connection accepted is in m_clients now
+  drain_clients();
+  m_node_loops.clear();
+  m_loops.clear();
+}
+
+void *Server::acceptor_worker(void *arg) {
+  std::unique_ptr<AcceptorParams> params(static_cast<AcceptorParams *>(arg));
+  params->server->accept_loop(params->listen_fd, params->node);
+  return nullptr;
+}
+
+// Accepts connections on listen_fd, serving them on NUMA node node (-1
+// to spread them over the nodes) when connections are placed by node
+void Server::accept_loop(int listen_fd, int node) {
+  std::unique_ptr<Acceptor> acceptor(Acceptor::create(listen_fd));
   while (1) {
-    int client_fd = Accept(server_socket_fd, NULL, NULL);
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    int client_fd = acceptor->accept(&addr, &addrlen);
+    if (m_draining) {
+      // shutdown() woke us up
+      if (client_fd >= 0) {
+        close(client_fd);
+      }
+      return;
+    }
     if (client_fd < 0) {
-      log_error("Error accepting client connection\n");
+      if (errno != EINTR && errno != ECONNABORTED) {
+        log(LogLevel::ERROR, "accept",
+            std::string("Error accepting client connection: ") +
+                strerror(errno));
+      }
+      if (errno == EMFILE || errno == ENFILE) {
+        // Out of descriptors: give clients a chance to disconnect
+        usleep(10000);
+      }
       continue; // Doesn't create client connection
     }
-    ClientConnection *client = new ClientConnection(this, client_fd);
+    m_accepted.fetch_add(1, std::memory_order_relaxed);
+
+    if (m_idle_timeout_secs > 0) {
+      // Reads (and writes) which block for longer fail with EAGAIN
+      struct timeval timeout = {time_t(m_idle_timeout_secs), 0};
+      setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                 sizeof(timeout));
+      setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+                 sizeof(timeout));
+    }
+    ClientConnection *client =
+        new ClientConnection(this, client_fd, format_address(addr, addrlen));
+    if (!add_client(client)) {
+      m_rejected.fetch_add(1, std::memory_order_relaxed);
+      log(LogLevel::WARN, "accept",
+          "Rejected connection from " + client->get_peer() +
+              ": too many connections");
+      client->reject("Too many connections");
+      delete client; // closes client_fd
+      continue;
+    }
+
+    int client_node = -1;
+    if (m_numa) {
+      client_node = node >= 0 ? node : m_next_node++ % Topology::num_nodes();
+    }
+
+    if (!m_loops.empty()) {
+      EventLoop *loop;
+      if (client_node >= 0 && !m_node_loops[client_node].empty()) {
+        const std::vector<EventLoop *> &loops = m_node_loops[client_node];
+        loop = loops[m_next_loop++ % loops.size()];
+      } else {
+        loop = m_loops[m_next_loop++ % m_loops.size()].get();
+      }
+      loop->spawn(serve_async(client, loop));
+      continue;
+    }
 
     // creating a detached thread for the client to allow for concurency and >1
     // connections
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (client_node >= 0) {
+      Topology::pin_attr(&attr, Topology::node_cpus(client_node));
+    }
     pthread_t thr_id;
-    if (pthread_create(&thr_id, NULL, client_worker, client) != 0) {
-      close(client_fd); // clean
+    int err = pthread_create(&thr_id, &attr, client_worker, client);
+    pthread_attr_destroy(&attr);
+    if (err != 0) {
+      remove_client(client); // closes client_fd
       log_error("Could not create client thread");
     }
   }
 }
 
+// Registers a new connection, unless that would exceed a connection limit
+bool Server::add_client(ClientConnection *client) {
+  Guard g(m_clients_lock);
+  unsigned &from_addr = m_clients_per_addr[client->get_peer()];
+  if ((m_max_clients > 0 && m_num_clients >= m_max_clients) ||
+      (m_max_clients_per_addr > 0 && from_addr >= m_max_clients_per_addr)) {
+    if (from_addr == 0) {
+      m_clients_per_addr.erase(client->get_peer());
+    }
+    return false;
+  }
+  from_addr++;
+  m_num_clients++;
+  m_clients.insert(client);
+  return true;
+}
+
+// Unregisters and deletes a connection
+void Server::remove_client(ClientConnection *client) {
+  std::string peer = client->get_peer();
+  {
+    // Once it's out of m_clients, drain_clients() won't touch it
+    Guard g(m_clients_lock);
+    m_clients.erase(client);
+  }
+  delete client; // rolls back its transaction, if any
+  Guard g(m_clients_lock);
+  auto it = m_clients_per_addr.find(peer);
+  if (it != m_clients_per_addr.end() && --it->second == 0) {
+    m_clients_per_addr.erase(it);
+  }
+  m_num_clients--;
+  pthread_cond_broadcast(&m_clients_cond);
+}
+
 void *Server::client_worker(void *arg) {
   pthread_detach(pthread_self()); // we want to develop client seperation so
                                   // we detatch the thread
-  std::unique_ptr<ClientConnection> client(
-      static_cast<ClientConnection *>(arg));
+  ClientConnection *client = static_cast<ClientConnection *>(arg);
+  Server *server = client->get_server();
   try {
     client->chat_with_client();
-  } catch (CommException &ex) { // Just in case of a communication error  }
+  } catch (CommException &ex) { // Just in case of a communication error
+    server->log(LogLevel::DEBUG, "client", ex.what());
   }
+  server->remove_client(client);
   return nullptr;
 }
 
+Task<void> Server::serve_async(ClientConnection *client, EventLoop *loop) {
+  Server *server = client->get_server();
+  try {
+    co_await client->chat_async(loop);
+  } catch (CommException &ex) {
+    server->log(LogLevel::DEBUG, "client", ex.what());
+  }
+  server->remove_client(client);
+}
+
+void Server::set_event_loops(unsigned num_loops) {
+  unsigned num_nodes = m_numa ? Topology::num_nodes() : 1;
+  m_node_loops.resize(num_nodes);
+  std::vector<int> all_cpus = Topology::all_cpus();
+  for (unsigned i = 0; i < num_loops; i++) {
+    // Loops are dealt out to the nodes in turn, and to the cores of each
+    unsigned node = i % num_nodes;
+    const std::vector<int> &cpus =
+        m_numa ? Topology::node_cpus(node) : all_cpus;
+    std::vector<int> loop_cpus;
+    if (m_pin_threads) {
+      loop_cpus.push_back(cpus[(i / num_nodes) % cpus.size()]);
+    } else if (m_numa) {
+      loop_cpus = cpus;
+    }
+    m_loops.emplace_back(new EventLoop());
+    m_loops.back()->start(loop_cpus);
+    m_node_loops[node].push_back(m_loops.back().get());
+  }
+}
+
+void Server::set_placement(bool pin, bool numa) {
+  m_pin_threads = pin;
+  m_numa = numa;
+  m_db.set_numa_homes(numa);
+}
+
+void Server::set_connection_limits(unsigned max_clients,
+                                   unsigned max_per_addr) {
+  m_max_clients = max_clients;
+  m_max_clients_per_addr = max_per_addr;
+}
+
+void Server::set_idle_timeout(unsigned seconds) {
+  m_idle_timeout_secs = seconds;
+}
+
+void Server::set_read_buffer_size(size_t bytes) {
+  m_read_buffer_size = std::max(bytes, size_t(RIO_BUFSIZE));
+}
+
+void Server::count_idle_timeout() {
+  m_idle_timeouts.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Server::shutdown() {
+  Guard g(m_clients_lock);
+  if (m_draining) {
+    m_force_close = true;
+  } else {
+    m_draining = true;
+    // Wake up the acceptor threads
+    for (int fd : m_listen_fds) {
+      ::shutdown(fd, SHUT_RDWR);
+    }
+  }
+  pthread_cond_broadcast(&m_clients_cond);
+}
+
+// Waits for the connections to finish their current requests, closing
+// them if they take too long
+void Server::drain_clients() {
+  Guard g(m_clients_lock);
+  log(LogLevel::INFO, "server",
+      "Shutting down, waiting for " + std::to_string(m_num_clients) +
+          " connections");
+  for (ClientConnection *client : m_clients) {
+    client->interrupt_if_idle();
+  }
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += DRAIN_TIMEOUT_SECS;
+  while (m_num_clients > 0 && !m_force_close) {
+    if (pthread_cond_timedwait(&m_clients_cond, &m_clients_lock, &deadline) ==
+        ETIMEDOUT) {
+      break;
+    }
+  }
+  if (m_num_clients > 0) {
+    log(LogLevel::WARN, "server",
+        "Closing " + std::to_string(m_num_clients) + " busy connections");
+    for (ClientConnection *client : m_clients) {
+      client->interrupt();
+    }
+    while (m_num_clients > 0) {
+      pthread_cond_wait(&m_clients_cond, &m_clients_lock);
+    }
+  }
+  log(LogLevel::INFO, "server", "Shutdown complete");
+}
+
+void Server::configure_logging(LogLevel level, bool json) {
+  m_log.reset(new Logger(STDERR_FILENO, json));
+  m_log->set_level(level);
+  m_db.set_log(m_log.get());
+}
+
+void Server::open_access_log(const std::string &path) {
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (fd < 0) {
+    throw CommException("Could not open access log " + path);
+  }
+  // Every request is logged, so no rate limit
+  m_access_log.reset(new Logger(fd, true, 8192, 0));
+}
+
+void Server::log(LogLevel level, const char *msg_class,
+                 std::string_view message) {
+  m_log->log(level, msg_class, message);
+}
+
 void Server::log_error(const std::string &what) {
-  std::cerr << "Error: " << what << "\n";
+  log(LogLevel::ERROR, "server", what);
+}
+
+void Server::set_data_dir(const std::string &dir) {
+  m_db.set_data_dir(dir);
+
+  if (pthread_create(&m_compactor, NULL, compactor_worker, this) != 0) {
+    throw std::runtime_error("Could not create compaction thread");
+  }
+  m_compactor_started = true;
 }
 
-void Server::create_table(const std::string &name) {
-  std::shared_ptr<Table> table = std::make_shared<Table>(name);
-  tables.push_back(table);
+bool Server::compactor_stopping() {
+  Guard g(m_compactor_lock);
+  return m_compactor_stopping;
 }
 
-Table *Server::find_table(const std::string &name) {
-  for (std::shared_ptr<Table> table : tables) {
-    if (table->get_name() == name) {
-      return table.get();
+void *Server::compactor_worker(void *arg) {
+  Server *server = static_cast<Server *>(arg);
+  while (1) {
+    {
+      Guard g(server->m_compactor_lock);
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += COMPACT_INTERVAL_SECS;
+      while (!server->m_compactor_stopping &&
+             pthread_cond_timedwait(&server->m_compactor_cond,
+                                    &server->m_compactor_lock,
+                                    &deadline) != ETIMEDOUT) {
+      }
+      if (server->m_compactor_stopping) {
+        return nullptr;
+      }
+    }
+    server->compact_tables();
+  }
+}
+
+// Compacts each table a batch at a time, releasing its lock in between
+// so requests aren't held up for long
+void Server::compact_tables() {
+  m_db.compact_tables(COMPACT_BATCH_BYTES,
+                      [this] { return compactor_stopping(); });
+}
+
+void Server::replicate_from(const std::string &host, const std::string &port) {
+  m_replica.reset(new ReplicaClient(this, host, port));
+  m_replica->start();
+}
+
+void Server::start_signal_thread() {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  sigaddset(&set, SIGUSR2);
+  sigaddset(&set, SIGTERM);
+  sigaddset(&set, SIGINT);
+  // Threads created later inherit this mask, so only the signal
+  // thread will ever see these signals
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  pthread_t thr_id;
+  if (pthread_create(&thr_id, NULL, signal_worker, this) != 0) {
+    log_error("Could not create signal thread");
+    return;
+  }
+  pthread_detach(thr_id);
+}
+
+void *Server::signal_worker(void *arg) {
+  Server *server = static_cast<Server *>(arg);
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  sigaddset(&set, SIGUSR2);
+  sigaddset(&set, SIGTERM);
+  sigaddset(&set, SIGINT);
+
+  while (1) {
+    int sig;
+    if (sigwait(&set, &sig) != 0) {
+      continue;
+    }
+    if (sig == SIGTERM || sig == SIGINT) {
+      server->log(LogLevel::INFO, "signal",
+                  server->is_draining() ? "Closing remaining connections"
+                                        : "Shutdown requested");
+      server->shutdown();
+    } else if (sig == SIGUSR1) {
+      server->dump_lock_stats(std::cerr);
+    } else if (sig == SIGUSR2) {
+      bool enable = !Table::profiling_enabled();
+      if (enable) {
+        // Start each profiling session with fresh counters
+        for (const std::shared_ptr<Table> &table : server->get_tables()) {
+          table->reset_lock_stats();
+        }
+      }
+      Table::set_profiling(enable);
+      server->log(LogLevel::INFO, "signal",
+                  enable ? "Lock profiling enabled" : "Lock profiling disabled");
     }
   }
   return nullptr;
-}
\ No newline at end of file
+}
+
+// Server-wide statistics, formatted as a single protocol value
+std::string Server::get_stats() {
+  std::string stats;
+  stats = "tables=" + std::to_string(m_db.get_num_tables()) +
+          ";lock_profiling=" + (Table::profiling_enabled() ? "on" : "off");
+  {
+    Guard g(m_clients_lock);
+    stats += ";connections=" + std::to_string(m_num_clients);
+  }
+  stats += ";acceptors=" + std::to_string(m_listen_fds.size()) +
+           ";connections_accepted=" +
+           std::to_string(m_accepted.load(std::memory_order_relaxed)) +
+           ";connections_rejected=" + std::to_string(m_rejected.load()) +
+           ";idle_timeouts=" + std::to_string(m_idle_timeouts.load()) +
+           ";io_backend=" +
+           (m_loops.empty() ? IoChannel::backend_name() : "epoll") +
+           ";event_loops=" + std::to_string(m_loops.size()) +
+           ";placement=" +
+           (m_numa ? "numa" : m_pin_threads ? "pinned" : "off") + ";" +
+           Topology::get_stats() +
+           ";io_syscalls=" + std::to_string(IoChannel::get_syscalls()) +
+           ";" + m_db.get_stack_pool().get_stats() +
+           ";log_dropped=" + std::to_string(m_log->get_dropped()) +
+           ";log_suppressed=" + std::to_string(m_log->get_suppressed()) +
+           ";slowlog_threshold_us=" +
+           std::to_string(m_slow_log.get_threshold_us()) +
+           ";slowlog_entries=" + std::to_string(m_slow_log.size()) +
+           ";" + m_pubsub.get_stats() + ";" + ValueCodec::get_stats() +
+           ";read_cache=" + (ReadCache::is_enabled() ? "on" : "off") + ";" +
+           Epoch::get_stats() + ";" + m_admission.get_stats();
+  if (m_replica) {
+    stats += ";" + m_replica->get_stats();
+  } else {
+    stats += ";role=primary;replicas=" +
+             std::to_string(m_replication_log.get_num_replicas()) +
+             ";repl_seq=" + std::to_string(m_replication_log.get_last_seq());
+  }
+  return stats;
+}
+
+void Server::dump_lock_stats(std::ostream &out) {
+  // Copy the table list so table mutexes aren't acquired while
+  // holding the database's table lock
+  std::vector<std::shared_ptr<Table>> snapshot = get_tables();
+  out << "Lock statistics (profiling "
+      << (Table::profiling_enabled() ? "on" : "off") << "):\n";
+  for (const std::shared_ptr<Table> &table : snapshot) {
+    out << "  " << table->get_name() << ": "
+        << table->get_stats() << "\n";
+  }
+  out.flush();
+}
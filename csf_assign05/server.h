@@ -1,19 +1,92 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#include "admission.h"
 #include "client_connection.h"
+#include "database.h"
+#include "event_loop.h"
+#include "logger.h"
+#include "pubsub.h"
+#include "replication.h"
+#include "slow_log.h"
 #include "table.h"
+#include "value_stack.h"
+#include <atomic>
+#include <cstdint>
 #include <map>
 #include <memory>
+#include <ostream>
 #include <pthread.h>
+#include <set>
 #include <string>
+#include <string_view>
 #include <vector>
 
 class Server {
 private:
-  // std::vector<std::shared_ptr<Table>> tables;
-  std::vector<std::shared_ptr<Table>> tables;
-  int server_socket_fd;
+  std::vector<int> m_listen_fds; // one per acceptor thread
+  std::vector<pthread_t> m_acceptors;
+  std::atomic<uint64_t> m_accepted; // connections accepted
+  // With event loops, connections are coroutines spread over the loops'
+  // threads instead of having a thread each
+  std::vector<std::unique_ptr<EventLoop>> m_loops;
+  std::atomic<unsigned> m_next_loop;
+
+  // Thread placement (see set_placement()). With m_numa, connections
+  // are served on the NUMA node of the acceptor which took them, by the
+  // event loops of that node (m_node_loops, by node), or by threads
+  // restricted to its CPUs.
+  bool m_pin_threads;
+  bool m_numa;
+  std::vector<std::vector<EventLoop *>> m_node_loops;
+  std::atomic<unsigned> m_next_node; // with fewer acceptors than nodes
+
+  // Live connections (protected by m_clients_lock). A connection stays
+  // counted in m_num_clients until it has been torn down completely.
+  pthread_mutex_t m_clients_lock;
+  pthread_cond_t m_clients_cond; // a connection ended, or shutdown began
+  std::set<ClientConnection *> m_clients;
+  std::map<std::string, unsigned, std::less<>> m_clients_per_addr;
+  unsigned m_num_clients;
+  unsigned m_max_clients;          // 0 for no limit
+  unsigned m_max_clients_per_addr; // 0 for no limit
+  unsigned m_idle_timeout_secs;    // 0 for no timeout
+  size_t m_read_buffer_size;       // per connection
+  std::atomic<uint64_t> m_rejected;      // over a connection limit
+  std::atomic<uint64_t> m_idle_timeouts; // closed for being idle
+  std::atomic<bool> m_draining; // shutting down: no new requests
+  bool m_force_close;           // a second shutdown request came in
+  std::unique_ptr<Logger> m_log;        // server log, on stderr
+  std::unique_ptr<Logger> m_access_log; // one record per request, if enabled
+  SlowLog m_slow_log;                   // requests over a time threshold
+  ReplicationLog m_replication_log; // changes to send to replicas
+  PubSub m_pubsub;                  // changes to send to subscribers
+  Database m_db; // the tables, and client stacks, recycled
+  AdmissionControl m_admission; // per-user rate limits and priorities
+  std::unique_ptr<ReplicaClient> m_replica; // set if this is a replica
+
+  // With a data directory, a background thread compacts log tables
+  pthread_t m_compactor;
+  bool m_compactor_started;
+  pthread_mutex_t m_compactor_lock;
+  pthread_cond_t m_compactor_cond; // signalled when the compactor must stop
+  bool m_compactor_stopping;       // protected by m_compactor_lock
+
+  static void *signal_worker(void *arg);
+  struct AcceptorParams {
+    Server *server;
+    int listen_fd;
+    int node; // see accept_loop()
+  };
+  static void *acceptor_worker(void *arg);
+  void accept_loop(int listen_fd, int node);
+  bool add_client(ClientConnection *client);
+  void remove_client(ClientConnection *client);
+  static Task<void> serve_async(ClientConnection *client, EventLoop *loop);
+  void drain_clients();
+  static void *compactor_worker(void *arg);
+  bool compactor_stopping();
+  void compact_tables();
 
   // copy constructor and assignment operator are prohibited
   Server(const Server &);
@@ -23,15 +96,105 @@ public:
   Server();
   ~Server();
 
-  void listen(const std::string &port);
+  // With num_acceptors > 1, opens one SO_REUSEPORT socket per acceptor
+  // thread, and the kernel spreads new connections between them
+  void listen(const std::string &port, int num_acceptors = 1);
+  // Accepts clients until shutdown() is called, and returns once every
+  // connection has finished
   void server_loop();
 
+  // Connection limits: the total number of connections and the number
+  // from one source address (0 for no limit), and how long a connection
+  // may wait for a request, or for a response to be read, before it is
+  // closed (0 for no timeout). Must be called before server_loop().
+  static const unsigned DEFAULT_MAX_CLIENTS = 1024;
+  static const unsigned DEFAULT_IDLE_TIMEOUT_SECS = 300;
+  void set_connection_limits(unsigned max_clients, unsigned max_per_addr);
+  void set_idle_timeout(unsigned seconds);
+  // Each connection's input buffer: at least RIO_BUFSIZE, which holds
+  // the longest request line. Bigger buffers take streamed LOADs in
+  // fewer reads. Applies to connections accepted from then on.
+  void set_read_buffer_size(size_t bytes);
+  size_t get_read_buffer_size() const { return m_read_buffer_size; }
+  // Runs connections on num_loops event loop threads (0 for a thread per
+  // connection). Must be called before server_loop().
+  void set_event_loops(unsigned num_loops);
+  // Where threads run: with pin, each event loop thread is pinned to a
+  // core of its own (round robin when there are more loops than cores);
+  // with numa, acceptors, event loops and connection threads are spread
+  // over the NUMA nodes and kept on their node's CPUs, each connection
+  // stays on its acceptor's node, and tables are kept in the memory of
+  // the node of the connection which created them. Must be called before
+  // set_event_loops() and server_loop().
+  void set_placement(bool pin, bool numa);
+  void count_idle_timeout();
+
+  // Graceful shutdown: stops accepting, closes idle connections, and lets
+  // the others finish the request they are handling. Connections still
+  // open after DRAIN_TIMEOUT_SECS, or once shutdown() is called again,
+  // are closed.
+  static const unsigned DRAIN_TIMEOUT_SECS = 30;
+  void shutdown();
+  bool is_draining() const { return m_draining.load(); }
+
   static void *client_worker(void *arg);
 
+  // Logging is asynchronous (see logger.h). configure_logging() and
+  // open_access_log() must be called before any clients are accepted.
+  void configure_logging(LogLevel level, bool json);
+  void open_access_log(const std::string &path);
+  void log(LogLevel level, const char *msg_class, std::string_view message);
   void log_error(const std::string &what);
+  Logger *get_access_log() { return m_access_log.get(); }
+  SlowLog &get_slow_log() { return m_slow_log; }
+  // Stack limits apply to connections accepted from then on
+  static const size_t DEFAULT_MAX_STACK_DEPTH = 65536;
+  static const size_t DEFAULT_MAX_STACK_BYTES = 16 * 1024 * 1024;
+  ValueStackPool &get_stack_pool() { return m_db.get_stack_pool(); }
+  // Connections use the database through a Session each
+  Database &get_database() { return m_db; }
+  // Users' limits must be set before clients are accepted
+  AdmissionControl &get_admission() { return m_admission; }
+
+  // Keeps log tables in subdirectories of dir: opens the ones already
+  // there, recovering their contents, and starts compacting them in the
+  // background. Must be called before clients are accepted. Throws
+  // std::runtime_error if a table can't be opened.
+  static const unsigned COMPACT_INTERVAL_SECS = 1;
+  static const size_t COMPACT_BATCH_BYTES = 1024 * 1024; // per table lock
+  void set_data_dir(const std::string &dir);
+
+  // Returns false if a table with the name already exists. The engine is
+  // "memory" or "log"; throws OperationException if a log table can't be
+  // created.
+  bool create_table(const std::string &name,
+                    std::string_view engine = "memory") {
+    return m_db.create_table(name, engine);
+  }
+  Table *find_table(std::string_view name) { return m_db.find_table(name); }
+  Table *find_or_create_table(std::string_view name) {
+    return m_db.find_or_create_table(name);
+  }
+  std::vector<std::shared_ptr<Table>> get_tables() {
+    return m_db.get_tables();
+  }
+
+  // Makes this server a read-only replica of the server at host:port.
+  // Must be called before the server starts accepting clients.
+  void replicate_from(const std::string &host, const std::string &port);
+  bool is_read_only() const { return m_replica != nullptr; }
+  ReplicationLog &get_replication_log() { return m_replication_log; }
+  // Subscriber queue limits must be set before clients are accepted
+  PubSub &get_pubsub() { return m_pubsub; }
+
+  // Block SIGUSR1/SIGUSR2/SIGTERM/SIGINT and start a thread which handles
+  // them: SIGUSR1 dumps lock statistics to stderr, SIGUSR2 toggles lock
+  // profiling, and SIGTERM and SIGINT shut the server down. Must be
+  // called before any other threads are created.
+  void start_signal_thread();
 
-  void create_table(const std::string &name);
-  Table *find_table(const std::string &name);
+  std::string get_stats();
+  void dump_lock_stats(std::ostream &out);
 };
 
 #endif // SERVER_H
@@ -1,19 +1,187 @@
+#include "async_channel.h"
 #include "server.h"
+#include "table.h"
+#include <csignal>
+#include <cstdlib>
 #include <iostream>
+#include <string>
+#include <unistd.h>
+#include <vector>
 
 int main(int argc, char **argv) {
-  if (argc != 2) {
-    std::cerr << "Usage: ./server <port>\n";
+  const char *usage =
+      "Usage: ./server [-p] [-a <acceptors>] [-e <event loops>]\n"
+      "                [-o <offload threads>]\n"
+      "                [-r <primary host>:<primary port>]\n"
+      "                [-L debug|info|warn|error] [-j] [-A <access log>]\n"
+      "                [-s <slow request threshold in us>] [-c <max "
+      "connections>]\n"
+      "                [-C <max connections per address>] [-t <idle timeout "
+      "in s>]\n"
+      "                [-D <max stack depth>] [-B <max stack bytes>]\n"
+      "                [-q <max queued events per subscriber>] [-d]\n"
+      "                [-z <compression threshold in bytes>] [-P <data dir>]\n"
+      "                [-k] [-R <read buffer bytes per connection>] [-T] [-N]\n"
+      "                [-l [<user>=]<requests/s>[:<burst>][:bulk]]...\n"
+      "                <port>\n";
+  std::string primary, access_log, data_dir;
+  int num_acceptors = 1;
+  int num_loops = 0;
+  long offload_threads = AsyncChannel::DEFAULT_OFFLOAD_THREADS;
+  LogLevel log_level = LogLevel::INFO;
+  bool json_log = false;
+  long slow_threshold_us = SlowLog::DEFAULT_THRESHOLD_US;
+  long max_clients = Server::DEFAULT_MAX_CLIENTS, max_per_addr = 0;
+  long idle_timeout = Server::DEFAULT_IDLE_TIMEOUT_SECS;
+  long max_stack_depth = Server::DEFAULT_MAX_STACK_DEPTH;
+  long max_stack_bytes = Server::DEFAULT_MAX_STACK_BYTES;
+  long max_queued = PubSub::DEFAULT_MAX_QUEUED;
+  bool disconnect_slow = false;
+  long compress_threshold = ValueCodec::DEFAULT_THRESHOLD;
+  long read_buffer = RIO_BUFSIZE;
+  bool pin_threads = false, numa = false;
+  std::vector<std::pair<std::string, AdmissionControl::Limits>> user_limits;
+  int opt;
+  while ((opt = getopt(argc, argv,
+                       "pa:e:o:r:L:jA:s:c:C:t:D:B:q:dz:P:kR:TNl:")) != -1) {
+    switch (opt) {
+    case 'p':
+      Table::set_profiling(true); // lock profiling on from startup
+      break;
+    case 'a':
+      num_acceptors = atoi(optarg); // SO_REUSEPORT acceptor threads
+      break;
+    case 'e':
+      num_loops = atoi(optarg); // coroutine event loop threads
+      break;
+    case 'o':
+      offload_threads = atol(optarg); // for LOAD, DUMP and REPLICATE
+      break;
+    case 'r':
+      primary = optarg; // run as a read-only replica
+      break;
+    case 'L':
+      if (!Logger::parse_level(optarg, log_level)) {
+        std::cerr << usage;
+        return 1;
+      }
+      break;
+    case 'j':
+      json_log = true; // log as JSON lines
+      break;
+    case 'A':
+      access_log = optarg; // JSON lines access log
+      break;
+    case 's':
+      slow_threshold_us = atol(optarg); // SLOWLOG threshold
+      break;
+    case 'c':
+      max_clients = atol(optarg); // 0 for no limit
+      break;
+    case 'C':
+      max_per_addr = atol(optarg); // 0 for no limit
+      break;
+    case 't':
+      idle_timeout = atol(optarg); // 0 for no timeout
+      break;
+    case 'D':
+      max_stack_depth = atol(optarg); // 0 for no limit
+      break;
+    case 'B':
+      max_stack_bytes = atol(optarg); // 0 for no limit
+      break;
+    case 'q':
+      max_queued = atol(optarg); // events a subscriber may fall behind
+      break;
+    case 'd':
+      disconnect_slow = true; // instead of dropping their oldest events
+      break;
+    case 'z':
+      compress_threshold = atol(optarg); // 0 to store values uncompressed
+      break;
+    case 'P':
+      data_dir = optarg; // for log tables, which persist across restarts
+      break;
+    case 'k':
+      ReadCache::set_enabled(false); // hot keys are read under the lock
+      break;
+    case 'R':
+      read_buffer = atol(optarg); // at least RIO_BUFSIZE
+      break;
+    case 'T':
+      pin_threads = true; // each event loop on a core of its own
+      break;
+    case 'N':
+      numa = true; // connections and tables placed by NUMA node
+      break;
+    case 'l': {
+      // rate limit and priority class, for one user or (without a user)
+      // everybody else
+      std::string user;
+      AdmissionControl::Limits limits;
+      if (!AdmissionControl::parse_limits(optarg, user, limits)) {
+        std::cerr << usage;
+        return 1;
+      }
+      user_limits.emplace_back(user, limits);
+      break;
+    }
+    default:
+      std::cerr << usage;
+      return 1;
+    }
+  }
+
+  size_t colon = primary.rfind(':');
+  if (argc - optind != 1 || num_acceptors < 1 || num_loops < 0 ||
+      offload_threads < 1 ||
+      slow_threshold_us < 0 || max_clients < 0 || max_per_addr < 0 ||
+      idle_timeout < 0 || max_stack_depth < 0 || max_stack_bytes < 0 ||
+      max_queued < 1 || compress_threshold < 0 || read_buffer < RIO_BUFSIZE ||
+      (!primary.empty() && (colon == std::string::npos || colon == 0))) {
+    std::cerr << usage;
     return 1;
   }
 
+  // A client disconnecting mid-response must not kill the server
+  signal(SIGPIPE, SIG_IGN);
+
   Server server;
+  server.configure_logging(log_level, json_log);
+  server.get_slow_log().set_threshold_us(slow_threshold_us);
+  server.set_connection_limits(max_clients, max_per_addr);
+  server.set_idle_timeout(idle_timeout);
+  server.set_read_buffer_size(read_buffer);
+  server.set_placement(pin_threads, numa);
+  for (const auto &[user, limits] : user_limits) {
+    if (user.empty()) {
+      server.get_admission().set_default_limits(limits);
+    } else {
+      server.get_admission().set_user_limits(user, limits);
+    }
+  }
+  server.get_stack_pool().set_limits(max_stack_depth, max_stack_bytes);
+  server.get_pubsub().set_limits(max_queued, disconnect_slow);
+  ValueCodec::set_threshold(compress_threshold);
+  server.start_signal_thread();
 
   try {
-    server.listen(argv[1]);
+    if (!access_log.empty()) {
+      server.open_access_log(access_log);
+    }
+    if (!data_dir.empty()) {
+      server.set_data_dir(data_dir);
+    }
+    server.listen(argv[optind], num_acceptors);
+    AsyncChannel::set_offload_threads(offload_threads);
+    server.set_event_loops(num_loops);
+    if (!primary.empty()) {
+      server.replicate_from(primary.substr(0, colon),
+                            primary.substr(colon + 1));
+    }
     server.server_loop();
   } catch (std::runtime_error &ex) {
-    server.log_error("Fatal error starting server");
+    server.log_error(std::string("Fatal error starting server: ") + ex.what());
     return 1;
   }
 
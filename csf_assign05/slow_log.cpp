@@ -0,0 +1,91 @@
+#include "slow_log.h"
+#include "guard.h"
+#include "logger.h"
+#include <stdexcept>
+
+uint64_t RequestTiming::exec_ns() const {
+  uint64_t phases = read_ns + parse_ns + lock_ns + throttle_ns + write_ns;
+  return total_ns > phases ? total_ns - phases : 0;
+}
+
+std::string SlowLog::Entry::to_string() const {
+  char time_buf[32];
+  size_t time_len = Logger::format_time(time_buf, sizeof(time_buf), time_ns);
+  std::string s = "id=" + std::to_string(id) + ";time=";
+  s.append(time_buf, time_len);
+  s += ";user=" + (user.empty() ? "-" : user) + ";cmd=" + command +
+       ";table=" + (table.empty() ? "-" : table) +
+       ";key=" + (key.empty() ? "-" : key) +
+       ";total_us=" + std::to_string(timing.total_ns / 1000) +
+       ";read_us=" + std::to_string(timing.read_ns / 1000) +
+       ";parse_us=" + std::to_string(timing.parse_ns / 1000) +
+       ";lock_us=" + std::to_string(timing.lock_ns / 1000) +
+       ";exec_us=" + std::to_string(timing.exec_ns() / 1000) +
+       ";write_us=" + std::to_string(timing.write_ns / 1000) +
+       ";throttle_us=" + std::to_string(timing.throttle_ns / 1000);
+  return s;
+}
+
+SlowLog::SlowLog(size_t capacity, uint64_t threshold_us)
+    : m_capacity(capacity), m_next(0), m_next_id(1),
+      m_threshold_ns(threshold_us * 1000) {
+  if (capacity == 0) {
+    throw std::invalid_argument("SlowLog capacity must not be 0");
+  }
+  if (pthread_mutex_init(&m_lock, NULL) != 0) {
+    throw std::runtime_error("Failed to initialize mutex");
+  }
+  m_entries.reserve(capacity);
+}
+
+SlowLog::~SlowLog() { pthread_mutex_destroy(&m_lock); }
+
+void SlowLog::set_threshold_us(uint64_t threshold_us) {
+  m_threshold_ns.store(threshold_us * 1000, std::memory_order_relaxed);
+}
+
+uint64_t SlowLog::get_threshold_us() const {
+  return m_threshold_ns.load(std::memory_order_relaxed) / 1000;
+}
+
+void SlowLog::record(Entry entry) {
+  if (entry.table.size() > MAX_ARG_LEN) {
+    entry.table.resize(MAX_ARG_LEN);
+  }
+  if (entry.key.size() > MAX_ARG_LEN) {
+    entry.key.resize(MAX_ARG_LEN);
+  }
+  if (entry.user.size() > MAX_ARG_LEN) {
+    entry.user.resize(MAX_ARG_LEN);
+  }
+  Guard g(m_lock);
+  entry.id = m_next_id++;
+  if (m_entries.size() < m_capacity) {
+    m_entries.push_back(std::move(entry));
+  } else {
+    m_entries[m_next] = std::move(entry);
+    m_next = (m_next + 1) % m_capacity;
+  }
+}
+
+std::vector<SlowLog::Entry> SlowLog::get_entries() {
+  Guard g(m_lock);
+  std::vector<Entry> entries;
+  entries.reserve(m_entries.size());
+  // Before the ring fills up m_next is 0, so this is in order either way
+  for (size_t i = 0; i < m_entries.size(); i++) {
+    entries.push_back(m_entries[(m_next + i) % m_entries.size()]);
+  }
+  return entries;
+}
+
+size_t SlowLog::size() {
+  Guard g(m_lock);
+  return m_entries.size();
+}
+
+void SlowLog::reset() {
+  Guard g(m_lock);
+  m_entries.clear();
+  m_next = 0;
+}
@@ -0,0 +1,87 @@
+#ifndef SLOW_LOG_H
+#define SLOW_LOG_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <pthread.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Where the time of one request went
+struct RequestTiming {
+  uint64_t read_ns;  // from the first byte arriving to a complete line
+  uint64_t parse_ns; // decoding the line
+  uint64_t lock_ns;  // waiting for table locks
+  uint64_t throttle_ns; // waiting for the user's rate limit
+  uint64_t write_ns; // writing the response(s)
+  uint64_t total_ns; // everything, including the execution itself
+
+  RequestTiming() { clear(); }
+  void clear() {
+    read_ns = parse_ns = lock_ns = throttle_ns = write_ns = total_ns = 0;
+  }
+  // Time spent executing the request, i.e. not in any other phase
+  uint64_t exec_ns() const;
+};
+
+// Bounded in-memory log of the requests which took longer than a
+// threshold. Once full, each new entry replaces the oldest one.
+//
+// Requests are timed whether or not they end up here, so the threshold
+// can be changed at any time; recording takes a mutex, which is fine
+// because only slow requests get that far.
+class SlowLog {
+public:
+  static const size_t DEFAULT_CAPACITY = 128;
+  static const uint64_t DEFAULT_THRESHOLD_US = 10000;
+
+  struct Entry {
+    uint64_t id;      // entries are numbered from 1
+    uint64_t time_ns; // wall clock time the request arrived
+    std::string user;
+    std::string command;
+    std::string table; // empty if the command has no table
+    std::string key;   // empty if the command has no key
+    RequestTiming timing;
+
+    // The entry as a single whitespace-free protocol value
+    std::string to_string() const;
+  };
+
+private:
+  pthread_mutex_t m_lock; // protects everything below
+  std::vector<Entry> m_entries; // ring of up to m_capacity entries
+  size_t m_capacity;
+  size_t m_next; // where the next entry goes, once the ring is full
+  uint64_t m_next_id;
+  std::atomic<uint64_t> m_threshold_ns;
+
+  // copy constructor and assignment operator are prohibited
+  SlowLog(const SlowLog &);
+  SlowLog &operator=(const SlowLog &);
+
+public:
+  SlowLog(size_t capacity = DEFAULT_CAPACITY,
+          uint64_t threshold_us = DEFAULT_THRESHOLD_US);
+  ~SlowLog();
+
+  void set_threshold_us(uint64_t threshold_us);
+  uint64_t get_threshold_us() const;
+  bool is_slow(uint64_t total_ns) const {
+    return total_ns >= m_threshold_ns.load(std::memory_order_relaxed);
+  }
+
+  // Records a request; the entry's id is assigned here. Arguments longer
+  // than MAX_ARG_LEN are truncated.
+  static const size_t MAX_ARG_LEN = 64;
+  void record(Entry entry);
+
+  // The entries currently held, oldest first
+  std::vector<Entry> get_entries();
+  size_t size();
+  void reset();
+};
+
+#endif // SLOW_LOG_H
@@ -0,0 +1,117 @@
+#ifndef STORAGE_ENGINE_H
+#define STORAGE_ENGINE_H
+
+#include "compact_store.h"
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+
+// Where a table keeps its committed data. The engine is chosen when the
+// table is created (CREATE <table> [memory|log]); the Table locks around
+// every call but get_unlocked(), so engines need no locking of their own.
+class StorageEngine {
+public:
+  typedef std::function<void(std::string_view, std::string_view)> EntryFn;
+
+  // The entries as they were when the snapshot was taken, which can be
+  // read without the table lock while the table goes on changing
+  class Snapshot {
+  public:
+    virtual ~Snapshot() {}
+    // Calls fn(key, value) for every entry, in no particular order
+    virtual void for_each(const EntryFn &fn) = 0;
+  };
+
+  virtual ~StorageEngine() {}
+
+  virtual const char *name() const = 0;
+
+  // On success, value refers to storage owned by the engine, which stays
+  // valid until the next modification (including compact())
+  virtual bool get(std::string_view key, std::string_view &value) = 0;
+  virtual bool contains(std::string_view key) = 0;
+  // Engines which can be read while the table is being modified support
+  // get_unlocked(), called without the table lock inside an
+  // Epoch::ReadGuard; value stays valid until the guard ends
+  virtual bool supports_unlocked_reads() const { return false; }
+  virtual bool get_unlocked(std::string_view key, std::string_view &value) {
+    return false;
+  }
+  virtual void put(std::string_view key, std::string_view value) = 0;
+  // Moves every entry of writes into the engine, leaving writes empty
+  virtual void adopt(CompactStore &writes) = 0;
+  // Calls fn(key, value) for every entry, in no particular order
+  virtual void for_each(const EntryFn &fn) = 0;
+  // Replaces the contents of out with a copy of every entry
+  virtual void copy_to(CompactStore &out) = 0;
+  // Takes a snapshot. By default it is a copy of every entry; engines
+  // which never change a record once written can share the records.
+  virtual std::unique_ptr<Snapshot> snapshot();
+
+  virtual size_t size() const = 0;
+  // Heap bytes used
+  virtual size_t memory_usage() const = 0;
+
+  // Reclaims up to about budget bytes of stale data. Returns false if
+  // there was nothing to reclaim.
+  virtual bool compact(size_t budget) { return false; }
+
+  // Asks the engine to keep its data in the memory of NUMA node (see
+  // Topology) from now on, or anywhere if node is -1. Engines may ignore it.
+  virtual void set_home_node(int node) {}
+
+  // Engine specific statistics for STATS <table>, each preceded by ';'
+  virtual std::string get_stats() const { return ""; }
+};
+
+// A snapshot which is a copy of the entries
+class CopySnapshot : public StorageEngine::Snapshot {
+private:
+  CompactStore m_data;
+
+public:
+  explicit CopySnapshot(StorageEngine &engine) { engine.copy_to(m_data); }
+  void for_each(const StorageEngine::EntryFn &fn) override {
+    m_data.for_each(fn);
+  }
+};
+
+inline std::unique_ptr<StorageEngine::Snapshot> StorageEngine::snapshot() {
+  return std::unique_ptr<Snapshot>(new CopySnapshot(*this));
+}
+
+// The default engine: everything in memory, in a CompactStore
+class MemoryEngine : public StorageEngine {
+private:
+  CompactStore m_data;
+
+public:
+  MemoryEngine() { m_data.set_concurrent_reads(true); }
+
+  const char *name() const override { return "memory"; }
+
+  bool get(std::string_view key, std::string_view &value) override {
+    return m_data.get(key, value);
+  }
+  bool supports_unlocked_reads() const override { return true; }
+  bool get_unlocked(std::string_view key, std::string_view &value) override {
+    return m_data.get_concurrent(key, value);
+  }
+  bool contains(std::string_view key) override { return m_data.contains(key); }
+  void put(std::string_view key, std::string_view value) override {
+    m_data.put(key, value);
+  }
+  // Takes over the writes' slabs, without copying
+  void adopt(CompactStore &writes) override { m_data.adopt(writes); }
+  void for_each(const EntryFn &fn) override { m_data.for_each(fn); }
+  void copy_to(CompactStore &out) override { m_data.copy_to(out); }
+
+  size_t size() const override { return m_data.size(); }
+  size_t memory_usage() const override { return m_data.memory_usage(); }
+
+  void set_home_node(int node) override { m_data.set_node(node); }
+};
+
+#endif // STORAGE_ENGINE_H
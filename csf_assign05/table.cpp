@@ -1,11 +1,56 @@
 
 #include "table.h"
+#include "epoch.h"
 #include "exceptions.h"
 #include "guard.h"
+#include "message.h"
+#include <algorithm>
 #include <cassert>
+#include <sched.h>
+#include <sstream>
 #include <stdexcept>
+#include <time.h>
 
-Table::Table(const std::string &name) : m_name(name), is_locked(false) {
+namespace {
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000UL + uint64_t(ts.tv_nsec);
+}
+
+// Decoding buffer for reads without the lock
+thread_local std::string t_scratch;
+
+} // namespace
+
+LockStats::LockStats()
+    : acquisitions(0), contended(0), trylock_failures(0), wait_ns(0),
+      hold_ns(0), max_hold_ns(0) {}
+
+// Formats the statistics as a single whitespace-free token so it can be
+// sent to a client as a protocol value.
+std::string LockStats::to_string() const {
+  std::ostringstream ss;
+  ss << "acquisitions=" << acquisitions << ";contended=" << contended
+     << ";trylock_failures=" << trylock_failures
+     << ";wait_us=" << wait_ns / 1000 << ";hold_us=" << hold_ns / 1000
+     << ";max_hold_us=" << max_hold_ns / 1000
+     << ";max_hold_by=" << (max_hold_holder.empty() ? "-" : max_hold_holder);
+  return ss.str();
+}
+
+std::atomic<bool> Table::s_profiling(false);
+std::atomic<uint64_t> Table::s_next_id(1);
+
+Table::Table(const std::string &name, StorageEngine *engine)
+    : m_name(name), data(engine ? engine : new MemoryEngine()),
+      is_locked(false), m_profiled_hold(false), m_hold_start(0), m_holder(""),
+      m_id(s_next_id.fetch_add(1)), m_commit_seq(0), m_home_node(-1) {
+  static_assert(VERSION_STRIPES <= 64, "stripes are committed as a mask");
+  for (std::atomic<uint64_t> &version : m_versions) {
+    version.store(0, std::memory_order_relaxed);
+  }
   if (pthread_mutex_init(&mutex, NULL) != 0) {
     throw std::runtime_error("Failed to initialize mutex");
   }
@@ -13,73 +58,403 @@ Table::Table(const std::string &name) : m_name(name), is_locked(false) {
 
 Table::~Table() { pthread_mutex_destroy(&mutex); }
 
-std::string Table::get_name() const { return m_name; }
+const std::string &Table::get_name() const { return m_name; }
+
+uint64_t Table::lock(const char *holder) {
+  // The wait is only timed if the uncontended fast path fails
+  if (pthread_mutex_trylock(&mutex) == 0) {
+    if (s_profiling.load(std::memory_order_relaxed)) {
+      begin_hold(holder, false, 0);
+    } else {
+      is_locked = true;
+      m_profiled_hold = false;
+    }
+    return 0;
+  }
 
-void Table::lock() {
+  uint64_t start = now_ns();
   pthread_mutex_lock(&mutex);
-  is_locked = true;
+  uint64_t wait_ns = now_ns() - start;
+  if (s_profiling.load(std::memory_order_relaxed)) {
+    begin_hold(holder, true, wait_ns);
+  } else {
+    is_locked = true;
+    m_profiled_hold = false;
+  }
+  return wait_ns;
 }
 
 void Table::unlock() {
+  if (m_profiled_hold) {
+    uint64_t held = now_ns() - m_hold_start;
+    lock_stats.hold_ns += held;
+    if (held > lock_stats.max_hold_ns) {
+      lock_stats.max_hold_ns = held;
+      lock_stats.max_hold_holder = m_holder;
+    }
+    m_profiled_hold = false;
+  }
   is_locked = false;
   pthread_mutex_unlock(&mutex);
 }
 
-bool Table::trylock() {
+bool Table::trylock(const char *holder) {
   if (pthread_mutex_trylock(&mutex) == 0) {
-    is_locked = true;
+    if (s_profiling.load(std::memory_order_relaxed)) {
+      begin_hold(holder, false, 0);
+    } else {
+      is_locked = true;
+      m_profiled_hold = false;
+    }
     return true;
   }
+  if (s_profiling.load(std::memory_order_relaxed)) {
+    // We don't own the mutex, so this counter can't be protected by it
+    __atomic_fetch_add(&lock_stats.trylock_failures, 1, __ATOMIC_RELAXED);
+  }
   return false;
 }
 
-void Table::set(const std::string &key, const std::string &value, bool stage) {
+// Records the start of a profiled hold; must be called with mutex held.
+void Table::begin_hold(const char *holder, bool contended, uint64_t wait_ns) {
+  is_locked = true;
+  m_profiled_hold = true;
+  m_holder = holder;
+  lock_stats.acquisitions++;
+  if (contended) {
+    lock_stats.contended++;
+    lock_stats.wait_ns += wait_ns;
+  }
+  m_hold_start = now_ns();
+}
+
+void Table::set(std::string_view key, std::string_view value) {
   if (!is_locked) {
     throw std::logic_error("Attempt to call set without lock being held");
   }
-  if (stage) {
-    staged_data[key] = value;
-  } else {
-    data[key] = value;
+  // The index needs the value being replaced, which the write may free
+  bool had_old = m_index && read_old_value(key, m_old_value);
+  data->put(key, ValueCodec::encode(value, m_scratch));
+  key_written(key);
+  value_committed(key, value, had_old ? &m_old_value : nullptr);
+}
+
+// Copies key's committed value into old_value; returns false if there is
+// none
+bool Table::read_old_value(std::string_view key, std::string &old_value) {
+  std::string_view stored;
+  if (!data->get(key, stored)) {
+    return false;
+  }
+  old_value.assign(ValueCodec::decode(stored, m_old_scratch));
+  return true;
+}
+
+// Brings the index and the listeners up to date with a change the engine
+// has stored. old_value is the value it replaced, if the index needs it.
+void Table::value_committed(std::string_view key, std::string_view value,
+                            const std::string *old_value) {
+  if (m_index) {
+    if (old_value) {
+      m_index->remove(key, *old_value);
+    }
+    m_index->add(key, value);
+  }
+  for (TableListener *listener : m_listeners) {
+    listener->key_changed(this, key, value);
+  }
+}
+
+// Invalidates the cached copies of key, once its new value is in place.
+// Readers load the version before the value, so a value cached with a
+// version is never older than that version.
+void Table::key_written(std::string_view key) {
+  size_t hash = std::hash<std::string_view>()(key);
+  m_versions[hash % VERSION_STRIPES].fetch_add(1, std::memory_order_release);
+}
+
+void Table::set(std::string_view key, std::string_view value, WriteSet &txn) {
+  if (!is_locked) {
+    throw std::logic_error("Attempt to call set without lock being held");
   }
+  txn.put(key, value);
 }
 
-std::string Table::get(const std::string &key, bool checkStaged) {
+std::string Table::get(std::string_view key, const WriteSet *txn) {
   if (!is_locked) {
     throw std::logic_error("Attempt to call get without lock being held");
   }
-  if (checkStaged && staged_data.find(key) != staged_data.end()) {
-    return staged_data[key];
+  std::string_view value;
+  if (txn && txn->m_writes.get(key, value)) {
+    return std::string(ValueCodec::decode(value, m_scratch));
+  }
+  if (!data->get(key, value)) {
+    throw std::out_of_range("Key not found: " + std::string(key));
+  }
+  std::string_view decoded = ValueCodec::decode(value, m_scratch);
+  size_t hash = std::hash<std::string_view>()(key);
+  read_committed(
+      key, hash,
+      m_versions[hash % VERSION_STRIPES].load(std::memory_order_relaxed),
+      decoded);
+  return std::string(decoded);
+}
+
+bool Table::get_unlocked(std::string_view key, std::string &value) {
+  size_t hash = std::hash<std::string_view>()(key);
+  std::atomic<uint64_t> &version = m_versions[hash % VERSION_STRIPES];
+  while (1) {
+    uint64_t seq = m_commit_seq.load(std::memory_order_acquire);
+    if (seq & 1) {
+      sched_yield(); // a commit holds the lock for just as long
+      continue;
+    }
+    uint64_t read_version = version.load(std::memory_order_acquire);
+    bool found;
+    {
+      Epoch::ReadGuard guard;
+      std::string_view stored;
+      found = data->get_unlocked(key, stored);
+      if (found) {
+        value.assign(ValueCodec::decode(stored, t_scratch));
+      }
+    }
+    // Records never change, so only the slots read (with acquire loads,
+    // which this can't move ahead of) need checking against a commit
+    if (m_commit_seq.load(std::memory_order_acquire) != seq) {
+      continue;
+    }
+    if (found) {
+      read_committed(key, hash, read_version, value);
+    }
+    return found;
+  }
+}
+
+// Samples a read of a committed value, and caches it if the key is hot.
+// version is the key's version from before the value was read.
+void Table::read_committed(std::string_view key, size_t hash,
+                           uint64_t version, std::string_view value) {
+  if (HotKeyTracker::sample()) {
+    m_hot_keys.record(key, hash, false);
+  }
+  if (ReadCache::is_enabled() && m_hot_keys.is_hot(hash)) {
+    ReadCache::store(m_id, hash, key, version, value);
+  }
+}
+
+bool Table::get_cached(std::string_view key, std::string &value) {
+  if (!ReadCache::is_enabled()) {
+    return false;
+  }
+  size_t hash = std::hash<std::string_view>()(key);
+  uint64_t version =
+      m_versions[hash % VERSION_STRIPES].load(std::memory_order_acquire);
+  if (!ReadCache::lookup(m_id, hash, key, version, value)) {
+    return false;
   }
-  auto it = data.find(key);
-  if (it != data.end()) {
-    return it->second;
+  if (HotKeyTracker::sample()) {
+    m_hot_keys.record(key, hash, true);
   }
-  throw std::out_of_range("Key not found: " + key);
+  return true;
 }
 
-bool Table::has_key(const std::string &key, bool checkStaged) {
+bool Table::is_cached(std::string_view key) {
+  if (!ReadCache::is_enabled()) {
+    return false;
+  }
+  size_t hash = std::hash<std::string_view>()(key);
+  return ReadCache::contains(
+      m_id, hash, key,
+      m_versions[hash % VERSION_STRIPES].load(std::memory_order_acquire));
+}
+
+bool Table::has_key(std::string_view key, const WriteSet *txn) {
   if (!is_locked) {
     throw std::logic_error("Attempt to call has_key without lock being held");
   }
-  return (checkStaged && staged_data.find(key) != staged_data.end()) ||
-         data.find(key) != data.end();
+  return (txn && txn->m_writes.contains(key)) || data->contains(key);
 }
 
-void Table::commit_changes() {
+void Table::commit_changes(WriteSet &txn) {
   if (!is_locked) {
     throw std::logic_error("Attempt to commit changes without lock being held");
   }
-  for (const auto &kv : staged_data) {
-    data[kv.first] = kv.second;
+  bool notify = m_index || !m_listeners.empty();
+  uint64_t stripes = 0; // versions to change once the values are in
+  // Adopting empties the write set (and replaces the old values), so
+  // what the index and the listeners need is copied out first
+  std::vector<Change> changes;
+  if (notify) {
+    changes.reserve(txn.size());
+  }
+  txn.m_writes.for_each([&](std::string_view key, std::string_view value) {
+    if (notify) {
+      changes.emplace_back();
+      Change &change = changes.back();
+      change.key = key;
+      change.value = ValueCodec::decode(value, m_scratch);
+      change.had_old = m_index && read_old_value(key, change.old_value);
+    }
+    stripes |= uint64_t(1)
+               << (std::hash<std::string_view>()(key) % VERSION_STRIPES);
+  });
+  m_commit_seq.fetch_add(1, std::memory_order_acq_rel);
+  try {
+    data->adopt(txn.m_writes);
+  } catch (std::exception &ex) {
+    m_commit_seq.fetch_add(1, std::memory_order_release);
+    throw;
+  }
+  for (unsigned i = 0; i < VERSION_STRIPES; i++) {
+    if (stripes & (uint64_t(1) << i)) {
+      m_versions[i].fetch_add(1, std::memory_order_release);
+    }
+  }
+  m_commit_seq.fetch_add(1, std::memory_order_release);
+  if (changes.empty()) {
+    return;
+  }
+  for (TableListener *listener : m_listeners) {
+    listener->commit_started(this, changes.size());
+  }
+  for (const Change &change : changes) {
+    value_committed(change.key, change.value,
+                    change.had_old ? &change.old_value : nullptr);
+  }
+  for (TableListener *listener : m_listeners) {
+    listener->commit_finished(this);
   }
-  staged_data.clear();
 }
 
-void Table::rollback_changes() {
+bool Table::create_index() {
+  if (!is_locked) {
+    throw std::logic_error("Attempt to create index without lock being held");
+  }
+  if (m_index) {
+    return false;
+  }
+  m_index.reset(new ValueIndex());
+  data->for_each([this](std::string_view key, std::string_view value) {
+    m_index->add(key, ValueCodec::decode(value, m_scratch));
+  });
+  return true;
+}
+
+bool Table::find(std::string_view value, std::vector<std::string> &keys,
+                 const WriteSet *txn) {
+  if (!is_locked) {
+    throw std::logic_error("Attempt to call find without lock being held");
+  }
+  if (!m_index) {
+    return false;
+  }
+  // Keys the transaction has changed are judged by their new values
+  size_t start = keys.size();
+  m_index->find(value, [&](std::string_view key) {
+    if (!txn || !txn->m_writes.contains(key)) {
+      keys.emplace_back(key);
+    }
+  });
+  if (txn) {
+    // The index's keys come in order, the write set's don't: sort those,
+    // and merge the two
+    size_t middle = keys.size();
+    txn->m_writes.for_each([&](std::string_view key, std::string_view v) {
+      if (ValueCodec::decode(v, m_scratch) == value) {
+        keys.emplace_back(key);
+      }
+    });
+    std::sort(keys.begin() + middle, keys.end());
+    std::inplace_merge(keys.begin() + start, keys.begin() + middle,
+                       keys.end());
+  }
+  return true;
+}
+
+bool Table::compact(size_t budget) {
+  if (!is_locked) {
+    throw std::logic_error("Attempt to compact without lock being held");
+  }
+  return data->compact(budget);
+}
+
+void Table::set_home_node(int node) {
+  data->set_home_node(node);
+  m_home_node = node;
+}
+
+void Table::add_listener(TableListener *listener) {
+  m_listeners.push_back(listener);
+}
+
+void Table::rollback_changes(WriteSet &txn) {
   if (!is_locked) {
     throw std::logic_error(
         "Attempt to rollback changes without lock being held");
   }
-  staged_data.clear();
-}
\ No newline at end of file
+  txn.m_writes.clear();
+}
+
+std::unique_ptr<StorageEngine::Snapshot> Table::snapshot() {
+  if (!is_locked) {
+    throw std::logic_error("Attempt to snapshot without lock being held");
+  }
+  return data->snapshot();
+}
+
+void Table::set_profiling(bool enabled) {
+  s_profiling.store(enabled, std::memory_order_relaxed);
+}
+
+bool Table::profiling_enabled() {
+  return s_profiling.load(std::memory_order_relaxed);
+}
+
+LockStats Table::get_lock_stats() {
+  // Bypass lock() so that reading the statistics doesn't skew them
+  pthread_mutex_lock(&mutex);
+  LockStats result;
+  result.acquisitions = lock_stats.acquisitions;
+  result.contended = lock_stats.contended;
+  result.trylock_failures =
+      __atomic_load_n(&lock_stats.trylock_failures, __ATOMIC_RELAXED);
+  result.wait_ns = lock_stats.wait_ns;
+  result.hold_ns = lock_stats.hold_ns;
+  result.max_hold_ns = lock_stats.max_hold_ns;
+  result.max_hold_holder = lock_stats.max_hold_holder;
+  pthread_mutex_unlock(&mutex);
+  return result;
+}
+
+void Table::reset_lock_stats() {
+  pthread_mutex_lock(&mutex);
+  uint64_t failures = 0;
+  lock_stats.acquisitions = lock_stats.contended = 0;
+  lock_stats.wait_ns = lock_stats.hold_ns = lock_stats.max_hold_ns = 0;
+  lock_stats.max_hold_holder.clear();
+  __atomic_store(&lock_stats.trylock_failures, &failures, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&mutex);
+}
+
+std::string Table::get_stats() {
+  LockStats locks = get_lock_stats();
+  pthread_mutex_lock(&mutex);
+  std::string result = locks.to_string() +
+                       ";entries=" + std::to_string(data->size()) +
+                       ";memory_bytes=" + std::to_string(data->memory_usage()) +
+                       ";index_entries=" +
+                       (m_index ? std::to_string(m_index->size()) : "-") +
+                       ";engine=" + data->name() + data->get_stats() +
+                       ";home_node=" +
+                       (m_home_node >= 0 ? std::to_string(m_home_node) : "-") +
+                       ";";
+  pthread_mutex_unlock(&mutex);
+  // The statistics are sent as one DATA response, so as many hot keys
+  // are listed as fit in it
+  const size_t DATA_OVERHEAD = 6; // "DATA " and the newline
+  size_t used = result.size() + DATA_OVERHEAD;
+  result += m_hot_keys.get_stats(
+      used < Message::MAX_ENCODED_LEN ? Message::MAX_ENCODED_LEN - used : 0);
+  return result;
+}
@@ -1,37 +1,213 @@
 #ifndef TABLE_H
 #define TABLE_H
 
-#include <map>
+#include "compact_store.h"
+#include "hot_keys.h"
+#include "storage_engine.h"
+#include "value_codec.h"
+#include "value_index.h"
+#include <atomic>
+#include <cstdint>
+#include <memory>
 #include <pthread.h>
 #include <string>
+#include <string_view>
+#include <vector>
+
+class Table;
+
+// Observer of committed changes. Listeners are called once per key as
+// the change is committed, with the table locked, so they must be quick
+// and must not lock the table themselves.
+class TableListener {
+public:
+  virtual ~TableListener() {}
+  virtual void key_changed(Table *table, std::string_view key,
+                           std::string_view value) = 0;
+  // Called when a table is created, once the listener has been added
+  virtual void table_created(Table *table) {}
+  // Called around the key_changed() calls for a committed WriteSet of
+  // num_keys keys, so a listener can treat them as one change
+  virtual void commit_started(Table *table, size_t num_keys) {}
+  virtual void commit_finished(Table *table) {}
+};
+
+// A transaction's pending writes to one table. Each transaction owns its
+// own, so uncommitted changes are never visible to other clients, and
+// committing moves the buffered records into the table without copying.
+// Values are buffered in their stored form (see value_codec.h).
+class WriteSet {
+private:
+  CompactStore m_writes;
+  std::string m_scratch; // encoding buffer
+
+  friend class Table;
+
+public:
+  WriteSet() : m_writes(CompactStore::SMALL_SLAB_SIZE) {}
+
+  bool empty() const { return m_writes.size() == 0; }
+  size_t size() const { return m_writes.size(); }
+
+  // Buffers a write directly; used to build bulk loads without holding
+  // the table lock
+  void put(std::string_view key, std::string_view value) {
+    m_writes.put(key, ValueCodec::encode(value, m_scratch));
+  }
+};
+
+// Lock contention counters for a single table. Only updated while
+// lock profiling is enabled (see Table::set_profiling()).
+struct LockStats {
+  uint64_t acquisitions;      // successful lock()/trylock() calls
+  uint64_t contended;         // acquisitions that had to wait for the mutex
+  uint64_t trylock_failures;  // trylock() calls that found the mutex held
+  uint64_t wait_ns;           // total time spent waiting to acquire
+  uint64_t hold_ns;           // total time the mutex was held
+  uint64_t max_hold_ns;       // longest single hold
+  std::string max_hold_holder; // command which held the mutex longest
+
+  LockStats();
+  std::string to_string() const;
+};
 
 class Table {
 private:
   std::string m_name;
-  std::map<std::string, std::string> data;
+  std::unique_ptr<StorageEngine> data; // Committed data
   pthread_mutex_t mutex;
-  std::map<std::string, std::string>
-      staged_data; // Temporary storage for proposed changes.
   bool is_locked;
 
+  // Lock profiling state (protected by mutex)
+  LockStats lock_stats;
+  bool m_profiled_hold;    // current hold started while profiling was on
+  uint64_t m_hold_start;   // when the current hold started
+  const char *m_holder;    // command holding the mutex
+
+  std::vector<TableListener *> m_listeners;
+  std::unique_ptr<ValueIndex> m_index; // set by create_index()
+
+  // Buffers for encoding and decoding values (protected by mutex)
+  std::string m_scratch, m_old_scratch, m_old_value;
+
+  // A committed change, kept until the engine has it so that the index
+  // and the listeners only ever see changes which were stored
+  struct Change {
+    std::string key;
+    std::string value;
+    std::string old_value;
+    bool had_old; // whether old_value was read (with an index only)
+  };
+
+  // Hot keys, and the versions which the threads' read caches check (see
+  // hot_keys.h): writing a key changes the version of its stripe
+  static const unsigned VERSION_STRIPES = 64;
+  const uint64_t m_id;
+  HotKeyTracker m_hot_keys;
+  std::atomic<uint64_t> m_versions[VERSION_STRIPES];
+  // Odd while a transaction's changes are being committed, so that
+  // reads without the lock see all of them or none
+  std::atomic<uint64_t> m_commit_seq;
+  int m_home_node; // NUMA node the data is kept on, -1 for anywhere
+
+  static std::atomic<bool> s_profiling;
+  static std::atomic<uint64_t> s_next_id;
+
+  void begin_hold(const char *holder, bool contended, uint64_t wait_ns);
+  bool read_old_value(std::string_view key, std::string &old_value);
+  void value_committed(std::string_view key, std::string_view value,
+                       const std::string *old_value);
+  void key_written(std::string_view key);
+  void read_committed(std::string_view key, size_t hash, uint64_t version,
+                      std::string_view value);
+
   // Copy constructor and assignment operator are prohibited
   Table(const Table &);
   Table &operator=(const Table &);
 
 public:
-  Table(const std::string &name);
+  // Takes ownership of engine; without one, the table is kept in memory
+  Table(const std::string &name, StorageEngine *engine = nullptr);
   ~Table();
 
-  std::string get_name() const;
-  void lock();
+  const std::string &get_name() const;
+  const char *get_engine_name() const { return data->name(); }
+  // Returns how long the caller waited for the mutex, in nanoseconds
+  // (0 if it was free)
+  uint64_t lock(const char *holder = "");
   void unlock();
-  bool trylock();
+  bool trylock(const char *holder = "");
+
+  // Data access: the table must be locked by the caller. Without a
+  // WriteSet, set() changes the table immediately (autocommit); with one,
+  // the change is buffered in it, and get()/has_key() see the buffered
+  // changes ahead of the committed data.
+  void set(std::string_view key, std::string_view value);
+  void set(std::string_view key, std::string_view value, WriteSet &txn);
+  std::string get(std::string_view key, const WriteSet *txn = nullptr);
+  bool has_key(std::string_view key, const WriteSet *txn = nullptr);
+  // Reads a hot key's committed value from the calling thread's read
+  // cache, without the lock. Returns false if it isn't cached, or has
+  // been written since; get() caches hot keys as it reads them.
+  bool get_cached(std::string_view key, std::string &value);
+  // Whether get_cached() would succeed, without counting a read
+  bool is_cached(std::string_view key);
+  // Reads key's committed value without the lock, which tables whose
+  // engine supports it allow (see StorageEngine::get_unlocked()). Returns
+  // false if the key doesn't exist. Waits (briefly) while a transaction
+  // is being committed.
+  bool supports_unlocked_reads() const {
+    return data->supports_unlocked_reads();
+  }
+  bool get_unlocked(std::string_view key, std::string &value);
+
+  // Apply (and empty) or discard a transaction's buffered changes
+  void commit_changes(WriteSet &txn);
+  void rollback_changes(WriteSet &txn);
+
+  // Secondary index: keys by value (see value_index.h). create_index()
+  // indexes the committed data, and returns false if the table is
+  // indexed already; from then on the index follows every commit.
+  // find() appends the keys holding value to keys, seeing txn's changes,
+  // and returns false if there is no index. The table must be locked.
+  bool create_index();
+  bool has_index() const { return m_index != nullptr; }
+  bool find(std::string_view value, std::vector<std::string> &keys,
+            const WriteSet *txn = nullptr);
+
+  // Lets the engine reclaim up to about budget bytes of stale data (see
+  // StorageEngine::compact()). The table must be locked.
+  bool compact(size_t budget);
+
+  // Keeps the table's data in the memory of NUMA node (see Topology), or
+  // anywhere if node is -1, as far as the engine supports it. The table
+  // must be locked, or not yet shared with other threads.
+  void set_home_node(int node);
+  int get_home_node() const { return m_home_node; }
+
+  // Registers a listener for committed changes. The table must be locked,
+  // or not yet shared with other threads.
+  void add_listener(TableListener *listener);
+
+  // Takes a snapshot of the committed data, to be read after the lock is
+  // released (see StorageEngine::snapshot()). Values are in their stored
+  // form, to be read through ValueCodec::decode().
+  std::unique_ptr<StorageEngine::Snapshot> snapshot();
+
+  // Lock profiling: disabled by default, toggled at runtime for all tables.
+  // When disabled, lock()/unlock() cost one relaxed atomic load extra
+  // (and a contended lock() a clock read, to report its wait).
+  static void set_profiling(bool enabled);
+  static bool profiling_enabled();
+
+  // Snapshot/reset of this table's lock statistics. These acquire the
+  // table mutex, so they must not be called while holding it.
+  LockStats get_lock_stats();
+  void reset_lock_stats();
 
-  void set(const std::string &key, const std::string &value, bool stage = true);
-  std::string get(const std::string &key, bool checkStaged = true);
-  bool has_key(const std::string &key, bool checkStaged = true);
-  void commit_changes();
-  void rollback_changes();
+  // Lock and storage statistics formatted as a single protocol value.
+  // Acquires the table mutex.
+  std::string get_stats();
 };
 
-#endif // TABLE_H
\ No newline at end of file
+#endif // TABLE_H
@@ -0,0 +1,105 @@
+#ifndef TASK_H
+#define TASK_H
+
+#include <coroutine>
+#include <exception>
+#include <utility>
+
+// A coroutine returning T. Tasks start suspended and run when they are
+// co_awaited; the awaiting coroutine is resumed once the task finishes,
+// with its result or exception. Control passes between the two by
+// symmetric transfer, so chains of awaited tasks don't grow the stack.
+template <typename T = void> class Task;
+
+namespace task_detail {
+
+template <typename T> struct PromiseBase {
+  std::coroutine_handle<> continuation;
+  std::exception_ptr error;
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+
+  struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+    template <typename Promise>
+    std::coroutine_handle<>
+    await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+      std::coroutine_handle<> next = handle.promise().continuation;
+      return next ? next : std::noop_coroutine();
+    }
+    void await_resume() noexcept {}
+  };
+  FinalAwaiter final_suspend() noexcept { return {}; }
+
+  void unhandled_exception() { error = std::current_exception(); }
+};
+
+template <typename T> struct Promise : PromiseBase<T> {
+  T value;
+
+  Task<T> get_return_object();
+  void return_value(T v) { value = std::move(v); }
+  T result() {
+    if (this->error) {
+      std::rethrow_exception(this->error);
+    }
+    return std::move(value);
+  }
+};
+
+template <> struct Promise<void> : PromiseBase<void> {
+  Task<void> get_return_object();
+  void return_void() {}
+  void result() {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+};
+
+} // namespace task_detail
+
+template <typename T> class Task {
+public:
+  using promise_type = task_detail::Promise<T>;
+
+private:
+  std::coroutine_handle<promise_type> m_handle;
+
+  // copy constructor and assignment operator are prohibited
+  Task(const Task &);
+  Task &operator=(const Task &);
+
+public:
+  explicit Task(std::coroutine_handle<promise_type> handle)
+      : m_handle(handle) {}
+  Task(Task &&other) noexcept : m_handle(std::exchange(other.m_handle, {})) {}
+  ~Task() {
+    if (m_handle) {
+      m_handle.destroy();
+    }
+  }
+
+  // Awaiting a task runs it
+  bool await_ready() const noexcept { return false; }
+  std::coroutine_handle<>
+  await_suspend(std::coroutine_handle<> awaiting) noexcept {
+    m_handle.promise().continuation = awaiting;
+    return m_handle;
+  }
+  T await_resume() { return m_handle.promise().result(); }
+};
+
+namespace task_detail {
+
+template <typename T> Task<T> Promise<T>::get_return_object() {
+  return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline Task<void> Promise<void>::get_return_object() {
+  return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+} // namespace task_detail
+
+#endif // TASK_H
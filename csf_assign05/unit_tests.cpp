@@ -1,11 +1,38 @@
 // Unit tests
 
+#include "admission.h"
+#include "arena.h"
+#include "async_channel.h"
+#include "compact_store.h"
+#include "cpu_topology.h"
+#include "database.h"
+#include "epoch.h"
+#include "event_loop.h"
 #include "exceptions.h"
+#include "hash_ring.h"
+#include "hot_keys.h"
+#include "log_engine.h"
+#include "logger.h"
 #include "message.h"
 #include "message_serialization.h"
+#include "pubsub.h"
+#include "record_stream.h"
+#include "slow_log.h"
 #include "table.h"
 #include "tctest.h"
+#include "value_codec.h"
 #include "value_stack.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <set>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 struct TestObjs {
   Message m; // default message
@@ -92,13 +119,48 @@ void test_message_serialization_encode_long(TestObjs *objs);
 void test_message_serialization_encode_too_long(TestObjs *objs);
 void test_message_serialization_decode(TestObjs *objs);
 void test_message_serialization_decode_invalid(TestObjs *objs);
+void test_message_serialization_decode_arena(TestObjs *objs);
+void test_message_serialization_encode_quoted(TestObjs *objs);
 void test_table_has_key(TestObjs *objs);
 void test_table_get(TestObjs *objs);
 void test_table_commit_changes(TestObjs *objs);
 void test_table_rollback_changes(TestObjs *objs);
 void test_table_commit_and_rollback(TestObjs *objs);
+void test_table_transaction_isolation(TestObjs *objs);
+void test_table_lock_stats(TestObjs *objs);
+void test_table_listener(TestObjs *objs);
+void test_table_engine_failure(TestObjs *objs);
+void test_pubsub(TestObjs *objs);
+void test_table_index(TestObjs *objs);
+void test_value_codec(TestObjs *objs);
+void test_table_compression(TestObjs *objs);
+void test_log_engine(TestObjs *objs);
+void test_log_engine_compaction(TestObjs *objs);
+void test_log_engine_snapshot(TestObjs *objs);
+void test_log_engine_batch(TestObjs *objs);
+void test_session(TestObjs *objs);
+void test_hot_keys(TestObjs *objs);
+void test_read_cache(TestObjs *objs);
+void test_unlocked_reads(TestObjs *objs);
+void test_session_conflict(TestObjs *objs);
+void test_session_commit_failure(TestObjs *objs);
+void test_admission(TestObjs *objs);
+void test_compact_store(TestObjs *objs);
+void test_compact_store_overwrite(TestObjs *objs);
+void test_compact_store_copy_and_adopt(TestObjs *objs);
+void test_epoch(TestObjs *objs);
+void test_topology(TestObjs *objs);
+void test_record_stream(TestObjs *objs);
+void test_rio_lines(TestObjs *objs);
+void test_hash_ring(TestObjs *objs);
+void test_logger(TestObjs *objs);
+void test_slow_log(TestObjs *objs);
 void test_value_stack(TestObjs *objs);
 void test_value_stack_exceptions(TestObjs *objs);
+void test_value_stack_limits(TestObjs *objs);
+void test_value_stack_pool(TestObjs *objs);
+void test_task(TestObjs *objs);
+void test_event_loop(TestObjs *objs);
 
 int main(int argc, char **argv) {
   // Allow test name to be specified on the command line
@@ -119,13 +181,48 @@ int main(int argc, char **argv) {
   TEST(test_message_serialization_encode_too_long);
   TEST(test_message_serialization_decode);
   TEST(test_message_serialization_decode_invalid);
+  TEST(test_message_serialization_decode_arena);
+  TEST(test_message_serialization_encode_quoted);
   TEST(test_table_has_key);
   TEST(test_table_get);
   TEST(test_table_commit_changes);
   TEST(test_table_rollback_changes);
   TEST(test_table_commit_and_rollback);
+  TEST(test_table_transaction_isolation);
+  TEST(test_table_lock_stats);
+  TEST(test_table_listener);
+  TEST(test_table_engine_failure);
+  TEST(test_pubsub);
+  TEST(test_table_index);
+  TEST(test_value_codec);
+  TEST(test_table_compression);
+  TEST(test_log_engine);
+  TEST(test_log_engine_compaction);
+  TEST(test_log_engine_snapshot);
+  TEST(test_log_engine_batch);
+  TEST(test_session);
+  TEST(test_hot_keys);
+  TEST(test_read_cache);
+  TEST(test_unlocked_reads);
+  TEST(test_session_conflict);
+  TEST(test_session_commit_failure);
+  TEST(test_admission);
+  TEST(test_compact_store);
+  TEST(test_compact_store_overwrite);
+  TEST(test_compact_store_copy_and_adopt);
+  TEST(test_epoch);
+  TEST(test_topology);
+  TEST(test_record_stream);
+  TEST(test_rio_lines);
+  TEST(test_hash_ring);
+  TEST(test_logger);
+  TEST(test_slow_log);
   TEST(test_value_stack);
   TEST(test_value_stack_exceptions);
+  TEST(test_value_stack_limits);
+  TEST(test_value_stack_pool);
+  TEST(test_task);
+  TEST(test_event_loop);
 
   TEST_FINI();
 }
@@ -378,108 +475,162 @@ void test_message_serialization_decode_invalid(TestObjs *objs) {
   }
 }
 
+void test_message_serialization_decode_arena(TestObjs *objs) {
+  Arena arena(64);
+
+  for (int i = 0; i < 3; i++) {
+    {
+      Message msg(MessageType::NONE, &arena);
+      MessageSerialization::decode(
+          "SET " + std::string(100, 't') + " " + std::string(100, 'k') + "\n",
+          msg);
+      ASSERT(MessageType::SET == msg.get_message_type());
+      ASSERT(std::string(100, 't') == msg.get_table());
+      ASSERT(std::string(100, 'k') == msg.get_key());
+
+      // Copies don't refer to the arena
+      Message copy(msg);
+      ASSERT(copy.get_args().get_allocator().m_arena == nullptr);
+      ASSERT(std::string(100, 'k') == copy.get_key());
+    }
+    arena.reset();
+  }
+
+  // Oversized blocks are released by reset(), normal ones are kept
+  ASSERT(arena.get_capacity() <= 64);
+}
+
+void test_message_serialization_encode_quoted(TestObjs *objs) {
+  std::string s;
+
+  MessageSerialization::encode(objs->failed_resp, s);
+  ASSERT("FAILED \"The operation failed\"\n" == s);
+
+  MessageSerialization::encode(objs->ok_resp, s);
+  ASSERT("OK\n" == s);
+
+  // Round trip
+  Message msg;
+  MessageSerialization::encode(objs->error_resp, s);
+  MessageSerialization::decode(s, msg);
+  ASSERT(MessageType::ERROR == msg.get_message_type());
+  ASSERT("An error occurred" == msg.get_quoted_text());
+}
+
 void test_table_has_key(TestObjs *objs) {
+  // Pending changes of one transaction
+  WriteSet txn;
+
   {
     TableGuard g(objs->invoices); // ensure table is locked and unlocked
 
-    objs->invoices->set("abc123", "1000");
-    objs->invoices->set("xyz456", "1318");
+    objs->invoices->set("abc123", "1000", txn);
+    objs->invoices->set("xyz456", "1318", txn);
   }
 
   {
     TableGuard g(objs->invoices); // ensure table is locked and unlocked
 
     // Changes should be visible even though we haven't committed them
-    ASSERT(objs->invoices->has_key("abc123"));
-    ASSERT(objs->invoices->has_key("xyz456"));
+    ASSERT(objs->invoices->has_key("abc123", &txn));
+    ASSERT(objs->invoices->has_key("xyz456", &txn));
 
-    ASSERT(!objs->invoices->has_key("nonexistent"));
+    ASSERT(!objs->invoices->has_key("nonexistent", &txn));
   }
 }
 
 void test_table_get(TestObjs *objs) {
+  // Pending changes of one transaction
+  WriteSet txn;
+
   {
     TableGuard g(objs->invoices); // ensure table is locked and unlocked
 
-    objs->invoices->set("abc123", "1000");
-    objs->invoices->set("xyz456", "1318");
+    objs->invoices->set("abc123", "1000", txn);
+    objs->invoices->set("xyz456", "1318", txn);
   }
 
   {
     TableGuard g(objs->invoices); // ensure table is locked and unlocked
 
     // Changes should be visible even though we haven't committed them
-    ASSERT("1000" == objs->invoices->get("abc123"));
-    ASSERT("1318" == objs->invoices->get("xyz456"));
+    ASSERT("1000" == objs->invoices->get("abc123", &txn));
+    ASSERT("1318" == objs->invoices->get("xyz456", &txn));
 
-    ASSERT(!objs->invoices->has_key("nonexistent"));
+    ASSERT(!objs->invoices->has_key("nonexistent", &txn));
   }
 }
 
 void test_table_commit_changes(TestObjs *objs) {
+  // Pending changes of one transaction
+  WriteSet txn;
+
   {
     TableGuard g(objs->invoices); // ensure table is locked and unlocked
 
-    objs->invoices->set("abc123", "1000");
-    objs->invoices->set("xyz456", "1318");
+    objs->invoices->set("abc123", "1000", txn);
+    objs->invoices->set("xyz456", "1318", txn);
   }
 
   {
     TableGuard g(objs->invoices); // ensure table is locked and unlocked
 
     // Changes should be visible even though we haven't committed them
-    ASSERT("1000" == objs->invoices->get("abc123"));
-    ASSERT("1318" == objs->invoices->get("xyz456"));
+    ASSERT("1000" == objs->invoices->get("abc123", &txn));
+    ASSERT("1318" == objs->invoices->get("xyz456", &txn));
 
-    ASSERT(!objs->invoices->has_key("nonexistent"));
+    ASSERT(!objs->invoices->has_key("nonexistent", &txn));
   }
 
   {
     TableGuard g(objs->invoices); // ensure table is locked and unlocked
 
     // Commit changes
-    objs->invoices->commit_changes();
+    objs->invoices->commit_changes(txn);
 
     // Changes should still be visible
-    ASSERT("1000" == objs->invoices->get("abc123"));
-    ASSERT("1318" == objs->invoices->get("xyz456"));
+    ASSERT("1000" == objs->invoices->get("abc123", &txn));
+    ASSERT("1318" == objs->invoices->get("xyz456", &txn));
 
-    ASSERT(!objs->invoices->has_key("nonexistent"));
+    ASSERT(!objs->invoices->has_key("nonexistent", &txn));
   }
 }
 
 void test_table_rollback_changes(TestObjs *objs) {
+  // Pending changes of one transaction
+  WriteSet txn;
+
   {
     TableGuard g(objs->invoices); // ensure table is locked and unlocked
 
-    objs->invoices->set("abc123", "1000");
-    objs->invoices->set("xyz456", "1318");
+    objs->invoices->set("abc123", "1000", txn);
+    objs->invoices->set("xyz456", "1318", txn);
   }
 
   {
     TableGuard g(objs->invoices); // ensure table is locked and unlocked
 
     // Changes should be visible even though we haven't committed them
-    ASSERT("1000" == objs->invoices->get("abc123"));
-    ASSERT("1318" == objs->invoices->get("xyz456"));
+    ASSERT("1000" == objs->invoices->get("abc123", &txn));
+    ASSERT("1318" == objs->invoices->get("xyz456", &txn));
 
-    ASSERT(!objs->invoices->has_key("nonexistent"));
+    ASSERT(!objs->invoices->has_key("nonexistent", &txn));
   }
 
   {
     TableGuard g(objs->invoices); // ensure table is locked and unlocked
 
     // Rollback changes
-    objs->invoices->rollback_changes();
+    objs->invoices->rollback_changes(txn);
   }
 
   {
     TableGuard g(objs->invoices); // ensure table is locked and unlocked
 
     // Table should be empty again!
-    ASSERT(!objs->invoices->has_key("abc123"));
-    ASSERT(!objs->invoices->has_key("xyz456"));
-    ASSERT(!objs->invoices->has_key("nonexistent"));
+    ASSERT(!objs->invoices->has_key("abc123", &txn));
+    ASSERT(!objs->invoices->has_key("xyz456", &txn));
+    ASSERT(!objs->invoices->has_key("nonexistent", &txn));
   }
 }
 
@@ -487,50 +638,53 @@ void test_table_rollback_changes(TestObjs *objs) {
 // done and then rolled back, and the originally committed data is still
 // there.
 void test_table_commit_and_rollback(TestObjs *objs) {
+  // Pending changes of one transaction
+  WriteSet txn;
+
   // Add some data
   {
     TableGuard g(objs->line_items);
 
-    objs->line_items->set("apples", "100");
-    objs->line_items->set("bananas", "150");
+    objs->line_items->set("apples", "100", txn);
+    objs->line_items->set("bananas", "150", txn);
   }
 
   // Commit changes
   {
     TableGuard g(objs->line_items);
 
-    objs->line_items->commit_changes();
+    objs->line_items->commit_changes(txn);
   }
 
   // Ensure that data is there
   {
     TableGuard g(objs->line_items);
 
-    ASSERT("100" == objs->line_items->get("apples"));
-    ASSERT("150" == objs->line_items->get("bananas"));
+    ASSERT("100" == objs->line_items->get("apples", &txn));
+    ASSERT("150" == objs->line_items->get("bananas", &txn));
   }
 
   // Add more data
   {
     TableGuard g(objs->line_items);
 
-    objs->line_items->set("oranges", "220");
+    objs->line_items->set("oranges", "220", txn);
   }
 
   // Ensure that data is there
   {
     TableGuard g(objs->line_items);
 
-    ASSERT("100" == objs->line_items->get("apples"));
-    ASSERT("150" == objs->line_items->get("bananas"));
-    ASSERT("220" == objs->line_items->get("oranges"));
+    ASSERT("100" == objs->line_items->get("apples", &txn));
+    ASSERT("150" == objs->line_items->get("bananas", &txn));
+    ASSERT("220" == objs->line_items->get("oranges", &txn));
   }
 
   // Rollback most recent change
   {
     TableGuard g(objs->line_items);
 
-    objs->line_items->rollback_changes();
+    objs->line_items->rollback_changes(txn);
   }
 
   // Original data should still be there (since it was committed),
@@ -538,10 +692,1540 @@ void test_table_commit_and_rollback(TestObjs *objs) {
   {
     TableGuard g(objs->line_items);
 
-    ASSERT("100" == objs->line_items->get("apples"));
-    ASSERT("150" == objs->line_items->get("bananas"));
-    ASSERT(!objs->line_items->has_key("oranges"));
+    ASSERT("100" == objs->line_items->get("apples", &txn));
+    ASSERT("150" == objs->line_items->get("bananas", &txn));
+    ASSERT(!objs->line_items->has_key("oranges", &txn));
+  }
+}
+
+// Each transaction only sees its own pending changes
+void test_table_transaction_isolation(TestObjs *objs) {
+  WriteSet txn1, txn2;
+
+  {
+    TableGuard g(objs->invoices);
+
+    objs->invoices->set("shared", "0"); // autocommit
+    objs->invoices->set("shared", "1", txn1);
+    objs->invoices->set("only1", "1", txn1);
+    objs->invoices->set("shared", "2", txn2);
+
+    ASSERT("0" == objs->invoices->get("shared"));
+    ASSERT("1" == objs->invoices->get("shared", &txn1));
+    ASSERT("2" == objs->invoices->get("shared", &txn2));
+    ASSERT(objs->invoices->has_key("only1", &txn1));
+    ASSERT(!objs->invoices->has_key("only1", &txn2));
+    ASSERT(!objs->invoices->has_key("only1"));
+  }
+
+  {
+    TableGuard g(objs->invoices);
+
+    objs->invoices->commit_changes(txn1);
+    ASSERT(txn1.empty());
+    objs->invoices->rollback_changes(txn2);
+    ASSERT(txn2.empty());
+
+    ASSERT("1" == objs->invoices->get("shared"));
+    ASSERT("1" == objs->invoices->get("only1"));
+  }
+}
+
+// Records the changes a table reports to its listeners
+class RecordingListener : public TableListener {
+public:
+  std::map<std::string, std::string> changes;
+  int calls = 0;
+  std::string events; // keys changed, each commit's as [<count>...]
+
+  void key_changed(Table *table, std::string_view key,
+                   std::string_view value) override {
+    changes[std::string(key)] = std::string(value);
+    calls++;
+    events += key;
+  }
+  void commit_started(Table *table, size_t num_keys) override {
+    events += "[" + std::to_string(num_keys);
+  }
+  void commit_finished(Table *table) override { events += "]"; }
+};
+
+void test_table_listener(TestObjs *objs) {
+  RecordingListener listener;
+  objs->invoices->add_listener(&listener);
+  WriteSet txn;
+
+  TableGuard g(objs->invoices);
+  objs->invoices->set("a", "1"); // autocommit: reported immediately
+  ASSERT(1 == listener.calls);
+  ASSERT("1" == listener.changes["a"]);
+
+  objs->invoices->set("b", "2", txn); // buffered: reported on commit
+  objs->invoices->set("b", "3", txn);
+  objs->invoices->set("c", "4", txn);
+  ASSERT(1 == listener.calls);
+  objs->invoices->commit_changes(txn);
+  ASSERT(3 == listener.calls); // one call per key, with its final value
+  ASSERT("3" == listener.changes["b"]);
+  ASSERT("4" == listener.changes["c"]);
+  ASSERT("a[2bc]" == listener.events); // the commit's keys together
+
+  objs->invoices->set("d", "5", txn); // rolled back: never reported
+  objs->invoices->rollback_changes(txn);
+  ASSERT(3 == listener.calls);
+}
+
+// A memory engine whose writes fail (as a log engine's would on an I/O
+// error) while fail is set
+class FailingEngine : public MemoryEngine {
+public:
+  bool fail = false;
+
+  void put(std::string_view key, std::string_view value) override {
+    if (fail) {
+      throw std::runtime_error("write failed");
+    }
+    MemoryEngine::put(key, value);
+  }
+  void adopt(CompactStore &writes) override {
+    if (fail) {
+      throw std::runtime_error("write failed");
+    }
+    MemoryEngine::adopt(writes);
+  }
+};
+
+void test_table_engine_failure(TestObjs *objs) {
+  FailingEngine *engine = new FailingEngine();
+  Table table("failing", engine);
+  RecordingListener listener;
+  table.add_listener(&listener);
+  WriteSet txn;
+  std::vector<std::string> keys;
+
+  TableGuard g(&table);
+  ASSERT(table.create_index());
+  table.set("a", "1");
+  ASSERT(1 == listener.calls);
+
+  // Neither the index nor the listeners hear of changes the engine
+  // didn't store
+  engine->fail = true;
+  try {
+    table.set("a", "2");
+    FAIL("set should have thrown");
+  } catch (std::runtime_error &ex) {
+  }
+  table.set("b", "2", txn);
+  try {
+    table.commit_changes(txn);
+    FAIL("commit should have thrown");
+  } catch (std::runtime_error &ex) {
+  }
+  ASSERT(1 == listener.calls);
+  ASSERT("1" == listener.changes["a"]);
+  ASSERT(table.find("2", keys));
+  ASSERT(keys.empty());
+  table.find("1", keys);
+  ASSERT(std::vector<std::string>({"a"}) == keys);
+  ASSERT("1" == table.get("a"));
+
+  engine->fail = false;
+  table.set("a", "2");
+  keys.clear();
+  table.find("1", keys);
+  ASSERT(keys.empty());
+  table.find("2", keys);
+  ASSERT(std::vector<std::string>({"a"}) == keys);
+  ASSERT(2 == listener.calls);
+}
+
+void test_pubsub(TestObjs *objs) {
+  PubSub pubsub;
+  objs->invoices->add_listener(&pubsub);
+  objs->line_items->add_listener(&pubsub);
+  pubsub.set_limits(3, false);
+  std::unique_ptr<Subscriber> keys(pubsub.create_subscriber());
+  std::unique_ptr<Subscriber> table(pubsub.create_subscriber());
+  pubsub.watch(keys.get(), "invoices", "a");
+  pubsub.watch(keys.get(), "invoices", "a"); // no duplicate events
+  pubsub.subscribe(table.get(), "invoices");
+  pubsub.watch(table.get(), "invoices", "a"); // already covered
+
+  std::vector<Subscriber::Event> events;
+  uint64_t dropped;
+  {
+    TableGuard g(objs->invoices);
+    objs->invoices->set("a", "1");
+    objs->invoices->set("b", "2");
+  }
+  {
+    TableGuard g(objs->line_items);
+    objs->line_items->set("a", "3"); // nobody is subscribed
+  }
+  uint64_t count;
+  ASSERT(sizeof(count) == read(keys->get_fd(), &count, sizeof(count)));
+  ASSERT(keys->take(events, dropped));
+  ASSERT(1 == events.size());
+  ASSERT(0 == dropped);
+  ASSERT("invoices" == events[0].table);
+  ASSERT("a" == events[0].key);
+  ASSERT("1" == events[0].value);
+  ASSERT(table->take(events, dropped));
+  ASSERT(2 == events.size());
+  ASSERT("b" == events[1].key);
+
+  // A full queue drops its oldest events
+  {
+    TableGuard g(objs->invoices);
+    WriteSet txn;
+    for (int i = 0; i < 5; i++) {
+      objs->invoices->set("k" + std::to_string(i), std::to_string(i), txn);
+    }
+    objs->invoices->commit_changes(txn);
+  }
+  ASSERT(table->take(events, dropped));
+  ASSERT(3 == events.size());
+  ASSERT(2 == dropped);
+  ASSERT(keys->take(events, dropped)); // watches another key
+  ASSERT(events.empty());
+
+  // Under the disconnect policy, overflowing ends the subscription
+  pubsub.set_limits(1, true);
+  std::unique_ptr<Subscriber> slow(pubsub.create_subscriber());
+  pubsub.subscribe(slow.get(), "line_items");
+  {
+    TableGuard g(objs->line_items);
+    objs->line_items->set("a", "4");
+    objs->line_items->set("b", "5");
+  }
+  ASSERT(!slow->take(events, dropped));
+
+  pubsub.unsubscribe(keys.get());
+  pubsub.unsubscribe(table.get());
+  pubsub.unsubscribe(slow.get());
+  ASSERT(pubsub.get_stats().find("subscriptions=0;") == 0);
+  {
+    TableGuard g(objs->invoices);
+    objs->invoices->set("a", "6");
+  }
+  ASSERT(table->take(events, dropped));
+  ASSERT(events.empty());
+}
+
+void test_table_index(TestObjs *objs) {
+  TableGuard g(objs->invoices);
+  std::vector<std::string> keys;
+  objs->invoices->set("a", "x");
+  objs->invoices->set("b", "y");
+  ASSERT(!objs->invoices->find("x", keys)); // not indexed yet
+
+  // Existing data is indexed, and the index follows later changes
+  ASSERT(objs->invoices->create_index());
+  ASSERT(!objs->invoices->create_index());
+  objs->invoices->set("c", "x");
+  ASSERT(objs->invoices->find("x", keys));
+  ASSERT(std::vector<std::string>({"a", "c"}) == keys);
+  objs->invoices->set("a", "y");
+  keys.clear();
+  objs->invoices->find("x", keys);
+  ASSERT(std::vector<std::string>({"c"}) == keys);
+  keys.clear();
+  objs->invoices->find("y", keys);
+  ASSERT(std::vector<std::string>({"a", "b"}) == keys);
+
+  // A transaction sees its own changes; others only once committed
+  WriteSet txn;
+  objs->invoices->set("b", "x", txn);
+  objs->invoices->set("d", "x", txn);
+  objs->invoices->set("aa", "x", txn);
+  keys.clear();
+  objs->invoices->find("x", keys, &txn);
+  // In key order, across the index and the transaction's writes
+  ASSERT(std::vector<std::string>({"aa", "b", "c", "d"}) == keys);
+  keys.clear();
+  objs->invoices->find("x", keys);
+  ASSERT(std::vector<std::string>({"c"}) == keys);
+
+  // Rolled back changes never reach the index
+  objs->invoices->rollback_changes(txn);
+  keys.clear();
+  objs->invoices->find("x", keys);
+  ASSERT(std::vector<std::string>({"c"}) == keys);
+
+  objs->invoices->set("b", "x", txn);
+  objs->invoices->commit_changes(txn);
+  keys.clear();
+  objs->invoices->find("x", keys);
+  ASSERT(std::vector<std::string>({"b", "c"}) == keys);
+  keys.clear();
+  objs->invoices->find("y", keys);
+  ASSERT(std::vector<std::string>({"a"}) == keys);
+  keys.clear();
+  ASSERT(objs->invoices->find("z", keys));
+  ASSERT(keys.empty());
+}
+
+void test_value_codec(TestObjs *objs) {
+  std::string scratch, decoded;
+  std::string json;
+  for (int i = 0; i < 40; i++) {
+    json += "{\"id\":" + std::to_string(i) + ",\"status\":\"paid\"},";
+  }
+
+  // Repetitive values shrink, and round trip
+  std::string_view stored = ValueCodec::encode(json, scratch);
+  ASSERT(stored.size() < json.size() / 2);
+  ASSERT(json == ValueCodec::decode(stored, decoded));
+
+  // Short values, and ones which don't compress, are stored as they are
+  ASSERT("short" == ValueCodec::encode("short", scratch));
+  std::string noise;
+  unsigned seed = 1;
+  for (int i = 0; i < 512; i++) {
+    seed = seed * 1103515245 + 12345;
+    noise += char('!' + (seed >> 16) % 90);
+  }
+  stored = ValueCodec::encode(noise, scratch);
+  ASSERT(noise.data() == stored.data());
+  ASSERT(noise == ValueCodec::decode(stored, decoded));
+
+  // Values starting with a tag byte are escaped
+  std::string tagged = std::string(1, '\x01') + "abc";
+  stored = ValueCodec::encode(tagged, scratch);
+  ASSERT(5 == stored.size());
+  ASSERT(tagged == ValueCodec::decode(stored, decoded));
+
+  // Long runs, matches overlapping their output, and long literal runs
+  std::string runs = std::string(1000, 'a') + noise.substr(0, 300) +
+                     std::string(700, 'b') + noise.substr(0, 300);
+  std::vector<char> block(ValueCodec::compress_bound(runs.size()));
+  size_t len = ValueCodec::compress(runs.data(), runs.size(), block.data());
+  ASSERT(len < runs.size() / 2);
+  std::string out(runs.size(), '\0');
+  ASSERT(ValueCodec::decompress(block.data(), len, &out[0], out.size()));
+  ASSERT(runs == out);
+
+  // Damaged blocks are rejected
+  ASSERT(!ValueCodec::decompress(block.data(), len - 1, &out[0], out.size()));
+  ASSERT(!ValueCodec::decompress(block.data(), len, &out[0], out.size() - 1));
+  std::string bad = std::string("\x01\x10", 2) + "\x0f" + "abc";
+  try {
+    ValueCodec::decode(bad, decoded);
+    FAIL("decoding a corrupt value should fail");
+  } catch (std::runtime_error &ex) {
+    // good
+  }
+
+  // Threshold 0 turns compression off
+  ValueCodec::set_threshold(0);
+  ASSERT(json.data() == ValueCodec::encode(json, scratch).data());
+  ValueCodec::set_threshold(ValueCodec::DEFAULT_THRESHOLD);
+}
+
+void test_table_compression(TestObjs *objs) {
+  std::string big;
+  for (int i = 0; i < 50; i++) {
+    big += "line-item-" + std::to_string(i % 5) + ";";
+  }
+  TableGuard g(objs->invoices);
+  objs->invoices->create_index();
+
+  // Values are compressed transparently, whichever way they are written
+  objs->invoices->set("a", big);
+  WriteSet txn;
+  objs->invoices->set("b", big + "!", txn);
+  ASSERT(big + "!" == objs->invoices->get("b", &txn));
+  objs->invoices->commit_changes(txn);
+  ASSERT(big == objs->invoices->get("a"));
+  ASSERT(big + "!" == objs->invoices->get("b"));
+
+  std::vector<std::string> keys;
+  objs->invoices->find(big, keys);
+  ASSERT(std::vector<std::string>({"a"}) == keys);
+
+  // Snapshots hold the stored form
+  CompactStore snapshot;
+  objs->invoices->snapshot()->for_each(
+      [&](std::string_view key, std::string_view value) {
+        snapshot.put(key, value);
+      });
+  std::string_view stored;
+  ASSERT(snapshot.get("a", stored));
+  ASSERT(stored.size() < big.size());
+  std::string scratch;
+  ASSERT(big == ValueCodec::decode(stored, scratch));
+}
+
+// A fresh directory for a log engine, removed by the destructor
+struct TempDir {
+  std::string path;
+  TempDir() {
+    char name[] = "/tmp/kvlogXXXXXX";
+    path = mkdtemp(name);
+  }
+  ~TempDir() {
+    std::string cmd = "rm -rf " + path;
+    if (system(cmd.c_str()) != 0) {
+      // leave it
+    }
+  }
+};
+
+void test_log_engine(TestObjs *objs) {
+  TempDir dir;
+  std::string_view value;
+  {
+    LogEngine engine(dir.path, 1024);
+    ASSERT(!engine.get("a", value));
+    engine.put("a", "1");
+    engine.put("b", "2");
+    engine.put("a", "3");
+    ASSERT(engine.get("a", value) && "3" == value);
+    ASSERT(2 == engine.size());
+
+    // Enough writes to fill several segments
+    for (int i = 0; i < 100; i++) {
+      engine.put("key" + std::to_string(i % 20), std::string(40, 'a' + i % 26));
+    }
+    ASSERT(22 == engine.size());
+
+    // Committing a transaction's writes
+    CompactStore writes(CompactStore::SMALL_SLAB_SIZE);
+    writes.put("b", "4");
+    writes.put("c", "5");
+    engine.adopt(writes);
+    ASSERT(0 == writes.size());
+    ASSERT(engine.get("b", value) && "4" == value);
+  }
+
+  // Reopening rebuilds the index, with the latest value of each key
+  {
+    LogEngine engine(dir.path, 1024);
+    ASSERT(23 == engine.size());
+    ASSERT(engine.get("a", value) && "3" == value);
+    ASSERT(engine.get("c", value) && "5" == value);
+    ASSERT(engine.get("key19", value) && std::string(40, 'a' + 99 % 26) == value);
+    engine.put("d", "6");
+  }
+
+  // A record torn by a crash is lost, but nothing before it
+  {
+    LogEngine engine(dir.path, 1024);
+    ASSERT(engine.get("d", value) && "6" == value);
+    engine.put("e", "7");
+    ASSERT(engine.get_stats().find(";torn_bytes=0") != std::string::npos);
+  }
+  bool damaged = false;
+  for (unsigned id = 1; id < 100 && !damaged; id++) {
+    char name[16];
+    snprintf(name, sizeof(name), "/%08u.log", id);
+    int fd = open((dir.path + name).c_str(), O_RDWR);
+    if (fd < 0) {
+      continue;
+    }
+    // e's record ends with its key and value lengths, key and value
+    char buf[1024];
+    ssize_t n = pread(fd, buf, sizeof(buf), 0);
+    std::string_view contents(buf, n > 0 ? n : 0);
+    size_t pos = contents.find(std::string_view("\x01\x01" "e7", 4));
+    if (pos != std::string_view::npos) {
+      ASSERT(1 == pwrite(fd, "8", 1, pos + 3));
+      damaged = true;
+    }
+    close(fd);
+  }
+  ASSERT(damaged);
+  {
+    LogEngine engine(dir.path, 1024);
+    ASSERT(!engine.get("e", value));
+    ASSERT(engine.get("d", value) && "6" == value);
+    ASSERT(engine.get_stats().find(";torn_bytes=0") == std::string::npos);
+    // Appending carries on over the torn record
+    engine.put("e", "9");
+  }
+  {
+    LogEngine engine(dir.path, 1024);
+    ASSERT(engine.get("e", value) && "9" == value);
+    ASSERT(25 == engine.size());
+  }
+}
+
+void test_log_engine_compaction(TestObjs *objs) {
+  TempDir dir;
+  std::string_view value;
+  {
+    LogEngine engine(dir.path, 1024);
+    ASSERT(!engine.compact(1024)); // nothing stale yet
+
+    // Rewriting the same keys leaves full segments of stale records
+    for (int round = 0; round < 10; round++) {
+      for (int i = 0; i < 10; i++) {
+        engine.put("key" + std::to_string(i),
+                   std::to_string(round) + std::string(50, 'v'));
+      }
+    }
+    std::string before = engine.get_stats();
+    ASSERT(before.find(";compactions=0;") != std::string::npos);
+    while (engine.compact(256)) {
+    }
+    std::string after = engine.get_stats();
+    ASSERT(after.find(";compactions=0;") == std::string::npos);
+    ASSERT(std::stoul(after.substr(after.find("segments=") + 9)) <
+           std::stoul(before.substr(before.find("segments=") + 9)));
+    for (int i = 0; i < 10; i++) {
+      ASSERT(engine.get("key" + std::to_string(i), value));
+      ASSERT("9" + std::string(50, 'v') == value);
+    }
+  }
+
+  // Compacted segments are gone for good
+  LogEngine engine(dir.path, 1024);
+  ASSERT(10 == engine.size());
+  for (int i = 0; i < 10; i++) {
+    ASSERT(engine.get("key" + std::to_string(i), value));
+    ASSERT("9" + std::string(50, 'v') == value);
+  }
+
+  // A table on a log engine behaves like any other
+  Table table("logged", new LogEngine(dir.path + "/t", 4096));
+  TableGuard g(&table);
+  table.set("a", "1");
+  WriteSet txn;
+  table.set("b", "2", txn);
+  table.commit_changes(txn);
+  ASSERT("2" == table.get("b"));
+  size_t entries = 0;
+  table.snapshot()->for_each(
+      [&](std::string_view key, std::string_view value) { entries++; });
+  ASSERT(2 == entries);
+  ASSERT(0 == strcmp("log", table.get_engine_name()));
+}
+
+void test_log_engine_snapshot(TestObjs *objs) {
+  TempDir dir;
+  LogEngine engine(dir.path, 1024);
+  for (int i = 0; i < 10; i++) {
+    engine.put("key" + std::to_string(i), "old" + std::string(50, 'v'));
+  }
+  std::unique_ptr<StorageEngine::Snapshot> snapshot = engine.snapshot();
+
+  // Later writes aren't seen, even once compaction has deleted the
+  // segments the snapshot refers to
+  for (int round = 0; round < 10; round++) {
+    for (int i = 0; i < 10; i++) {
+      engine.put("key" + std::to_string(i),
+                 std::to_string(round) + std::string(50, 'v'));
+    }
+  }
+  engine.put("new", "1");
+  while (engine.compact(1024)) {
+  }
+  ASSERT(engine.get_stats().find(";compactions=0;") == std::string::npos);
+
+  std::map<std::string, std::string> seen;
+  snapshot->for_each([&](std::string_view key, std::string_view value) {
+    seen[std::string(key)] = std::string(value);
+  });
+  ASSERT(10 == seen.size());
+  for (int i = 0; i < 10; i++) {
+    ASSERT("old" + std::string(50, 'v') == seen["key" + std::to_string(i)]);
+  }
+}
+
+void test_log_engine_batch(TestObjs *objs) {
+  TempDir dir;
+  std::string_view value;
+  {
+    LogEngine engine(dir.path, 1024);
+    engine.put("a", "1");
+    CompactStore writes(CompactStore::SMALL_SLAB_SIZE);
+    writes.put("b", "2");
+    writes.put("c", "3");
+    engine.adopt(writes);
+
+    // A batch which fails partway takes no effect
+    writes.put("a", "4");
+    writes.put("d", std::string(2000, 'v')); // too long for a segment
+    writes.put("e", "5");
+    try {
+      engine.adopt(writes);
+      FAIL("adopting an oversized record succeeded");
+    } catch (std::length_error &ex) {
+    }
+    ASSERT(engine.get("a", value) && "1" == value);
+    ASSERT(!engine.get("e", value));
+    ASSERT(3 == engine.size());
+    writes.clear();
+
+    // This batch's commit record is damaged below
+    writes.put("f", "6");
+    writes.put("g", "7");
+    engine.adopt(writes);
+    ASSERT(engine.get("g", value) && "7" == value);
+  }
+
+  // The last commit record: [0xb9][checksum][0][8][location]
+  bool damaged = false;
+  for (unsigned id = 1; id < 10 && !damaged; id++) {
+    char name[16];
+    snprintf(name, sizeof(name), "/%08u.log", id);
+    int fd = open((dir.path + name).c_str(), O_RDWR);
+    if (fd < 0) {
+      continue;
+    }
+    char buf[1024];
+    ssize_t n = pread(fd, buf, sizeof(buf), 0);
+    ssize_t last = -1;
+    for (ssize_t pos = 0; pos + 15 <= n; pos++) {
+      if ((unsigned char)buf[pos] == 0xb9 && buf[pos + 5] == 0 &&
+          buf[pos + 6] == 8) {
+        last = pos;
+      }
+    }
+    std::string_view contents(buf, n > 0 ? n : 0);
+    if (last >= 0 && contents.find("g7") != std::string_view::npos) {
+      ASSERT(1 == pwrite(fd, "", 1, last));
+      damaged = true;
+    }
+    close(fd);
+  }
+  ASSERT(damaged);
+
+  // Reading the log again, only committed batches are applied
+  {
+    LogEngine engine(dir.path, 1024);
+    ASSERT(3 == engine.size());
+    ASSERT(engine.get("a", value) && "1" == value);
+    ASSERT(engine.get("c", value) && "3" == value);
+    ASSERT(!engine.get("e", value));
+    ASSERT(!engine.get("f", value));
+    ASSERT(!engine.get("g", value));
+
+    // A batch spanning segments survives its commit record's segment
+    // going stale
+    CompactStore writes(CompactStore::SMALL_SLAB_SIZE);
+    for (int i = 0; i < 40; i++) {
+      writes.put("key" + std::to_string(i), std::string(40, 'b'));
+    }
+    engine.adopt(writes);
+    for (int i = 0; i < 40; i++) {
+      engine.put("pad", std::string(40, 'p'));
+    }
+    for (int i = 36; i < 40; i++) {
+      engine.put("key" + std::to_string(i), std::string(40, 'c'));
+    }
+    while (engine.compact(1024)) {
+    }
+  }
+  LogEngine engine(dir.path, 1024);
+  ASSERT(44 == engine.size());
+  for (int i = 0; i < 40; i++) {
+    ASSERT(engine.get("key" + std::to_string(i), value));
+    ASSERT(std::string(40, i < 36 ? 'b' : 'c') == value);
+  }
+}
+
+void test_hot_keys(TestObjs *objs) {
+  HotKeyTracker tracker;
+  std::hash<std::string_view> hash;
+  // One key gets most of the reads
+  for (int i = 0; i < 20000; i++) {
+    std::string key = i % 2 ? "hot" : "cold" + std::to_string(i);
+    tracker.record(key, hash(key), false);
+  }
+  ASSERT(tracker.is_hot(hash("hot")));
+  ASSERT(!tracker.is_hot(hash("cold2")));
+  std::string stats = tracker.get_stats(Message::MAX_ENCODED_LEN);
+  ASSERT(0 == stats.find("hot_keys=hot:"));
+  ASSERT(std::string::npos != stats.find(";reads_sampled=20000;"));
+
+  // Reads cycling through keys are sampled across all of them, not just
+  // the ones a fixed sampling interval lines up with
+  HotKeyTracker cyclic;
+  for (int round = 0; round < 300; round++) {
+    for (int i = 0; i < 32; i++) {
+      std::string key = "key" + std::to_string(i);
+      if (HotKeyTracker::sample()) {
+        cyclic.record(key, hash(key), false);
+      }
+    }
+  }
+  int hot_keys = 0;
+  for (int i = 0; i < 32; i++) {
+    hot_keys += cyclic.is_hot(hash("key" + std::to_string(i)));
+  }
+  ASSERT(hot_keys >= 24);
+
+  // Only the hottest keys that fit are listed
+  stats = tracker.get_stats(60);
+  ASSERT(0 == stats.find("hot_keys=hot:") && stats.size() <= 60);
+  ASSERT(0 == tracker.get_stats(40).find("hot_keys=-;"));
+
+  // A table's statistics fit in a DATA response however long its hot
+  // keys are
+  Table table("long_keys");
+  std::vector<std::string> keys;
+  for (int i = 0; i < 32; i++) {
+    keys.push_back(std::string(60, 'k') + std::to_string(i));
+    TableGuard g(&table);
+    table.set(keys.back(), "1");
+  }
+  for (const std::string &key : keys) {
+    for (int i = 0; i < 400; i++) {
+      TableGuard g(&table);
+      table.get(key);
+    }
+  }
+  stats = table.get_stats();
+  ASSERT(std::string::npos != stats.find("hot_keys=" + std::string(60, 'k')));
+  Message response(MessageType::DATA, {stats});
+  std::string encoded;
+  MessageSerialization::encode(response, encoded);
+}
+
+void *is_a_cached(void *table) {
+  return static_cast<Table *>(table)->is_cached("a") ? table : nullptr;
+}
+
+void test_read_cache(TestObjs *objs) {
+  Table *table = objs->invoices;
+  {
+    TableGuard g(table);
+    table->set("a", "1");
+    table->set("b", "2");
+  }
+  std::string value;
+  ASSERT(!table->get_cached("a", value));
+  // Reading a key often makes it hot, and cached by this thread
+  for (int i = 0; i < 1000; i++) {
+    TableGuard g(table);
+    ASSERT("1" == table->get("a"));
+  }
+  ASSERT(table->is_cached("a"));
+  ASSERT(table->get_cached("a", value));
+  ASSERT("1" == value);
+  ASSERT(!table->get_cached("b", value));
+
+  // Writes invalidate it, committed or not
+  {
+    TableGuard g(table);
+    table->set("a", "3");
+  }
+  ASSERT(!table->get_cached("a", value));
+  {
+    TableGuard g(table);
+    ASSERT("3" == table->get("a"));
+  }
+  ASSERT(table->get_cached("a", value));
+  ASSERT("3" == value);
+  {
+    TableGuard g(table);
+    WriteSet txn;
+    table->set("a", "4", txn);
+    table->commit_changes(txn);
+  }
+  ASSERT(!table->get_cached("a", value));
+  ASSERT(0 == table->get_stats().find("acquisitions=") &&
+         std::string::npos != table->get_stats().find("hot_keys=a:"));
+
+  // Other threads have caches of their own
+  {
+    TableGuard g(table);
+    table->get("a");
+  }
+  ASSERT(table->is_cached("a"));
+  pthread_t other;
+  pthread_create(&other, NULL, is_a_cached, table);
+  void *cached_elsewhere;
+  pthread_join(other, &cached_elsewhere);
+  ASSERT(!cached_elsewhere);
+
+  ReadCache::set_enabled(false);
+  ASSERT(!table->get_cached("a", value));
+  ReadCache::set_enabled(true);
+}
+
+struct PairWriter {
+  Table *table;
+  std::atomic<bool> done;
+};
+
+// Commits x and y together, and overwrites filler keys enough to grow
+// the table's index and compact its slabs
+void *commit_pairs(void *arg) {
+  PairWriter *writer = static_cast<PairWriter *>(arg);
+  for (int i = 1; i <= 2000; i++) {
+    TableGuard g(writer->table);
+    writer->table->set("k" + std::to_string(i % 500), std::string(200, 'v'));
+    WriteSet txn;
+    writer->table->set("x", std::to_string(i), txn);
+    writer->table->set("y", std::to_string(i), txn);
+    writer->table->commit_changes(txn);
+  }
+  writer->done.store(true);
+  return nullptr;
+}
+
+void test_unlocked_reads(TestObjs *objs) {
+  Table *table = objs->invoices;
+  ASSERT(table->supports_unlocked_reads());
+  std::string value;
+  ASSERT(!table->get_unlocked("x", value));
+
+  PairWriter writer;
+  writer.table = table;
+  writer.done.store(false);
+  pthread_t thread;
+  pthread_create(&thread, NULL, commit_pairs, &writer);
+  // A transaction's writes are seen together: y is never behind x
+  int reads = 0;
+  while (!writer.done.load() || reads == 0) {
+    std::string x, y;
+    if (table->get_unlocked("x", x)) {
+      ASSERT(table->get_unlocked("y", y));
+      ASSERT(std::stoi(y) >= std::stoi(x));
+      reads++;
+    }
+    if (table->get_unlocked("k7", value)) {
+      ASSERT(std::string(200, 'v') == value);
+    }
+  }
+  pthread_join(thread, NULL);
+  ASSERT(table->get_unlocked("y", value));
+  ASSERT("2000" == value);
+
+  // Replaced slabs and indexes are freed once nobody reads them
+  ASSERT(0 == Epoch::reclaim());
+  ASSERT(std::string::npos == Epoch::get_stats().find("epoch_retired=0;"));
+
+  // Log tables are only read under the lock
+  TempDir dir;
+  Table log_table("log", new LogEngine(dir.path));
+  ASSERT(!log_table.supports_unlocked_reads());
+}
+
+void test_session(TestObjs *objs) {
+  Database db;
+  Session session(&db);
+  ASSERT(session.create_table("accounts"));
+  ASSERT(!session.create_table("accounts"));
+
+  // Autocommit
+  session.set("accounts", "alice", "100");
+  ASSERT("100" == session.get("accounts", "alice"));
+  try {
+    session.get("accounts", "bob");
+    FAIL("getting a missing key should fail");
+  } catch (std::out_of_range &ex) {
+    // good
+  }
+  try {
+    session.set("nope", "alice", "1");
+    FAIL("setting a value in a missing table should fail");
+  } catch (UnknownTable &ex) {
+    // good
+  }
+
+  // Transactions see their own writes, and nobody else does until they
+  // commit
+  Session other(&db);
+  session.begin();
+  session.set("accounts", "alice", "90");
+  session.set("accounts", "bob", "10");
+  ASSERT("90" == session.get("accounts", "alice"));
+  session.commit();
+  ASSERT("90" == other.get("accounts", "alice"));
+  ASSERT("10" == other.get("accounts", "bob"));
+
+  session.begin();
+  session.set("accounts", "alice", "0");
+  session.rollback();
+  ASSERT("90" == other.get("accounts", "alice"));
+  try {
+    session.commit();
+    FAIL("committing without a transaction should fail");
+  } catch (OperationException &ex) {
+    // good
+  }
+
+  // The stack, and its arithmetic
+  session.push("7");
+  session.push("2");
+  session.sub();
+  ASSERT("5" == session.top());
+  session.push("0");
+  try {
+    session.div();
+    FAIL("dividing by zero should fail");
+  } catch (std::invalid_argument &ex) {
+    // good
+  }
+  session.pop();
+  session.pop();
+  ASSERT(session.stack().is_empty());
+}
+
+void test_session_conflict(TestObjs *objs) {
+  Database db;
+  db.create_table("a");
+  db.create_table("b");
+  Session first(&db), second(&db);
+  first.set("a", "k", "1");
+
+  // A transaction which finds a table locked by another is rolled back
+  first.begin();
+  first.set("a", "k", "2");
+  second.begin();
+  second.set("b", "k", "3");
+  try {
+    second.get("a", "k");
+    FAIL("using a table locked by another transaction should fail");
+  } catch (FailedTransaction &ex) {
+    // good
+  }
+  ASSERT(!second.in_transaction());
+  first.commit();
+  // The rollback unlocked b, and discarded the write to it
+  ASSERT(db.find_table("b")->trylock());
+  db.find_table("b")->unlock();
+  try {
+    second.get("b", "k");
+    FAIL("the rolled back write should be discarded");
+  } catch (std::out_of_range &ex) {
+    // good
+  }
+  ASSERT("2" == second.get("a", "k"));
+
+  // A session that goes away mid-transaction unlocks its tables
+  {
+    Session third(&db);
+    third.begin();
+    third.set("a", "k", "4");
+  }
+  ASSERT("2" == first.get("a", "k"));
+}
+
+void test_session_commit_failure(TestObjs *objs) {
+  TempDir dir;
+  Database db;
+  db.set_data_dir(dir.path);
+  db.create_table("a");
+  db.create_table("z", "log");
+  Session session(&db);
+
+  // A value which (incompressible) can't fit a log segment fails the
+  // commit of z, after a, which comes first, has committed
+  std::string big(LogEngine::DEFAULT_SEGMENT_SIZE, ' ');
+  uint32_t x = 1;
+  for (char &c : big) {
+    x = x * 1103515245 + 12345;
+    c = char(x >> 24);
+  }
+  session.begin();
+  session.set("a", "k", "1");
+  session.set("z", "k", big);
+  try {
+    session.commit();
+    FAIL("commit should have thrown");
+  } catch (OperationException &ex) {
+    ASSERT(std::string(ex.what()).find("after committing a:") !=
+           std::string::npos);
+  }
+  ASSERT(!session.in_transaction());
+  ASSERT("1" == session.get("a", "k"));
+  try {
+    session.get("z", "k");
+    FAIL("the write to z should have been rolled back");
+  } catch (std::out_of_range &ex) {
+    // good
+  }
+  // Both tables are unlocked, once each
+  Table *tables[] = {db.find_table("a"), db.find_table("z")};
+  for (Table *table : tables) {
+    ASSERT(table->trylock());
+    ASSERT(!table->trylock());
+    table->unlock();
+  }
+}
+
+void test_table_lock_stats(TestObjs *objs) {
+  // Nothing is recorded while profiling is off
+  { TableGuard g(objs->invoices); }
+  ASSERT(0 == objs->invoices->get_lock_stats().acquisitions);
+
+  Table::set_profiling(true);
+
+  objs->invoices->lock("SET");
+  ASSERT(!objs->invoices->trylock("GET")); // already held
+  objs->invoices->unlock();
+
+  ASSERT(objs->invoices->trylock("GET"));
+  objs->invoices->unlock();
+
+  Table::set_profiling(false);
+
+  LockStats stats = objs->invoices->get_lock_stats();
+  ASSERT(2 == stats.acquisitions);
+  ASSERT(0 == stats.contended);
+  ASSERT(1 == stats.trylock_failures);
+  ASSERT(stats.max_hold_ns <= stats.hold_ns);
+  ASSERT("SET" == stats.max_hold_holder || "GET" == stats.max_hold_holder);
+
+  objs->invoices->reset_lock_stats();
+  ASSERT(0 == objs->invoices->get_lock_stats().acquisitions);
+}
+
+void test_admission(TestObjs *objs) {
+  std::string name;
+  AdmissionControl::Limits limits;
+  ASSERT(AdmissionControl::parse_limits("100", name, limits));
+  ASSERT(name.empty() && 100 == limits.rate);
+  ASSERT(AdmissionControl::DEFAULT_BURST == limits.burst);
+  ASSERT(AdmissionControl::Priority::INTERACTIVE == limits.priority);
+  ASSERT(AdmissionControl::parse_limits("bob=2.5:10:bulk", name, limits));
+  ASSERT("bob" == name && 2.5 == limits.rate && 10 == limits.burst);
+  ASSERT(AdmissionControl::Priority::BULK == limits.priority);
+  ASSERT(AdmissionControl::parse_limits("carol=0:bulk", name, limits));
+  ASSERT(0 == limits.rate && AdmissionControl::Priority::BULK == limits.priority);
+  ASSERT(!AdmissionControl::parse_limits("", name, limits));
+  ASSERT(!AdmissionControl::parse_limits("=5", name, limits));
+  ASSERT(!AdmissionControl::parse_limits("bob=fast", name, limits));
+  ASSERT(!AdmissionControl::parse_limits("5:0", name, limits));
+  ASSERT(!AdmissionControl::parse_limits("5:10:20", name, limits));
+
+  // 1000 requests/s with a burst of 3: three go at once, then one per ms
+  AdmissionControl admission;
+  AdmissionControl::parse_limits("importer=1000:3:bulk", name, limits);
+  admission.set_user_limits(name, limits);
+  AdmissionControl::User *importer = admission.get_user("importer");
+  ASSERT(importer == admission.get_user("importer"));
+  ASSERT(importer->is_bulk());
+  const uint64_t MS = 1000000, start = 1000 * MS;
+  for (int i = 0; i < 3; i++) {
+    ASSERT(0 == importer->admit(start));
+  }
+  ASSERT(MS == importer->admit(start));
+  ASSERT(2 * MS == importer->admit(start));
+  // Once the queued requests have gone, the bucket refills
+  ASSERT(0 == importer->admit(start + 10 * MS));
+  ASSERT(0 == importer->admit(start + 10 * MS));
+
+  // Users without limits of their own share the default bucket, with
+  // the default limits: none here
+  AdmissionControl::User *alice = admission.get_user("alice");
+  ASSERT(!alice->is_bulk());
+  ASSERT(alice == admission.get_user("bob"));
+  for (int i = 0; i < 1000; i++) {
+    ASSERT(0 == alice->admit(start));
+  }
+  ASSERT("users=importer:bulk:req=7:throttled=2:wait_ms=3,"
+         "*:interactive:req=1000:throttled=0:wait_ms=0" ==
+         admission.get_stats());
+
+  // A default rate gives each user a bucket of its own, for at most two
+  // users here
+  AdmissionControl limited(2);
+  AdmissionControl::parse_limits("1000:1", name, limits);
+  limited.set_default_limits(limits);
+  AdmissionControl::User *carol = limited.get_user("carol");
+  AdmissionControl::User *dave = limited.get_user("dave");
+  ASSERT(carol != dave && carol == limited.get_user("carol"));
+  ASSERT(0 == carol->admit(start) && 0 == dave->admit(start));
+  ASSERT(MS == carol->admit(start));
+  // With both connected, a third user shares the * bucket
+  AdmissionControl::User *erin = limited.get_user("erin");
+  ASSERT(erin != carol && erin != dave && "*" == erin->get_name());
+  limited.release_user(erin);
+  // Once dave has gone, his bucket makes way for a new user, and his
+  // requests still count
+  limited.release_user(dave);
+  AdmissionControl::User *frank = limited.get_user("frank");
+  ASSERT("frank" == frank->get_name());
+  ASSERT(0 == frank->admit(start));
+  ASSERT(carol == limited.get_user("carol"));
+  ASSERT("users=*:interactive:req=4:throttled=1:wait_ms=1" ==
+         limited.get_stats());
+}
+
+void test_compact_store(TestObjs *objs) {
+  CompactStore store;
+  std::string_view value;
+
+  ASSERT(!store.get("missing", value));
+
+  // Enough entries to grow the index and fill several slabs
+  for (int i = 0; i < 20000; i++) {
+    store.put("key" + std::to_string(i), std::to_string(i * 3));
+  }
+  ASSERT(20000 == store.size());
+  for (int i = 0; i < 20000; i++) {
+    ASSERT(store.get("key" + std::to_string(i), value));
+    ASSERT(std::to_string(i * 3) == value);
+  }
+  ASSERT(!store.contains("key20000"));
+
+  // Values bigger than a quarter slab get their own slab
+  std::string big(CompactStore::SLAB_SIZE, 'b');
+  store.put("big", big);
+  store.put("small", "s");
+  ASSERT(store.get("big", value));
+  ASSERT(big == value);
+  ASSERT(store.get("small", value));
+  ASSERT("s" == value);
+
+  size_t count = 0;
+  store.for_each([&](std::string_view k, std::string_view v) { count++; });
+  ASSERT(20002 == count);
+
+  store.clear();
+  ASSERT(0 == store.size());
+  ASSERT(!store.contains("key1"));
+}
+
+void test_compact_store_overwrite(TestObjs *objs) {
+  CompactStore store;
+  std::string_view value;
+
+  for (int i = 0; i < 1000; i++) {
+    store.put("key" + std::to_string(i), "initial");
+  }
+  size_t usage = store.memory_usage();
+
+  // Repeated overwrites trigger compaction, so memory stays bounded
+  for (int round = 0; round < 200; round++) {
+    for (int i = 0; i < 1000; i++) {
+      store.put("key" + std::to_string(i), std::to_string(round));
+    }
+  }
+  ASSERT(1000 == store.size());
+  ASSERT(store.memory_usage() < usage + 4 * CompactStore::SLAB_SIZE);
+  for (int i = 0; i < 1000; i++) {
+    ASSERT(store.get("key" + std::to_string(i), value));
+    ASSERT("199" == value);
+  }
+}
+
+void test_compact_store_copy_and_adopt(TestObjs *objs) {
+  CompactStore store, copy, empty;
+  std::string_view value;
+
+  for (int i = 0; i < 100; i++) {
+    store.put("key" + std::to_string(i), std::to_string(i));
+  }
+
+  // Copies are independent of the original
+  store.copy_to(copy);
+  store.put("key0", "changed");
+  ASSERT(100 == copy.size());
+  ASSERT(copy.get("key0", value));
+  ASSERT("0" == value);
+  ASSERT(copy.get("key99", value));
+  ASSERT("99" == value);
+
+  // Adopting into an empty store takes over the entries wholesale
+  empty.adopt(copy);
+  ASSERT(0 == copy.size());
+  ASSERT(100 == empty.size());
+  ASSERT(empty.get("key42", value));
+  ASSERT("42" == value);
+
+  // Adopting into a non-empty store merges, the adopted values winning
+  CompactStore more(CompactStore::SMALL_SLAB_SIZE);
+  more.put("key1", "new");
+  more.put("extra", "x");
+  store.adopt(more);
+  ASSERT(101 == store.size());
+  ASSERT(store.get("key1", value));
+  ASSERT("new" == value);
+  ASSERT(store.get("key0", value));
+  ASSERT("changed" == value);
+}
+
+int g_epoch_frees;
+
+void count_free(void *p) {
+  g_epoch_frees++;
+  delete static_cast<int *>(p);
+}
+
+struct GuardHolder {
+  int entered[2]; // the holder writes to it once it holds a guard
+  int leave[2];   // and waits on it to let go
+};
+
+void *hold_guard(void *arg) {
+  GuardHolder *holder = static_cast<GuardHolder *>(arg);
+  Epoch::ReadGuard guard;
+  char c = 0;
+  if (write(holder->entered[1], &c, 1) == 1 &&
+      read(holder->leave[0], &c, 1) == 1) {
+    return holder;
+  }
+  return nullptr;
+}
+
+void test_epoch(TestObjs *objs) {
+  ASSERT(0 == Epoch::reclaim()); // earlier tests' retired memory
+  g_epoch_frees = 0;
+
+  // Nothing is freed while this thread's guards (nested or not) last
+  {
+    Epoch::ReadGuard guard;
+    Epoch::retire(new int(1), count_free);
+    {
+      Epoch::ReadGuard nested;
+    }
+    ASSERT(1 == Epoch::reclaim());
+    ASSERT(0 == g_epoch_frees);
+  }
+  // Leaving the guard frees it
+  ASSERT(1 == g_epoch_frees);
+  ASSERT(0 == Epoch::reclaim());
+
+  // Nor while another thread's
+  GuardHolder holder;
+  ASSERT(0 == pipe(holder.entered));
+  ASSERT(0 == pipe(holder.leave));
+  pthread_t thread;
+  pthread_create(&thread, NULL, hold_guard, &holder);
+  char c = 0;
+  ASSERT(1 == read(holder.entered[0], &c, 1));
+  Epoch::retire(new int(2), count_free);
+  ASSERT(1 == Epoch::reclaim());
+  ASSERT(1 == g_epoch_frees);
+  ASSERT(1 == write(holder.leave[1], &c, 1));
+  void *held;
+  pthread_join(thread, &held);
+  ASSERT(held);
+  ASSERT(2 == g_epoch_frees);
+  ASSERT(0 == Epoch::reclaim());
+  for (int fd : {holder.entered[0], holder.entered[1], holder.leave[0],
+                 holder.leave[1]}) {
+    close(fd);
+  }
+}
+
+void test_record_stream(TestObjs *objs) {
+  std::string buf;
+  RecordStream::append(buf, "apples", "100");
+  RecordStream::append(buf, "empty", "");
+  RecordStream::append_end(buf);
+
+  int fds[2];
+  ASSERT(0 == pipe(fds));
+  ASSERT(static_cast<ssize_t>(buf.size()) ==
+         rio_writen(fds[1], buf.data(), buf.size()));
+  close(fds[1]);
+
+  rio_t rio;
+  rio_readinitb(&rio, fds[0]);
+  std::string key, value;
+  ASSERT(RecordStream::read(&rio, key, value));
+  ASSERT("apples" == key);
+  ASSERT("100" == value);
+  ASSERT(RecordStream::read(&rio, key, value));
+  ASSERT("empty" == key);
+  ASSERT("" == value);
+  ASSERT(!RecordStream::read(&rio, key, value));
+
+  // A truncated stream is a communication error
+  try {
+    RecordStream::read(&rio, key, value);
+    FAIL("No exception thrown reading past the end of the stream");
+  } catch (CommException &ex) {
+    // Good
+  }
+  close(fds[0]);
+}
+
+// Input for a rio_t which arrives chunk bytes at a time
+struct ChunkedInput {
+  std::string data;
+  size_t pos;
+  size_t chunk;
+};
+
+ssize_t read_chunk(void *ctx, void *buf, size_t n) {
+  ChunkedInput *in = static_cast<ChunkedInput *>(ctx);
+  n = std::min({n, in->chunk, in->data.size() - in->pos});
+  memcpy(buf, in->data.data() + in->pos, n);
+  in->pos += n;
+  return n;
+}
+
+void test_topology(TestObjs *objs) {
+  // Every CPU belongs to one node
+  ASSERT(Topology::num_nodes() >= 1);
+  std::vector<int> cpus = Topology::all_cpus();
+  ASSERT(!cpus.empty());
+  size_t total = 0;
+  for (unsigned node = 0; node < Topology::num_nodes(); node++) {
+    ASSERT(!Topology::node_cpus(node).empty());
+    for (int cpu : Topology::node_cpus(node)) {
+      ASSERT(node == Topology::node_of_cpu(cpu));
+    }
+    total += Topology::node_cpus(node).size();
+  }
+  ASSERT(cpus.size() == total);
+  ASSERT(Topology::current_node() < Topology::num_nodes());
+  ASSERT(0 == Topology::get_stats().find("numa_nodes="));
+
+  // Pinning to one CPU keeps the thread there
+  cpu_set_t saved;
+  pthread_getaffinity_np(pthread_self(), sizeof(saved), &saved);
+  ASSERT(Topology::pin_thread(pthread_self(), {cpus.back()}));
+  ASSERT(cpus.back() == sched_getcpu());
+  pthread_setaffinity_np(pthread_self(), sizeof(saved), &saved);
+
+  size_t size = 4 * Topology::page_size();
+  char *p = static_cast<char *>(Topology::alloc_on_node(size, 0));
+  memset(p, 'x', size);
+  ASSERT('x' == p[size - 1]);
+  Topology::free_on_node(p, size);
+
+  // A store on a node adopts heap slabs, and the other way round; each
+  // slab is freed the way it was allocated
+  CompactStore placed, heap;
+  placed.set_node(Topology::num_nodes() - 1);
+  heap.put("big", std::string(CompactStore::SLAB_SIZE, 'b'));
+  for (int i = 0; i < 1000; i++) {
+    placed.put("p" + std::to_string(i), std::to_string(i));
+    heap.put("h" + std::to_string(i), std::to_string(i));
+  }
+  placed.adopt(heap);
+  ASSERT(2001 == placed.size());
+  std::string_view value;
+  ASSERT(placed.get("h999", value) && "999" == value);
+  ASSERT(placed.get("big", value) && CompactStore::SLAB_SIZE == value.size());
+  heap.put("again", "1");
+  heap.adopt(placed);
+  ASSERT(2002 == heap.size());
+  ASSERT(heap.get("p0", value) && "0" == value);
+
+  // Tables say where they are kept
+  Table table("placed");
+  ASSERT(-1 == table.get_home_node());
+  table.set_home_node(0);
+  table.lock();
+  table.set("k", "v");
+  ASSERT("v" == table.get("k"));
+  table.unlock();
+  ASSERT(table.get_stats().find(";home_node=0;") != std::string::npos);
+}
+
+void test_rio_lines(TestObjs *objs) {
+  const std::string input =
+      "SET a 1\nGET b\n" + std::string(40, 'x') + "\nend";
+
+  // Lines are returned in place, across refills of a small buffer
+  ChunkedInput in{input, 0, 3};
+  rio_t rio;
+  rio_readinitb(&rio, -1);
+  rio_setfill(&rio, read_chunk, &in);
+  char small[16];
+  ASSERT(0 == rio_setbuf(&rio, small, sizeof(small)));
+  const char *line;
+  ASSERT(8 == rio_readlinev(&rio, &line, MAXLINE));
+  ASSERT("SET a 1\n" == std::string_view(line, 8));
+  ASSERT(6 == rio_readlinev(&rio, &line, MAXLINE));
+  ASSERT("GET b\n" == std::string_view(line, 6));
+  // Lines longer than the buffer come in pieces
+  ASSERT(16 == rio_readlinev(&rio, &line, MAXLINE));
+  ASSERT(std::string(16, 'x') == std::string_view(line, 16));
+  ASSERT(16 == rio_readlinev(&rio, &line, MAXLINE));
+  ASSERT(9 == rio_readlinev(&rio, &line, MAXLINE));
+  ASSERT(std::string(8, 'x') + "\n" == std::string_view(line, 9));
+  // An unterminated last line, then the end
+  ASSERT(3 == rio_readlinev(&rio, &line, MAXLINE));
+  ASSERT("end" == std::string_view(line, 3));
+  ASSERT(0 == rio_readlinev(&rio, &line, MAXLINE));
+
+  // rio_readlineb copies the same lines, stopping at maxlen - 1
+  ChunkedInput again{input, 0, 5};
+  rio_readinitb(&rio, -1);
+  rio_setfill(&rio, read_chunk, &again);
+  char buf[MAXLINE];
+  ASSERT(8 == rio_readlineb(&rio, buf, MAXLINE));
+  ASSERT(0 == strcmp(buf, "SET a 1\n"));
+  // Unread data moves to a new buffer, if it fits
+  char tiny[1];
+  ASSERT(-1 == rio_setbuf(&rio, tiny, sizeof(tiny)));
+  ASSERT(0 == rio_setbuf(&rio, small, sizeof(small)));
+  ASSERT(6 == rio_readlineb(&rio, buf, MAXLINE));
+  ASSERT(0 == strcmp(buf, "GET b\n"));
+  ASSERT(10 == rio_readlineb(&rio, buf, 11));
+  ASSERT(std::string(10, 'x') == buf);
+  ASSERT(31 == rio_readlineb(&rio, buf, MAXLINE));
+  ASSERT(3 == rio_readlineb(&rio, buf, MAXLINE));
+  ASSERT(0 == strcmp(buf, "end"));
+  ASSERT(0 == rio_readlineb(&rio, buf, MAXLINE));
+}
+
+void test_hash_ring(TestObjs *objs) {
+  HashRing ring;
+  ring.add_node("localhost:5000");
+  ring.add_node("localhost:5001");
+  ring.add_node("localhost:5002");
+  ASSERT(3 == ring.num_nodes());
+  ASSERT("localhost:5001" == ring.get_node(1));
+
+  // Keys spread roughly evenly, and the mapping only depends on the
+  // node names
+  HashRing same;
+  same.add_node("localhost:5000");
+  same.add_node("localhost:5001");
+  same.add_node("localhost:5002");
+  int counts[3] = {0, 0, 0};
+  for (int i = 0; i < 30000; i++) {
+    std::string key = "key" + std::to_string(i);
+    size_t node = ring.node_for("t", key);
+    ASSERT(node == same.node_for("t", key));
+    counts[node]++;
+  }
+  for (int count : counts) {
+    ASSERT(count > 7000 && count < 13000);
+  }
+
+  // The table is part of the hashed key
+  int differ = 0;
+  for (int i = 0; i < 100; i++) {
+    std::string key = "key" + std::to_string(i);
+    differ += ring.node_for("a", key) != ring.node_for("b", key);
+  }
+  ASSERT(differ > 0);
+
+  // Adding a node only moves keys to the new node
+  HashRing bigger;
+  bigger.add_node("localhost:5000");
+  bigger.add_node("localhost:5001");
+  bigger.add_node("localhost:5002");
+  bigger.add_node("localhost:5003");
+  int moved = 0;
+  for (int i = 0; i < 30000; i++) {
+    std::string key = "key" + std::to_string(i);
+    size_t before = ring.node_for("t", key), after = bigger.node_for("t", key);
+    if (before != after) {
+      ASSERT(3 == after);
+      moved++;
+    }
+  }
+  ASSERT(moved > 4000 && moved < 11000);
+}
+
+// Reads everything written to a pipe until it is closed
+std::string read_all(int fd) {
+  std::string result;
+  char buf[4096];
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    result.append(buf, n);
   }
+  return result;
+}
+
+int count_lines(const std::string &text, const std::string &needle) {
+  int count = 0;
+  size_t pos = 0;
+  while ((pos = text.find(needle, pos)) != std::string::npos) {
+    count++;
+    pos += needle.size();
+  }
+  return count;
+}
+
+void test_logger(TestObjs *objs) {
+  int fds[2];
+  ASSERT(pipe(fds) == 0);
+  {
+    Logger logger(fds[1], false, 64, 5);
+    logger.set_level(LogLevel::INFO);
+    logger.log(LogLevel::DEBUG, "test", "hidden");
+    logger.log(LogLevel::WARN, "test", "shown\n");
+    // Only 5 "flood" messages per second get through
+    for (int i = 0; i < 20; i++) {
+      logger.log(LogLevel::ERROR, "flood", "flooding");
+    }
+    logger.log_record("raw record");
+    ASSERT(logger.get_suppressed() >= 14);
+    // The destructor writes out everything logged
+  }
+  close(fds[1]);
+  std::string text = read_all(fds[0]);
+  close(fds[0]);
+  ASSERT(text.find("hidden") == std::string::npos);
+  ASSERT(count_lines(text, " warn [test] shown\n") == 1);
+  int flooded = count_lines(text, "[flood] flooding\n");
+  ASSERT(flooded >= 5 && flooded <= 10); // may straddle two seconds
+  ASSERT(count_lines(text, "raw record\n") == 1);
+
+  ASSERT(pipe(fds) == 0);
+  {
+    Logger logger(fds[1], true, 64, 0);
+    logger.log(LogLevel::ERROR, "test", "say \"hi\"\t");
+  }
+  close(fds[1]);
+  text = read_all(fds[0]);
+  close(fds[0]);
+  ASSERT(text.find("\"level\":\"error\",\"class\":\"test\","
+                   "\"msg\":\"say \\\"hi\\\"\\u0009\"}\n") !=
+         std::string::npos);
+
+  std::string json;
+  Logger::append_json_string(json, "a\\b");
+  ASSERT("\"a\\\\b\"" == json);
+}
+
+void test_slow_log(TestObjs *objs) {
+  SlowLog slow_log(3, 100);
+  ASSERT(100 == slow_log.get_threshold_us());
+  ASSERT(!slow_log.is_slow(99999));
+  ASSERT(slow_log.is_slow(100000));
+
+  // Only the 3 newest entries are kept, oldest first
+  for (int i = 0; i < 5; i++) {
+    SlowLog::Entry entry;
+    entry.time_ns = 0;
+    entry.user = "alice";
+    entry.command = "GET";
+    entry.table = "fruit";
+    entry.key = std::string(100, 'k');
+    entry.timing.read_ns = 1000;
+    entry.timing.lock_ns = 5000;
+    entry.timing.write_ns = 2000;
+    entry.timing.total_ns = 100000 * (i + 1);
+    slow_log.record(entry);
+  }
+  std::vector<SlowLog::Entry> entries = slow_log.get_entries();
+  ASSERT(3 == entries.size());
+  ASSERT(3 == entries[0].id);
+  ASSERT(4 == entries[1].id);
+  ASSERT(5 == entries[2].id);
+  ASSERT(SlowLog::MAX_ARG_LEN == entries[0].key.size());
+  ASSERT(500000 - 8000 == entries[2].timing.exec_ns());
+
+  std::string text = entries[2].to_string();
+  ASSERT(text.find(' ') == std::string::npos);
+  ASSERT(text.find("id=5;time=1970-01-01T00:00:00.000Z;user=alice;cmd=GET;"
+                   "table=fruit;key=kkk") == 0);
+  ASSERT(text.find(";total_us=500;read_us=1;parse_us=0;lock_us=5;"
+                   "exec_us=492;write_us=2") != std::string::npos);
+
+  slow_log.reset();
+  ASSERT(0 == slow_log.size());
+  SlowLog::Entry entry;
+  entry.time_ns = 0;
+  entry.command = "BYE";
+  slow_log.record(entry);
+  entries = slow_log.get_entries();
+  ASSERT(1 == entries.size());
+  ASSERT(6 == entries[0].id); // ids aren't reused
+  ASSERT(entries[0].to_string().find("user=-;cmd=BYE;table=-;key=-;") !=
+         std::string::npos);
+
+  // An uncontended lock doesn't wait
+  ASSERT(0 == objs->invoices->lock());
+  objs->invoices->unlock();
 }
 
 void test_value_stack(TestObjs *objs) {
@@ -587,3 +2271,344 @@ void test_value_stack_exceptions(TestObjs *objs) {
     // good
   }
 }
+
+void test_value_stack_limits(TestObjs *objs) {
+  ValueStack depth_limited(3, 0);
+  depth_limited.push("a");
+  depth_limited.push("b");
+  ASSERT(depth_limited.has_room(1, 1000));
+  ASSERT(!depth_limited.has_room(2, 2));
+  depth_limited.push("c");
+  try {
+    depth_limited.push("d");
+    FAIL("ValueStack didn't enforce its depth limit");
+  } catch (OperationException &ex) {
+    // good
+  }
+  ASSERT(3 == depth_limited.size());
+  ASSERT("c" == depth_limited.get_top());
+
+  ValueStack size_limited(0, 10);
+  size_limited.push("12345");
+  size_limited.push("6789");
+  ASSERT(9 == size_limited.get_bytes());
+  try {
+    size_limited.push("ab");
+    FAIL("ValueStack didn't enforce its size limit");
+  } catch (OperationException &ex) {
+    // good
+  }
+  size_limited.pop();
+  size_limited.push("abcde");
+  ASSERT(10 == size_limited.get_bytes());
+
+  // Growing past the initial slots keeps the values in order
+  for (int i = 0; i < 100; i++) {
+    objs->valstack.push(std::to_string(i));
+  }
+  for (int i = 99; i >= 0; i--) {
+    ASSERT(std::to_string(i) == objs->valstack.get_top());
+    objs->valstack.pop();
+  }
+  ASSERT(objs->valstack.is_empty());
+}
+
+void test_value_stack_pool(TestObjs *objs) {
+  ValueStackPool pool(1);
+  pool.set_limits(2, 0);
+  ValueStack *first = pool.acquire();
+  ValueStack *second = pool.acquire();
+  first->push("left behind");
+  first->push(std::string(1000, 'x'));
+  try {
+    first->push("over the limit");
+    FAIL("Pooled stack didn't get the pool's limits");
+  } catch (OperationException &ex) {
+    // good
+  }
+
+  // Released stacks come back empty, with the current limits; only one
+  // is kept
+  pool.release(first);
+  pool.release(second);
+  pool.set_limits(3, 0);
+  ValueStack *reused = pool.acquire();
+  ASSERT(reused == first);
+  ASSERT(reused->is_empty());
+  ASSERT(0 == reused->get_bytes());
+  reused->push("a");
+  reused->push("b");
+  reused->push("c");
+  ASSERT(!reused->has_room(1, 1));
+  pool.release(reused);
+  ASSERT("stacks_created=2;stacks_reused=1;stacks_free=1" == pool.get_stats());
+}
+
+Task<int> add_one(int value) {
+  if (value < 0) {
+    throw OperationException("negative");
+  }
+  co_return value + 1;
+}
+
+Task<int> add_two(int value) {
+  int result = co_await add_one(value);
+  co_return co_await add_one(result);
+}
+
+Task<void> run_add_two(int value, int &result, bool &failed) {
+  try {
+    result = co_await add_two(value);
+  } catch (OperationException &ex) {
+    failed = true;
+  }
+}
+
+void test_task(TestObjs *) {
+  int result = 0;
+  bool failed = false;
+  // Tasks start suspended; awaiting the outer one runs the chain
+  Task<void> task = run_add_two(40, result, failed);
+  ASSERT(0 == result);
+  task.await_suspend(std::noop_coroutine()).resume();
+  ASSERT(42 == result);
+  ASSERT(!failed);
+
+  Task<void> failing = run_add_two(-1, result, failed);
+  failing.await_suspend(std::noop_coroutine()).resume();
+  ASSERT(failed);
+}
+
+// Reads a line and sends it back, as a coroutine on an event loop.
+// result is 1 on success, 2 after a timeout, 3 on other failures.
+Task<void> echo_line(EventLoop *loop, int fd, std::atomic<int> *result) {
+  int outcome;
+  {
+    AsyncChannel channel(fd, loop);
+    rio_t rio;
+    rio_readinitb(&rio, fd);
+    channel.attach(&rio);
+    ssize_t avail = co_await channel.wait_line(&rio);
+    if (avail < 0) {
+      outcome = errno == EAGAIN ? 2 : 3;
+    } else {
+      char buf[MAXLINE];
+      ssize_t len = rio_readlineb(&rio, buf, MAXLINE);
+      bool sent = len > 0 && channel.write(std::string_view(buf, len)) &&
+                  co_await channel.drain();
+      outcome = sent ? 1 : 3;
+    }
+  }
+  // Only once the channel has stopped watching fd, which the test closes
+  result->store(outcome);
+}
+
+// Appends tag to order once it runs, deferring to the rest of the loop
+// first if asked to; the last one to finish sets result
+Task<void> append_in_turn(EventLoop *loop, std::string *order, char tag,
+                          bool deferred, std::atomic<int> *result) {
+  if (deferred) {
+    co_await loop->defer();
+  }
+  *order += tag;
+  if (order->size() == 3) {
+    result->store(1);
+  }
+}
+
+// Spawns a deferred coroutine and two others from the loop's thread, so
+// that all three are ready in the same pass of the loop
+Task<void> spawn_in_turn(EventLoop *loop, std::string *order,
+                         std::atomic<int> *result) {
+  loop->spawn(append_in_turn(loop, order, 'b', true, result));
+  loop->spawn(append_in_turn(loop, order, 'i', false, result));
+  loop->spawn(append_in_turn(loop, order, 'j', false, result));
+  co_return;
+}
+
+Task<void> sleep_for_ms(EventLoop *loop, uint64_t ms,
+                        std::atomic<int> *result) {
+  uint64_t start = EventLoop::now_ms();
+  co_await loop->sleep_until(start + ms);
+  result->store(EventLoop::now_ms() - start >= ms ? 1 : 2);
+}
+
+// Reads two pipelined lines for a throttled user, sleeping for its token
+// after each like a connection on an event loop does. result is 1 once
+// both are read, 2 if the channel timed out instead, 3 on other failures.
+Task<void> read_throttled(EventLoop *loop, int fd, AdmissionControl::User *user,
+                          std::atomic<int> *result) {
+  int outcome = 1;
+  {
+    AsyncChannel channel(fd, loop);
+    rio_t rio;
+    rio_readinitb(&rio, fd);
+    channel.attach(&rio);
+    for (int i = 0; i < 2 && outcome == 1; i++) {
+      ssize_t avail = co_await channel.wait_line(&rio);
+      char buf[MAXLINE];
+      if (avail <= 0) {
+        outcome = avail < 0 && errno == EAGAIN ? 2 : 3;
+      } else if (rio_readlineb(&rio, buf, MAXLINE) <= 0) {
+        outcome = 3;
+      } else if (uint64_t wait_ns = user->admit(EventLoop::now_ms() * 1000000)) {
+        co_await loop->sleep_until(EventLoop::now_ms() + wait_ns / 1000000 + 1);
+      }
+    }
+  }
+  result->store(outcome);
+}
+
+Task<void> store_result(std::atomic<int> *result, int value) {
+  result->store(value);
+  co_return;
+}
+
+// Waits for fd, and then removes the other watch, as a connection which
+// ends (a subscriber sending BYE, say) removes its watches. Both sockets
+// are made readable first, so their events arrive in one batch, this
+// one's first.
+Task<void> remove_other_watch(EventLoop *loop, int fd, int peer,
+                              EventLoop::Watch *other, int other_peer,
+                              std::atomic<int> *result) {
+  EventLoop::Watch watch(fd);
+  loop->add(&watch);
+  loop->add(other);
+  bool written = write(peer, "x", 1) == 1 && write(other_peer, "x", 1) == 1;
+  co_await loop->wait(&watch, EPOLLIN, 0);
+  loop->remove(other);
+  loop->remove(&watch);
+  result->store(written ? 1 : 3);
+}
+
+// Moves to the offload pool and back, noting the thread it ran on there;
+// adds 1 to result once it is back on the loop
+Task<void> offload_and_return(EventLoop *loop, int fd, pthread_t *thread,
+                              std::atomic<int> *result) {
+  {
+    AsyncChannel channel(fd, loop);
+    co_await channel.offload();
+    *thread = pthread_self();
+    usleep(10000);
+    co_await channel.return_to_loop();
+  }
+  result->fetch_add(1);
+}
+
+void wait_for_result(std::atomic<int> &result) {
+  for (int i = 0; i < 500 && result.load() == 0; i++) {
+    usleep(10000);
+  }
+}
+
+void test_event_loop(TestObjs *) {
+  EventLoop loop;
+  loop.start();
+
+  // A line arriving in two parts
+  int fds[2];
+  ASSERT(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  std::atomic<int> result(0);
+  loop.spawn(echo_line(&loop, fds[1], &result));
+  ASSERT(3 == write(fds[0], "hel", 3));
+  usleep(20000);
+  ASSERT(0 == result.load());
+  ASSERT(3 == write(fds[0], "lo\n", 3));
+  wait_for_result(result);
+  ASSERT(1 == result.load());
+  char buf[16];
+  ASSERT(6 == read(fds[0], buf, sizeof(buf)));
+  ASSERT(0 == memcmp(buf, "hello\n", 6));
+  close(fds[0]);
+  close(fds[1]);
+
+  // The channel applies SO_RCVTIMEO to its waits
+  ASSERT(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  struct timeval timeout = {0, 50000};
+  setsockopt(fds[1], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  result.store(0);
+  loop.spawn(echo_line(&loop, fds[1], &result));
+  wait_for_result(result);
+  ASSERT(2 == result.load());
+  close(fds[0]);
+  close(fds[1]);
+
+  // Deferred coroutines run after the others which are ready
+  std::string order;
+  result.store(0);
+  loop.spawn(spawn_in_turn(&loop, &order, &result));
+  wait_for_result(result);
+  ASSERT(1 == result.load());
+  ASSERT("ijb" == order);
+
+  result.store(0);
+  loop.spawn(sleep_for_ms(&loop, 30, &result));
+  wait_for_result(result);
+  ASSERT(1 == result.load());
+
+  // A request which arrives while the connection sleeps for its user's
+  // rate limit is still read once it wakes, before the idle timeout
+  AdmissionControl admission;
+  AdmissionControl::Limits limits;
+  limits.rate = 20;
+  limits.burst = 1;
+  admission.set_user_limits("throttled", limits);
+  AdmissionControl::User *user = admission.get_user("throttled");
+  user->admit(EventLoop::now_ms() * 1000000); // the bucket is empty
+  ASSERT(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  timeout.tv_usec = 500000;
+  setsockopt(fds[1], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  result.store(0);
+  loop.spawn(read_throttled(&loop, fds[1], user, &result));
+  ASSERT(8 == write(fds[0], "GET a b\n", 8));
+  usleep(20000); // the first request is still being throttled
+  ASSERT(8 == write(fds[0], "GET a c\n", 8));
+  wait_for_result(result);
+  ASSERT(1 == result.load());
+  close(fds[0]);
+  close(fds[1]);
+
+  // A watch removed while the loop is handling a batch of events gets
+  // none of the batch's remaining events: its coroutine (which stores 2)
+  // is not resumed
+  int other_fds[2];
+  ASSERT(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  ASSERT(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, other_fds));
+  result.store(0);
+  Task<void> stray = store_result(&result, 2);
+  EventLoop::Watch other(other_fds[1]);
+  other.waiter = stray.await_suspend(std::noop_coroutine());
+  other.events = EPOLLIN;
+  loop.spawn(remove_other_watch(&loop, fds[1], fds[0], &other, other_fds[0],
+                                &result));
+  wait_for_result(result);
+  usleep(20000);
+  ASSERT(1 == result.load());
+  close(fds[0]);
+  close(fds[1]);
+  close(other_fds[0]);
+  close(other_fds[1]);
+
+  // Offloads share the pool's threads, queueing once they are all busy
+  AsyncChannel::set_offload_threads(2);
+  const int OFFLOADS = 6;
+  int offload_fds[OFFLOADS][2];
+  pthread_t threads[OFFLOADS];
+  result.store(0);
+  for (int i = 0; i < OFFLOADS; i++) {
+    ASSERT(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, offload_fds[i]));
+    loop.spawn(offload_and_return(&loop, offload_fds[i][1], &threads[i],
+                                  &result));
+  }
+  for (int i = 0; i < 500 && result.load() < OFFLOADS; i++) {
+    usleep(10000);
+  }
+  ASSERT(OFFLOADS == result.load());
+  std::set<pthread_t> distinct(threads, threads + OFFLOADS);
+  ASSERT(distinct.size() <= 2);
+  for (int i = 0; i < OFFLOADS; i++) {
+    close(offload_fds[i][0]);
+    close(offload_fds[i][1]);
+  }
+  AsyncChannel::set_offload_threads(AsyncChannel::DEFAULT_OFFLOAD_THREADS);
+}
@@ -0,0 +1,260 @@
+#include "value_codec.h"
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <time.h>
+
+namespace {
+
+const unsigned char TAG_ESCAPED = 0;
+const unsigned char TAG_COMPRESSED = 1;
+
+const size_t MIN_MATCH = 4;
+const size_t MAX_OFFSET = 65535;
+const unsigned HASH_BITS = 10;
+
+std::atomic<size_t> s_threshold(ValueCodec::DEFAULT_THRESHOLD);
+std::atomic<uint64_t> s_compressed;     // values stored compressed
+std::atomic<uint64_t> s_incompressible; // over the threshold, but kept raw
+std::atomic<uint64_t> s_raw_bytes;      // sizes of the compressed values
+std::atomic<uint64_t> s_stored_bytes;   // and of their stored forms
+std::atomic<uint64_t> s_compress_ns;
+std::atomic<uint64_t> s_decompressed;
+std::atomic<uint64_t> s_decompress_ns;
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000UL + uint64_t(ts.tv_nsec);
+}
+
+uint32_t load32(const char *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+unsigned hash_seq(uint32_t seq) {
+  return (seq * 2654435761U) >> (32 - HASH_BITS);
+}
+
+// Lengths beyond a token's nibble continue in bytes of 255, ended by a
+// byte below 255
+char *put_length(char *op, size_t len) {
+  while (len >= 255) {
+    *op++ = char(255);
+    len -= 255;
+  }
+  *op++ = char(len);
+  return op;
+}
+
+bool get_length(const char *&ip, const char *end, size_t &len) {
+  while (1) {
+    if (ip >= end) {
+      return false;
+    }
+    unsigned char b = *ip++;
+    len += b;
+    if (b != 255) {
+      return true;
+    }
+  }
+}
+
+// A sequence: literals, then (unless it is the last) a match of match_len
+// bytes at offset back
+char *put_sequence(char *op, const char *literals, size_t lit_len,
+                   size_t offset, size_t match_len) {
+  size_t match_code = match_len > 0 ? match_len - MIN_MATCH : 0;
+  char *token = op++;
+  *token = char(((lit_len < 15 ? lit_len : 15) << 4) |
+                (match_code < 15 ? match_code : 15));
+  if (lit_len >= 15) {
+    op = put_length(op, lit_len - 15);
+  }
+  memcpy(op, literals, lit_len);
+  op += lit_len;
+  if (match_len > 0) {
+    *op++ = char(offset & 0xff);
+    *op++ = char(offset >> 8);
+    if (match_code >= 15) {
+      op = put_length(op, match_code - 15);
+    }
+  }
+  return op;
+}
+
+size_t put_varint(char *p, uint64_t v) {
+  size_t n = 0;
+  while (v >= 0x80) {
+    p[n++] = char(v | 0x80);
+    v >>= 7;
+  }
+  p[n++] = char(v);
+  return n;
+}
+
+bool get_varint(std::string_view &s, uint64_t &v) {
+  v = 0;
+  for (unsigned shift = 0; shift < 64; shift += 7) {
+    if (s.empty()) {
+      return false;
+    }
+    unsigned char b = s[0];
+    s.remove_prefix(1);
+    v |= uint64_t(b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+} // namespace
+
+void ValueCodec::set_threshold(size_t bytes) { s_threshold = bytes; }
+
+size_t ValueCodec::get_threshold() { return s_threshold.load(); }
+
+size_t ValueCodec::compress_bound(size_t n) { return n + n / 255 + 16; }
+
+size_t ValueCodec::compress(const char *src, size_t n, char *dst) {
+  uint32_t table[1 << HASH_BITS]; // last position of each hashed sequence
+  memset(table, 0xff, sizeof(table));
+  const char *ip = src, *anchor = src, *end = src + n;
+  char *op = dst;
+  while (n >= MIN_MATCH && ip <= end - MIN_MATCH) {
+    uint32_t seq = load32(ip);
+    uint32_t &slot = table[hash_seq(seq)];
+    uint32_t candidate = slot;
+    slot = uint32_t(ip - src);
+    if (candidate == UINT32_MAX || size_t(ip - src) - candidate > MAX_OFFSET ||
+        load32(src + candidate) != seq) {
+      ip++;
+      continue;
+    }
+    const char *ref = src + candidate;
+    size_t len = MIN_MATCH;
+    while (ip + len < end && ref[len] == ip[len]) {
+      len++;
+    }
+    op = put_sequence(op, anchor, ip - anchor, ip - ref, len);
+    ip += len;
+    anchor = ip;
+  }
+  op = put_sequence(op, anchor, end - anchor, 0, 0);
+  return op - dst;
+}
+
+bool ValueCodec::decompress(const char *src, size_t n, char *dst,
+                            size_t raw_len) {
+  const char *ip = src, *iend = src + n;
+  char *op = dst, *oend = dst + raw_len;
+  while (1) {
+    if (ip >= iend) {
+      return false; // the block must end with a literal-only sequence
+    }
+    unsigned char token = *ip++;
+    size_t lit_len = token >> 4;
+    if (lit_len == 15 && !get_length(ip, iend, lit_len)) {
+      return false;
+    }
+    if (lit_len > size_t(iend - ip) || lit_len > size_t(oend - op)) {
+      return false;
+    }
+    memcpy(op, ip, lit_len);
+    ip += lit_len;
+    op += lit_len;
+    if (ip == iend) {
+      return op == oend; // the last sequence has no match
+    }
+    if (iend - ip < 2) {
+      return false;
+    }
+    size_t offset = (unsigned char)ip[0] | (size_t((unsigned char)ip[1]) << 8);
+    ip += 2;
+    size_t match_len = token & 15;
+    if (match_len == 15 && !get_length(ip, iend, match_len)) {
+      return false;
+    }
+    match_len += MIN_MATCH;
+    if (offset == 0 || offset > size_t(op - dst) ||
+        match_len > size_t(oend - op)) {
+      return false;
+    }
+    // Byte by byte: a match may overlap the bytes it produces
+    const char *ref = op - offset;
+    for (size_t i = 0; i < match_len; i++) {
+      op[i] = ref[i];
+    }
+    op += match_len;
+  }
+}
+
+std::string_view ValueCodec::encode(std::string_view value,
+                                    std::string &scratch) {
+  size_t threshold = s_threshold.load(std::memory_order_relaxed);
+  if (threshold > 0 && value.size() >= threshold) {
+    uint64_t start = now_ns();
+    scratch.resize(1 + 10 + compress_bound(value.size()));
+    char *p = &scratch[0];
+    p[0] = char(TAG_COMPRESSED);
+    size_t header = 1 + put_varint(p + 1, value.size());
+    size_t total =
+        header + compress(value.data(), value.size(), p + header);
+    s_compress_ns.fetch_add(now_ns() - start, std::memory_order_relaxed);
+    if (total <= value.size() - value.size() / 8) {
+      scratch.resize(total);
+      s_compressed.fetch_add(1, std::memory_order_relaxed);
+      s_raw_bytes.fetch_add(value.size(), std::memory_order_relaxed);
+      s_stored_bytes.fetch_add(total, std::memory_order_relaxed);
+      return scratch;
+    }
+    s_incompressible.fetch_add(1, std::memory_order_relaxed);
+  }
+  if (!value.empty() && (unsigned char)value[0] <= TAG_COMPRESSED) {
+    scratch.assign(1, char(TAG_ESCAPED));
+    scratch.append(value);
+    return scratch;
+  }
+  return value;
+}
+
+std::string_view ValueCodec::decode(std::string_view stored,
+                                    std::string &scratch) {
+  if (stored.empty() || (unsigned char)stored[0] > TAG_COMPRESSED) {
+    return stored;
+  }
+  if ((unsigned char)stored[0] == TAG_ESCAPED) {
+    return stored.substr(1);
+  }
+  uint64_t start = now_ns();
+  std::string_view block = stored.substr(1);
+  uint64_t raw_len;
+  if (!get_varint(block, raw_len)) {
+    throw std::runtime_error("Corrupt compressed value");
+  }
+  scratch.resize(raw_len);
+  if (!decompress(block.data(), block.size(), &scratch[0], raw_len)) {
+    throw std::runtime_error("Corrupt compressed value");
+  }
+  s_decompressed.fetch_add(1, std::memory_order_relaxed);
+  s_decompress_ns.fetch_add(now_ns() - start, std::memory_order_relaxed);
+  return scratch;
+}
+
+std::string ValueCodec::get_stats() {
+  uint64_t raw = s_raw_bytes.load(), stored = s_stored_bytes.load();
+  char ratio[32];
+  snprintf(ratio, sizeof(ratio), "%.2f", stored > 0 ? double(raw) / stored : 1.0);
+  return "compress_threshold=" + std::to_string(get_threshold()) +
+         ";values_compressed=" + std::to_string(s_compressed.load()) +
+         ";values_incompressible=" + std::to_string(s_incompressible.load()) +
+         ";compress_ratio=" + ratio +
+         ";compress_us=" + std::to_string(s_compress_ns.load() / 1000) +
+         ";values_decompressed=" + std::to_string(s_decompressed.load()) +
+         ";decompress_us=" + std::to_string(s_decompress_ns.load() / 1000);
+}
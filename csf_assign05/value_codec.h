@@ -0,0 +1,47 @@
+#ifndef VALUE_CODEC_H
+#define VALUE_CODEC_H
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+// Transparent compression of stored values. Values at least as long as
+// the threshold are compressed with a small LZ77 codec in the style of
+// LZ4 (greedy matching through a hash table of 4-byte sequences, byte
+// aligned literal runs and matches, no entropy coding), which
+// decompresses at memory speed; the compressed form is kept only if it
+// saves at least an eighth of the value.
+//
+// The stored form of a value is the value itself, unless its first byte
+// is a tag:
+//
+//   \x01 <varint raw length> <compressed block>   compressed value
+//   \x00 <value>                                  value starting with a tag
+//
+// so values which aren't compressed cost nothing extra.
+namespace ValueCodec {
+const size_t DEFAULT_THRESHOLD = 256;
+
+// 0 disables compression; values stored already stay readable
+void set_threshold(size_t bytes);
+size_t get_threshold();
+
+// Returns the stored form of value: value itself, or an encoding of it
+// built in scratch
+std::string_view encode(std::string_view value, std::string &scratch);
+// Returns the value which stored encodes: stored itself, or a decoding
+// of it built in scratch
+std::string_view decode(std::string_view stored, std::string &scratch);
+
+// The raw codec. compress() writes at most compress_bound(n) bytes to
+// dst and returns how many it wrote; decompress() returns false if src
+// isn't a valid block of exactly raw_len bytes.
+size_t compress_bound(size_t n);
+size_t compress(const char *src, size_t n, char *dst);
+bool decompress(const char *src, size_t n, char *dst, size_t raw_len);
+
+// Compression counters and CPU time, formatted for STATS
+std::string get_stats();
+} // namespace ValueCodec
+
+#endif // VALUE_CODEC_H
@@ -0,0 +1,14 @@
+#include "value_index.h"
+
+void ValueIndex::add(std::string_view key, std::string_view value) {
+  if (m_entries.find(Probe{value, key}) == m_entries.end()) {
+    m_entries.insert(Entry{std::string(value), std::string(key)});
+  }
+}
+
+void ValueIndex::remove(std::string_view key, std::string_view value) {
+  auto it = m_entries.find(Probe{value, key});
+  if (it != m_entries.end()) {
+    m_entries.erase(it);
+  }
+}
@@ -0,0 +1,56 @@
+#ifndef VALUE_INDEX_H
+#define VALUE_INDEX_H
+
+#include <cstddef>
+#include <set>
+#include <string>
+#include <string_view>
+
+// Secondary index of a table: its (value, key) pairs in order, so the
+// keys holding a value are found in O(log n) plus one step per key.
+// Maintained by the Table as changes are committed.
+class ValueIndex {
+private:
+  struct Entry {
+    std::string value;
+    std::string key;
+  };
+  struct Probe {
+    std::string_view value;
+    std::string_view key;
+  };
+  // Orders entries by value, then key; probes look entries up without
+  // building strings
+  struct Less {
+    typedef void is_transparent;
+    template <typename A, typename B>
+    bool operator()(const A &a, const B &b) const {
+      int cmp = std::string_view(a.value).compare(b.value);
+      return cmp < 0 || (cmp == 0 && std::string_view(a.key) < b.key);
+    }
+  };
+
+  std::set<Entry, Less> m_entries;
+
+  // copy constructor and assignment operator are prohibited
+  ValueIndex(const ValueIndex &);
+  ValueIndex &operator=(const ValueIndex &);
+
+public:
+  ValueIndex() {}
+
+  void add(std::string_view key, std::string_view value);
+  void remove(std::string_view key, std::string_view value);
+
+  // Calls fn(key) for every key with the value, in key order
+  template <typename Fn> void find(std::string_view value, Fn fn) const {
+    for (auto it = m_entries.lower_bound(Probe{value, std::string_view()});
+         it != m_entries.end() && it->value == value; ++it) {
+      fn(std::string_view(it->key));
+    }
+  }
+
+  size_t size() const { return m_entries.size(); }
+};
+
+#endif // VALUE_INDEX_H
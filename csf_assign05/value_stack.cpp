@@ -1,27 +1,124 @@
 #include "value_stack.h"
 #include "exceptions.h"
-#include <stack>
+#include "guard.h"
+#include <stdexcept>
+#include <utility>
 
-ValueStack::ValueStack()
-// TODO: initialize member variable(s) (if necessary)
-{}
+ValueStack::ValueStack(size_t max_depth, size_t max_bytes)
+    : m_slots(INITIAL_SLOTS), m_size(0), m_bytes(0), m_max_depth(max_depth),
+      m_max_bytes(max_bytes) {}
 
 ValueStack::~ValueStack() {}
 
-bool ValueStack::is_empty() const { return stack.empty(); }
+bool ValueStack::is_empty() const { return m_size == 0; }
 
-void ValueStack::push(const std::string &value) { stack.push(value); }
+bool ValueStack::has_room(size_t count, size_t bytes) const {
+  return (m_max_depth == 0 || m_size + count <= m_max_depth) &&
+         (m_max_bytes == 0 || m_bytes + bytes <= m_max_bytes);
+}
 
-std::string ValueStack::get_top() const {
+void ValueStack::push(std::string_view value) {
+  if (m_max_depth > 0 && m_size >= m_max_depth) {
+    throw OperationException("Stack depth limit exceeded");
+  }
+  if (m_max_bytes > 0 && m_bytes + value.size() > m_max_bytes) {
+    throw OperationException("Stack size limit exceeded");
+  }
+  if (m_size == m_slots.size()) {
+    m_slots.resize(m_slots.size() * 2);
+  }
+  // Assigning reuses the slot's buffer if it is big enough
+  m_slots[m_size].assign(value.data(), value.size());
+  m_size++;
+  m_bytes += value.size();
+}
+
+const std::string &ValueStack::get_top() const {
   if ((is_empty())) {
     throw OperationException("Operand Stack is empty");
   }
-  return stack.top();
+  return m_slots[m_size - 1];
 }
 
 void ValueStack::pop() {
   if ((is_empty())) {
     throw OperationException("Operand Stack is empty");
   }
-  stack.pop();
+  m_size--;
+  m_bytes -= m_slots[m_size].size();
+  m_slots[m_size].clear();
+}
+
+void ValueStack::reset(size_t max_depth, size_t max_bytes, size_t keep_slots,
+                       size_t max_slot_bytes) {
+  if (m_slots.size() > keep_slots) {
+    m_slots.resize(keep_slots < INITIAL_SLOTS ? INITIAL_SLOTS : keep_slots);
+    m_slots.shrink_to_fit();
+  }
+  for (std::string &slot : m_slots) {
+    if (slot.capacity() > max_slot_bytes) {
+      std::string().swap(slot);
+    } else {
+      slot.clear();
+    }
+  }
+  m_size = 0;
+  m_bytes = 0;
+  m_max_depth = max_depth;
+  m_max_bytes = max_bytes;
+}
+
+ValueStackPool::ValueStackPool(size_t max_free)
+    : m_max_free(max_free), m_max_depth(0), m_max_bytes(0), m_created(0),
+      m_reused(0) {
+  if (pthread_mutex_init(&m_lock, NULL) != 0) {
+    throw std::runtime_error("Failed to initialize mutex");
+  }
+}
+
+ValueStackPool::~ValueStackPool() {
+  for (ValueStack *stack : m_free) {
+    delete stack;
+  }
+  pthread_mutex_destroy(&m_lock);
+}
+
+void ValueStackPool::set_limits(size_t max_depth, size_t max_bytes) {
+  Guard g(m_lock);
+  m_max_depth = max_depth;
+  m_max_bytes = max_bytes;
+}
+
+ValueStack *ValueStackPool::acquire() {
+  Guard g(m_lock);
+  if (m_free.empty()) {
+    m_created++;
+    return new ValueStack(m_max_depth, m_max_bytes);
+  }
+  ValueStack *stack = m_free.back();
+  m_free.pop_back();
+  m_reused++;
+  // The limits may have changed since the stack was released
+  stack->reset(m_max_depth, m_max_bytes, KEEP_SLOTS, MAX_SLOT_BYTES);
+  return stack;
+}
+
+void ValueStackPool::release(ValueStack *stack) {
+  // Trim the stack before taking the lock; the limits are set on reuse
+  stack->reset(0, 0, KEEP_SLOTS, MAX_SLOT_BYTES);
+  {
+    Guard g(m_lock);
+    if (m_free.size() < m_max_free) {
+      m_free.push_back(stack);
+      return;
+    }
+  }
+  delete stack;
+}
+
+std::string ValueStackPool::get_stats() {
+  Guard g(m_lock);
+  return "stacks_created=" + std::to_string(m_created) +
+         ";stacks_reused=" + std::to_string(m_reused) +
+         ";stacks_free=" + std::to_string(m_free.size());
 }
@@ -1,26 +1,89 @@
 #ifndef VALUE_STACK_H
 #define VALUE_STACK_H
 
-#include <stack>
+#include <cstddef>
+#include <pthread.h>
 #include <string>
+#include <string_view>
 #include <vector>
 
+// A client's operand stack. Values live in a vector of string slots
+// which is only ever grown: popping a value keeps its slot (and the
+// slot's buffer), so a stack that has been used once pushes and pops
+// without allocating. The stack may be limited in depth and in the
+// total size of its values.
 class ValueStack {
 private:
-  std::stack<std::string> stack;
+  std::vector<std::string> m_slots; // m_slots[0..m_size) are the values
+  size_t m_size;
+  size_t m_bytes; // total size of the values
+  size_t m_max_depth;
+  size_t m_max_bytes;
 
 public:
-  ValueStack();
+  // Slots allocated up front, enough for typical clients
+  static const size_t INITIAL_SLOTS = 8;
+
+  // A limit of 0 means no limit
+  ValueStack(size_t max_depth = 0, size_t max_bytes = 0);
   ~ValueStack();
 
   bool is_empty() const;
-  void push(const std::string &value);
+  size_t size() const { return m_size; }
+  size_t get_bytes() const { return m_bytes; }
+
+  // Throws OperationException if the value would exceed a limit
+  void push(std::string_view value);
+  // Whether count more values, of bytes in total, would fit
+  bool has_room(size_t count, size_t bytes) const;
 
   // Note: get_top() and pop() should throw OperationException
   // if called when the stack is empty
 
-  std::string get_top() const;
+  const std::string &get_top() const;
   void pop();
+
+  // Empties the stack and sets new limits. Slots beyond keep_slots are
+  // freed, along with the buffers of any slots holding more than
+  // max_slot_bytes.
+  void reset(size_t max_depth, size_t max_bytes, size_t keep_slots,
+             size_t max_slot_bytes);
+};
+
+// Recycles ValueStacks between connections, so a new connection
+// usually gets a stack whose slots are already allocated
+class ValueStackPool {
+private:
+  pthread_mutex_t m_lock; // protects everything below
+  std::vector<ValueStack *> m_free;
+  size_t m_max_free;
+  size_t m_max_depth;
+  size_t m_max_bytes;
+  unsigned long m_created;
+  unsigned long m_reused;
+
+  // copy constructor and assignment operator are prohibited
+  ValueStackPool(const ValueStackPool &);
+  ValueStackPool &operator=(const ValueStackPool &);
+
+public:
+  // Stacks returned to the pool keep at most this many slots, each with
+  // a buffer of at most MAX_SLOT_BYTES
+  static const size_t KEEP_SLOTS = 64;
+  static const size_t MAX_SLOT_BYTES = 256;
+
+  ValueStackPool(size_t max_free = 1024);
+  ~ValueStackPool();
+
+  // Limits for the stacks handed out from now on (0 for no limit)
+  void set_limits(size_t max_depth, size_t max_bytes);
+
+  // Returns an empty stack, which must be given back with release()
+  ValueStack *acquire();
+  void release(ValueStack *stack);
+
+  // "stacks_created=...;stacks_reused=...;stacks_free=..."
+  std::string get_stats();
 };
 
 #endif // VALUE_STACK_H